@@ -245,7 +245,8 @@ AC_DEFUN([SANE_CHECK_PTHREAD],
       fi
     ])
 
-  if test $use_pthread = yes ; then
+  dnl Worker threads only need pthreads to be there, so always look.
+  dnl use_pthread just picks threads instead of fork for sanei_thread.
   AC_CHECK_HEADERS(pthread.h,
     [
        AC_CHECK_LIB(pthread, pthread_create, PTHREAD_LIBS="-lpthread")
@@ -255,18 +256,17 @@ AC_DEFUN([SANE_CHECK_PTHREAD],
        AC_CHECK_FUNCS([pthread_create pthread_kill pthread_join pthread_detach pthread_cancel pthread_testcancel],
 	,[ have_pthread=no; use_pthread=no ])
        LIBS="$save_LIBS"
-    ],)
-  fi
+    ],[ use_pthread=no ])
  
   if test $use_pthread = yes ; then
     AC_DEFINE_UNQUOTED(USE_PTHREAD, "$use_pthread",
                    [Define if pthreads should be used instead of forked processes.])
-  else
-    dnl Reset library in case it was found but we are not going to use it.
-    PTHREAD_LIBS=""
   fi
   if test "$have_pthread" = "yes" ; then
     CPPFLAGS="${CPPFLAGS} -D_REENTRANT"
+  else
+    dnl Reset library in case it was found but the functions are missing.
+    PTHREAD_LIBS=""
   fi
   AC_SUBST(PTHREAD_LIBS)
   AC_MSG_CHECKING([whether to enable pthread support])
@@ -136,6 +136,13 @@
 
 #include <math.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#if defined (MAP_ANON) && !defined (MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 #define BACKEND_NAME avision
 #define BACKEND_BUILD 296 /* avision backend BUILD version */
 
@@ -1273,6 +1280,10 @@ static SANE_Bool force_calibration = SANE_FALSE;
 static SANE_Bool force_a4 = SANE_FALSE;
 static SANE_Bool force_a3 = SANE_FALSE;
 
+/* duplex rear pages up to this size are kept in memory, larger ones
+   and all with 0 go through the temporary file */
+static size_t duplex_rear_memory = 128 * 1024 * 1024;
+
 /* hardware resolutions to interpolate from */
 static const int  hw_res_list_c5[] =
   {
@@ -2231,47 +2242,55 @@ write_usb_cmd:
   } /* end cmd usb */
 }
 
-/* A bubble sort for the calibration. It only sorts the first third
- * and returns an average of the top 2/3 values. The input data is
- * 16bit big endian and the count is the count of the words - not
- * bytes! */
+/* The average of the top 2/3 values for the calibration, the same as
+ * sorting the values and averaging all from index count / 3 on. Rather
+ * than sorting, the count / 3 darkest values are selected by counting
+ * their high bytes, and then the low bytes within the one high byte
+ * that holds the cut, so the time only grows with the count. The input
+ * data is native endian. */
 
 static uint16_t
-bubble_sort (uint8_t* sort_data, size_t count)
+trimmed_average (const uint16_t* values, size_t count)
 {
-  size_t i, j, limit, k;
-  double sum = 0.0;
+  uint16_t hist[256];
+  size_t i, limit, below, need;
+  unsigned long total = 0, dark = 0;
+  unsigned int high, low;
   
   limit = count / 3;
   
-  for (i = 0; i < limit; ++i)
-    {
-      uint16_t ti = 0;
-      uint16_t tj = 0;
-      
-      for (j = (i + 1); j < count; ++j)
-	{
-	  ti = get_double ((sort_data + i*2));
-	  tj = get_double ((sort_data + j*2));
-	  
-	  if (ti > tj) {
-	    set_double ((sort_data + i*2), tj);
-	    set_double ((sort_data + j*2), ti);
-	  }
-	}
-    }
+  for (i = 0; i < count; ++i)
+    total += values[i];
   
-  for (k = 0, i = limit; i < count; ++i) {
-    sum += get_double ((sort_data + i*2));
-    ++ k;
+  if (count - limit == 0) /* no avg to compute */
+    return (uint16_t) total; /* always zero? */
+  
+  /* find the high byte in which the darkest third ends */
+  memset (hist, 0, sizeof (hist));
+  for (i = 0; i < count; ++i)
+    ++hist[values[i] >> 8];
+  
+  for (high = 0, below = 0; below + hist[high] < limit; ++high)
+    below += hist[high];
+  
+  /* all values with a lower high byte are in the darkest third */
+  memset (hist, 0, sizeof (hist));
+  for (i = 0; i < count; ++i) {
+    if ((values[i] >> 8) < high)
+      dark += values[i];
+    else if ((values[i] >> 8) == high)
+      ++hist[values[i] & 0xff];
   }
   
-  /* DBG (7, "bubble_sort: %d values for average\n", k); */
+  /* and the rest come from the bottom of the one high byte */
+  need = limit - below;
+  for (low = 0; need > 0; ++low) {
+    size_t take = hist[low] < need ? hist[low] : need;
+    dark += take * ((high << 8) | low);
+    need -= take;
+  }
   
-  if (k > 0) /* if avg to compute */
-    return (uint16_t) (sum / k);
-  else
-    return (uint16_t) (sum); /* always zero? */
+  return (uint16_t) ((total - dark) / (count - limit));
 }
 
 static SANE_Status
@@ -4747,31 +4766,38 @@ set_calib_data (Avision_Scanner* s, struct calibration_format* format,
   return SANE_STATUS_GOOD;
 }
 
-/* Sort data pixel by pixel and average first 2/3 of the data.
+/* Average the top 2/3 of the data pixel by pixel, see trimmed_average.
    The caller has to free return pointer. R,G,B pixels
    interleave to R,G,B line interleave.
    
    The input data data is in 16 bits little endian, always.
    That is a = b[1] << 8 + b[0] in all system.
 
+   The lines of a block of pixels are first gathered into native endian
+   columns, one line at a time, so the input is read in order and the
+   columns stay in cache.
+
    We convert it to SCSI high-endian (big-endian) since we use it all
    over the place anyway .... - Sorry for this mess. */
 
+#define SORT_AND_AVERAGE_BLOCK 64
+
 static uint8_t*
 sort_and_average (struct calibration_format* format, uint8_t* data)
 {
   const int elements_per_line = format->pixel_per_line * format->channels;
   const int stride = format->bytes_per_channel * elements_per_line;
-  int i, line;
+  int i, j, block, line;
     
-  uint8_t *sort_data, *avg_data;
+  uint16_t *sort_data;
+  uint8_t *avg_data;
   
   DBG (1, "sort_and_average:\n");
   
   if (!format || !data)
     return NULL;
   
-  sort_data = malloc (format->lines * 2);
+  sort_data = malloc (SORT_AND_AVERAGE_BLOCK * format->lines * 2);
   if (!sort_data)
     return NULL;
   
@@ -4781,27 +4807,31 @@ sort_and_average (struct calibration_format* format, uint8_t* data)
     return NULL;
   }
   
-  /* for each pixel */
-  for (i = 0; i < elements_per_line; ++ i)
+  /* for each block of pixels */
+  for (i = 0; i < elements_per_line; i += SORT_AND_AVERAGE_BLOCK)
     {
-      uint8_t* ptr1 = data + i * format->bytes_per_channel;
-      uint16_t temp;
+      block = elements_per_line - i;
+      if (block > SORT_AND_AVERAGE_BLOCK)
+	block = SORT_AND_AVERAGE_BLOCK;
       
-      /* copy all lines for pixel i into the linear array sort_data */
+      /* copy all lines for the block into one linear array per pixel */
       for (line = 0; line < format->lines; ++ line) {
-	uint8_t* ptr2 = ptr1 + line * stride; /* pixel */
+	uint8_t* ptr = data + line * stride + i * format->bytes_per_channel;
 	
 	if (format->bytes_per_channel == 1)
-	  temp = 0xffff * *ptr2 / 255;
+	  for (j = 0; j < block; ++j)
+	    sort_data[j * format->lines + line] = 0xffff * ptr[j] / 255;
 	else
-	  temp = get_double_le (ptr2);	  /* little-endian! */
-	set_double ((sort_data + line*2), temp); /* store big-endian */
-	/* DBG (7, "ReneR to sort: %x\n", temp); */
+	  for (j = 0; j < block; ++j)	/* little-endian! */
+	    sort_data[j * format->lines + line] = get_double_le ((ptr + j*2));
       }
       
-      temp = bubble_sort (sort_data, format->lines);
-      /* DBG (7, "ReneR averaged: %x\n", temp); */
-      set_double ((avg_data + i*2), temp); /* store big-endian */
+      for (j = 0; j < block; ++j) {
+	uint16_t temp = trimmed_average (sort_data + j * format->lines,
+					 format->lines);
+	/* DBG (7, "ReneR averaged: %x\n", temp); */
+	set_double ((avg_data + (i + j)*2), temp); /* store big-endian */
+      }
     }
   
   free ((void *) sort_data);
@@ -6681,6 +6711,122 @@ init_options (Avision_Scanner* s)
   return SANE_STATUS_GOOD;
 }
 
+/* Duplex rear page store. The rear data is kept in the shared memory
+   of the scanner handle as long as it fits, and in the rear file once it
+   does not, or if there is no memory. The calls mirror the stdio ones
+   they replace, rear_fp is only opened for the file. */
+
+static uint8_t*
+rear_data (Avision_Scanner* s)
+{
+  return (uint8_t*) (s->duplex_rear_mem + 1);
+}
+
+static SANE_Status
+rear_open (Avision_Scanner* s, FILE** rear_fp, SANE_Bool for_write)
+{
+  Avision_Rear_Store* mem = s->duplex_rear_mem;
+  
+  *rear_fp = 0;
+  if (mem && for_write) {
+    mem->size = mem->pos = 0;
+    mem->spilled = SANE_FALSE;
+    return SANE_STATUS_GOOD;
+  }
+  if (mem && !mem->spilled) {
+    mem->pos = 0;
+    return SANE_STATUS_GOOD;
+  }
+  
+  *rear_fp = fopen (s->duplex_rear_fname, for_write ? "w" : "r");
+  if (! *rear_fp)
+    return for_write ? SANE_STATUS_NO_MEM : SANE_STATUS_IO_ERROR;
+  return SANE_STATUS_GOOD;
+}
+
+/* move what is in memory to the rear file and continue there */
+static SANE_Status
+rear_spill (Avision_Scanner* s, FILE** rear_fp)
+{
+  Avision_Rear_Store* mem = s->duplex_rear_mem;
+  
+  DBG (3, "rear_spill: rear page exceeds %lu bytes, using %s\n",
+       (u_long) mem->capacity, s->duplex_rear_fname);
+  
+  *rear_fp = fopen (s->duplex_rear_fname, "w");
+  if (! *rear_fp)
+    return SANE_STATUS_NO_MEM;
+  
+  mem->spilled = SANE_TRUE;
+  if (fwrite (rear_data (s), 1, mem->size, *rear_fp) != mem->size ||
+      fseek (*rear_fp, (long) mem->pos, SEEK_SET) != 0)
+    return SANE_STATUS_IO_ERROR;
+  return SANE_STATUS_GOOD;
+}
+
+static size_t
+rear_write (Avision_Scanner* s, FILE** rear_fp, const uint8_t* ptr, size_t len)
+{
+  Avision_Rear_Store* mem = s->duplex_rear_mem;
+  
+  if (mem && !mem->spilled && mem->pos + len > mem->capacity)
+    if (rear_spill (s, rear_fp) != SANE_STATUS_GOOD)
+      return 0;
+  
+  if (! mem || mem->spilled)
+    return fwrite (ptr, len, 1, *rear_fp);
+  
+  /* a seek past the end leaves a hole, as in a file */
+  if (mem->pos > mem->size)
+    memset (rear_data (s) + mem->size, 0, mem->pos - mem->size);
+  memcpy (rear_data (s) + mem->pos, ptr, len);
+  mem->pos += len;
+  if (mem->pos > mem->size)
+    mem->size = mem->pos;
+  return 1;
+}
+
+static int
+rear_seek (Avision_Scanner* s, FILE** rear_fp, long offset)
+{
+  Avision_Rear_Store* mem = s->duplex_rear_mem;
+  
+  if (! mem || mem->spilled)
+    return fseek (*rear_fp, offset, SEEK_SET);
+  
+  if (offset < 0)
+    return -1;
+  mem->pos = offset;
+  return 0;
+}
+
+/* where a flipped rear line goes: the first line last and the last line
+   first. absline counts scanner lines, so this uses hw_lines and not the
+   (possibly scaled) params.lines. Negative for lines past the page end. */
+static long
+rear_flip_offset (Avision_Scanner* s, unsigned int absline)
+{
+  return ((long) s->avdimen.hw_lines - (long) absline - 1) *
+    s->avdimen.hw_bytes_per_line;
+}
+
+static size_t
+rear_read (Avision_Scanner* s, FILE** rear_fp, uint8_t* ptr, size_t len)
+{
+  Avision_Rear_Store* mem = s->duplex_rear_mem;
+  
+  if (! mem || mem->spilled)
+    return fread (ptr, 1, len, *rear_fp);
+  
+  if (mem->pos >= mem->size)
+    return 0;
+  if (len > mem->size - mem->pos)
+    len = mem->size - mem->pos;
+  memcpy (ptr, rear_data (s) + mem->pos, len);
+  mem->pos += len;
+  return len;
+}
+
 /* This function is executed as a child process. The reason this is
    executed as a subprocess is because some (most?) generic SCSI
    interfaces block a SCSI request until it has completed. With a
@@ -6824,18 +6970,18 @@ reader_process (void *data)
     {
       if (!s->duplex_rear_valid) { /* create new file for writing */
 	DBG (3, "reader_process: opening duplex rear file for writing.\n");
-	rear_fp = fopen (s->duplex_rear_fname, "w");
-	if (! rear_fp) {
+	status = rear_open (s, &rear_fp, SANE_TRUE);
+	if (status != SANE_STATUS_GOOD) {
 	  fclose (fp);
-	  return SANE_STATUS_NO_MEM;
+	  return status;
 	}
       }
       else { /* open saved rear data */
 	DBG (3, "reader_process: opening duplex rear file for reading.\n");
-	rear_fp = fopen (s->duplex_rear_fname, "r");
-	if (! rear_fp) {
+	status = rear_open (s, &rear_fp, SANE_FALSE);
+	if (status != SANE_STATUS_GOOD) {
 	  fclose (fp);
-	  return SANE_STATUS_IO_ERROR;
+	  return status;
 	}
       }
     }
@@ -6998,7 +7144,7 @@ reader_process (void *data)
 	       (u_long) processed_bytes, (u_long) total_size);
 	  DBG (5, "reader_process: virtual this_read: %lu\n", (u_long) this_read);
 	  
-	  got = fread (stripe_data + stripe_fill, 1, this_read, rear_fp);
+	  got = rear_read (s, &rear_fp, stripe_data + stripe_fill, this_read);
 	  stripe_fill += got;
 	  processed_bytes += got;
 	  if (got != this_read)
@@ -7032,7 +7178,7 @@ reader_process (void *data)
 		   (deinterlace == LINE   && absline & 0x1) ) /* last bit equals % 2 */
 		{
 		  DBG (9, "reader_process: saving rear line %d to temporary file.\n", absline);
-		  fwrite (ptr, s->avdimen.hw_bytes_per_line, 1, rear_fp);
+		  rear_write (s, &rear_fp, ptr, s->avdimen.hw_bytes_per_line);
 		  if (deinterlace == LINE)
 		    memmove (ptr, ptr+s->avdimen.hw_bytes_per_line,
 			     stripe_data + stripe_fill - ptr - s->avdimen.hw_bytes_per_line);
@@ -7053,8 +7199,11 @@ reader_process (void *data)
 	unsigned int abslines = absline + useful_bytes / s->avdimen.hw_bytes_per_line;
 	uint8_t* ptr = stripe_data;
 	for ( ; absline < abslines; ++absline) {
-          fseek (rear_fp, ((0 - s->params.lines) - absline - 2) * s->avdimen.hw_bytes_per_line, SEEK_SET);
-          fwrite (ptr, s->avdimen.hw_bytes_per_line, 1, rear_fp);
+	  long offset = rear_flip_offset (s, absline);
+	  if (offset >= 0 && rear_seek (s, &rear_fp, offset) == 0)
+	    rear_write (s, &rear_fp, ptr, s->avdimen.hw_bytes_per_line);
+	  else
+	    DBG (1, "reader_process: rear line %d beyond page end, dropped\n", absline);
           useful_bytes -= s->avdimen.hw_bytes_per_line;
           stripe_fill -= s->avdimen.hw_bytes_per_line;
           ptr += s->avdimen.hw_bytes_per_line;
@@ -7622,6 +7771,27 @@ sane_reload_devices (void)
 		     linenumber);
 		force_a3 = SANE_TRUE;
 	      }
+	      else if (strcmp (word, "duplex-rear-memory") == 0) {
+		free (word);
+		word = NULL;
+		cp = sanei_config_get_string (cp, &word);
+		
+		if (!word) {
+		  DBG (1, "sane_reload_devices: config file line %d: missing size\n",
+		       linenumber);
+		  continue;
+		}
+		
+		if (atoi (word) < 0) {
+		  DBG (1, "sane_reload_devices: config file line %d: negative duplex rear memory %s ignored\n",
+		       linenumber, word);
+		  continue;
+		}
+		
+		duplex_rear_memory = (size_t) atoi (word) * 1024 * 1024;
+		DBG (3, "sane_reload_devices: config file line %d: duplex rear memory %lu\n",
+		     linenumber, (u_long) duplex_rear_memory);
+	      }
 	      else if (strcmp (word, "static-red-calib") == 0) {
 		DBG (3, "sane_reload_devices: config file line %d: static red calibration\n",
 		     linenumber);
@@ -7904,6 +8074,22 @@ sane_open (SANE_String_Const devicename, SANE_Handle *handle)
       DBG (1, "sane_open: temporary fname for duplex scans: %s\n",
 	   s->duplex_rear_fname);
     }
+    
+    /* shared, so it survives the forked reader process */
+#if defined (HAVE_MMAP) && defined (MAP_ANONYMOUS)
+    if (duplex_rear_memory > 0) {
+      void* mem = mmap (NULL, sizeof (Avision_Rear_Store) + duplex_rear_memory,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+      if (mem == MAP_FAILED) {
+	DBG (1, "sane_open: no memory for duplex rear page, using the file\n");
+      }
+      else {
+	s->duplex_rear_mem = mem;
+	s->duplex_rear_mem->capacity = duplex_rear_memory;
+      }
+    }
+#endif
   }
   
   /* calibrate film scanners, as this must be done without the
@@ -8001,6 +8187,14 @@ sane_close (SANE_Handle handle)
     *(s->duplex_rear_fname) = 0;
   }
   
+#if defined (HAVE_MMAP) && defined (MAP_ANONYMOUS)
+  if (s->duplex_rear_mem) {
+    munmap ((void*) s->duplex_rear_mem,
+	    sizeof (Avision_Rear_Store) + s->duplex_rear_mem->capacity);
+    s->duplex_rear_mem = NULL;
+  }
+#endif
+  
   free (handle);
 }
 
@@ -425,6 +425,17 @@ typedef struct Avision_Device
   Avision_HWEntry* hw;
 } Avision_Device;
 
+/* Duplex rear page kept in memory. The header is followed by capacity
+   bytes of data, all in a shared mapping, so that the reader process of
+   the front page can hand the data to the reader of the rear page. */
+typedef struct Avision_Rear_Store
+{
+  size_t capacity;
+  size_t size;     /* bytes of rear data */
+  size_t pos;      /* read or write position */
+  SANE_Bool spilled; /* too large, the data is in the rear file */
+} Avision_Rear_Store;
+
 /* all the state relevant for the SANE interface */
 typedef struct Avision_Scanner
 {
@@ -455,6 +466,7 @@ typedef struct Avision_Scanner
   /* Internal data for duplex scans */
   char duplex_rear_fname [PATH_MAX];
   SANE_Bool duplex_rear_valid;
+  Avision_Rear_Store* duplex_rear_mem; /* NULL: always use the file */
   
   color_mode c_mode;
   source_mode source_mode;
@@ -102,6 +102,28 @@ struct img_params
 
 };
 
+struct scanner;
+
+/* one side's trip through the image processing functions.
+ * each side gets its own thread, see queue_processing() */
+struct pp_job
+{
+  struct scanner * s;
+  int side;
+  int state;
+
+  /* copy of the intermediate params, changed by buffer_process() */
+  struct img_params i;
+
+  /* rotation buffer kept between pages */
+  SANEI_Magic_Arena * arena;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  int running;
+#endif
+};
+
 struct scanner
 {
   /* --------------------------------------------------------------------- */
@@ -314,6 +336,9 @@ struct scanner
 
   unsigned char * buffers[2];
 
+  /* image processing of each side */
+  struct pp_job pp[2];
+
   /* --------------------------------------------------------------------- */
   /* values used by the command and data sending functions (scsi/usb)      */
   int fd;                      /* The scanner device file descriptor.      */
@@ -350,6 +375,10 @@ struct scanner
 #define SOURCE_ADF_BACK 2
 #define SOURCE_ADF_DUPLEX 3
 
+#define PP_NONE 0
+#define PP_QUEUED 1
+#define PP_DONE 2
+
 static const int dpi_list[] = {
 60,75,100,120,150,160,180,200,
 240,300,320,400,480,600,800,1200
@@ -538,26 +567,12 @@ static SANE_Status copy_simplex(struct scanner *s, unsigned char * buf, int len,
 static SANE_Status copy_duplex(struct scanner *s, unsigned char * buf, int len);
 static SANE_Status copy_line(struct scanner *s, unsigned char * buf, int side);
 
-static SANE_Status buffer_despeck(struct scanner *s, int side);
-static SANE_Status buffer_deskew(struct scanner *s, int side);
-static SANE_Status buffer_crop(struct scanner *s, int side);
-
-int * getTransitionsY (struct scanner *s, int side, int top);
-int * getTransitionsX (struct scanner *s, int side, int top);
-
-SANE_Status getEdgeIterate (int width, int height, int resolution,
-  int * buff, double * finSlope, int * finXInter, int * finYInter);
-
-SANE_Status getEdgeSlope (int width, int height, int * top, int * bot,
-  double slope, int * finXInter, int * finYInter);
-
-SANE_Status rotateOnCenter (struct scanner *s, int side,
-  int centerX, int centerY, double slope);
-
-static SANE_Status getLine (int height, int width, int * buff,
- int slopes, double minSlope, double maxSlope,
- int offsets, int minOffset, int maxOffset,
- double * finSlope, int * finOffset, int * finDensity);
+static int must_process(struct scanner *s);
+static SANE_Status buffer_process(struct scanner *s, int side);
+static SANE_Status queue_processing(struct scanner *s, int side);
+static SANE_Status wait_for_processing(struct scanner *s, int side);
+static void finish_processing(struct scanner *s);
+static void free_arenas(struct scanner *s);
 
 static SANE_Status load_lut (unsigned char * lut, int in_bits, int out_bits,
   int out_min, int out_max, int slope, int offset);
@@ -39,6 +39,7 @@
 #include "../include/sane/sanei_usb.h"
 #include "../include/sane/sanei_debug.h"
 #include "../include/sane/sanei_config.h"
+#include "../include/sane/sanei_tiles.h"
 
 #define BACKEND_NAME coolscan3
 #include "../include/sane/sanei_backend.h"	/* must be last */
@@ -48,6 +49,25 @@
 #define CS3_REVISION 0
 #define CS3_CONFIG_FILE "coolscan3.conf"
 
+/* largest block of lines read at once over USB, SCSI uses
+ * sanei_scsi_max_request_size */
+#define CS3_BLOCK_SIZE (256 * 1024)
+
+/* SCSI reads kept in flight while a block is converted, plus one */
+#define CS3_READ_AHEAD 3
+
+/* lines of a block handed to one thread, and the most threads used */
+#define CS3_TILE_LINES 16
+#define CS3_MAX_THREADS 16
+
+/* dust removal: pixels whose infrared is below this percentage of the
+ * line average are dust, and are filled in from clean pixels at most
+ * CS3_IR_RADIUS away */
+#define CS3_IR_THRESHOLD 60
+#define CS3_IR_RADIUS 8
+
+#define CS3_MAX_SAMPLES 16
+
 #define WSIZE (sizeof (SANE_Word))
 
 
@@ -114,6 +134,9 @@ typedef enum
 	CS3_OPTION_NEGATIVE,
 
 	CS3_OPTION_INFRARED,
+	CS3_OPTION_DUST_REMOVAL,
+
+	CS3_OPTION_SAMPLES,
 
 	CS3_OPTION_DEPTH,
 
@@ -212,7 +235,10 @@ typedef struct
 
 	/* settings */
 	SANE_Bool preview, negative, infrared, autoload, autofocus, ae, aewb;
+	SANE_Bool dust_removal;
+	int samples;
 	int depth, real_depth, bytes_per_pixel, shift_bits, n_colors;
+	int n_colors_out;	/* without infrared if only read for dust removal */
 	cs3_pixel_t n_lut;
 	cs3_pixel_t *lut_r, *lut_g, *lut_b, *lut_neutral;
 	unsigned long resx, resy, res, res_independent, res_preview;
@@ -238,6 +264,14 @@ typedef struct
 	SANE_Bool scanning;
 	SANE_Byte *line_buf;
 	ssize_t n_line_buf, i_line_buf;
+	size_t line_buf_size;
+	SANEI_SCSI_Read_Ahead *read_ahead;	/* queued SCSI reads, or NULL */
+	size_t xfer_queued;	/* bytes of lines asked for so far */
+	ssize_t queue_len_line, queue_len_in;
+	SANE_Byte *ir_buf;	/* lines kept for dust removal */
+	uint8_t *ir_mask;	/* their dust, one byte per pixel */
+	size_t ir_buf_lines;
+	int ir_above, ir_pending;	/* lines already returned / not yet */
 	unsigned long sense_key, sense_asc, sense_ascq, sense_info;
 	unsigned long sense_code;
 	cs3_status_t status;
@@ -285,6 +319,8 @@ static SANE_Status cs3_get_exposure(cs3_t * s);
 static SANE_Status cs3_set_window(cs3_t * s, cs3_scan_t type);
 static SANE_Status cs3_convert_options(cs3_t * s);
 static SANE_Status cs3_scan(cs3_t * s, cs3_scan_t type);
+static SANE_Status cs3_read_block(cs3_t * s, ssize_t xfer_len_line,
+				  ssize_t xfer_len_in);
 static void *cs3_xmalloc(size_t size);
 static void *cs3_xrealloc(void *p, size_t size);
 static void cs3_xfree(const void *p);
@@ -295,6 +331,8 @@ static void cs3_xfree(const void *p);
 
 static int cs3_colors[] = { 1, 2, 3, 9 };
 
+static int cs3_threads = 1;
+
 static SANE_Device **device_list = NULL;
 static int n_device_list = 0;
 static cs3_interface_t try_interface = CS3_INTERFACE_UNKNOWN;
@@ -318,6 +356,14 @@ sane_init(SANE_Int * version_code, SANE_Auth_Callback authorize)
 
 	sanei_usb_init();
 
+#if defined (HAVE_PTHREAD_H) && defined (_SC_NPROCESSORS_ONLN)
+	cs3_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cs3_threads < 1)
+		cs3_threads = 1;
+	if (cs3_threads > CS3_MAX_THREADS)
+		cs3_threads = CS3_MAX_THREADS;
+#endif
+
 	return SANE_STATUS_GOOD;
 }
 
@@ -463,6 +509,39 @@ sane_open(SANE_String_Const name, SANE_Handle * h)
 #endif
 			break;
 
+		case CS3_OPTION_DUST_REMOVAL:
+			o.name = "dust-removal";
+			o.title = "Infrared dust removal";
+			o.desc = "Find dust and scratches in the infrared channel "
+				"and fill them in from the surrounding image";
+			o.type = SANE_TYPE_BOOL;
+			o.size = WSIZE;
+			o.cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT;
+			break;
+
+		case CS3_OPTION_SAMPLES:
+			o.name = "samples";
+			o.title = "Samples per line";
+			o.desc = "Number of times each line is read and averaged, "
+				"to reduce noise";
+			o.type = SANE_TYPE_INT;
+			o.unit = SANE_UNIT_NONE;
+			o.size = WSIZE;
+			o.cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT |
+				SANE_CAP_ADVANCED;
+			o.constraint_type = SANE_CONSTRAINT_RANGE;
+			range = (SANE_Range *)
+				cs3_xmalloc(sizeof(SANE_Range));
+			if (!range)
+				alloc_failed = 1;
+			else {
+				range->min = 1;
+				range->max = CS3_MAX_SAMPLES;
+				range->quant = 1;
+				o.constraint.range = range;
+			}
+			break;
+
 		case CS3_OPTION_DEPTH:
 			o.name = "depth";
 			o.title = "Bit depth per channel";
@@ -981,6 +1060,8 @@ sane_open(SANE_String_Const name, SANE_Handle * h)
 	s->negative = SANE_FALSE;
 	s->autoload = SANE_FALSE;
 	s->infrared = SANE_FALSE;
+	s->dust_removal = SANE_FALSE;
+	s->samples = 1;
 	s->ae = SANE_FALSE;
 	s->aewb = SANE_FALSE;
 	s->depth = 8;
@@ -1007,6 +1088,8 @@ sane_open(SANE_String_Const name, SANE_Handle * h)
 	s->exposure_b = 1000.;
 	s->line_buf = NULL;
 	s->n_line_buf = 0;
+	s->line_buf_size = 0;
+	s->read_ahead = NULL;
 
 	if (alloc_failed) {
 		cs3_close(s);
@@ -1064,6 +1147,12 @@ sane_control_option(SANE_Handle h, SANE_Int n, SANE_Action a, void *v,
 		case CS3_OPTION_INFRARED:
 			*(SANE_Word *) v = s->infrared;
 			break;
+		case CS3_OPTION_DUST_REMOVAL:
+			*(SANE_Word *) v = s->dust_removal;
+			break;
+		case CS3_OPTION_SAMPLES:
+			*(SANE_Word *) v = s->samples;
+			break;
 		case CS3_OPTION_DEPTH:
 			*(SANE_Word *) v = s->depth;
 			break;
@@ -1222,6 +1311,12 @@ sane_control_option(SANE_Handle h, SANE_Int n, SANE_Action a, void *v,
 			s->infrared = *(SANE_Word *) v;
 			/*      flags |= SANE_INFO_RELOAD_PARAMS; XXX */
 			break;
+		case CS3_OPTION_DUST_REMOVAL:
+			s->dust_removal = *(SANE_Word *) v;
+			break;
+		case CS3_OPTION_SAMPLES:
+			s->samples = *(SANE_Word *) v;
+			break;
 		case CS3_OPTION_DEPTH:
 			if (*(SANE_Word *) v > s->maxbits)
 				return SANE_STATUS_INVAL;
@@ -1396,7 +1491,7 @@ sane_get_parameters(SANE_Handle h, SANE_Parameters * p)
 	}
 
 	p->bytes_per_line =
-		s->n_colors * s->logical_width * s->bytes_per_pixel;
+		s->n_colors_out * s->logical_width * s->bytes_per_pixel;
 
 #ifdef SANE_FRAME_RGBI
 	if (s->infrared) {
@@ -1443,7 +1538,12 @@ sane_start(SANE_Handle h)
 		return status;
 
 	s->i_line_buf = 0;
+	s->n_line_buf = 0;
 	s->xfer_position = 0;
+	sanei_scsi_read_ahead_stop(s->read_ahead);
+	s->read_ahead = NULL;
+	s->ir_above = 0;
+	s->ir_pending = 0;
 
 	s->scanning = SANE_TRUE;
 
@@ -1486,11 +1586,6 @@ sane_read(SANE_Handle h, SANE_Byte * buf, SANE_Int maxlen, SANE_Int * len)
 	cs3_t *s = (cs3_t *) h;
 	SANE_Status status;
 	ssize_t xfer_len_in, xfer_len_line, xfer_len_out;
-	unsigned long index;
-	int color;
-	uint8_t *s8 = NULL;
-	uint16_t *s16 = NULL;
-	SANE_Byte *line_buf_new;
 
 	DBG(32, "%s, maxlen = %i.\n", __func__, maxlen);
 
@@ -1500,7 +1595,7 @@ sane_read(SANE_Handle h, SANE_Byte * buf, SANE_Int maxlen, SANE_Int * len)
 	}
 
 	/* transfer from buffer */
-	if (s->i_line_buf > 0) {
+	if (s->i_line_buf < s->n_line_buf) {
 		xfer_len_out = s->n_line_buf - s->i_line_buf;
 		if (xfer_len_out > maxlen)
 			xfer_len_out = maxlen;
@@ -1508,8 +1603,6 @@ sane_read(SANE_Handle h, SANE_Byte * buf, SANE_Int maxlen, SANE_Int * len)
 		memcpy(buf, &(s->line_buf[s->i_line_buf]), xfer_len_out);
 
 		s->i_line_buf += xfer_len_out;
-		if (s->i_line_buf >= s->n_line_buf)
-			s->i_line_buf = 0;
 
 		*len = xfer_len_out;
 		return SANE_STATUS_GOOD;
@@ -1539,12 +1632,12 @@ sane_read(SANE_Handle h, SANE_Byte * buf, SANE_Int maxlen, SANE_Int * len)
 			    __func__, (long) xfer_len_in);
 	}
 
-	if (s->xfer_position + xfer_len_line > s->xfer_bytes_total)
-		xfer_len_line = s->xfer_bytes_total - s->xfer_position;	/* just in case */
-
-	if (xfer_len_line == 0) {	/* no more data */
+	if (s->xfer_position + xfer_len_line > s->xfer_bytes_total) {	/* no more data */
 		*len = 0;
 
+		sanei_scsi_read_ahead_stop(s->read_ahead);
+		s->read_ahead = NULL;
+
 		/* increment frame number if appropriate */
 		if (s->n_frames > 1 && --s->frame_count) {
 			s->i_frame++;
@@ -1554,84 +1647,30 @@ sane_read(SANE_Handle h, SANE_Byte * buf, SANE_Int maxlen, SANE_Int * len)
 		return SANE_STATUS_EOF;
 	}
 
-	if (xfer_len_line != s->n_line_buf) {
-		line_buf_new =
-			(SANE_Byte *) cs3_xrealloc(s->line_buf,
-						   xfer_len_line *
-						   sizeof(SANE_Byte));
-		if (!line_buf_new) {
-			*len = 0;
-			return SANE_STATUS_NO_MEM;
-		}
-		s->line_buf = line_buf_new;
-		s->n_line_buf = xfer_len_line;
+	if (s->bytes_per_pixel != 1 && s->bytes_per_pixel != 2) {
+		DBG(1,
+		    "BUG: sane_read(): Unknown number of bytes per pixel.\n");
+		*len = 0;
+		return SANE_STATUS_INVAL;
 	}
 
-	cs3_scanner_ready(s, CS3_STATUS_READY);
-	cs3_init_buffer(s);
-	cs3_parse_cmd(s, "28 00 00 00 00 00");
-	cs3_pack_byte(s, (xfer_len_in >> 16) & 0xff);
-	cs3_pack_byte(s, (xfer_len_in >> 8) & 0xff);
-	cs3_pack_byte(s, xfer_len_in & 0xff);
-	cs3_parse_cmd(s, "00");
-	s->n_recv = xfer_len_in;
+	/* dust removal may hold back all lines of a short block */
+	do
+		status = cs3_read_block(s, xfer_len_line, xfer_len_in);
+	while (status == SANE_STATUS_GOOD && s->n_line_buf == 0
+	       && s->xfer_position + xfer_len_line <= s->xfer_bytes_total);
 
-	status = cs3_issue_cmd(s);
 	if (status != SANE_STATUS_GOOD) {
 		*len = 0;
 		return status;
 	}
 
-	for (index = 0; index < s->logical_width; index++) {
-		for (color = 0; color < s->n_colors; color++) {
-
-			int where = s->bytes_per_pixel
-				* (s->n_colors * index + color);
-
-			switch (s->bytes_per_pixel) {
-			case 1:
-			{
-				int p8 = color * s->logical_width
-					+ (color + 1) * s->odd_padding
-					+ index;
-
-				s8 = (uint8_t *) & (s->line_buf[where]);
-				*s8 = s->recv_buf[p8];
-			}
-				break;
-			case 2:
-			{
-				int p16 =
-					2 * (color * s->logical_width +
-					     index);
-
-				s16 = (uint16_t *) & (s->line_buf[where]);
-				*s16 = (s->recv_buf[p16] << 8)
-					+ s->recv_buf[p16 + 1];
-
-				*s16 <<= s->shift_bits;
-			}
-				break;
-
-			default:
-				DBG(1,
-				    "BUG: sane_read(): Unknown number of bytes per pixel.\n");
-				*len = 0;
-				return SANE_STATUS_INVAL;
-				break;
-			}
-		}
-	}
-
-	s->xfer_position += xfer_len_line;
-
-	xfer_len_out = xfer_len_line;
+	xfer_len_out = s->n_line_buf;
 	if (xfer_len_out > maxlen)
 		xfer_len_out = maxlen;
 
 	memcpy(buf, s->line_buf, xfer_len_out);
-	if (xfer_len_out < xfer_len_line)
-		s->i_line_buf = xfer_len_out;	/* data left in the line buffer, read out next time */
+	s->i_line_buf = xfer_len_out;	/* data left in the line buffer, read out next time */
 
 	*len = xfer_len_out;
 	return SANE_STATUS_GOOD;
@@ -1644,6 +1683,9 @@ sane_cancel(SANE_Handle h)
 
 	DBG(10, "%s, scanning = %d.\n", __func__, s->scanning);
 
+	sanei_scsi_read_ahead_stop(s->read_ahead);
+	s->read_ahead = NULL;
+
 	if (s->scanning) {
 		cs3_init_buffer(s);
 		cs3_parse_cmd(s, "c0 00 00 00 00 00");
@@ -1920,6 +1962,9 @@ cs3_close(cs3_t * s)
 	cs3_xfree(s->lut_b);
 	cs3_xfree(s->lut_neutral);
 	cs3_xfree(s->line_buf);
+	sanei_scsi_read_ahead_stop(s->read_ahead);
+	cs3_xfree(s->ir_buf);
+	cs3_xfree(s->ir_mask);
 
 	switch (s->interface) {
 	case CS3_INTERFACE_UNKNOWN:
@@ -2807,8 +2852,9 @@ cs3_convert_options(cs3_t * s)
 			s->real_exposure[cs3_colors[i_color]] = 1;
 
 	s->n_colors = 3;	/* XXXXXXXXXXXXXX CCCCCCCCCCCCCC */
-	if (s->infrared)
+	if (s->infrared || s->dust_removal)
 		s->n_colors = 4;
+	s->n_colors_out = s->infrared ? 4 : 3;
 
 	s->xfer_bytes_total =
 		s->bytes_per_pixel * s->n_colors * s->logical_width *
@@ -2919,6 +2965,7 @@ static SANE_Status
 cs3_set_window(cs3_t * s, cs3_scan_t type)
 {
 	int color;
+	int samples = (type == CS3_SCAN_NORMAL) ? s->samples : 1;
 	SANE_Status status = SANE_STATUS_INVAL;
 
 	/* SET WINDOW */
@@ -2955,9 +3002,11 @@ cs3_set_window(cs3_t * s, cs3_scan_t type)
 		cs3_pack_byte(s, 0x05);	/* image composition CCCCCCC */
 		cs3_pack_byte(s, s->real_depth);	/* pixel composition */
 		cs3_parse_cmd(s, "00 00 00 00 00 00 00 00 00 00 00 00 00");
-		cs3_pack_byte(s, 0x00);	/* multiread, ordering */
+		/* with several samples the scanner sends each line that
+		 * often, and they are averaged in cs3_deinterleave() */
+		cs3_pack_byte(s, samples - 1);	/* multiread, ordering */
 
-		cs3_pack_byte(s, 0x80 | (s->negative ? 0 : 1));	/* averaging, pos/neg */
+		cs3_pack_byte(s, (samples > 1 ? 0 : 0x80) | (s->negative ? 0 : 1));	/* averaging, pos/neg */
 
 		switch (type) {	/* scanning kind */
 		case CS3_SCAN_NORMAL:
@@ -3076,6 +3125,437 @@ cs3_scan(cs3_t * s, cs3_scan_t type)
 	return SANE_STATUS_GOOD;
 }
 
+/* Line data is read in blocks of as many lines as fit in one request.
+ * On SCSI the read of the next block is queued as soon as the current
+ * one is in the line buffer, so the scanner keeps sending while the
+ * frontend works on the current block.
+ *
+ * Each block is then put through the line pipeline: the samples of
+ * every line are de-interleaved and averaged, and for dust removal the
+ * lines are kept in a window of CS3_IR_RADIUS lines above and below
+ * the ones cleaned, so lines are returned that much later. All stages
+ * work on tiles of CS3_TILE_LINES lines, shared by cs3_threads threads.
+ */
+
+typedef struct
+{
+	cs3_t *s;
+	const SANE_Byte *src;
+	SANE_Byte *dst;
+	ssize_t xfer_len_in, xfer_len_line, xfer_len_out;
+	int first, lines, rows;
+}
+cs3_block_t;
+
+/* call func for each tile of lines, the caller works on tiles too */
+static void
+cs3_run_tiles(void (*func) (void *, int), cs3_block_t * block)
+{
+	sanei_tiles_run(cs3_threads, func, block,
+			(block->lines + CS3_TILE_LINES - 1) / CS3_TILE_LINES);
+}
+
+static int
+cs3_block_lines(cs3_t * s, size_t position, ssize_t xfer_len_line,
+		ssize_t xfer_len_in)
+{
+	size_t max = CS3_BLOCK_SIZE;
+	unsigned long lines_left;
+	int lines;
+
+	if (s->interface == CS3_INTERFACE_SCSI)
+		max = sanei_scsi_max_request_size;
+	if (max > 0xffffff)	/* 24 bit transfer length */
+		max = 0xffffff;
+
+	lines_left = (s->xfer_bytes_total - position) / xfer_len_line;
+
+	lines = max / (xfer_len_in * s->samples);
+	if (lines < 1)
+		lines = 1;
+	if ((unsigned long) lines > lines_left)
+		lines = lines_left;
+
+	return lines;
+}
+
+/* build the READ for n bytes; the caller waits for the scanner first */
+static void
+cs3_block_cmd(cs3_t * s, size_t n)
+{
+	cs3_init_buffer(s);
+	cs3_parse_cmd(s, "28 00 00 00 00 00");
+	cs3_pack_byte(s, (n >> 16) & 0xff);
+	cs3_pack_byte(s, (n >> 8) & 0xff);
+	cs3_pack_byte(s, n & 0xff);
+	cs3_parse_cmd(s, "00");
+}
+
+/* the READ for the next block, for sanei_scsi_read_ahead */
+static SANE_Status
+cs3_read_ahead_cmd(void *arg, int index, SANE_Byte * cmd, size_t * cmd_size,
+		   size_t * size)
+{
+	cs3_t *s = (cs3_t *) arg;
+	int lines;
+
+	(void) index;
+
+	if (s->xfer_queued + s->queue_len_line > s->xfer_bytes_total)
+		return SANE_STATUS_EOF;
+
+	lines = cs3_block_lines(s, s->xfer_queued, s->queue_len_line,
+				s->queue_len_in);
+	*size = lines * s->samples * s->queue_len_in;
+	s->xfer_queued += lines * s->queue_len_line;
+
+	cs3_block_cmd(s, *size);
+	if (s->n_send > *cmd_size)
+		return SANE_STATUS_INVAL;
+	memcpy(cmd, s->send_buf, s->n_send);
+	*cmd_size = s->n_send;
+
+	return SANE_STATUS_GOOD;
+}
+
+/* de-interleave one line from the planar scanner layout, averaging the
+ * samples that follow each other stride bytes apart */
+static void
+cs3_deinterleave(cs3_t * s, SANE_Byte * dst, const SANE_Byte * src,
+		 ssize_t stride)
+{
+	unsigned long index, width = s->logical_width;
+	int color, n_colors = s->n_colors;
+	int k, samples = s->samples;
+	unsigned int sum;
+
+	if (s->bytes_per_pixel == 1) {
+		for (color = 0; color < n_colors; color++) {
+			const uint8_t *in = src + color * width
+				+ (color + 1) * s->odd_padding;
+			uint8_t *out = dst + color;
+
+			if (samples == 1) {
+				for (index = 0; index < width; index++) {
+					*out = in[index];
+					out += n_colors;
+				}
+				continue;
+			}
+
+			for (index = 0; index < width; index++) {
+				sum = 0;
+				for (k = 0; k < samples; k++)
+					sum += in[index + k * stride];
+				*out = (sum + samples / 2) / samples;
+				out += n_colors;
+			}
+		}
+	} else {
+		int shift = s->shift_bits;
+
+		for (color = 0; color < n_colors; color++) {
+			const uint8_t *in = src + 2 * color * width;
+			uint16_t *out = (uint16_t *) dst + color;
+
+			for (index = 0; index < width; index++) {
+				sum = 0;
+				for (k = 0; k < samples; k++)
+					sum += (in[k * stride] << 8)
+						| in[k * stride + 1];
+				*out = ((sum + samples / 2) / samples) << shift;
+				in += 2;
+				out += n_colors;
+			}
+		}
+	}
+}
+
+static void
+cs3_convert_tile(void *arg, int tile)
+{
+	cs3_block_t *b = (cs3_block_t *) arg;
+	int i = tile * CS3_TILE_LINES;
+	int end = i + CS3_TILE_LINES;
+
+	if (end > b->lines)
+		end = b->lines;
+
+	for (; i < end; i++)
+		cs3_deinterleave(b->s, b->dst + i * b->xfer_len_line,
+				 b->src + i * b->s->samples * b->xfer_len_in,
+				 b->xfer_len_in);
+}
+
+static unsigned int
+cs3_value(cs3_t * s, const SANE_Byte * line, unsigned long i)
+{
+	if (s->bytes_per_pixel == 1)
+		return line[i];
+	return ((const uint16_t *) line)[i];
+}
+
+static void
+cs3_set_value(cs3_t * s, SANE_Byte * line, unsigned long i,
+	      unsigned int val)
+{
+	if (s->bytes_per_pixel == 1)
+		line[i] = val;
+	else
+		((uint16_t *) line)[i] = val;
+}
+
+/* mark dust in the lines first to first + lines of the window */
+static void
+cs3_mask_tile(void *arg, int tile)
+{
+	cs3_block_t *b = (cs3_block_t *) arg;
+	cs3_t *s = b->s;
+	unsigned long x, width = s->logical_width, level;
+	int i = tile * CS3_TILE_LINES;
+	int end = i + CS3_TILE_LINES;
+	uint8_t *mask, prev, cur;
+	const SANE_Byte *line;
+
+	if (end > b->lines)
+		end = b->lines;
+
+	for (i += b->first; i < end + b->first; i++) {
+		line = s->ir_buf + i * b->xfer_len_line;
+		mask = s->ir_mask + i * width;
+
+		level = 0;
+		for (x = 0; x < width; x++)
+			level += cs3_value(s, line, 4 * x + 3);
+		level = level / width * CS3_IR_THRESHOLD / 100;
+
+		for (x = 0; x < width; x++)
+			mask[x] = cs3_value(s, line, 4 * x + 3) < level;
+
+		/* grow by a pixel, the edges of dust are soft */
+		prev = 0;
+		for (x = 0; x < width; x++) {
+			cur = mask[x];
+			mask[x] |= prev | (x + 1 < width ? mask[x + 1] : 0);
+			prev = cur;
+		}
+	}
+}
+
+/* fill in the dust in lines first to first + lines of the window from
+ * the nearest clean pixel in each direction, weighted by distance */
+static void
+cs3_clean_tile(void *arg, int tile)
+{
+	static const int dirs[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+	cs3_block_t *b = (cs3_block_t *) arg;
+	cs3_t *s = b->s;
+	unsigned long x, width = s->logical_width;
+	int n_out = s->n_colors_out;
+	int i = tile * CS3_TILE_LINES;
+	int end = i + CS3_TILE_LINES;
+	int c, d, k, row;
+	unsigned int sum[3], weight;
+	const SANE_Byte *line;
+	SANE_Byte *out;
+
+	if (end > b->lines)
+		end = b->lines;
+
+	for (; i < end; i++) {
+		row = b->first + i;
+		line = s->ir_buf + row * b->xfer_len_line;
+		out = b->dst + i * b->xfer_len_out;
+
+		for (x = 0; x < width; x++) {
+			for (c = 0; c < n_out; c++)
+				cs3_set_value(s, out, n_out * x + c,
+					      cs3_value(s, line, 4 * x + c));
+
+			if (!s->ir_mask[row * width + x])
+				continue;
+
+			sum[0] = sum[1] = sum[2] = weight = 0;
+			for (k = 0; k < 4; k++)
+				for (d = 1; d <= CS3_IR_RADIUS; d++) {
+					long xx = (long) x + d * dirs[k][0];
+					int rr = row + d * dirs[k][1];
+					const SANE_Byte *near;
+					unsigned int w;
+
+					if (xx < 0 || xx >= (long) width
+					    || rr < 0 || rr >= b->rows)
+						break;
+					if (s->ir_mask[rr * width + xx])
+						continue;
+
+					near = s->ir_buf + rr * b->xfer_len_line;
+					w = CS3_IR_RADIUS + 1 - d;
+					for (c = 0; c < 3; c++)
+						sum[c] += w * cs3_value(s, near,
+									4 * xx + c);
+					weight += w;
+					break;
+				}
+
+			if (weight)
+				for (c = 0; c < 3; c++)
+					cs3_set_value(s, out, n_out * x + c,
+						      (sum[c] + weight / 2) /
+						      weight);
+		}
+	}
+}
+
+/* add the lines of a block to the dust removal window and return those
+ * that have enough lines below them, or all at the end of the scan */
+static SANE_Status
+cs3_dust_removal(cs3_block_t * b)
+{
+	cs3_t *s = b->s;
+	unsigned long width = s->logical_width;
+	int lines = b->lines;
+	int rows = s->ir_above + s->ir_pending + lines;
+	int ready, keep;
+	SANE_Byte *buf_new;
+
+	if ((size_t) rows > s->ir_buf_lines) {
+		buf_new = (SANE_Byte *) cs3_xrealloc(s->ir_buf,
+						     rows * b->xfer_len_line);
+		if (!buf_new)
+			return SANE_STATUS_NO_MEM;
+		s->ir_buf = buf_new;
+
+		buf_new = (SANE_Byte *) cs3_xrealloc(s->ir_mask, rows * width);
+		if (!buf_new)
+			return SANE_STATUS_NO_MEM;
+		s->ir_mask = buf_new;
+		s->ir_buf_lines = rows;
+	}
+
+	b->first = s->ir_above + s->ir_pending;
+	b->dst = s->ir_buf + b->first * b->xfer_len_line;
+	cs3_run_tiles(cs3_convert_tile, b);
+	cs3_run_tiles(cs3_mask_tile, b);
+
+	ready = s->ir_pending + lines;
+	if (s->xfer_position + b->xfer_len_line <= s->xfer_bytes_total) {
+		ready -= CS3_IR_RADIUS;
+		if (ready < 0)
+			ready = 0;
+	}
+
+	if ((size_t) (ready * b->xfer_len_out) > s->line_buf_size) {
+		buf_new = (SANE_Byte *) cs3_xrealloc(s->line_buf,
+						     ready * b->xfer_len_out);
+		if (!buf_new)
+			return SANE_STATUS_NO_MEM;
+		s->line_buf = buf_new;
+		s->line_buf_size = ready * b->xfer_len_out;
+	}
+
+	b->first = s->ir_above;
+	b->lines = ready;
+	b->rows = rows;
+	b->dst = s->line_buf;
+	cs3_run_tiles(cs3_clean_tile, b);
+	s->n_line_buf = ready * b->xfer_len_out;
+
+	/* keep the lines above the next ones to clean */
+	keep = s->ir_above + ready - CS3_IR_RADIUS;
+	if (keep < 0)
+		keep = 0;
+	memmove(s->ir_buf, s->ir_buf + keep * b->xfer_len_line,
+		(rows - keep) * b->xfer_len_line);
+	memmove(s->ir_mask, s->ir_mask + keep * width, (rows - keep) * width);
+	s->ir_pending = rows - s->ir_above - ready;
+	s->ir_above = s->ir_above + ready - keep;
+
+	return SANE_STATUS_GOOD;
+}
+
+static SANE_Status
+cs3_read_block(cs3_t * s, ssize_t xfer_len_line, ssize_t xfer_len_in)
+{
+	SANE_Status status;
+	SANE_Byte *line_buf_new, *data;
+	cs3_block_t block;
+	size_t n;
+	int lines;
+
+	block.s = s;
+	block.xfer_len_in = xfer_len_in;
+	block.xfer_len_line = xfer_len_line;
+	block.xfer_len_out = s->n_colors_out * s->logical_width
+		* s->bytes_per_pixel;
+
+	lines = cs3_block_lines(s, s->xfer_position, xfer_len_line,
+				xfer_len_in);
+
+	if (s->interface == CS3_INTERFACE_SCSI) {
+		if (!s->read_ahead) {
+			s->xfer_queued = s->xfer_position;
+			s->queue_len_line = xfer_len_line;
+			s->queue_len_in = xfer_len_in;
+			/* once here, the queued READs must not poll the fd */
+			cs3_scanner_ready(s, CS3_STATUS_READY);
+			status = sanei_scsi_read_ahead_start(s->fd,
+							     CS3_READ_AHEAD,
+							     lines * s->samples
+							     * xfer_len_in,
+							     cs3_read_ahead_cmd,
+							     s,
+							     &s->read_ahead);
+			if (status != SANE_STATUS_GOOD)
+				return status;
+		}
+
+		/* the status is left to the sense handler, as in cs3_issue_cmd() */
+		status = sanei_scsi_read_ahead_next(s->read_ahead, &data, &n);
+		if (!data)
+			return (status == SANE_STATUS_EOF) ?
+				SANE_STATUS_IO_ERROR : status;
+		block.src = data;
+	} else {
+		cs3_scanner_ready(s, CS3_STATUS_READY);
+		cs3_block_cmd(s, lines * s->samples * xfer_len_in);
+		s->n_recv = lines * s->samples * xfer_len_in;
+
+		status = cs3_issue_cmd(s);
+		if (status != SANE_STATUS_GOOD)
+			return status;
+		block.src = s->recv_buf;
+	}
+
+	DBG(22, "%s: %d lines\n", __func__, lines);
+
+	n = lines * xfer_len_line;
+	s->xfer_position += n;
+	s->i_line_buf = 0;
+	block.lines = lines;
+
+	if (s->dust_removal) {
+		status = cs3_dust_removal(&block);
+		if (status != SANE_STATUS_GOOD)
+			return status;
+	} else {
+		if (n > s->line_buf_size) {
+			line_buf_new =
+				(SANE_Byte *) cs3_xrealloc(s->line_buf, n);
+			if (!line_buf_new)
+				return SANE_STATUS_NO_MEM;
+			s->line_buf = line_buf_new;
+			s->line_buf_size = n;
+		}
+
+		block.dst = s->line_buf;
+		cs3_run_tiles(cs3_convert_tile, &block);
+		s->n_line_buf = n;
+	}
+
+	return SANE_STATUS_GOOD;
+}
+
 static void *
 cs3_xmalloc(size_t size)
 {
@@ -96,6 +96,9 @@
 /* size of registation name */
 #define REG_NAME_SIZE 64
 
+/* number of decoded lines held between the decoder and sane_read */
+#define DECODE_BUF_LINES 32
+
 struct DeviceRecord
 {
   SANE_Device m_device;
@@ -111,18 +114,60 @@ struct ComBuf
   unsigned char *m_pBuf;	/* storage (or NULL if none allocated) */
 };
 
+/* state data for a single page 
+   NOTE: all ints are in host byte order 
+*/
+struct PageInfo
+{
+  int m_width;                 /* pixel width */
+  int m_height;                /* pixel height */
+  int m_lineSize;              /* bytes per decoded line */
+  int m_totalSize;             /* total page size (bytes) */
+  int m_bytesRemaining;        /* number of bytes not yet passed to SANE client */
+};
+
+/* struct for in-memory jpeg decompression, fed as the page data arrives */
+struct JpegDataDecompState
+{
+  struct jpeg_decompress_struct m_cinfo;	/* base struct */
+  struct jpeg_source_mgr m_srcMgr;	/* source manager */
+  struct jpeg_error_mgr m_errMgr;	/* error manager */
+  struct ComBuf *m_pData;	/* compressed data not yet consumed */
+  size_t m_bytesHanded;		/* bytes of m_pData handed to the source manager */
+  size_t m_bytesToSkip;		/* bytes to skip as soon as they arrive */
+  int m_bLastData;		/* set non-0 when no more data will arrive */
+  int m_bEoi;			/* set non-0 once a dummy EOI has been supplied */
+  int m_bCreated;		/* set non-0 once m_cinfo has been created */
+  int m_bHeaderRead;		/* set non-0 once the header has been read */
+};
+
+/* an in-memory file for use with TIFFClientOpen */
+struct TiffMemFile
+{
+  struct ComBuf m_data;		/* file contents */
+  toff_t m_pos;			/* current offset */
+};
+
 /* state data for a single scanner connection */
 struct ScannerState
 {
   int m_udpFd;			/* file descriptor to UDP socket */
-  int m_tcpFd;			/* file descriptor to TCP socket */
+  int m_tcpFd;			/* file descriptor to TCP socket (-1 if closed) */
   struct sockaddr_in m_sockAddr;	/* printer address */
-  struct ComBuf m_buf;		/* buffer for network data */
-  struct ComBuf m_imageData;	/* storage for decoded image data */
-  int m_numPages;	        /* number of complete pages (host byte order) */
-  struct ComBuf m_pageInfo;	/* "array" of numPages PageInfo structs */
-  int m_bFinish;		/* set non-0 to signal that we are finished */
-  int m_bCancelled;		/* set non-0 that bFinish state arose from cancelation */
+  struct ComBuf m_buf;		/* compressed data of the current page */
+  struct ComBuf m_tcpBuf;	/* TCP data not yet processed */
+  struct ComBuf m_imageData;	/* decoded lines not yet passed to SANE */
+  size_t m_imageOffset;		/* bytes of m_imageData already passed to SANE */
+  struct PageInfo m_pageInfo;	/* the page being decoded */
+  int m_decodedLines;		/* number of lines of the page decoded so far */
+  int m_bPageStarted;		/* set non-0 when the scanner has started a page */
+  int m_bPageEnd;		/* set non-0 when all data of the page has arrived */
+  int m_bDecoding;		/* set non-0 while the page is being passed to SANE */
+  int m_bCancelled;		/* set non-0 by sane_cancel */
+  struct JpegDataDecompState m_jpeg;	/* decoder for JPEG pages */
+  struct TiffMemFile m_tiffFile;	/* in-memory TIFF file for G4 pages */
+  TIFF *m_pTiff;		/* decoder for G4 pages (or NULL) */
+  unsigned char *m_pTiffLine;	/* a single line of G4 page data */
   char m_regName[REG_NAME_SIZE];	/* name with which to register */
   unsigned short m_xres;	/* x resolution (network byte order) */
   unsigned short m_yres;	/* y resolution (network byte order) */
@@ -136,25 +181,6 @@ struct ScannerState
   unsigned int m_currentPageBytes;/* number of bytes of current page read (host byte order) */
 };
 
-/* state data for a single page 
-   NOTE: all ints are in host byte order 
-*/
-struct PageInfo
-{
-  int m_width;                 /* pixel width */
-  int m_height;                /* pixel height */
-  int m_totalSize;             /* total page size (bytes) */
-  int m_bytesRemaining;        /* number of bytes not yet passed to SANE client */
-};
-
-/* struct for in-memory jpeg decompression */
-struct JpegDataDecompState
-{
-  struct jpeg_decompress_struct m_cinfo;	/* base struct */
-  unsigned char *m_pData;	/* data pointer */
-  unsigned int m_bytesRemaining;	/* amount of unprocessed data */
-};
-
 /* initial ComBuf allocation */
 #define INITIAL_COM_BUF_SIZE 1024
 
@@ -217,14 +243,46 @@ static int ProcessUdpResponse (unsigned char *pData, size_t size,
 static int ProcessTcpResponse (struct ScannerState *pState,
 			       struct ComBuf *pTcpBufBuf);
 
-/* Process the data from a single scanned page, \return 0 in success, >0 otherwise */
-static int ProcessPageData (struct ScannerState *pState);
+/* process the complete messages in the TCP buffer, \return 0 in success, >0 otherwise */
+static int ProcessTcpBuffer (struct ScannerState *pState);
+
+/* read from the TCP socket and process the result, \return 0 in success, >0 otherwise */
+static int ReadTcpData (struct ScannerState *pState);
+
+/* wait for the scanner to start a page, \return SANE status */
+static SANE_Status WaitForPage (struct ScannerState *pState);
+
+/* read the rest of the session up to the next page, \return 0 in success, >0 otherwise */
+static int FinishPage (struct ScannerState *pState);
+
+/* drop the TCP connection to the scanner along with any page data */
+static void CloseSession (struct ScannerState *pState);
+
+/* set up a decoder for the current page
+   \return 0 if ready, -1 if more data is needed, >0 otherwise */
+static int StartPageDecode (struct ScannerState *pState);
+
+/* decode further lines of the current page, \return 0 in success, >0 otherwise */
+static int DecodePageLines (struct ScannerState *pState);
+
+/* release the decoder and data of the current page */
+static void EndPageDecode (struct ScannerState *pState);
 
 /* Libjpeg decompression interface */
 static void JpegDecompInitSource (j_decompress_ptr cinfo);
 static boolean JpegDecompFillInputBuffer (j_decompress_ptr cinfo);
 static void JpegDecompSkipInputData (j_decompress_ptr cinfo, long numBytes);
 static void JpegDecompTermSource (j_decompress_ptr cinfo);
+static void JpegDecompSync (struct JpegDataDecompState *pJpeg, int bLastData);
+
+/* Libtiff in-memory file interface */
+static tsize_t TiffMemRead (thandle_t handle, tdata_t pData, tsize_t size);
+static tsize_t TiffMemWrite (thandle_t handle, tdata_t pData, tsize_t size);
+static toff_t TiffMemSeek (thandle_t handle, toff_t offset, int whence);
+static int TiffMemClose (thandle_t handle);
+static toff_t TiffMemSize (thandle_t handle);
+static int TiffMemMap (thandle_t handle, tdata_t *ppData, toff_t *pSize);
+static void TiffMemUnmap (thandle_t handle, tdata_t pData, toff_t size);
 
 /***********************************************************
  * GLOBALS
@@ -487,9 +545,11 @@ sane_open (SANE_String_Const devicename, SANE_Handle * handle)
 
   /* init data */
   memset (gOpenScanners[iHandle], 0, sizeof (struct ScannerState));
+  gOpenScanners[iHandle]->m_tcpFd = -1;
   InitComBuf (&gOpenScanners[iHandle]->m_buf);
+  InitComBuf (&gOpenScanners[iHandle]->m_tcpBuf);
   InitComBuf (&gOpenScanners[iHandle]->m_imageData);
-  InitComBuf (&gOpenScanners[iHandle]->m_pageInfo);
+  InitComBuf (&gOpenScanners[iHandle]->m_tiffFile.m_data);
   gOpenScanners[iHandle]->m_xres = ntohs (200);
   gOpenScanners[iHandle]->m_yres = ntohs (200);
   gOpenScanners[iHandle]->m_composition = ntohl (0x01);
@@ -625,40 +685,23 @@ SANE_Status
 sane_get_parameters (SANE_Handle handle, SANE_Parameters * params)
 {
   int iHandle = (int) (unsigned long)handle;
-  unsigned int width, height, imageSize;
-  struct PageInfo pageInfo;
+  unsigned int width, height;
+  struct PageInfo *pPageInfo;
 
   if (!gOpenScanners[iHandle])
     return SANE_STATUS_INVAL;
 
   /* fetch page info */
-  memcpy( & pageInfo, gOpenScanners[iHandle]->m_pageInfo.m_pBuf, sizeof( pageInfo ) );
+  pPageInfo = &gOpenScanners[iHandle]->m_pageInfo;
 
-  width = pageInfo.m_width;
-  height = pageInfo.m_height;
-  imageSize = width * height * 3;
+  width = pPageInfo->m_width;
+  height = pPageInfo->m_height;
 
-  DBG( 5, "sane_get_parameters: bytes remaining on this page: %d, num pages: %d, size: %dx%d\n", 
-       pageInfo.m_bytesRemaining,
-       gOpenScanners[iHandle]->m_numPages,
+  DBG( 5, "sane_get_parameters: bytes remaining on this page: %d, size: %dx%d\n", 
+       pPageInfo->m_bytesRemaining,
        width,
        height );
 
-  DBG (5,
-       "sane_get_parameters: handle %x: bytes outstanding: %lu, image size: %d\n",
-       iHandle, (unsigned long)gOpenScanners[iHandle]->m_imageData.m_used, imageSize);
-
-  /* check for enough data */
-  /*
-  if (gOpenScanners[iHandle]->m_imageData.m_used < imageSize)
-    {
-      DBG (1, "sane_get_parameters: handle %d: not enough data: %d < %d\n",
-	   iHandle, gOpenScanners[iHandle]->m_imageData.m_used, imageSize);
-      return SANE_STATUS_INVAL;
-    }
-  */
-
-
   params->format = SANE_FRAME_RGB;
   params->last_frame = SANE_TRUE;
   params->lines = height;
@@ -685,6 +728,7 @@ sane_start (SANE_Handle handle)
   socklen_t addrSize;
   fd_set readFds;
   struct timeval selTimeVal;
+  struct ScannerState *pState;
 
   iHandle = (int) (unsigned long)handle;
 
@@ -694,18 +738,31 @@ sane_start (SANE_Handle handle)
   if (!ValidScannerNumber (iHandle))
     return SANE_STATUS_INVAL;
 
-  /* check if we still have oustanding pages of data on this handle */
-  if (gOpenScanners[iHandle]->m_imageData.m_used){
+  pState = gOpenScanners[iHandle];
 
-    /* remove empty page */
-    PopFromComBuf ( & gOpenScanners[iHandle]->m_pageInfo, sizeof( struct PageInfo ) );
-    return SANE_STATUS_GOOD;
+  /* deal with the previous page: if it was read to the end then carry on
+     with the session, otherwise drop the session along with the page */
+  if (pState->m_bDecoding && pState->m_pageInfo.m_bytesRemaining > 0)
+    CloseSession (pState);
+  pState->m_bCancelled = 0;
+  if (pState->m_bDecoding && FinishPage (pState))
+    CloseSession (pState);
 
-  }
+  /* if a session is still open then wait for its next page */
+  if (pState->m_tcpFd >= 0)
+    {
+      status = WaitForPage (pState);
+      if (status != SANE_STATUS_NO_DOCS)
+        {
+          if (status != SANE_STATUS_GOOD)
+            CloseSession (pState);
+          return status;
+        }
+    }
 
   /* determine local IP address */
   addrSize = sizeof (myAddr);
-  if (getsockname (gOpenScanners[iHandle]->m_udpFd, &myAddr, &addrSize))
+  if (getsockname (pState->m_udpFd, &myAddr, &addrSize))
     {
       DBG (1, "sane_start: Error getting own IP address\n");
       return SANE_STATUS_IO_ERROR;
@@ -718,8 +775,7 @@ sane_start (SANE_Handle handle)
   errorCheck |= InitPacket (&buf, 1);
   errorCheck |=
     AppendMessageToPacket (&buf, 0x22, "std-scan-subscribe-user-name", 0x0b,
-      gOpenScanners[iHandle]->m_regName,
-      strlen (gOpenScanners[iHandle]->m_regName));
+      pState->m_regName, strlen (pState->m_regName));
   errorCheck |=
     AppendMessageToPacket (&buf, 0x22, "std-scan-subscribe-ip-address", 0x0a,
       &myAddr.sin_addr, 4);
@@ -733,17 +789,22 @@ sane_start (SANE_Handle handle)
     }
 
   /* send the packet */
-  send (gOpenScanners[iHandle]->m_udpFd, buf.m_pBuf, buf.m_used, 0);
+  send (pState->m_udpFd, buf.m_pBuf, buf.m_used, 0);
 
 
-  /* loop until done */
-  gOpenScanners[iHandle]->m_bFinish = 0;
-  while (!gOpenScanners[iHandle]->m_bFinish)
+  /* loop until the scanner opens a session */
+  while (pState->m_tcpFd < 0)
     {
 
+      if (pState->m_bCancelled)
+        {
+          status = SANE_STATUS_CANCELLED;
+          goto cleanup;
+        }
+
       /* prepare select mask */
       FD_ZERO (&readFds);
-      FD_SET (gOpenScanners[iHandle]->m_udpFd, &readFds);
+      FD_SET (pState->m_udpFd, &readFds);
       selTimeVal.tv_sec = 1;
       selTimeVal.tv_usec = 0;
 
@@ -752,22 +813,23 @@ sane_start (SANE_Handle handle)
       DBG (5, "sane_start: waiting for scan signal\n");
 
       /* wait again if nothing received */
-      if (!select (gOpenScanners[iHandle]->m_udpFd + 1,
-        &readFds, NULL, NULL, &selTimeVal))
+      if (select (pState->m_udpFd + 1,
+        &readFds, NULL, NULL, &selTimeVal) <= 0)
         continue;
 
       /* read from socket */
       nread =
-        read (gOpenScanners[iHandle]->m_udpFd, sockBuf, sizeof (sockBuf));
+        read (pState->m_udpFd, sockBuf, sizeof (sockBuf));
 
       if (nread <= 0)
         {
           DBG (1, "sane_start: read returned %d\n", nread);
-          break;
+          status = SANE_STATUS_IO_ERROR;
+          goto cleanup;
         }
 
       /* process the response */
-      if (ProcessUdpResponse (sockBuf, nread, gOpenScanners[iHandle]))
+      if (ProcessUdpResponse (sockBuf, nread, pState))
         {
           status = SANE_STATUS_IO_ERROR;
           goto cleanup;
@@ -775,8 +837,10 @@ sane_start (SANE_Handle handle)
 
     } /* while */
 
-  /* check whether we were cancelled */
-  if ( gOpenScanners[iHandle]->m_bCancelled ) status = SANE_STATUS_CANCELLED;
+  /* wait for the first page of the session */
+  status = WaitForPage (pState);
+  if (status != SANE_STATUS_GOOD)
+    CloseSession (pState);
 
 cleanup:
 
@@ -795,7 +859,7 @@ sane_read (SANE_Handle handle, SANE_Byte * data,
 
   int iHandle = (int) (unsigned long)handle;
   int dataSize;
-  struct PageInfo pageInfo;
+  struct ScannerState *pState;
 
   DBG( 5, "sane_read: %x (max_length=%d)\n", iHandle, max_length );
 
@@ -804,55 +868,75 @@ sane_read (SANE_Handle handle, SANE_Byte * data,
   if (!gOpenScanners[iHandle])
     return SANE_STATUS_INVAL;
 
-  /* check for end of data (no further pages) */
-  if ( ( ! gOpenScanners[iHandle]->m_imageData.m_used ) 
-       || ( ! gOpenScanners[iHandle]->m_numPages ) )
+  pState = gOpenScanners[iHandle];
+
+  /* check for cancellation */
+  if (pState->m_bCancelled)
     {
-      /* remove empty page if there are no more cached pages */
-      PopFromComBuf ( & gOpenScanners[iHandle]->m_pageInfo, sizeof( struct PageInfo ) );
+      CloseSession (pState);
+      return SANE_STATUS_CANCELLED;
+    }
+
+  /* check for end of page data */
+  if ((!pState->m_bDecoding) || (pState->m_pageInfo.m_bytesRemaining < 1))
+    {
+      /* let the scanner get on with the rest of the session */
+      if (pState->m_bDecoding && FinishPage (pState))
+        CloseSession (pState);
 
       return SANE_STATUS_EOF;
     }
 
-  /* fetch page info */
-  memcpy( & pageInfo, gOpenScanners[iHandle]->m_pageInfo.m_pBuf, sizeof( pageInfo ) );
+  /* decode more lines once the previous ones have all been sent */
+  while (pState->m_imageOffset == pState->m_imageData.m_used)
+    {
+      if (DecodePageLines (pState))
+        {
+          CloseSession (pState);
+          return SANE_STATUS_IO_ERROR;
+        }
+      if (pState->m_imageData.m_used)
+        break;
 
-  /* check for end of page data (we still have further cached pages) */
-  if ( pageInfo.m_bytesRemaining < 1 ) return SANE_STATUS_EOF;
+      /* the decoder is waiting for more of the page to arrive */
+      if (pState->m_tcpFd < 0)
+        {
+          DBG (1, "sane_read: connection closed before end of page\n");
+          CloseSession (pState);
+          return SANE_STATUS_IO_ERROR;
+        }
+      if (ReadTcpData (pState))
+        {
+          CloseSession (pState);
+          return SANE_STATUS_IO_ERROR;
+        }
+      if (pState->m_bCancelled)
+        {
+          CloseSession (pState);
+          return SANE_STATUS_CANCELLED;
+        }
+    } /* while */
 
-  /*  send the remainder of the current image */
-  dataSize = pageInfo.m_bytesRemaining;
+  /*  send the decoded lines */
+  dataSize = pState->m_imageData.m_used - pState->m_imageOffset;
 
   /* unless there's not enough room in the output buffer */
   if (dataSize > max_length)
     dataSize = max_length;
 
   /* update the data sent counters */
-  gOpenScanners[iHandle]->m_bytesRead += dataSize;
-  pageInfo.m_bytesRemaining -= dataSize;
-
-  /* update counter */
-  memcpy( gOpenScanners[iHandle]->m_pageInfo.m_pBuf, & pageInfo, sizeof( pageInfo ) );
-
-  /* check for end of page */
-  if ( pageInfo.m_bytesRemaining < 1 ){
-
-    /* yes, so remove page info */
-    gOpenScanners[iHandle]->m_numPages--;
-
-  } /* if */
+  pState->m_bytesRead += dataSize;
+  pState->m_pageInfo.m_bytesRemaining -= dataSize;
 
   DBG (5,
-       "sane_read: sending %d bytes, image total %d, %d page bytes remaining, %lu total remaining, image: %dx%d\n",
-       dataSize, gOpenScanners[iHandle]->m_bytesRead, pageInfo.m_bytesRemaining ,
-       (unsigned long)(gOpenScanners[iHandle]->m_imageData.m_used - dataSize), 
-       pageInfo.m_width,
-       pageInfo.m_height);
+       "sane_read: sending %d bytes, image total %d, %d page bytes remaining, image: %dx%d\n",
+       dataSize, pState->m_bytesRead, pState->m_pageInfo.m_bytesRemaining,
+       pState->m_pageInfo.m_width,
+       pState->m_pageInfo.m_height);
 
   /* copy the data */
-  memcpy (data, gOpenScanners[iHandle]->m_imageData.m_pBuf, dataSize);
-  if (PopFromComBuf (&gOpenScanners[iHandle]->m_imageData, dataSize))
-    return SANE_STATUS_NO_MEM;
+  memcpy (data, pState->m_imageData.m_pBuf + pState->m_imageOffset, dataSize);
+  pState->m_imageOffset += dataSize;
 
   *length = dataSize;
 
@@ -869,8 +953,8 @@ sane_cancel (SANE_Handle handle)
 
   DBG( 5, "sane_cancel: %x\n", iHandle );
 
-  /* signal that bad things are afoot */
-  gOpenScanners[iHandle]->m_bFinish = 1;
+  /* signal that bad things are afoot - the session is dropped by the next
+     sane_start or sane_read, as this may be called from a signal handler */
   gOpenScanners[iHandle]->m_bCancelled = 1;
 
 } /* sane_cancel */
@@ -1286,12 +1370,21 @@ FreeScannerState (int iHandle)
   if (gOpenScanners[iHandle]->m_udpFd)
     close (gOpenScanners[iHandle]->m_udpFd);
 
+  /* close TCP handle and release any page decoder */
+  CloseSession (gOpenScanners[iHandle]);
+
   /* free m_buf */
   FreeComBuf (&gOpenScanners[iHandle]->m_buf);
 
+  /* free m_tcpBuf */
+  FreeComBuf (&gOpenScanners[iHandle]->m_tcpBuf);
+
   /* free m_imageData */
   FreeComBuf (&gOpenScanners[iHandle]->m_imageData);
 
+  /* free in-memory TIFF file */
+  FreeComBuf (&gOpenScanners[iHandle]->m_tiffFile.m_data);
+
   /* free the struct */
   free (gOpenScanners[iHandle]);
 
@@ -1336,10 +1429,7 @@ ProcessUdpResponse (unsigned char *pData, size_t size,
 
   unsigned short messageSize, nameSize, valueSize;
   unsigned char *pItem, *pEnd, *pValue;
-  char sockBuf[SOCK_BUF_SIZE], *pName;
-  struct ComBuf tcpBuf;
-  int nread;
-  unsigned int numUsed;
+  char *pName;
 
   HexDump (15, pData, size);
 
@@ -1353,9 +1443,6 @@ ProcessUdpResponse (unsigned char *pData, size_t size,
       return 1;
     }
 
-  /* init a com buf for use in tcp communication */
-  InitComBuf (&tcpBuf);
-
   /* extract data size */
   messageSize = (((unsigned short) (pData[6])) << 8) | pData[7];
 
@@ -1385,7 +1472,8 @@ ProcessUdpResponse (unsigned char *pData, size_t size,
         {
 
           /* open TCP socket to scanner */
-          if (!(pState->m_tcpFd = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP)))
+          if ((pState->m_tcpFd =
+               socket (PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
             {
               DBG (1, "ProcessUdpResponse: error opening TCP socket\n");
               return 2;
@@ -1396,55 +1484,16 @@ ProcessUdpResponse (unsigned char *pData, size_t size,
             {
               DBG (1,
                    "ProcessUdpResponse: error connecting to scanner TCP port\n");
-              goto cleanup;
+              close (pState->m_tcpFd);
+              pState->m_tcpFd = -1;
+              return 3;
             }
 
           DBG (1, "ProcessUdpResponse: opened TCP connection to scanner\n");
 
-          /* clear read buf */
-          tcpBuf.m_used = 0;
-
-          /* TCP read loop */
-          while (1)
-            {
-
-              nread = read (pState->m_tcpFd, sockBuf, sizeof (sockBuf));
-
-              if (nread <= 0)
-                {
-                  DBG (1, "ProcessUdpResponse: TCP read returned %d\n",
-                       nread);
-                  break;
-                }
-
-              /* append message to buffer */
-              if (AppendToComBuf (&tcpBuf, (unsigned char *) sockBuf, nread))
-                goto cleanup;
-
-              /* process all available responses */
-              while (tcpBuf.m_used)
-                {
-
-                  /* note the buffer size before the call */
-                  numUsed = tcpBuf.m_used;
-
-                  /* process the response */
-                  if (ProcessTcpResponse (pState, &tcpBuf))
-                    goto cleanup;
-
-                  /* if the buffer size has not changed then assume no more processing is possible */
-                  if (numUsed == tcpBuf.m_used)
-                    break;
-
-                } /* while */
-
-            } /* while */
-
-          close (pState->m_tcpFd);
-          DBG (1, "ProcessUdpResponse: closed TCP connection to scanner\n");
-
-          /* signal end of session */
-          pState->m_bFinish = 1;
+          /* clear read buf - the session itself is handled as the pages
+             are read, see WaitForPage and sane_read */
+          pState->m_tcpBuf.m_used = 0;
 
         } /* if */
 
@@ -1452,12 +1501,6 @@ ProcessUdpResponse (unsigned char *pData, size_t size,
 
   return 0;
 
-cleanup:
-
-  FreeComBuf (&tcpBuf);
-  close (pState->m_tcpFd);
-  return 3;
-
 } /* ProcessUdpResponse */
 
 /***********************************************************/
@@ -1474,7 +1517,6 @@ ProcessTcpResponse (struct ScannerState *pState, struct ComBuf *pTcpBuf)
   char *pName;
   unsigned int uiVal;
   int errorCheck = 0;
-  int bProcessImage = 0;
 
   DBG (10, "ProcessTcpResponse: processing %lu bytes, pData=%p\n",
        (unsigned long)pTcpBuf->m_used, pData);
@@ -1661,6 +1703,8 @@ ProcessTcpResponse (struct ScannerState *pState, struct ComBuf *pTcpBuf)
 
           /* reset the data buffer ready to store a new page */
           pState->m_buf.m_used = 0;
+          pState->m_bPageStarted = 1;
+          pState->m_bPageEnd = 0;
 
           /* init current page size */
           pState->m_currentPageBytes = 0;
@@ -1670,7 +1714,8 @@ ProcessTcpResponse (struct ScannerState *pState, struct ComBuf *pTcpBuf)
         }
       else if (!strncmp ("std-scan-page-end", pName, nameSize))
         {
-          bProcessImage = 1;
+          /* all the page data is here, see ProcessTcpBuffer */
+          pState->m_bPageEnd = 1;
 
           errorCheck |= InitPacket (&buf, 0x02);
           uiVal = 0;
@@ -1690,9 +1735,6 @@ ProcessTcpResponse (struct ScannerState *pState, struct ComBuf *pTcpBuf)
                                    &uiVal, sizeof (uiVal));
           FinalisePacket (&buf);
           send (pState->m_tcpFd, buf.m_pBuf, buf.m_used, 0);
-
-          /* reset the data buffer ready to store a new page */
-          pState->m_buf.m_used = 0;
         }
       else if (!strncmp ("std-scan-session-end", pName, nameSize))
         {
@@ -1727,9 +1769,6 @@ ProcessTcpResponse (struct ScannerState *pState, struct ComBuf *pTcpBuf)
         } /* if */
     } /* while */
 
-  /* process page data if required */ 
-  if ( bProcessImage ) errorCheck |= ProcessPageData (pState);
-
 cleanup:
 
   /* remove processed data (including 8 byte header) from start of tcp buffer */
@@ -1775,32 +1814,200 @@ PopFromComBuf (struct ComBuf *pBuf, size_t datSize)
 
 /***********************************************************/
 
-/* Process the data from a single scanned page, \return 0 in success, >0 otherwise */
+/* process the complete messages in the TCP buffer, stopping at the end
+   of a page as anything after it may belong to the next page
+   \return 0 in success, >0 otherwise */
 int
-ProcessPageData (struct ScannerState *pState)
+ProcessTcpBuffer (struct ScannerState *pState)
 {
 
-  FILE *fTmp;
-  int fdTmp;
-  struct jpeg_source_mgr jpegSrcMgr;
-  struct JpegDataDecompState jpegCinfo;
-  struct jpeg_error_mgr jpegErr;
-  int numPixels, iPixel, width, height, scanLineSize, imageBytes;
-  int ret = 0;
-  struct PageInfo pageInfo;
+  size_t numUsed;
+
+  /* process all available responses */
+  while (pState->m_tcpBuf.m_used && !pState->m_bPageEnd)
+    {
+
+      /* note the buffer size before the call */
+      numUsed = pState->m_tcpBuf.m_used;
+
+      /* process the response */
+      if (ProcessTcpResponse (pState, &pState->m_tcpBuf))
+        return 1;
+
+      /* if the buffer size has not changed then assume no more processing is possible */
+      if (numUsed == pState->m_tcpBuf.m_used)
+        break;
+
+    } /* while */
+
+  return 0;
+
+} /* ProcessTcpBuffer */
 
-  JSAMPLE *pJpegLine = NULL;
-  uint32 *pTiffRgba = NULL;
-  unsigned char *pOut;
-  char tiffErrBuf[1024];
+/***********************************************************/
 
-  TIFF *pTiff = NULL;
+/* read whatever has arrived on the TCP socket and process it.  Waits for
+   at most a second, so that callers can check for cancellation.
+   \return 0 in success, >0 otherwise */
+int
+ReadTcpData (struct ScannerState *pState)
+{
 
-  /* If there's no data then there's nothing to write */
-  if (!pState->m_buf.m_used)
+  unsigned char sockBuf[SOCK_BUF_SIZE];
+  fd_set readFds;
+  struct timeval selTimeVal;
+  int nread;
+
+  /* prepare select mask */
+  FD_ZERO (&readFds);
+  FD_SET (pState->m_tcpFd, &readFds);
+  selTimeVal.tv_sec = 1;
+  selTimeVal.tv_usec = 0;
+
+  /* nothing to do if nothing received */
+  if (select (pState->m_tcpFd + 1, &readFds, NULL, NULL, &selTimeVal) <= 0)
     return 0;
 
-  DBG (1, "ProcessPageData: Got compression %x\n",
+  nread = read (pState->m_tcpFd, sockBuf, sizeof (sockBuf));
+
+  if (nread <= 0)
+    {
+      DBG (1, "ReadTcpData: TCP read returned %d\n", nread);
+
+      close (pState->m_tcpFd);
+      pState->m_tcpFd = -1;
+      DBG (1, "ReadTcpData: closed TCP connection to scanner\n");
+
+      return 0;
+    }
+
+  /* append message to buffer */
+  if (AppendToComBuf (&pState->m_tcpBuf, sockBuf, nread))
+    return 1;
+
+  return ProcessTcpBuffer (pState);
+
+} /* ReadTcpData */
+
+/***********************************************************/
+
+/* run the session until the scanner has sent enough of a page to set up
+   its decoder, \return SANE status */
+SANE_Status
+WaitForPage (struct ScannerState *pState)
+{
+
+  int ret;
+
+  /* deal with anything already received */
+  if (ProcessTcpBuffer (pState))
+    return SANE_STATUS_IO_ERROR;
+
+  while (1)
+    {
+
+      if (pState->m_bCancelled)
+        return SANE_STATUS_CANCELLED;
+
+      if (pState->m_bPageStarted)
+        {
+          ret = StartPageDecode (pState);
+          if (!ret)
+            return SANE_STATUS_GOOD;
+          if (ret > 0)
+            return SANE_STATUS_IO_ERROR;
+        }
+
+      /* check for end of session */
+      if (pState->m_tcpFd < 0)
+        {
+          if (pState->m_bPageStarted)
+            {
+              DBG (1, "WaitForPage: connection closed before end of page\n");
+              return SANE_STATUS_IO_ERROR;
+            }
+          return SANE_STATUS_NO_DOCS;
+        }
+
+      if (ReadTcpData (pState))
+        return SANE_STATUS_IO_ERROR;
+
+    } /* while */
+
+} /* WaitForPage */
+
+/***********************************************************/
+
+/* called once SANE has read a whole page: receive the rest of that page,
+   then run the session up to the start of the next page or the end of
+   the session so that the scanner is not kept waiting
+   \return 0 in success, >0 otherwise */
+int
+FinishPage (struct ScannerState *pState)
+{
+
+  /* wait for the end of the page, the decoder may not have needed it all */
+  while ((pState->m_tcpFd >= 0) && !pState->m_bPageEnd
+         && !pState->m_bCancelled)
+    {
+      if (ReadTcpData (pState))
+        return 1;
+    }
+
+  EndPageDecode (pState);
+
+  /* deal with anything already received */
+  if (ProcessTcpBuffer (pState))
+    return 1;
+
+  /* and wait for the next page (if any) */
+  while ((pState->m_tcpFd >= 0) && !pState->m_bPageStarted
+         && !pState->m_bCancelled)
+    {
+      if (ReadTcpData (pState))
+        return 1;
+    }
+
+  return 0;
+
+} /* FinishPage */
+
+/***********************************************************/
+
+/* drop the TCP connection to the scanner along with any page data */
+void
+CloseSession (struct ScannerState *pState)
+{
+
+  EndPageDecode (pState);
+
+  if (pState->m_tcpFd >= 0)
+    {
+      close (pState->m_tcpFd);
+      pState->m_tcpFd = -1;
+      DBG (1, "CloseSession: closed TCP connection to scanner\n");
+    }
+
+  pState->m_tcpBuf.m_used = 0;
+
+} /* CloseSession */
+
+/***********************************************************/
+
+/* set up a decoder for the current page.  JPEG pages are decoded as the
+   data arrives, so this only needs the JPEG header; G4 pages are wrapped
+   in an in-memory TIFF file once complete and decoded a line at a time.
+   \return 0 if ready, -1 if more data is needed, >0 otherwise */
+int
+StartPageDecode (struct ScannerState *pState)
+{
+
+  struct JpegDataDecompState *pJpeg = &pState->m_jpeg;
+  TIFF *pTiff;
+  int width, height, lineSize;
+  int ret;
+
+  DBG (10, "StartPageDecode: Got compression %x\n",
        ntohl (pState->m_compression));
 
   switch (ntohl (pState->m_compression))
@@ -1810,194 +2017,290 @@ ProcessPageData (struct ScannerState *pState)
       /* decode as JPEG if appropriate */
       {
 
-        jpegSrcMgr.resync_to_restart = jpeg_resync_to_restart;
-        jpegSrcMgr.init_source = JpegDecompInitSource;
-        jpegSrcMgr.fill_input_buffer = JpegDecompFillInputBuffer;
-        jpegSrcMgr.skip_input_data = JpegDecompSkipInputData;
-        jpegSrcMgr.term_source = JpegDecompTermSource;
-
-        jpegCinfo.m_cinfo.err = jpeg_std_error (&jpegErr);
-        jpeg_create_decompress (&jpegCinfo.m_cinfo);
-        jpegCinfo.m_cinfo.src = &jpegSrcMgr;
-        jpegCinfo.m_bytesRemaining = pState->m_buf.m_used;
-        jpegCinfo.m_pData = pState->m_buf.m_pBuf;
-        
-        jpeg_read_header (&jpegCinfo.m_cinfo, TRUE);
-        jpeg_start_decompress (&jpegCinfo.m_cinfo);
-        
-        /* allocate space for a single scanline */
-        scanLineSize = jpegCinfo.m_cinfo.output_width
-          * jpegCinfo.m_cinfo.output_components;
-        DBG (1, "ProcessPageData: image dimensions: %d x %d, line size: %d\n",
-        jpegCinfo.m_cinfo.output_width,
-        jpegCinfo.m_cinfo.output_height, scanLineSize);
-
-        pJpegLine = calloc (scanLineSize, sizeof (JSAMPLE));
-        if (!pJpegLine)
+        if (!pJpeg->m_bCreated)
           {
-            DBG (1, "ProcessPageData: memory allocation error\n");
-            ret = 1;
-            goto JPEG_CLEANUP;
-          } /* if */
-
-        /* note dimensions - may be different from those previously reported */
-        pState->m_pixelWidth = htonl (jpegCinfo.m_cinfo.output_width);
-        pState->m_pixelHeight = htonl (jpegCinfo.m_cinfo.output_height);
+            pJpeg->m_srcMgr.resync_to_restart = jpeg_resync_to_restart;
+            pJpeg->m_srcMgr.init_source = JpegDecompInitSource;
+            pJpeg->m_srcMgr.fill_input_buffer = JpegDecompFillInputBuffer;
+            pJpeg->m_srcMgr.skip_input_data = JpegDecompSkipInputData;
+            pJpeg->m_srcMgr.term_source = JpegDecompTermSource;
+            pJpeg->m_srcMgr.next_input_byte = NULL;
+            pJpeg->m_srcMgr.bytes_in_buffer = 0;
+
+            pJpeg->m_cinfo.err = jpeg_std_error (&pJpeg->m_errMgr);
+            jpeg_create_decompress (&pJpeg->m_cinfo);
+            pJpeg->m_cinfo.src = &pJpeg->m_srcMgr;
+            pJpeg->m_pData = &pState->m_buf;
+            pJpeg->m_bytesHanded = 0;
+            pJpeg->m_bytesToSkip = 0;
+            pJpeg->m_bEoi = 0;
+            pJpeg->m_bHeaderRead = 0;
+            pJpeg->m_bCreated = 1;
+          }
 
-        /* decode scanlines */
-        while (jpegCinfo.m_cinfo.output_scanline
-               < jpegCinfo.m_cinfo.output_height)
+        /* a page with no data at all has no header to read */
+        if (pState->m_bPageEnd && !pState->m_buf.m_used
+            && !pJpeg->m_bHeaderRead)
           {
-            DBG (20, "Reading scanline %d of %d\n",
-                 jpegCinfo.m_cinfo.output_scanline,
-                 jpegCinfo.m_cinfo.output_height);
-
-            /* read scanline */
-            jpeg_read_scanlines (&jpegCinfo.m_cinfo, &pJpegLine, 1);
-
-            /* append to output buffer */
-            ret |= AppendToComBuf (&pState->m_imageData,
-                                   pJpegLine, scanLineSize);
+            DBG (1, "StartPageDecode: no JPEG data for page\n");
+            return 1;
+          }
 
-          } /* while */
+        /* read as much as the data received so far allows */
+        JpegDecompSync (pJpeg, pState->m_bPageEnd);
 
-        /* update info for this page */
-        pageInfo.m_width = jpegCinfo.m_cinfo.output_width;
-        pageInfo.m_height = jpegCinfo.m_cinfo.output_height;
-        pageInfo.m_totalSize = pageInfo.m_width * pageInfo.m_height * 3;
-        pageInfo.m_bytesRemaining = pageInfo.m_totalSize;
+        if (!pJpeg->m_bHeaderRead)
+          {
+            if (jpeg_read_header (&pJpeg->m_cinfo, TRUE) == JPEG_SUSPENDED)
+              return -1;
+            pJpeg->m_bHeaderRead = 1;
+          }
 
-        DBG( 1, "Process page data: page %d: JPEG image: %d x %d, %d bytes\n",
-             pState->m_numPages, pageInfo.m_width, pageInfo.m_height, pageInfo.m_totalSize );
+        if (!jpeg_start_decompress (&pJpeg->m_cinfo))
+          return -1;
 
-        ret |= AppendToComBuf( & pState->m_pageInfo, (unsigned char*)& pageInfo, sizeof( pageInfo ) );
-        ++( pState->m_numPages );
+        width = pJpeg->m_cinfo.output_width;
+        height = pJpeg->m_cinfo.output_height;
+        lineSize = width * pJpeg->m_cinfo.output_components;
 
-      JPEG_CLEANUP:
-        jpeg_finish_decompress (&jpegCinfo.m_cinfo);
-        jpeg_destroy_decompress (&jpegCinfo.m_cinfo);
+        DBG (1, "StartPageDecode: JPEG image: %d x %d, line size: %d\n",
+             width, height, lineSize);
 
-        if (pJpegLine)
-          free (pJpegLine);
+        break;
 
-        return ret;
       } /* case JPEG */
 
     case 0x08:
       /* CCITT Group 4 Fax data */
       {
-        /* get a temp file
-           :TODO: 2006-04-18: Use TIFFClientOpen and do everything in RAM
-         */
-        fTmp = tmpfile ();
-        fdTmp = fileno (fTmp);
 
-        pTiff = TIFFFdOpen (fdTmp, "tempfile", "w");
-        if (!pTiff)
+        /* G4 pages are small, so wait for the whole page */
+        if (!pState->m_bPageEnd)
+          return -1;
+
+        if (!pState->m_buf.m_used)
           {
-            DBG (1, "ProcessPageData: Error opening temp TIFF file");
-            ret = SANE_STATUS_IO_ERROR;
-            goto TIFF_CLEANUP;
+            DBG (1, "StartPageDecode: no G4 data for page\n");
+            return 1;
           }
 
-        /* create a TIFF file */
         width = ntohl (pState->m_pixelWidth);
         height = ntohl (pState->m_pixelHeight);
+        lineSize = width * 3;
+
+        /* create a TIFF file in memory */
+        pState->m_tiffFile.m_data.m_used = 0;
+        pState->m_tiffFile.m_pos = 0;
+        pTiff = TIFFClientOpen ("page", "w",
+                                (thandle_t) & pState->m_tiffFile,
+                                TiffMemRead, TiffMemWrite, TiffMemSeek,
+                                TiffMemClose, TiffMemSize,
+                                TiffMemMap, TiffMemUnmap);
+        if (!pTiff)
+          {
+            DBG (1, "StartPageDecode: Error creating TIFF file\n");
+            return 1;
+          }
+
         TIFFSetField (pTiff, TIFFTAG_IMAGEWIDTH, width);
         TIFFSetField (pTiff, TIFFTAG_IMAGELENGTH, height);
         TIFFSetField (pTiff, TIFFTAG_BITSPERSAMPLE, 1);
         TIFFSetField (pTiff, TIFFTAG_PHOTOMETRIC, 0);        /* 0 is white */
         TIFFSetField (pTiff, TIFFTAG_COMPRESSION, 4);        /* CCITT Group 4 */
         TIFFSetField (pTiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+        TIFFSetField (pTiff, TIFFTAG_ROWSPERSTRIP, height);
 
-        TIFFWriteRawStrip (pTiff, 0, pState->m_buf.m_pBuf,
-                           pState->m_buf.m_used);
-
-        if (0 > TIFFRGBAImageOK (pTiff, tiffErrBuf))
+        ret = TIFFWriteRawStrip (pTiff, 0, pState->m_buf.m_pBuf,
+                                 pState->m_buf.m_used);
+        TIFFClose (pTiff);
+        if (ret < 0 || !pState->m_tiffFile.m_data.m_pBuf)
           {
-            DBG (1, "ProcessPageData: %s\n", tiffErrBuf);
-            ret = SANE_STATUS_IO_ERROR;
-            goto TIFF_CLEANUP;
+            DBG (1, "StartPageDecode: Error writing TIFF file\n");
+            return 1;
           }
 
-        /* allocate space for RGBA representation of image */
-        numPixels = height * width;
-        DBG (20, "ProcessPageData: num TIFF RGBA pixels: %d\n", numPixels);
-        if (!(pTiffRgba = calloc (numPixels, sizeof (u_long))))
+        /* the data is all in the TIFF file now */
+        pState->m_buf.m_used = 0;
+
+        /* and open it again for decoding */
+        pState->m_tiffFile.m_pos = 0;
+        pState->m_pTiff = TIFFClientOpen ("page", "r",
+                                          (thandle_t) & pState->m_tiffFile,
+                                          TiffMemRead, TiffMemWrite,
+                                          TiffMemSeek, TiffMemClose,
+                                          TiffMemSize, TiffMemMap,
+                                          TiffMemUnmap);
+        if (!pState->m_pTiff)
           {
-            ret = SANE_STATUS_NO_MEM;
-            goto TIFF_CLEANUP;
+            DBG (1, "StartPageDecode: Error opening TIFF file\n");
+            return 1;
           }
 
-        /* make space in image buffer to store the results */
-        imageBytes = width * height * 3;
-        ret |= AppendToComBuf (&pState->m_imageData, NULL, imageBytes);
-        if (ret)
-          goto TIFF_CLEANUP;
-
-        /* get a pointer to the start of the output data */
-        pOut = pState->m_imageData.m_pBuf
-          + pState->m_imageData.m_used - imageBytes;
-
-        /* read RGBA image */
-        DBG (20, "ProcessPageData: setting up read buffer\n");
-        TIFFReadBufferSetup (pTiff, NULL, width * height * sizeof (u_long));
-        DBG (20, "ProcessPageData: reading RGBA data\n");
-        TIFFReadRGBAImageOriented (pTiff, width, height, pTiffRgba,
-                                   ORIENTATION_TOPLEFT, 0);
-
-        /* loop over pixels */
-        for (iPixel = 0; iPixel < numPixels; ++iPixel)
+        pState->m_pTiffLine = malloc (TIFFScanlineSize (pState->m_pTiff));
+        if (!pState->m_pTiffLine)
           {
+            DBG (1, "StartPageDecode: memory allocation error\n");
+            return 1;
+          }
 
-            *(pOut++) = TIFFGetR (pTiffRgba[iPixel]);
-            *(pOut++) = TIFFGetG (pTiffRgba[iPixel]);
-            *(pOut++) = TIFFGetB (pTiffRgba[iPixel]);
-
-          } /* for iRow */
-
-
-
-        /* update info for this page */
-        pageInfo.m_width = width;
-        pageInfo.m_height = height;
-        pageInfo.m_totalSize = pageInfo.m_width * pageInfo.m_height * 3;
-        pageInfo.m_bytesRemaining = pageInfo.m_totalSize;
-
-        DBG( 1, "Process page data: page %d: TIFF image: %d x %d, %d bytes\n",
-             pState->m_numPages, width, height, pageInfo.m_totalSize );
-
-        ret |= AppendToComBuf( & pState->m_pageInfo, (unsigned char*)& pageInfo, sizeof( pageInfo ) );
-        ++( pState->m_numPages );
+        DBG (1, "StartPageDecode: TIFF image: %d x %d\n", width, height);
 
-      TIFF_CLEANUP:
-        if (pTiff)
-          TIFFClose (pTiff);
-        if (fTmp)
-          fclose (fTmp);
-        if (pTiffRgba)
-          free (pTiffRgba);
-        return ret;
+        break;
 
       } /* case CCITT */
+
     default:
       /* this is not expected or very useful */
       {
-        DBG (1, "ProcessPageData: Unexpected compression flag %d\n", ntohl (pState->m_compression));
-        ret = SANE_STATUS_IO_ERROR;
+        DBG (1, "StartPageDecode: Unexpected compression flag %d\n", ntohl (pState->m_compression));
+        return 1;
       }
     } /* switch */
 
-  return ret;
-} /* ProcessPageData */
+  /* note dimensions - may be different from those previously reported */
+  pState->m_pixelWidth = htonl (width);
+  pState->m_pixelHeight = htonl (height);
+
+  /* update info for this page */
+  pState->m_pageInfo.m_width = width;
+  pState->m_pageInfo.m_height = height;
+  pState->m_pageInfo.m_lineSize = lineSize;
+  pState->m_pageInfo.m_totalSize = lineSize * height;
+  pState->m_pageInfo.m_bytesRemaining = pState->m_pageInfo.m_totalSize;
+
+  /* make space for the decoded lines */
+  pState->m_imageData.m_used = 0;
+  if (AppendToComBuf (&pState->m_imageData, NULL, DECODE_BUF_LINES * lineSize))
+    return 1;
+  pState->m_imageData.m_used = 0;
+  pState->m_imageOffset = 0;
+
+  pState->m_decodedLines = 0;
+  pState->m_bDecoding = 1;
+
+  return 0;
+
+} /* StartPageDecode */
+
+/***********************************************************/
+
+/* decode up to DECODE_BUF_LINES further lines of the current page into
+   m_imageData, which must have been passed to SANE already.  JPEG pages
+   may not produce any lines until more data arrives.
+   \return 0 in success, >0 otherwise */
+int
+DecodePageLines (struct ScannerState *pState)
+{
+
+  struct JpegDataDecompState *pJpeg = &pState->m_jpeg;
+  int numLines, lineSize, iLine, iPixel, width;
+  unsigned char *pOut, pixel;
+
+  lineSize = pState->m_pageInfo.m_lineSize;
+  width = pState->m_pageInfo.m_width;
+
+  pState->m_imageData.m_used = 0;
+  pState->m_imageOffset = 0;
+
+  numLines = pState->m_pageInfo.m_height - pState->m_decodedLines;
+  if (numLines > DECODE_BUF_LINES)
+    numLines = DECODE_BUF_LINES;
+
+  if (pState->m_pTiff)
+    {
+      for (iLine = 0; iLine < numLines; ++iLine)
+        {
+          if (TIFFReadScanline (pState->m_pTiff, pState->m_pTiffLine,
+                                pState->m_decodedLines, 0) < 0)
+            {
+              DBG (1, "DecodePageLines: error decoding TIFF line %d\n",
+                   pState->m_decodedLines);
+              return 1;
+            }
+
+          /* expand to RGB, 0 is white */
+          pOut = pState->m_imageData.m_pBuf + pState->m_imageData.m_used;
+          for (iPixel = 0; iPixel < width; ++iPixel)
+            {
+              pixel = (pState->m_pTiffLine[iPixel >> 3]
+                       & (0x80 >> (iPixel & 7))) ? 0 : 0xff;
+              *(pOut++) = pixel;
+              *(pOut++) = pixel;
+              *(pOut++) = pixel;
+            } /* for iPixel */
+
+          pState->m_imageData.m_used += lineSize;
+          ++pState->m_decodedLines;
+        } /* for iLine */
+
+      return 0;
+    }
+
+  /* feed the JPEG decoder whatever has arrived */
+  JpegDecompSync (pJpeg, pState->m_bPageEnd);
+
+  for (iLine = 0; iLine < numLines; ++iLine)
+    {
+      DBG (20, "Reading scanline %d of %d\n",
+           pJpeg->m_cinfo.output_scanline,
+           pJpeg->m_cinfo.output_height);
+
+      /* read scanline, or stop until more data arrives */
+      pOut = pState->m_imageData.m_pBuf + pState->m_imageData.m_used;
+      if (jpeg_read_scanlines (&pJpeg->m_cinfo, &pOut, 1) != 1)
+        break;
+
+      pState->m_imageData.m_used += lineSize;
+      ++pState->m_decodedLines;
+    } /* for iLine */
+
+  return 0;
+
+} /* DecodePageLines */
 
 /***********************************************************/
 
+/* release the decoder and data of the current page */
 void
-JpegDecompInitSource (j_decompress_ptr cinfo)
+EndPageDecode (struct ScannerState *pState)
+{
+
+  if (pState->m_jpeg.m_bCreated)
+    {
+      jpeg_destroy_decompress (&pState->m_jpeg.m_cinfo);
+      pState->m_jpeg.m_bCreated = 0;
+    }
+
+  if (pState->m_pTiff)
+    {
+      TIFFClose (pState->m_pTiff);
+      pState->m_pTiff = NULL;
+    }
+
+  if (pState->m_pTiffLine)
+    {
+      free (pState->m_pTiffLine);
+      pState->m_pTiffLine = NULL;
+    }
+
+  pState->m_tiffFile.m_data.m_used = 0;
+  pState->m_buf.m_used = 0;
+  pState->m_imageData.m_used = 0;
+  pState->m_imageOffset = 0;
+
+  pState->m_bPageStarted = 0;
+  pState->m_bPageEnd = 0;
+  pState->m_bDecoding = 0;
+
+} /* EndPageDecode */
+
+/***********************************************************/
+
+void
+JpegDecompInitSource (j_decompress_ptr __sane_unused__ cinfo)
 /* Libjpeg decompression interface */
 {
-  cinfo->src->bytes_in_buffer = 0;
+  /* nothing to do - data is handed over by JpegDecompSync */
 
 } /* JpegDecompInitSource */
 
@@ -2012,28 +2315,16 @@ JpegDecompFillInputBuffer (j_decompress_ptr cinfo)
     0xFF, JPEG_EOI
   };
 
-  DBG (10, "JpegDecompFillInputBuffer: bytes remaining: %d\n",
-       pState->m_bytesRemaining);
+  /* suspend until more data arrives */
+  if (!pState->m_bLastData)
+    return FALSE;
 
-  if (!pState->m_bytesRemaining)
-    {
-
-      /* no input data available so return dummy data */
-      cinfo->src->bytes_in_buffer = 2;
-      cinfo->src->next_input_byte = (const JOCTET *) eoiByte;
-
-    }
-  else
-    {
+  DBG (10, "JpegDecompFillInputBuffer: out of data\n");
 
-      /* point to data */
-      cinfo->src->bytes_in_buffer = pState->m_bytesRemaining;
-      cinfo->src->next_input_byte = (const JOCTET *) pState->m_pData;
-
-      /* note that data is now gone */
-      pState->m_bytesRemaining = 0;
-
-    } /* if */
+  /* no more input data will arrive so return dummy data */
+  cinfo->src->bytes_in_buffer = 2;
+  cinfo->src->next_input_byte = (const JOCTET *) eoiByte;
+  pState->m_bEoi = 1;
 
   return TRUE;
 
@@ -2045,8 +2336,20 @@ void
 JpegDecompSkipInputData (j_decompress_ptr cinfo, long numBytes)
 /* Libjpeg decompression interface */
 {
+  struct JpegDataDecompState *pState = (struct JpegDataDecompState *) cinfo;
+
   DBG (10, "JpegDecompSkipInputData: skipping %ld bytes\n", numBytes);
 
+  if (numBytes <= 0)
+    return;
+
+  /* skip data that has not arrived yet when it does */
+  if ((size_t) numBytes > cinfo->src->bytes_in_buffer)
+    {
+      pState->m_bytesToSkip += numBytes - cinfo->src->bytes_in_buffer;
+      numBytes = cinfo->src->bytes_in_buffer;
+    }
+
   cinfo->src->bytes_in_buffer -= numBytes;
   cinfo->src->next_input_byte += numBytes;
 
@@ -2063,3 +2366,155 @@ JpegDecompTermSource (j_decompress_ptr __sane_unused__ cinfo)
 } /* JpegDecompTermSource */
 
 /***********************************************************/
+
+/* hand the data received since the last call to the decoder, dropping
+   whatever it has consumed.  The data may have moved since the last call,
+   so the source manager always starts at the beginning of m_pData. */
+void
+JpegDecompSync (struct JpegDataDecompState *pJpeg, int bLastData)
+{
+  struct jpeg_source_mgr *pSrc = &pJpeg->m_srcMgr;
+  size_t numBytes;
+
+  pJpeg->m_bLastData = bLastData;
+
+  /* the decoder has run out of data and is reading a dummy EOI */
+  if (pJpeg->m_bEoi)
+    return;
+
+  /* remove the consumed data */
+  PopFromComBuf (pJpeg->m_pData, pJpeg->m_bytesHanded - pSrc->bytes_in_buffer);
+
+  /* and any that was to be skipped */
+  numBytes = pJpeg->m_bytesToSkip;
+  if (numBytes > pJpeg->m_pData->m_used)
+    numBytes = pJpeg->m_pData->m_used;
+  PopFromComBuf (pJpeg->m_pData, numBytes);
+  pJpeg->m_bytesToSkip -= numBytes;
+
+  /* hand over the rest */
+  pJpeg->m_bytesHanded = pJpeg->m_pData->m_used;
+  pSrc->next_input_byte = (const JOCTET *) pJpeg->m_pData->m_pBuf;
+  pSrc->bytes_in_buffer = pJpeg->m_bytesHanded;
+
+} /* JpegDecompSync */
+
+/***********************************************************/
+
+tsize_t
+TiffMemRead (thandle_t handle, tdata_t pData, tsize_t size)
+/* Libtiff in-memory file interface */
+{
+  struct TiffMemFile *pFile = (struct TiffMemFile *) handle;
+  toff_t available = 0;
+
+  if (pFile->m_pos < pFile->m_data.m_used)
+    available = pFile->m_data.m_used - pFile->m_pos;
+  if ((toff_t) size > available)
+    size = available;
+
+  memcpy (pData, pFile->m_data.m_pBuf + pFile->m_pos, size);
+  pFile->m_pos += size;
+
+  return size;
+
+} /* TiffMemRead */
+
+/***********************************************************/
+
+tsize_t
+TiffMemWrite (thandle_t handle, tdata_t pData, tsize_t size)
+/* Libtiff in-memory file interface */
+{
+  struct TiffMemFile *pFile = (struct TiffMemFile *) handle;
+  size_t oldSize = pFile->m_data.m_used;
+
+  /* grow the file if need be */
+  if (pFile->m_pos + size > oldSize)
+    {
+      if (AppendToComBuf (&pFile->m_data, NULL,
+                          pFile->m_pos + size - oldSize))
+        return -1;
+      if (pFile->m_pos > oldSize)
+        memset (pFile->m_data.m_pBuf + oldSize, 0, pFile->m_pos - oldSize);
+    }
+
+  memcpy (pFile->m_data.m_pBuf + pFile->m_pos, pData, size);
+  pFile->m_pos += size;
+
+  return size;
+
+} /* TiffMemWrite */
+
+/***********************************************************/
+
+toff_t
+TiffMemSeek (thandle_t handle, toff_t offset, int whence)
+/* Libtiff in-memory file interface */
+{
+  struct TiffMemFile *pFile = (struct TiffMemFile *) handle;
+
+  switch (whence)
+    {
+    case SEEK_CUR:
+      pFile->m_pos += offset;
+      break;
+    case SEEK_END:
+      pFile->m_pos = pFile->m_data.m_used + offset;
+      break;
+    default:
+      pFile->m_pos = offset;
+      break;
+    } /* switch */
+
+  return pFile->m_pos;
+
+} /* TiffMemSeek */
+
+/***********************************************************/
+
+int
+TiffMemClose (thandle_t __sane_unused__ handle)
+/* Libtiff in-memory file interface */
+{
+  /* nothing to do - the data is released with the scanner state */
+  return 0;
+
+} /* TiffMemClose */
+
+/***********************************************************/
+
+toff_t
+TiffMemSize (thandle_t handle)
+/* Libtiff in-memory file interface */
+{
+  return ((struct TiffMemFile *) handle)->m_data.m_used;
+
+} /* TiffMemSize */
+
+/***********************************************************/
+
+int
+TiffMemMap (thandle_t __sane_unused__ handle,
+            tdata_t __sane_unused__ * ppData,
+            toff_t __sane_unused__ * pSize)
+/* Libtiff in-memory file interface */
+{
+  /* not supported */
+  return 0;
+
+} /* TiffMemMap */
+
+/***********************************************************/
+
+void
+TiffMemUnmap (thandle_t __sane_unused__ handle,
+              tdata_t __sane_unused__ pData,
+              toff_t __sane_unused__ size)
+/* Libtiff in-memory file interface */
+{
+  /* nothing to do */
+
+} /* TiffMemUnmap */
+
+/***********************************************************/
@@ -551,6 +551,16 @@
 #include <math.h> /*tan*/
 #include <unistd.h> /*usleep*/
 
+#ifdef HAVE_LIBJPEG
+#include <stdio.h> /*FILE, for jpeglib*/
+#include <setjmp.h> /*jpeg errors*/
+#include <jpeglib.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h> /*jpeg decoding and image processing threads*/
+#endif
+
 #include "../include/sane/sanei_backend.h"
 #include "../include/sane/sanei_scsi.h"
 #include "../include/sane/sanei_usb.h"
@@ -575,6 +585,53 @@
  - useless noise   35
 */
 
+#ifdef HAVE_LIBJPEG
+/* one side's jpeg decoder, see start_jpeg_decode */
+#define JPEG_CHUNK 16384
+
+struct fujitsu_jpeg
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
+  struct jpeg_error_mgr jerr;
+  jmp_buf jmpbuf;
+
+  /* compressed data queued by the reader, not yet taken by the decoder */
+  unsigned char * in;
+  int in_size;
+  int in_pos;
+  int in_len;
+  int in_eof;
+
+  /* jpeg duplex splits one stream, side data is staged here per read */
+  unsigned char * stage;
+  int stage_size;
+  int stage_len;
+
+  /* decoder's private copy of the input */
+  unsigned char chunk[JPEG_CHUNK];
+
+  /* where the decoded lines go */
+  unsigned char * out;
+  int out_bpl;
+  int out_lines;
+  int components;
+
+  /* written by the decoder, read by sane_read */
+  int lines_done;
+  int done;
+  int abort;
+  SANE_Status status;
+
+  int running;
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+};
+#endif
+
 /* ------------------------------------------------------------------------- */
 #define STRING_FLATBED SANE_I18N("Flatbed")
 #define STRING_ADFFRONT SANE_I18N("ADF Front")
@@ -798,6 +855,11 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
       DBG (5, "sane_get_devices: missing scanner %s\n",s->device_name);
 
       /*splice s out of list by changing pointer in prev to next*/
+      sanei_magic_arenaFree(s->magic_arena[SIDE_FRONT]);
+      sanei_magic_arenaFree(s->magic_arena[SIDE_BACK]);
+      sanei_magic_streamFree(s->magic_stream[SIDE_FRONT]);
+      sanei_magic_streamFree(s->magic_stream[SIDE_BACK]);
+
       if(prev){
         prev->next = s->next;
         free(s);
@@ -1550,7 +1612,7 @@ init_vpd (struct fujitsu *s)
 
           s->has_comp_JPG1 = get_IN_compression_JPG_BASE (in);
           DBG (15, "  compression JPG1: %d\n", s->has_comp_JPG1);
-#ifndef SANE_FRAME_JPEG
+#if !defined(SANE_FRAME_JPEG) && !defined(HAVE_LIBJPEG)
           DBG (15, "  (Disabled)\n");
           s->has_comp_JPG1 = 0;
 #endif
@@ -6107,12 +6169,29 @@ update_params (struct fujitsu * s)
   params->lines = s->resolution_y * (s->br_y - s->tl_y) / 1200;
   params->lines -= params->lines % 2;
 
+  /* jpeg we decode ourselves still comes from the scanner in 8x8 squares.
+   * we do that if the frontend can't take jpeg, or if the software
+   * image processing needs the raw image */
+  s->jpeg_decode = 0;
+#ifdef HAVE_LIBJPEG
+  if(s->compress == COMP_JPEG
+    && (s->mode == MODE_COLOR || s->mode == MODE_GRAYSCALE)
+#ifdef SANE_FRAME_JPEG
+    && (s->swdeskew || s->swdespeck || s->swcrop)
+#endif
+  ){
+    s->jpeg_decode = 1;
+    params->pixels_per_line -= params->pixels_per_line % 8;
+    params->lines -= params->lines % 8;
+  }
+#endif
+
   if (s->mode == MODE_COLOR) {
     params->depth = 8;
 
 #ifdef SANE_FRAME_JPEG
     /* jpeg requires 8x8 squares */
-    if(s->compress == COMP_JPEG){
+    if(s->compress == COMP_JPEG && !s->jpeg_decode){
       params->format = SANE_FRAME_JPEG;
       params->pixels_per_line -= params->pixels_per_line % 8;
       params->lines -= params->lines % 8;
@@ -6133,7 +6212,7 @@ update_params (struct fujitsu * s)
 
 #ifdef SANE_FRAME_JPEG
     /* jpeg requires 8x8 squares */
-    if(s->compress == COMP_JPEG){
+    if(s->compress == COMP_JPEG && !s->jpeg_decode){
       params->format = SANE_FRAME_JPEG;
       params->pixels_per_line -= params->pixels_per_line % 8;
       params->lines -= params->lines % 8;
@@ -6381,6 +6460,9 @@ sane_start (SANE_Handle handle)
   /* dont call object pos or scan on back side of duplex scan */
   if(s->side == SIDE_FRONT || s->source == SOURCE_ADF_BACK){
 
+      /* previous sheet must be out of the worker's hands */
+      finish_processing(s);
+
       s->bytes_rx[0]=0;
       s->bytes_rx[1]=0;
       s->lines_rx[0]=0;
@@ -6390,6 +6472,10 @@ sane_start (SANE_Handle handle)
       s->ili_rx[0]=0;
       s->ili_rx[1]=0;
       s->eom_rx=0;
+      s->jpeg_rx[0]=0;
+      s->jpeg_rx[1]=0;
+      s->jpeg_eof_rx[0]=0;
+      s->jpeg_eof_rx[1]=0;
 
       s->bytes_tx[0]=0;
       s->bytes_tx[1]=0;
@@ -6416,7 +6502,7 @@ sane_start (SANE_Handle handle)
          * option combinations can't handle it, so we make a big one */
         if(
           (s->mode == MODE_COLOR && s->color_interlace == COLOR_INTERLACE_3091)
-          || must_fully_buffer(s)
+          || must_fully_buffer(s) || s->jpeg_decode
         ){
           s->buff_tot[SIDE_FRONT] = s->bytes_tot[SIDE_FRONT];
         }
@@ -6432,9 +6518,10 @@ sane_start (SANE_Handle handle)
         s->buff_tot[SIDE_BACK] = s->bytes_tot[SIDE_BACK];
 
         /* the back buffer is normally very large, but some scanners or
-         * option combinations dont need it, so we make a small one */
-        if(s->low_mem || s->source == SOURCE_ADF_BACK
-         || s->duplex_interlace == DUPLEX_INTERLACE_NONE)
+         * option combinations dont need it, so we make a small one.
+         * jpeg we decode always needs the large one */
+        if((s->low_mem || s->source == SOURCE_ADF_BACK
+         || s->duplex_interlace == DUPLEX_INTERLACE_NONE) && !s->jpeg_decode)
           s->buff_tot[SIDE_BACK] = s->buffer_size;
       }
       else{
@@ -6455,6 +6542,8 @@ sane_start (SANE_Handle handle)
           s->started=1;
       }
 
+      start_magic_streams(s);
+
       ret = object_position (s, SANE_TRUE);
       if (ret != SANE_STATUS_GOOD) {
         DBG (5, "sane_start: ERROR: cannot load page\n");
@@ -6468,6 +6557,25 @@ sane_start (SANE_Handle handle)
         s->started=0;
         return ret;
       }
+
+#ifdef HAVE_LIBJPEG
+      /* get decoders ready for the jpeg this page will send */
+      if(s->jpeg_decode){
+        int side;
+        for(side=0;side<2;side++){
+          if(!s->bytes_tot[side]){
+            stop_jpeg_decode(s,side);
+            continue;
+          }
+          ret = start_jpeg_decode(s,side);
+          if (ret != SANE_STATUS_GOOD) {
+            DBG (5, "sane_start: ERROR: cannot start jpeg decoder\n");
+            s->started=0;
+            return ret;
+          }
+        }
+      }
+#endif
   }
 
   DBG (15, "started=%d, side=%d, source=%d\n", s->started, s->side, s->source);
@@ -6493,22 +6601,20 @@ sane_start (SANE_Handle handle)
 
     DBG (5, "sane_start: OK: done buffering\n");
 
-    /* hardware deskew will tell image size after transfer */
-    ret = get_pixelsize(s,1);
-    if (ret != SANE_STATUS_GOOD) {
-      DBG (5, "sane_start: ERROR: cannot get final pixelsize\n");
-      return ret;
+    /* finished buffering, adjust image as required. sane_read
+     * usually queued it already, as soon as the last data arrived */
+    if(s->pp_state[s->side] == PP_NONE){
+      ret = queue_processing(s,s->side);
+      if (ret != SANE_STATUS_GOOD) {
+        DBG (5, "sane_start: ERROR: cannot get final pixelsize\n");
+        return ret;
+      }
     }
 
-    /* finished buffering, adjust image as required */
-    if(s->swdeskew && (!s->hwdeskewcrop || s->req_driv_crop)){
-      buffer_deskew(s,s->side);
-    }
-    if(s->swcrop && (!s->hwdeskewcrop || s->req_driv_crop)){
-      buffer_crop(s,s->side);
-    }
-    if(s->swdespeck){
-      buffer_despeck(s,s->side);
+    ret = wait_for_processing(s,s->side);
+    if (ret != SANE_STATUS_GOOD) {
+      DBG (5, "sane_start: ERROR: cannot process image\n");
+      goto errors;
     }
 
   }
@@ -6845,13 +6951,15 @@ set_window (struct fujitsu *s)
   set_WD_compress_type(desc1, COMP_NONE);
   set_WD_compress_arg(desc1, 0);
 
-#ifdef SANE_FRAME_JPEG
   /* some scanners support jpeg image compression, for color/gs only */
-  if(s->params.format == SANE_FRAME_JPEG){
+  if(s->jpeg_decode
+#ifdef SANE_FRAME_JPEG
+    || s->params.format == SANE_FRAME_JPEG
+#endif
+  ){
       set_WD_compress_type(desc1, COMP_JPEG);
       set_WD_compress_arg(desc1, s->compress_arg);
   }
-#endif
 
   /* the remainder of the block varies based on model and mode,
    * except for gamma and paper size, those are in the same place */
@@ -7207,6 +7315,12 @@ check_for_cancel(struct fujitsu *s)
 
       s->started = 0;
       s->cancelled = 0;
+
+#ifdef HAVE_LIBJPEG
+      stop_jpeg_decode(s,SIDE_FRONT);
+      stop_jpeg_decode(s,SIDE_BACK);
+#endif
+      finish_processing(s);
   }
   else if(s->cancelled){
     DBG (15, "check_for_cancel: already cancelled\n");
@@ -7284,10 +7398,14 @@ sane_read (SANE_Handle handle, SANE_Byte * buf, SANE_Int max_len, SANE_Int * len
     }
   } /* end 3091 */
 
-#ifdef SANE_FRAME_JPEG
+#if defined(SANE_FRAME_JPEG) || defined(HAVE_LIBJPEG)
   /* alternating jpeg duplex interlacing */
   else if(s->source == SOURCE_ADF_DUPLEX
-    && s->params.format == SANE_FRAME_JPEG 
+    && (s->jpeg_decode
+#ifdef SANE_FRAME_JPEG
+      || s->params.format == SANE_FRAME_JPEG
+#endif
+    )
     && s->jpeg_interlace == JPEG_INTERLACE_ALT
   ){
     ret = read_from_JPEGduplex(s);
@@ -7300,7 +7418,7 @@ sane_read (SANE_Handle handle, SANE_Byte * buf, SANE_Int max_len, SANE_Int * len
 
   /* alternating pnm duplex interlacing */
   else if(s->source == SOURCE_ADF_DUPLEX
-    && s->params.format <= SANE_FRAME_RGB
+    && s->params.format <= SANE_FRAME_RGB && !s->jpeg_decode
     && s->duplex_interlace == DUPLEX_INTERLACE_ALT
   ){
 
@@ -7330,6 +7448,38 @@ sane_read (SANE_Handle handle, SANE_Byte * buf, SANE_Int max_len, SANE_Int * len
     }
   } /*end simplex*/
 
+#ifdef HAVE_LIBJPEG
+  /* pick up whatever the jpeg decoders have finished */
+  if(s->jpeg_decode){
+    int side;
+    for(side=0;side<2;side++){
+      if(!s->bytes_tot[side])
+        continue;
+      ret = collect_jpeg_decode(s, side, side == s->side);
+      if(ret){
+        DBG(5,"sane_read: jpeg side %d returning %d\n",side,ret);
+        return ret;
+      }
+    }
+  }
+#endif
+
+  /* start adjusting any side that has just finished arriving */
+  if(must_process(s)){
+    int side;
+    for(side=0;side<2;side++){
+      feed_magic_stream(s, side);
+      if(s->eof_rx[side] && s->bytes_tot[side]
+        && s->pp_state[side] == PP_NONE){
+        ret = queue_processing(s, side);
+        if(ret){
+          DBG(5,"sane_read: side %d cannot queue %d\n",side,ret);
+          return ret;
+        }
+      }
+    }
+  }
+
   /* copy a block from buffer to frontend */
   ret = read_from_buffer(s,buf,max_len,len,s->side);
 
@@ -7353,7 +7503,7 @@ sane_read (SANE_Handle handle, SANE_Byte * buf, SANE_Int max_len, SANE_Int * len
   return ret;
 }
 
-#ifdef SANE_FRAME_JPEG
+#if defined(SANE_FRAME_JPEG) || defined(HAVE_LIBJPEG)
 static SANE_Status
 read_from_JPEGduplex(struct fujitsu *s)
 {
@@ -7367,22 +7517,24 @@ read_from_JPEGduplex(struct fujitsu *s)
 
     int bytes = s->buffer_size;
     int i = 0;
+    int eoi = 0;
   
     DBG (10, "read_from_JPEGduplex: start\n");
   
-    if(s->eof_rx[SIDE_FRONT] && s->eof_rx[SIDE_BACK]){
+    if(get_eof_rx(s,SIDE_FRONT) && get_eof_rx(s,SIDE_BACK)){
       DBG (10, "read_from_JPEGduplex: already have eofs, done\n");
       return ret;
     }
 
     /* we don't know if the following read will give us front or back data
-     * so we only get enough to fill whichever is smaller (and not yet done) */
-    if(!s->eof_rx[SIDE_FRONT]){
+     * so we only get enough to fill whichever is smaller (and not yet done).
+     * jpeg we decode is queued instead, so there is always room */
+    if(!s->eof_rx[SIDE_FRONT] && !s->jpeg_decode){
       int avail = s->buff_tot[SIDE_FRONT] - s->buff_rx[SIDE_FRONT];
       if(bytes > avail)
         bytes = avail;
     }
-    if(!s->eof_rx[SIDE_BACK]){
+    if(!s->eof_rx[SIDE_BACK] && !s->jpeg_decode){
       int avail = s->buff_tot[SIDE_BACK] - s->buff_rx[SIDE_BACK];
       if(bytes > avail)
         bytes = avail;
@@ -7400,7 +7552,8 @@ read_from_JPEGduplex(struct fujitsu *s)
     }
   
     /* fi-6770A gets mad if you 'read' too soon on usb, see if it is ready */
-    if(!s->bytes_rx[SIDE_FRONT] && s->connection == CONNECTION_USB){
+    if(!s->bytes_rx[SIDE_FRONT] && !s->jpeg_rx[SIDE_FRONT]
+      && s->connection == CONNECTION_USB){
       DBG (15, "read: start of usb page, checking RIC\n");
       ret = scanner_control_ric(s,bytes,SIDE_FRONT);
       if(ret){
@@ -7536,9 +7689,19 @@ read_from_JPEGduplex(struct fujitsu *s)
             s->lines_rx[SIDE_BACK]=0;
             s->buff_rx[SIDE_BACK]=0;
 
+#ifdef HAVE_LIBJPEG
+	    /* back decoder has seen some headers, start it over */
+	    if(s->jpeg_decode){
+	      ret = start_jpeg_decode(s,SIDE_BACK);
+	      if(ret){
+	        free(in);
+	        return ret;
+	      }
+	    }
+#endif
+
 	    /* and put the high-order width byte into front unchanged */
-            s->buffers[SIDE_FRONT][s->buff_rx[SIDE_FRONT]++] = s->jpeg_x_byte;
-            s->bytes_rx[SIDE_FRONT]++;
+            put_jpeg_byte(s, SIDE_FRONT, s->jpeg_x_byte);
 	  }
 
 	  /* image is interlaced afterall, continue */
@@ -7547,12 +7710,10 @@ read_from_JPEGduplex(struct fujitsu *s)
 	      s->params.pixels_per_line,width);
 
 	    /* put the high-order width byte into front side, shifted down */
-            s->buffers[SIDE_FRONT][s->buff_rx[SIDE_FRONT]++] = width >> 9;
-            s->bytes_rx[SIDE_FRONT]++;
+            put_jpeg_byte(s, SIDE_FRONT, width >> 9);
 
 	    /* put the high-order width byte into back side, shifted down */
-            s->buffers[SIDE_BACK][s->buff_rx[SIDE_BACK]++] = width >> 9;
-            s->bytes_rx[SIDE_BACK]++;
+            put_jpeg_byte(s, SIDE_BACK, width >> 9);
 
 	    /* shift down low order byte */
             in[i] = (width >> 1) & 0xff;
@@ -7568,11 +7729,9 @@ read_from_JPEGduplex(struct fujitsu *s)
         ){
             /* first byte after ff, send the ff first */
             if(s->jpeg_ff_offset == 1){
-              s->buffers[SIDE_FRONT][s->buff_rx[SIDE_FRONT]++] = 0xff;
-              s->bytes_rx[SIDE_FRONT]++;
+              put_jpeg_byte(s, SIDE_FRONT, 0xff);
             }
-            s->buffers[SIDE_FRONT][s->buff_rx[SIDE_FRONT]++] = in[i];
-            s->bytes_rx[SIDE_FRONT]++;
+            put_jpeg_byte(s, SIDE_FRONT, in[i]);
         }
 
         /* copy these stages to back */
@@ -7586,11 +7745,9 @@ read_from_JPEGduplex(struct fujitsu *s)
         ){
             /* first byte after ff, send the ff first */
             if(s->jpeg_ff_offset == 1){
-              s->buffers[SIDE_BACK][s->buff_rx[SIDE_BACK]++] = 0xff;
-              s->bytes_rx[SIDE_BACK]++;
+              put_jpeg_byte(s, SIDE_BACK, 0xff);
             }
-            s->buffers[SIDE_BACK][s->buff_rx[SIDE_BACK]++] = in[i];
-            s->bytes_rx[SIDE_BACK]++;
+            put_jpeg_byte(s, SIDE_BACK, in[i]);
         }
 
         /* reached last byte of SOS section, next byte front */
@@ -7600,21 +7757,42 @@ read_from_JPEGduplex(struct fujitsu *s)
 
         /* last byte of file, update totals, bail out */
         if(s->jpeg_stage == JPEG_STAGE_EOI){
-            s->eof_rx[SIDE_FRONT] = 1;
-            s->eof_rx[SIDE_BACK] = 1;
+            eoi = 1;
         }
     }
       
     free(in);
+
+#ifdef HAVE_LIBJPEG
+    /* hand the split streams to the decoders, before any eof */
+    if(s->jpeg_decode){
+      for(i=0;i<2;i++){
+        struct fujitsu_jpeg * d = s->jpeg_dec[i];
+
+        if(d && d->stage_len){
+          SANE_Status fret = feed_jpeg_decode(s, i, d->stage, d->stage_len);
+          d->stage_len = 0;
+          if(fret){
+            DBG(5, "read_from_JPEGduplex: cannot queue side %d\n", i);
+            return fret;
+          }
+        }
+      }
+    }
+#endif
   
     /* jpeg uses in-band EOI marker, so we should never hit this? */
     if(ret == SANE_STATUS_EOF){
       DBG(15, "read_from_JPEGduplex: got EOF, finishing both sides\n");
-      s->eof_rx[SIDE_FRONT] = 1;
-      s->eof_rx[SIDE_BACK] = 1;
+      eoi = 1;
       ret = SANE_STATUS_GOOD;
     }
 
+    if(eoi){
+      set_eof_rx(s, SIDE_FRONT);
+      set_eof_rx(s, SIDE_BACK);
+    }
+
     DBG (10, "read_from_JPEGduplex: finish\n");
   
     return ret;
@@ -7782,11 +7960,16 @@ read_from_scanner(struct fujitsu *s, int side)
   
     DBG (10, "read_from_scanner: start %d\n", side);
   
-    if(s->eof_rx[side]){
+    if(get_eof_rx(s,side)){
       DBG (10, "read_from_scanner: already have eof, done\n");
       return ret;
     }
 
+    /* jpeg we decode is queued, not stored in the buffer */
+    if(s->jpeg_decode){
+      avail = s->buffer_size;
+    }
+
     /* figure out the max amount to transfer */
     if(bytes > avail)
       bytes = avail;
@@ -7818,7 +8001,8 @@ read_from_scanner(struct fujitsu *s, int side)
     }
   
     /* fi-6770A gets mad if you 'read' too soon on usb, see if it is ready */
-    if(!s->bytes_rx[side] && s->connection == CONNECTION_USB){
+    if(!s->bytes_rx[side] && !s->jpeg_rx[side]
+      && s->connection == CONNECTION_USB){
       DBG (15, "read_from_scanner: start of usb page, checking RIC\n");
       ret = scanner_control_ric(s,bytes,side);
       if(ret){
@@ -7871,6 +8055,16 @@ read_from_scanner(struct fujitsu *s, int side)
     DBG(15, "read_from_scanner: read %d bytes\n",inLen);
 
     if(inLen){
+#ifdef HAVE_LIBJPEG
+        if(s->jpeg_decode){
+            SANE_Status fret = feed_jpeg_decode(s, side, in, inLen);
+            if(fret){
+              DBG(5, "read_from_scanner: cannot queue jpeg data\n");
+              ret = fret;
+            }
+        }
+        else
+#endif
         if(s->mode==MODE_COLOR && s->color_interlace == COLOR_INTERLACE_3091){
             copy_3091 (s, in, inLen, side);
         }
@@ -7900,7 +8094,7 @@ read_from_scanner(struct fujitsu *s, int side)
       for(i=0;i<2;i++){
         if(s->ili_rx[i]){
           DBG(15, "read_from_scanner: finishing side %d\n",i);
-          s->eof_rx[i] = 1;
+          set_eof_rx(s,i);
         }
       }
     }
@@ -8106,6 +8300,488 @@ read_from_buffer(struct fujitsu *s, SANE_Byte * buf,
     return ret;
 }
 
+/*
+ * Scanners with CMP can send jpeg, which is much less data on the wire,
+ * but the frontend cannot take it, and the software image processing
+ * needs the raw image. So we decode it ourselves: the read functions
+ * queue each side's compressed stream, and the decoded lines land in
+ * s->buffers[side], which is full size in this mode. With threads, each
+ * side is decoded by its own worker as the data arrives, otherwise a
+ * side is decoded once all of its data has been received.
+ */
+#ifdef HAVE_LIBJPEG
+
+static void
+dec_lock(struct fujitsu_jpeg * d)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&d->lock);
+#else
+  (void) d;
+#endif
+}
+
+static void
+dec_unlock(struct fujitsu_jpeg * d)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+#else
+  (void) d;
+#endif
+}
+
+/* libjpeg calls this on fatal errors, so we jump back to the decoder
+ * instead of letting it exit() the frontend */
+static void
+dec_error_exit(j_common_ptr cinfo)
+{
+  struct fujitsu_jpeg * d = cinfo->client_data;
+  char msg[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message) (cinfo, msg);
+  DBG (5, "dec_error_exit: %s\n", msg);
+
+  longjmp(d->jmpbuf, 1);
+}
+
+static void
+dec_output_message(j_common_ptr cinfo)
+{
+  char msg[JMSG_LENGTH_MAX];
+
+  (*cinfo->err->format_message) (cinfo, msg);
+  DBG (15, "dec_output_message: %s\n", msg);
+}
+
+static void
+dec_init_source(j_decompress_ptr cinfo)
+{
+  (void) cinfo;
+}
+
+/* hand the decoder the next piece of the queue, waiting for the
+ * scanner if there is none yet */
+static boolean
+dec_fill_input(j_decompress_ptr cinfo)
+{
+  struct fujitsu_jpeg * d = cinfo->client_data;
+  int len;
+
+  dec_lock(d);
+
+#ifdef HAVE_PTHREAD_H
+  while(d->in_pos == d->in_len && !d->in_eof && !d->abort){
+    pthread_cond_wait(&d->cond, &d->lock);
+  }
+#endif
+
+  if(d->abort){
+    dec_unlock(d);
+    DBG (15, "dec_fill_input: aborted\n");
+    longjmp(d->jmpbuf, 1);
+  }
+
+  len = d->in_len - d->in_pos;
+  if(len > JPEG_CHUNK)
+    len = JPEG_CHUNK;
+
+  memcpy(d->chunk, d->in + d->in_pos, len);
+  d->in_pos += len;
+
+  dec_unlock(d);
+
+  /* scanner stopped short, insert a fake EOI like libjpeg does */
+  if(!len){
+    DBG (5, "dec_fill_input: premature end of data\n");
+    d->chunk[0] = 0xff;
+    d->chunk[1] = JPEG_EOI;
+    len = 2;
+  }
+
+  d->src.next_input_byte = d->chunk;
+  d->src.bytes_in_buffer = len;
+
+  return TRUE;
+}
+
+static void
+dec_skip_input(j_decompress_ptr cinfo, long num_bytes)
+{
+  struct fujitsu_jpeg * d = cinfo->client_data;
+
+  if(num_bytes <= 0)
+    return;
+
+  while(num_bytes > (long) d->src.bytes_in_buffer){
+    num_bytes -= d->src.bytes_in_buffer;
+    dec_fill_input(cinfo);
+  }
+
+  d->src.next_input_byte += num_bytes;
+  d->src.bytes_in_buffer -= num_bytes;
+}
+
+static void
+dec_term_source(j_decompress_ptr cinfo)
+{
+  (void) cinfo;
+}
+
+/* decode one side's whole image into its buffer, publishing each line */
+static void
+decode_jpeg_side(struct fujitsu_jpeg * d)
+{
+  JSAMPARRAY row;
+  int width;
+
+  DBG (10, "decode_jpeg_side: start\n");
+
+  d->cinfo.err = jpeg_std_error(&d->jerr);
+  d->jerr.error_exit = dec_error_exit;
+  d->jerr.output_message = dec_output_message;
+  jpeg_create_decompress(&d->cinfo);
+  d->cinfo.client_data = d;
+
+  d->src.init_source = dec_init_source;
+  d->src.fill_input_buffer = dec_fill_input;
+  d->src.skip_input_data = dec_skip_input;
+  d->src.resync_to_restart = jpeg_resync_to_restart;
+  d->src.term_source = dec_term_source;
+  d->src.next_input_byte = NULL;
+  d->src.bytes_in_buffer = 0;
+  d->cinfo.src = &d->src;
+
+  if(setjmp(d->jmpbuf)){
+    d->status = d->abort ? SANE_STATUS_CANCELLED : SANE_STATUS_IO_ERROR;
+    goto cleanup;
+  }
+
+  jpeg_read_header(&d->cinfo, TRUE);
+  d->cinfo.out_color_space = (d->components == 3) ? JCS_RGB : JCS_GRAYSCALE;
+  jpeg_start_decompress(&d->cinfo);
+
+  DBG (15, "decode_jpeg_side: jpeg %dx%d, want %dx%d\n",
+    d->cinfo.output_width, d->cinfo.output_height,
+    d->out_bpl/d->components, d->out_lines);
+
+  width = d->cinfo.output_width * d->cinfo.output_components;
+  row = (*d->cinfo.mem->alloc_sarray)
+    ((j_common_ptr) &d->cinfo, JPOOL_IMAGE, width, 1);
+
+  if(width > d->out_bpl)
+    width = d->out_bpl;
+
+  while(d->cinfo.output_scanline < d->cinfo.output_height){
+
+    jpeg_read_scanlines(&d->cinfo, row, 1);
+
+    /* more lines than we asked for are dropped */
+    if(d->lines_done < d->out_lines){
+      unsigned char * line = d->out + d->lines_done * d->out_bpl;
+
+      memcpy(line, row[0], width);
+      if(width < d->out_bpl)
+        memset(line + width, 0xff, d->out_bpl - width);
+
+      dec_lock(d);
+      d->lines_done++;
+      dec_unlock(d);
+    }
+  }
+
+  jpeg_finish_decompress(&d->cinfo);
+
+  cleanup:
+  jpeg_destroy_decompress(&d->cinfo);
+
+  dec_lock(d);
+  d->done = 1;
+  dec_unlock(d);
+
+  DBG (10, "decode_jpeg_side: finish %d\n", d->status);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+dec_worker(void * arg)
+{
+  decode_jpeg_side(arg);
+  return NULL;
+}
+#endif
+
+/* prepare a side for a new image, starting its worker if we can */
+static SANE_Status
+start_jpeg_decode(struct fujitsu *s, int side)
+{
+  struct fujitsu_jpeg * d;
+
+  DBG (10, "start_jpeg_decode: start %d\n", side);
+
+  stop_jpeg_decode(s, side);
+
+  d = s->jpeg_dec[side];
+  if(!d){
+    d = calloc(1, sizeof(*d));
+    if(!d){
+      DBG (5, "start_jpeg_decode: no decoder %d\n", side);
+      return SANE_STATUS_NO_MEM;
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+#endif
+    s->jpeg_dec[side] = d;
+  }
+
+  /* each read can add a marker byte or two to the split streams */
+  if(d->stage_size < s->buffer_size + 16){
+    unsigned char * stage = realloc(d->stage, s->buffer_size + 16);
+    if(!stage){
+      DBG (5, "start_jpeg_decode: no stage buffer %d\n", side);
+      return SANE_STATUS_NO_MEM;
+    }
+    d->stage = stage;
+    d->stage_size = s->buffer_size + 16;
+  }
+
+  d->in_pos = 0;
+  d->in_len = 0;
+  d->in_eof = 0;
+  d->stage_len = 0;
+
+  d->out = s->buffers[side];
+  d->out_bpl = s->params.bytes_per_line;
+  d->out_lines = s->params.lines;
+  d->components = (s->mode == MODE_COLOR) ? 3 : 1;
+
+  d->lines_done = 0;
+  d->done = 0;
+  d->abort = 0;
+  d->status = SANE_STATUS_GOOD;
+
+  s->jpeg_rx[side] = 0;
+  s->jpeg_eof_rx[side] = 0;
+
+#ifdef HAVE_PTHREAD_H
+  if(!pthread_create(&d->thread, NULL, dec_worker, d)){
+    d->running = 1;
+  }
+  else{
+    DBG (5, "start_jpeg_decode: no thread, decoding at end of side\n");
+  }
+#endif
+
+  DBG (10, "start_jpeg_decode: finish\n");
+  return SANE_STATUS_GOOD;
+}
+
+/* make a side's worker give up, and wait for it */
+static void
+stop_jpeg_decode(struct fujitsu *s, int side)
+{
+  struct fujitsu_jpeg * d = s->jpeg_dec[side];
+
+  if(!d || !d->running)
+    return;
+
+  DBG (10, "stop_jpeg_decode: start %d\n", side);
+
+#ifdef HAVE_PTHREAD_H
+  dec_lock(d);
+  d->abort = 1;
+  dec_unlock(d);
+
+  pthread_join(d->thread, NULL);
+#endif
+  d->running = 0;
+
+  DBG (10, "stop_jpeg_decode: finish\n");
+}
+
+static void
+free_jpeg_decode(struct fujitsu *s)
+{
+  int side;
+
+  for(side=0;side<2;side++){
+    struct fujitsu_jpeg * d = s->jpeg_dec[side];
+
+    if(!d)
+      continue;
+
+    stop_jpeg_decode(s, side);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+#endif
+    free(d->in);
+    free(d->stage);
+    free(d);
+    s->jpeg_dec[side] = NULL;
+  }
+}
+
+/* add compressed data to the end of a side's queue */
+static SANE_Status
+feed_jpeg_decode(struct fujitsu *s, int side, unsigned char * buf, int len)
+{
+  struct fujitsu_jpeg * d = s->jpeg_dec[side];
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  if(!d || len < 1)
+    return ret;
+
+  dec_lock(d);
+
+  /* drop what the decoder has already taken */
+  if(d->in_pos){
+    memmove(d->in, d->in + d->in_pos, d->in_len - d->in_pos);
+    d->in_len -= d->in_pos;
+    d->in_pos = 0;
+  }
+
+  if(d->in_len + len > d->in_size){
+    int size = d->in_size * 2;
+    unsigned char * in;
+
+    if(size < d->in_len + len)
+      size = d->in_len + len;
+
+    in = realloc(d->in, size);
+    if(!in){
+      DBG (5, "feed_jpeg_decode: no mem for %d bytes\n", size);
+      ret = SANE_STATUS_NO_MEM;
+      goto cleanup;
+    }
+    d->in = in;
+    d->in_size = size;
+  }
+
+  memcpy(d->in + d->in_len, buf, len);
+  d->in_len += len;
+  s->jpeg_rx[side] += len;
+
+  cleanup:
+  dec_unlock(d);
+  return ret;
+}
+
+/* move lines the decoder has finished into the image, and note when
+ * it is done. if asked to wait, and the scanner has sent the whole side,
+ * blocks until there is something new, so sane_read makes progress */
+static SANE_Status
+collect_jpeg_decode(struct fujitsu *s, int side, int wait)
+{
+  struct fujitsu_jpeg * d = s->jpeg_dec[side];
+  SANE_Status ret = SANE_STATUS_GOOD;
+  int lines, done;
+
+  if(!d || s->eof_rx[side])
+    return ret;
+
+  /* no worker, so decode the side now that it is all here */
+  if(!d->running && d->in_eof && !d->done){
+    decode_jpeg_side(d);
+  }
+
+  dec_lock(d);
+
+#ifdef HAVE_PTHREAD_H
+  while(wait && d->running && d->in_eof && !d->done
+    && d->lines_done == s->lines_rx[side]){
+    pthread_cond_wait(&d->cond, &d->lock);
+  }
+#else
+  (void) wait;
+#endif
+
+  lines = d->lines_done;
+  done = d->done;
+  ret = d->status;
+
+  dec_unlock(d);
+
+  if(lines > s->lines_rx[side]){
+    int bytes = (lines - s->lines_rx[side]) * d->out_bpl;
+
+    s->lines_rx[side] = lines;
+    s->bytes_rx[side] += bytes;
+    s->buff_rx[side] += bytes;
+  }
+
+  if(done){
+    DBG (15, "collect_jpeg_decode: side %d done, %d lines, status %d\n",
+      side, lines, ret);
+
+#ifdef HAVE_PTHREAD_H
+    if(d->running){
+      pthread_join(d->thread, NULL);
+      d->running = 0;
+    }
+#endif
+    s->eof_rx[side] = 1;
+  }
+
+  return ret;
+}
+
+#endif /* HAVE_LIBJPEG */
+
+/* the scanner has sent everything for this side */
+static int
+get_eof_rx(struct fujitsu *s, int side)
+{
+  if(s->jpeg_decode)
+    return s->jpeg_eof_rx[side];
+
+  return s->eof_rx[side];
+}
+
+/* the scanner has finished sending this side. raw data is done now,
+ * jpeg we decode is done when the decoder says so */
+static void
+set_eof_rx(struct fujitsu *s, int side)
+{
+#ifdef HAVE_LIBJPEG
+  if(s->jpeg_decode){
+    struct fujitsu_jpeg * d = s->jpeg_dec[side];
+
+    s->jpeg_eof_rx[side] = 1;
+    if(d){
+      dec_lock(d);
+      d->in_eof = 1;
+      dec_unlock(d);
+    }
+    return;
+  }
+#endif
+
+  s->eof_rx[side] = 1;
+}
+
+#if defined(SANE_FRAME_JPEG) || defined(HAVE_LIBJPEG)
+/* store one byte of a split jpeg duplex stream for a side */
+static void
+put_jpeg_byte(struct fujitsu *s, int side, unsigned char c)
+{
+#ifdef HAVE_LIBJPEG
+  if(s->jpeg_decode){
+    struct fujitsu_jpeg * d = s->jpeg_dec[side];
+    if(d && d->stage_len < d->stage_size){
+      d->stage[d->stage_len++] = c;
+    }
+    return;
+  }
+#endif
+
+  s->buffers[side][s->buff_rx[side]++] = c;
+  s->bytes_rx[side]++;
+}
+#endif
+
 
 /*
  * @@ Section 5 - SANE cleanup functions
@@ -8180,6 +8856,11 @@ sane_close (SANE_Handle handle)
   /*clears any held scans*/
   mode_select_buff(s);
   disconnect_fd(s);
+#ifdef HAVE_LIBJPEG
+  stop_jpeg_decode(s,SIDE_FRONT);
+  stop_jpeg_decode(s,SIDE_BACK);
+#endif
+  stop_processing(s);
   DBG (10, "sane_close: finish\n");
 }
 
@@ -8228,7 +8909,15 @@ sane_exit (void)
 
   for (dev = fujitsu_devList; dev; dev = next) {
       disconnect_fd(dev);
+      stop_processing(dev);
       next = dev->next;
+      sanei_magic_arenaFree(dev->magic_arena[SIDE_FRONT]);
+      sanei_magic_arenaFree(dev->magic_arena[SIDE_BACK]);
+      sanei_magic_streamFree(dev->magic_stream[SIDE_FRONT]);
+      sanei_magic_streamFree(dev->magic_stream[SIDE_BACK]);
+#ifdef HAVE_LIBJPEG
+      free_jpeg_decode(dev);
+#endif
       free (dev);
   }
 
@@ -8858,6 +9547,25 @@ must_fully_buffer(struct fujitsu *s)
   return 0;
 }
 
+/* the software enhancements to run on each side once it is buffered */
+static int
+must_process(struct fujitsu *s)
+{
+  if(!must_fully_buffer(s)){
+    return 0;
+  }
+
+  if(s->swdespeck){
+    return 1;
+  }
+
+  if((s->swdeskew || s->swcrop) && (!s->hwdeskewcrop || s->req_driv_crop)){
+    return 1;
+  }
+
+  return 0;
+}
+
 /* s->page_width stores the user setting
  * for the paper width in adf. sometimes,
  * we need a value that differs from this
@@ -9014,135 +9722,362 @@ sane_get_select_fd (SANE_Handle h, SANE_Int *fdp)
  * @@ Section 7 - Image processing functions
  */
 
-/* Look in image for likely upper and left paper edges, then rotate
- * image so that upper left corner of paper is upper left of image.
+/* Look in image for likely paper edges, then rotate and crop the image
+ * to them, and remove small spots. This is all done by sanei_magic, in
+ * one pass, so the rotated image is only copied once.
  * FIXME: should we do this before we binarize instead of after? */
 static SANE_Status
-buffer_deskew(struct fujitsu *s, int side)
+buffer_process(struct fujitsu *s, int side)
 {
   SANE_Status ret = SANE_STATUS_GOOD;
+  SANEI_Magic_Page * page = &s->magic[side];
+  SANEI_Magic_Page * mirror = NULL;
 
-  int bg_color = 0xd6;
-
-  DBG (10, "buffer_deskew: start\n");
+  DBG (10, "buffer_process: start %d\n", side);
 
-  /*only find skew on first image from a page, or if first image had error */
-  if(s->side == SIDE_FRONT || s->source == SOURCE_ADF_BACK || s->deskew_stat){
+  page->params = &s->pp_params[side];
+  page->buffer = s->buffers[side];
+  page->dpiX = s->resolution_x;
+  page->dpiY = s->resolution_y;
+  page->ops = 0;
 
-    s->deskew_stat = sanei_magic_findSkew(
-      &s->params,s->buffers[side],s->resolution_x,s->resolution_y,
-      &s->deskew_vals[0],&s->deskew_vals[1],&s->deskew_slope);
-  
-    if(s->deskew_stat){
-      DBG (5, "buffer_deskew: bad findSkew, bailing\n");
-      goto cleanup;
-    }
-  }
-  /* backside images can use a 'flipped' version of frontside data */
-  else{
-    s->deskew_slope *= -1;
-    s->deskew_vals[0] = s->params.pixels_per_line - s->deskew_vals[0];
+  if(!s->hwdeskewcrop || s->req_driv_crop){
+    if(s->swdeskew)
+      page->ops |= SANEI_MAGIC_DESKEW;
+    if(s->swcrop)
+      page->ops |= SANEI_MAGIC_CROP;
   }
+  if(s->swdespeck)
+    page->ops |= SANEI_MAGIC_DESPECK;
 
   /* tweak the bg color based on scanner settings */
+  page->bgColor = 0xd6;
   if(s->mode == MODE_HALFTONE || s->mode == MODE_LINEART){
     if(s->bg_color == COLOR_BLACK || s->hwdeskewcrop || s->overscan)
-      bg_color = 0xff;
+      page->bgColor = 0xff;
     else
-      bg_color = 0;
+      page->bgColor = 0;
   }
   else if(s->bg_color == COLOR_BLACK || s->hwdeskewcrop || s->overscan)
-    bg_color = 0;
+    page->bgColor = 0;
+
+  /* we dont listen to the 'top' value, since fujitsu does not pad the top */
+  page->keepTop = 1;
+  page->despeckDiam = s->swdespeck;
+
+  /* used only if it saw every row of the final image */
+  page->stream = s->magic_stream[side];
+
+  /* backside images can use a 'flipped' version of frontside data */
+  if(side == SIDE_BACK && s->source != SOURCE_ADF_BACK)
+    mirror = &s->magic[SIDE_FRONT];
 
-  ret = sanei_magic_rotate(&s->params,s->buffers[side],
-    s->deskew_vals[0],s->deskew_vals[1],s->deskew_slope,bg_color);
+  /* keep the rotation buffer, so every page does not allocate one */
+  if(!s->magic_arena[side] && sanei_magic_arenaNew(&s->magic_arena[side])){
+    DBG (5, "buffer_process: no arena\n");
+  }
 
+  ret = sanei_magic_process(page, mirror, s->magic_arena[side]);
   if(ret){
-    DBG(5,"buffer_deskew: rotate error: %d",ret);
-    ret = SANE_STATUS_GOOD;
-    goto cleanup;
+    DBG (5, "buffer_process: error %d, continuing\n", ret);
   }
 
-  cleanup:
-  DBG (10, "buffer_deskew: finish\n");
-  return ret;
+  /* new, smaller size, for the image size counters */
+  if(page->edgeStatus == SANE_STATUS_GOOD)
+    s->pp_bytes[side] = page->params->lines * page->params->bytes_per_line;
+
+  DBG (10, "buffer_process: finish\n");
+  return SANE_STATUS_GOOD;
 }
 
-/* Look in image for likely left/right/bottom paper edges, then crop image.
- * Does not attempt to rotate the image, that should be done first.
- * FIXME: should we do this before we binarize instead of after? */
+/* a new sheet is starting. if the software deskew or crop will run,
+ * analyse each side as it arrives, from the buffer it is collected in */
+static void
+start_magic_streams(struct fujitsu *s)
+{
+  int side;
+
+  for(side=0;side<2;side++){
+    sanei_magic_streamFree(s->magic_stream[side]);
+    s->magic_stream[side] = NULL;
+    s->magic_lines[side] = 0;
+
+    if(!must_process(s) || !(s->swdeskew || s->swcrop)
+      || (s->hwdeskewcrop && !s->req_driv_crop)
+      || !s->bytes_tot[side] || s->buff_tot[side] != s->bytes_tot[side]
+    ){
+      continue;
+    }
+
+    if(sanei_magic_streamStart(&s->params_bk, s->resolution_x,
+      s->resolution_y, &s->magic_stream[side])){
+      DBG (5, "start_magic_streams: no stream %d, using buffer\n", side);
+    }
+  }
+}
+
+/* feed the whole rows which arrived since the last call. stops once the
+ * side is handed to buffer_process, which may be on another thread */
+static void
+feed_magic_stream(struct fujitsu *s, int side)
+{
+  int bwidth = s->params_bk.bytes_per_line;
+  int lines;
+
+  if(!s->magic_stream[side] || s->pp_state[side] != PP_NONE){
+    return;
+  }
+
+  lines = s->bytes_rx[side] / bwidth;
+  if(lines <= s->magic_lines[side]){
+    return;
+  }
+
+  if(sanei_magic_streamRows(s->magic_stream[side],
+    s->buffers[side] + s->magic_lines[side] * bwidth,
+    lines - s->magic_lines[side])){
+    DBG (5, "feed_magic_stream: no mem %d, using buffer\n", side);
+    sanei_magic_streamFree(s->magic_stream[side]);
+    s->magic_stream[side] = NULL;
+    return;
+  }
+
+  s->magic_lines[side] = lines;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* takes queued sides in page order. the back side is not started until
+ * the front is done, because it may reuse the front's skew and edges */
+static void *
+processing_thread(void * arg)
+{
+  struct fujitsu *s = arg;
+
+  pthread_mutex_lock(&s->pp_lock);
+
+  while(!s->pp_quit){
+    int side = -1;
+
+    if(s->pp_state[SIDE_FRONT] == PP_QUEUED){
+      side = SIDE_FRONT;
+    }
+    else if(s->pp_state[SIDE_BACK] == PP_QUEUED
+      && (s->source != SOURCE_ADF_DUPLEX
+        || s->pp_state[SIDE_FRONT] == PP_DONE)
+    ){
+      side = SIDE_BACK;
+    }
+
+    if(side < 0){
+      pthread_cond_wait(&s->pp_cond, &s->pp_lock);
+      continue;
+    }
+
+    s->pp_state[side] = PP_BUSY;
+    pthread_mutex_unlock(&s->pp_lock);
+
+    buffer_process(s,side);
+
+    pthread_mutex_lock(&s->pp_lock);
+    s->pp_state[side] = PP_DONE;
+    pthread_cond_broadcast(&s->pp_cond);
+  }
+
+  pthread_mutex_unlock(&s->pp_lock);
+  return NULL;
+}
+#endif
+
+/* a side has been fully buffered. get its final size from the scanner,
+ * and hand it to the worker, starting one if required. without a
+ * worker, the side stays queued until wait_for_processing() */
 static SANE_Status
-buffer_crop(struct fujitsu *s, int side)
+queue_processing(struct fujitsu *s, int side)
 {
   SANE_Status ret = SANE_STATUS_GOOD;
+  SANE_Parameters params = s->params;
+  int state = PP_QUEUED;
 
-  DBG (10, "buffer_crop: start\n");
+  DBG (10, "queue_processing: start %d\n", side);
 
-  /*only find edges on first image from a page, or if first image had error */
-  if(s->side == SIDE_FRONT || s->source == SOURCE_ADF_BACK || s->crop_stat){
+  /* hardware deskew will tell image size after transfer.
+   * we might be reading the other side, so keep params as they were */
+  restore_params(s);
+  ret = get_pixelsize(s,1);
+  s->pp_params[side] = s->params;
+  s->params = params;
 
-    s->crop_stat = sanei_magic_findEdges(
-      &s->params,s->buffers[side],s->resolution_x,s->resolution_y,
-      &s->crop_vals[0],&s->crop_vals[1],&s->crop_vals[2],&s->crop_vals[3]);
+  if (ret != SANE_STATUS_GOOD) {
+    DBG (5, "queue_processing: ERROR: cannot get final pixelsize\n");
+    return ret;
+  }
 
-    if(s->crop_stat){
-      DBG (5, "buffer_crop: bad edges, bailing\n");
-      goto cleanup;
-    }
-  
-    DBG (15, "buffer_crop: t:%d b:%d l:%d r:%d\n",
-      s->crop_vals[0],s->crop_vals[1],s->crop_vals[2],s->crop_vals[3]);
+  s->pp_bytes[side] = -1;
 
-    /* we dont listen to the 'top' value, since fujitsu does not pad the top */
-    s->crop_vals[0] = 0;
+  /* scanner might have just asked us not to */
+  if(!must_process(s)){
+    DBG (15, "queue_processing: nothing to do\n");
+    state = PP_DONE;
   }
-  /* backside images can use a 'flipped' version of frontside data */
-  else{
-    int left  = s->crop_vals[2];
-    int right = s->crop_vals[3];
 
-    s->crop_vals[2] = s->params.pixels_per_line - right;
-    s->crop_vals[3] = s->params.pixels_per_line - left;
+#ifdef HAVE_PTHREAD_H
+  if(state == PP_QUEUED && !s->pp_running){
+    pthread_mutex_init(&s->pp_lock, NULL);
+    pthread_cond_init(&s->pp_cond, NULL);
+    s->pp_quit = 0;
+
+    if(!pthread_create(&s->pp_thread, NULL, processing_thread, s)){
+      s->pp_running = 1;
+    }
+    else{
+      DBG (5, "queue_processing: no thread, processing in sane_start\n");
+      pthread_mutex_destroy(&s->pp_lock);
+      pthread_cond_destroy(&s->pp_cond);
+    }
   }
 
-  /* now crop the image */
-  ret = sanei_magic_crop(&s->params,s->buffers[side],
-      s->crop_vals[0],s->crop_vals[1],s->crop_vals[2],s->crop_vals[3]);
+  if(s->pp_running){
+    pthread_mutex_lock(&s->pp_lock);
+    s->pp_state[side] = state;
+    pthread_cond_broadcast(&s->pp_cond);
+    pthread_mutex_unlock(&s->pp_lock);
 
-  if(ret){
-    DBG (5, "buffer_crop: bad crop, bailing\n");
-    ret = SANE_STATUS_GOOD;
-    goto cleanup;
+    DBG (10, "queue_processing: finish\n");
+    return ret;
   }
+#endif
 
-  /* update image size counter to new, smaller size */
-  s->bytes_rx[side] = s->params.lines * s->params.bytes_per_line;
-  s->buff_rx[side] = s->bytes_rx[side];
- 
-  cleanup:
-  DBG (10, "buffer_crop: finish\n");
+  s->pp_state[side] = state;
+
+  DBG (10, "queue_processing: finish\n");
   return ret;
 }
 
-/* Look in image for disconnected 'spots' of the requested size.
- * Replace the spots with the average color of the surrounding pixels.
- * FIXME: should we do this before we binarize instead of after? */
+/* block until a side has been processed, then make its size current.
+ * while the worker is busy, we read the other side of a duplex page */
 static SANE_Status
-buffer_despeck(struct fujitsu *s, int side)
+wait_for_processing(struct fujitsu *s, int side)
 {
   SANE_Status ret = SANE_STATUS_GOOD;
 
-  DBG (10, "buffer_despeck: start\n");
+  DBG (10, "wait_for_processing: start %d\n", side);
 
-  ret = sanei_magic_despeck(&s->params,s->buffers[side],s->swdespeck);
-  if(ret){
-    DBG (5, "buffer_despeck: bad despeck, bailing\n");
-    ret = SANE_STATUS_GOOD;
-    goto cleanup;
+#ifdef HAVE_PTHREAD_H
+  if(s->pp_running){
+    int other = !side;
+    int pump = !s->low_mem && s->bytes_tot[other];
+
+    pthread_mutex_lock(&s->pp_lock);
+
+    while(s->pp_state[side] != PP_DONE){
+
+      if(pump && !s->eof_rx[other]
+        && s->bytes_rx[side] != s->bytes_tx[side]
+      ){
+        int before = s->bytes_rx[other] + s->jpeg_rx[other];
+        SANE_Int len = 0;
+
+        pthread_mutex_unlock(&s->pp_lock);
+        ret = sane_read((SANE_Handle)s, NULL, 0, &len);
+        pthread_mutex_lock(&s->pp_lock);
+
+        if(ret){
+          break;
+        }
+
+        /* other side is not moving, so just wait */
+        if(s->bytes_rx[other] + s->jpeg_rx[other] == before){
+          pump = 0;
+        }
+        continue;
+      }
+
+      pthread_cond_wait(&s->pp_cond, &s->pp_lock);
+    }
+
+    pthread_mutex_unlock(&s->pp_lock);
+
+    if(ret){
+      DBG (5, "wait_for_processing: ERROR: cannot read other side\n");
+      return ret;
+    }
   }
+#endif
 
-  cleanup:
-  DBG (10, "buffer_despeck: finish\n");
+  /* no worker, do it ourselves */
+  if(s->pp_state[side] == PP_QUEUED){
+    s->pp_state[side] = PP_BUSY;
+    buffer_process(s,side);
+    s->pp_state[side] = PP_DONE;
+  }
+
+  s->params = s->pp_params[side];
+
+  /* update image size counter to new, smaller size */
+  if(s->pp_bytes[side] >= 0){
+    s->bytes_rx[side] = s->pp_bytes[side];
+    s->buff_rx[side] = s->bytes_rx[side];
+  }
+
+  DBG (10, "wait_for_processing: finish\n");
   return ret;
 }
 
+/* drop sides which have not been started, wait out the rest */
+static void
+finish_processing(struct fujitsu *s)
+{
+#ifdef HAVE_PTHREAD_H
+  if(s->pp_running){
+    int side;
+
+    pthread_mutex_lock(&s->pp_lock);
+
+    for(side=0;side<2;side++){
+      if(s->pp_state[side] == PP_QUEUED)
+        s->pp_state[side] = PP_NONE;
+    }
+
+    while(s->pp_state[SIDE_FRONT] == PP_BUSY
+      || s->pp_state[SIDE_BACK] == PP_BUSY
+    ){
+      pthread_cond_wait(&s->pp_cond, &s->pp_lock);
+    }
+
+    s->pp_state[SIDE_FRONT] = PP_NONE;
+    s->pp_state[SIDE_BACK] = PP_NONE;
+
+    pthread_mutex_unlock(&s->pp_lock);
+    return;
+  }
+#endif
+
+  s->pp_state[SIDE_FRONT] = PP_NONE;
+  s->pp_state[SIDE_BACK] = PP_NONE;
+}
+
+/* shut down the worker */
+static void
+stop_processing(struct fujitsu *s)
+{
+  finish_processing(s);
+
+#ifdef HAVE_PTHREAD_H
+  if(!s->pp_running)
+    return;
+
+  DBG (10, "stop_processing: start\n");
+
+  pthread_mutex_lock(&s->pp_lock);
+  s->pp_quit = 1;
+  pthread_cond_broadcast(&s->pp_cond);
+  pthread_mutex_unlock(&s->pp_lock);
+
+  pthread_join(s->pp_thread, NULL);
+  pthread_mutex_destroy(&s->pp_lock);
+  pthread_cond_destroy(&s->pp_cond);
+  s->pp_running = 0;
+
+  DBG (10, "stop_processing: finish\n");
+#endif
+}
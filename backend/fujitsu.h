@@ -126,6 +126,9 @@ enum fujitsu_Option
   NUM_OPTIONS
 };
 
+/* per-side jpeg decoder state, private to fujitsu.c */
+struct fujitsu_jpeg;
+
 struct fujitsu
 {
   /* --------------------------------------------------------------------- */
@@ -543,12 +546,31 @@ struct fujitsu
 
   /* --------------------------------------------------------------------- */
   /* values used by the software enhancment code (deskew, crop, etc)       */
-  SANE_Status deskew_stat;
-  int deskew_vals[2];
-  double deskew_slope;
-
-  SANE_Status crop_stat;
-  int crop_vals[4];
+  /* skew and edges found on each side, the back may reuse the front's */
+  SANEI_Magic_Page magic[2];
+
+  /* rotation buffer kept between pages, one per side */
+  SANEI_Magic_Arena * magic_arena[2];
+
+  /* rows of each side fed to sanei_magic as they arrive, so the skew and
+   * edges are ready when the side is, instead of scanning the buffer */
+  SANEI_Magic_Stream * magic_stream[2];
+  int magic_lines[2];
+
+  /* each side's params and size, as changed by the processing above */
+  SANE_Parameters pp_params[2];
+  int pp_bytes[2];
+
+  /* the processing runs on a worker thread, one side at a time, while
+   * we carry on with the other side. see queue_processing() */
+  int pp_state[2];
+#ifdef HAVE_PTHREAD_H
+  int pp_running;
+  int pp_quit;
+  pthread_t pp_thread;
+  pthread_mutex_t pp_lock;
+  pthread_cond_t pp_cond;
+#endif
 
   /* --------------------------------------------------------------------- */
   /* values used by the compression functions, esp. jpeg with duplex       */
@@ -558,6 +580,13 @@ struct fujitsu
   int jpeg_back_rst;
   int jpeg_x_byte;
 
+  /* --------------------------------------------------------------------- */
+  /* values used when the backend decodes jpeg into raw frames itself      */
+  int jpeg_decode;      /* scanner sends jpeg, frontend gets raw data */
+  int jpeg_rx[2];       /* compressed bytes received from the scanner */
+  int jpeg_eof_rx[2];   /* all compressed data received */
+  struct fujitsu_jpeg * jpeg_dec[2];
+
   /* --------------------------------------------------------------------- */
   /* values which used by the command and data sending functions (scsi/usb)*/
   int fd;                      /* The scanner device file descriptor.     */
@@ -610,6 +639,11 @@ struct fujitsu
 #define SOURCE_ADF_BACK 2
 #define SOURCE_ADF_DUPLEX 3
 
+#define PP_NONE 0
+#define PP_QUEUED 1
+#define PP_BUSY 2
+#define PP_DONE 3
+
 #define COMP_NONE WD_cmp_NONE
 #define COMP_JPEG WD_cmp_JPG1
 
@@ -782,6 +816,7 @@ static SANE_Status mode_select_auto (struct fujitsu *s);
 static SANE_Status set_sleep_mode(struct fujitsu *s);
 
 static int must_fully_buffer (struct fujitsu *s);
+static int must_process (struct fujitsu *s);
 static int get_page_width (struct fujitsu *s);
 static int get_page_height (struct fujitsu *s);
 
@@ -798,8 +833,9 @@ static SANE_Status start_scan (struct fujitsu *s);
 
 static SANE_Status check_for_cancel(struct fujitsu *s);
 
-#ifdef SANE_FRAME_JPEG
+#if defined(SANE_FRAME_JPEG) || defined(HAVE_LIBJPEG)
 static SANE_Status read_from_JPEGduplex(struct fujitsu *s);
+static void put_jpeg_byte(struct fujitsu *s, int side, unsigned char c);
 #endif
 static SANE_Status read_from_3091duplex(struct fujitsu *s);
 static SANE_Status read_from_scanner(struct fujitsu *s, int side);
@@ -809,13 +845,29 @@ static SANE_Status copy_buffer(struct fujitsu *s, unsigned char * buf, int len,
 
 static SANE_Status read_from_buffer(struct fujitsu *s, SANE_Byte * buf, SANE_Int max_len, SANE_Int * len, int side);
 
+static int get_eof_rx(struct fujitsu *s, int side);
+static void set_eof_rx(struct fujitsu *s, int side);
+
+#ifdef HAVE_LIBJPEG
+static SANE_Status start_jpeg_decode(struct fujitsu *s, int side);
+static void stop_jpeg_decode(struct fujitsu *s, int side);
+static void free_jpeg_decode(struct fujitsu *s);
+static SANE_Status feed_jpeg_decode(struct fujitsu *s, int side, unsigned char * buf, int len);
+static SANE_Status collect_jpeg_decode(struct fujitsu *s, int side, int wait);
+#endif
+
 static SANE_Status setup_buffers (struct fujitsu *s);
 
 static SANE_Status get_hardware_status (struct fujitsu *s, SANE_Int option);
 
-static SANE_Status buffer_deskew(struct fujitsu *s, int side);
-static SANE_Status buffer_crop(struct fujitsu *s, int side);
-static SANE_Status buffer_despeck(struct fujitsu *s, int side);
+static SANE_Status buffer_process(struct fujitsu *s, int side);
+static void start_magic_streams(struct fujitsu *s);
+static void feed_magic_stream(struct fujitsu *s, int side);
+
+static SANE_Status queue_processing(struct fujitsu *s, int side);
+static SANE_Status wait_for_processing(struct fujitsu *s, int side);
+static void finish_processing(struct fujitsu *s);
+static void stop_processing(struct fujitsu *s);
 
 static void hexdump (int level, char *comment, unsigned char *p, int l);
 
@@ -62,11 +62,23 @@
 #define BACKEND_NAME genesys
 
 #include "genesys.h"
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
 #include "../include/sane/sanei_config.h"
 #include "../include/sane/sanei_magic.h"
 #include "genesys_devices.c"
 
 static SANE_Int num_devices = 0;
+/* size in MB of the buffer filled in background during a scan, 0 to read
+ * synchronously from sane_read. Set by the readahead configuration option */
+static SANE_Word read_ahead_mb = 64;
+static const SANE_Range readahead_range = { 0, 4096, 1 };
 static Genesys_Device *first_dev = 0;
 static Genesys_Scanner *first_handle = 0;
 static const SANE_Device **devlist = 0;
@@ -3146,6 +3158,492 @@ genesys_send_shading_coefficient (Genesys_Device * dev)
 }
 
 
+/**
+ * The calibration cache file starts with a header, followed by an index
+ * of fixed size records, one per cache entry, newest first. The average
+ * data of each entry is stored after the index, at the offset given in
+ * its record, white data first then dark data. Records and data are
+ * stored as is, so a change of any of the stored structures is caught by
+ * the record size check. The file is mapped read-only and cache entries
+ * point into the mapping, only the matching entry's data is ever copied.
+ *
+ * The file is never modified in place: writers take a lock, merge their
+ * entries with the ones currently on disk, write a new file and rename
+ * it over the old one. Readers don't need to lock, a file they mapped is
+ * never changed. This should be changed if one of the substructures of
+ * Genesys_Calibration_Cache changes without changing its size.
+*/
+#define CALIBRATION_MAGIC "GLCACHE"
+#define CALIBRATION_VERSION 2
+
+/* entries older than this (in seconds) are dropped when writing */
+#define CALIBRATION_MAX_AGE (30 * 24 * 60 * 60)
+/* maximum number of entries kept in the file */
+#define CALIBRATION_MAX_ENTRIES 64
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;		/* sizeof (Genesys_Calibration_Record) */
+  uint32_t count;		/* number of records */
+  uint32_t reserved;
+} Genesys_Calibration_Header;
+
+typedef struct
+{
+  Genesys_Current_Setup used_setup;
+  int64_t last_calibration;
+  Genesys_Frontend frontend;
+  /* the gamma (and later) fields are not stored */
+  uint8_t sensor[offsetof (Genesys_Sensor, red_gamma)];
+  uint64_t calib_pixels;
+  uint64_t calib_channels;
+  uint64_t average_size;
+  uint64_t offset;		/* offset of white data, dark data follows */
+} Genesys_Calibration_Record;
+
+/* returns true when both entries are made for the same scan setup, in
+ * which case only the most recent one is kept */
+static SANE_Bool
+calibration_same_key (Genesys_Calibration_Cache * a,
+		      Genesys_Calibration_Cache * b)
+{
+  return a->used_setup.xres == b->used_setup.xres
+    && a->used_setup.channels == b->used_setup.channels
+    && a->used_setup.depth == b->used_setup.depth
+    && a->used_setup.scan_method == b->used_setup.scan_method
+    && a->used_setup.half_ccd == b->used_setup.half_ccd
+    && a->calib_pixels == b->calib_pixels;
+}
+
+/* frees a list of cache entries. Data of mapped entries belongs to the
+ * mapping and is left alone */
+static void
+calibration_free_list (Genesys_Calibration_Cache * cache)
+{
+  Genesys_Calibration_Cache *next_cache;
+
+  for (; cache; cache = next_cache)
+    {
+      next_cache = cache->next;
+      if (cache->mapped == SANE_FALSE)
+	{
+	  free (cache->dark_average_data);
+	  free (cache->white_average_data);
+	}
+      free (cache);
+    }
+}
+
+static void
+calibration_unmap (void *map, size_t size)
+{
+  if (map == NULL)
+    return;
+#ifdef HAVE_MMAP
+  munmap (map, size);
+#else
+  size = size;
+  free (map);
+#endif
+}
+
+/* maps the calibration file read-only and checks its index. On success
+ * returns the mapping and its size, and the list of entries it holds */
+static SANE_Status
+calibration_map (const char *file, void **map, size_t * size,
+		 struct stat *st, Genesys_Calibration_Cache ** list)
+{
+  Genesys_Calibration_Header header;
+  Genesys_Calibration_Record record;
+  Genesys_Calibration_Cache *cache, *last = NULL;
+  uint8_t *data;
+  uint32_t i;
+  int fd;
+
+  *map = NULL;
+  *list = NULL;
+
+  fd = open (file, O_RDONLY);
+  if (fd < 0)
+    {
+      DBG (DBG_info, "Calibration: Cannot open %s\n", file);
+      return SANE_STATUS_IO_ERROR;
+    }
+  if (fstat (fd, st) < 0 || (size_t) st->st_size < sizeof (header))
+    {
+      DBG (DBG_info, "Calibration: %s is too short\n", file);
+      close (fd);
+      return SANE_STATUS_INVAL;
+    }
+  *size = st->st_size;
+
+#ifdef HAVE_MMAP
+  data = mmap (NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    data = NULL;
+#else
+  data = malloc (*size);
+  if (data && read (fd, data, *size) != (ssize_t) * size)
+    {
+      free (data);
+      data = NULL;
+    }
+#endif
+  close (fd);
+  if (data == NULL)
+    {
+      DBG (DBG_error, "Calibration: failed to map %s: %s\n", file,
+	   strerror (errno));
+      return SANE_STATUS_IO_ERROR;
+    }
+
+  /* these checks ensure that most bad things cannot happen */
+  memcpy (&header, data, sizeof (header));
+  if (memcmp (header.magic, CALIBRATION_MAGIC, sizeof (header.magic))
+      || header.version != CALIBRATION_VERSION)
+    {
+      DBG (DBG_info, "Calibration: Bad version\n");
+      calibration_unmap (data, *size);
+      return SANE_STATUS_INVAL;
+    }
+  if (header.record_size != sizeof (record)
+      || header.count > (*size - sizeof (header)) / sizeof (record))
+    {
+      DBG (DBG_info,
+	   "Calibration: Size of calibration cache struct differs\n");
+      calibration_unmap (data, *size);
+      return SANE_STATUS_INVAL;
+    }
+
+  for (i = 0; i < header.count; i++)
+    {
+      memcpy (&record, data + sizeof (header) + i * sizeof (record),
+	      sizeof (record));
+      if (record.offset > *size
+	  || record.average_size > (*size - record.offset) / 2)
+	{
+	  DBG (DBG_warn, "sanei_genesys_read_calibration: partial "
+	       "calibration record\n");
+	  break;
+	}
+
+      cache = malloc (sizeof (*cache));
+      if (!cache)
+	{
+	  DBG (DBG_error, "sanei_genesys_read_calibration: could not "
+	       "allocate cache struct\n");
+	  calibration_free_list (*list);
+	  *list = NULL;
+	  calibration_unmap (data, *size);
+	  return SANE_STATUS_NO_MEM;
+	}
+      memset (cache, 0, sizeof (*cache));
+      memcpy (&cache->used_setup, &record.used_setup,
+	      sizeof (cache->used_setup));
+      cache->last_calibration = record.last_calibration;
+      memcpy (&cache->frontend, &record.frontend, sizeof (cache->frontend));
+      memcpy (&cache->sensor, record.sensor, sizeof (record.sensor));
+      cache->calib_pixels = record.calib_pixels;
+      cache->calib_channels = record.calib_channels;
+      cache->average_size = record.average_size;
+      cache->white_average_data = data + record.offset;
+      cache->dark_average_data = data + record.offset + record.average_size;
+      cache->mapped = SANE_TRUE;
+
+      /* keep file order, newest first */
+      if (last)
+	last->next = cache;
+      else
+	*list = cache;
+      last = cache;
+    }
+
+  *map = data;
+  return SANE_STATUS_GOOD;
+}
+
+/**
+ * frees the calibration cache of a device and its mapping
+ */
+static void
+genesys_free_calibration_cache (Genesys_Device * dev)
+{
+  calibration_free_list (dev->calibration_cache);
+  dev->calibration_cache = NULL;
+  calibration_unmap (dev->calib_map, dev->calib_map_size);
+  dev->calib_map = NULL;
+  dev->calib_map_size = 0;
+}
+
+/**
+ * reads previously cached calibration data
+ * from file
+ */
+SANE_Status
+sanei_genesys_read_calibration (Genesys_Device * dev)
+{
+  SANE_Status status;
+  struct stat st;
+
+  DBGSTART;
+  genesys_free_calibration_cache (dev);
+  dev->calib_ino = 0;
+  dev->calib_mtime = 0;
+
+  status = calibration_map (dev->calib_file, &dev->calib_map,
+			    &dev->calib_map_size, &st,
+			    &dev->calibration_cache);
+  if (status == SANE_STATUS_GOOD)
+    {
+      dev->calib_ino = st.st_ino;
+      dev->calib_mtime = st.st_mtime;
+    }
+
+  DBGCOMPLETED;
+  return status;
+}
+
+/**
+ * reloads the calibration cache if another process has updated it since
+ * we read it, so that its calibrations can be used right away. Nothing
+ * is done while we hold entries that could not be written.
+ */
+static void
+genesys_refresh_calibration (Genesys_Device * dev)
+{
+  Genesys_Calibration_Cache *cache;
+  struct stat st;
+
+  if (dev->calib_file == NULL || stat (dev->calib_file, &st) < 0)
+    return;
+  if (st.st_ino == dev->calib_ino && st.st_mtime == dev->calib_mtime
+      && (size_t) st.st_size == dev->calib_map_size)
+    return;
+  for (cache = dev->calibration_cache; cache; cache = cache->next)
+    if (cache->mapped == SANE_FALSE)
+      return;
+
+  DBG (DBG_info, "genesys_refresh_calibration: %s changed, reloading\n",
+       dev->calib_file);
+  sanei_genesys_read_calibration (dev);
+}
+
+/* writes one item of a new calibration cache file */
+static SANE_Status
+calibration_write (int fd, const void *data, size_t size)
+{
+  ssize_t written;
+  const uint8_t *p = data;
+
+  while (size > 0)
+    {
+      written = write (fd, p, size);
+      if (written < 0 && errno == EINTR)
+	continue;
+      if (written <= 0)
+	return SANE_STATUS_IO_ERROR;
+      p += written;
+      size -= written;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+/* writes header, index and data of a new calibration cache file */
+static SANE_Status
+calibration_write_file (int fd, Genesys_Calibration_Cache ** entries,
+			unsigned int count)
+{
+  static const uint8_t pad[16] = { 0 };
+  SANE_Status status;
+  Genesys_Calibration_Header header;
+  Genesys_Calibration_Record record;
+  Genesys_Calibration_Cache *cache;
+  uint64_t offset, aligned;
+  unsigned int i;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CALIBRATION_MAGIC, sizeof (header.magic));
+  header.version = CALIBRATION_VERSION;
+  header.record_size = sizeof (record);
+  header.count = count;
+  status = calibration_write (fd, &header, sizeof (header));
+
+  /* index, with data laid out after it on 16 bytes boundaries */
+  offset = sizeof (header) + count * sizeof (record);
+  for (i = 0; i < count && status == SANE_STATUS_GOOD; i++)
+    {
+      cache = entries[i];
+      offset = (offset + 15) & ~((uint64_t) 15);
+      memset (&record, 0, sizeof (record));
+      memcpy (&record.used_setup, &cache->used_setup,
+	      sizeof (record.used_setup));
+      record.last_calibration = cache->last_calibration;
+      memcpy (&record.frontend, &cache->frontend, sizeof (record.frontend));
+      memcpy (record.sensor, &cache->sensor, sizeof (record.sensor));
+      record.calib_pixels = cache->calib_pixels;
+      record.calib_channels = cache->calib_channels;
+      record.average_size = cache->average_size;
+      record.offset = offset;
+      offset += 2 * cache->average_size;
+      status = calibration_write (fd, &record, sizeof (record));
+    }
+
+  offset = sizeof (header) + count * sizeof (record);
+  for (i = 0; i < count && status == SANE_STATUS_GOOD; i++)
+    {
+      cache = entries[i];
+      aligned = (offset + 15) & ~((uint64_t) 15);
+      status = calibration_write (fd, pad, aligned - offset);
+      if (status == SANE_STATUS_GOOD)
+	status = calibration_write (fd, cache->white_average_data,
+				    cache->average_size);
+      if (status == SANE_STATUS_GOOD)
+	status = calibration_write (fd, cache->dark_average_data,
+				    cache->average_size);
+      offset = aligned + 2 * cache->average_size;
+    }
+
+  if (status == SANE_STATUS_GOOD && fsync (fd) < 0)
+    status = SANE_STATUS_IO_ERROR;
+  return status;
+}
+
+/**
+ * writes the calibration cache of the device. Entries are merged with
+ * the ones already on disk, possibly written by another process, keeping
+ * the most recent entry for each scan setup and dropping stale ones. The
+ * new file replaces the old one atomically, then is mapped in place of
+ * the device's cache.
+ */
+static SANE_Status
+write_calibration (Genesys_Device * dev)
+{
+  SANE_Status status;
+  Genesys_Calibration_Cache *disk = NULL, *cache, *other;
+  Genesys_Calibration_Cache *entries[2 * CALIBRATION_MAX_ENTRIES];
+  void *disk_map = NULL;
+  size_t disk_size = 0;
+  struct stat st;
+  struct flock lock;
+  char *lock_file, *tmp_file;
+  time_t now;
+  unsigned int count, i, j;
+  int lock_fd, fd;
+
+  DBGSTART;
+  if (dev->calib_file == NULL)
+    return SANE_STATUS_INVAL;
+
+  /* nothing to write if we only have entries read from the file */
+  for (cache = dev->calibration_cache; cache; cache = cache->next)
+    if (cache->mapped == SANE_FALSE)
+      break;
+  if (cache == NULL)
+    {
+      DBGCOMPLETED;
+      return SANE_STATUS_GOOD;
+    }
+
+  lock_file = malloc (strlen (dev->calib_file) + 8);
+  tmp_file = malloc (strlen (dev->calib_file) + 8);
+  if (!lock_file || !tmp_file)
+    {
+      free (lock_file);
+      free (tmp_file);
+      return SANE_STATUS_NO_MEM;
+    }
+  sprintf (lock_file, "%s.lock", dev->calib_file);
+  sprintf (tmp_file, "%s.XXXXXX", dev->calib_file);
+
+  /* serialize writers, readers never see a partial file */
+  lock_fd = open (lock_file, O_RDWR | O_CREAT, 0600);
+  if (lock_fd < 0)
+    {
+      DBG (DBG_info, "write_calibration: Cannot open %s for writing\n",
+	   lock_file);
+      free (lock_file);
+      free (tmp_file);
+      return SANE_STATUS_IO_ERROR;
+    }
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  while (fcntl (lock_fd, F_SETLKW, &lock) < 0 && errno == EINTR);
+
+  /* entries on disk may have been updated by another process */
+  calibration_map (dev->calib_file, &disk_map, &disk_size, &st, &disk);
+
+  /* collect our entries then the disk ones, sort them newest first and
+   * keep only the most recent entry of each setup */
+  time (&now);
+  count = 0;
+  for (i = 0; i < 2; i++)
+    for (cache = i ? disk : dev->calibration_cache;
+	 cache && count < 2 * CALIBRATION_MAX_ENTRIES; cache = cache->next)
+      if (now - cache->last_calibration <= CALIBRATION_MAX_AGE)
+	entries[count++] = cache;
+  for (i = 1; i < count; i++)
+    for (j = i; j > 0
+	 && entries[j - 1]->last_calibration < entries[j]->last_calibration;
+	 j--)
+      {
+	other = entries[j];
+	entries[j] = entries[j - 1];
+	entries[j - 1] = other;
+      }
+  for (i = 0, j = 0; i < count; i++)
+    {
+      unsigned int k;
+      for (k = 0; k < j; k++)
+	if (calibration_same_key (entries[k], entries[i]))
+	  break;
+      if (k == j && j < CALIBRATION_MAX_ENTRIES)
+	entries[j++] = entries[i];
+    }
+  count = j;
+
+  fd = mkstemp (tmp_file);
+  if (fd < 0)
+    {
+      DBG (DBG_info, "write_calibration: Cannot open %s for writing\n",
+	   tmp_file);
+      status = SANE_STATUS_IO_ERROR;
+    }
+  else
+    {
+      status = calibration_write_file (fd, entries, count);
+      close (fd);
+      if (status == SANE_STATUS_GOOD
+	  && rename (tmp_file, dev->calib_file) < 0)
+	status = SANE_STATUS_IO_ERROR;
+      if (status != SANE_STATUS_GOOD)
+	{
+	  DBG (DBG_error, "write_calibration: failed to write %s: %s\n",
+	       dev->calib_file, strerror (errno));
+	  unlink (tmp_file);
+	}
+      else
+	DBG (DBG_info, "write_calibration: wrote %u entries\n", count);
+    }
+
+  /* what we wrote is now the device's cache */
+  if (status == SANE_STATUS_GOOD)
+    sanei_genesys_read_calibration (dev);
+
+  calibration_free_list (disk);
+  calibration_unmap (disk_map, disk_size);
+  lock.l_type = F_UNLCK;
+  fcntl (lock_fd, F_SETLK, &lock);
+  close (lock_fd);
+  free (lock_file);
+  free (tmp_file);
+
+  DBGCOMPLETED;
+  return status;
+}
+
 /**
  * search calibration cache list for an entry matching required scan.
  * If one is found, set device calibration with it
@@ -3161,6 +3659,9 @@ genesys_restore_calibration (Genesys_Device * dev)
 
   DBGSTART;
 
+  /* another process may have calibrated since we read the cache */
+  genesys_refresh_calibration (dev);
+
   /* if no cache or no function to evaluate cache entry ther can be no match */
   if (!dev->model->cmd_set->is_compatible_calibration
       || dev->calibration_cache == NULL)
@@ -3270,8 +3771,12 @@ genesys_save_calibration (Genesys_Device * dev)
   /* if we found on overridable cache, we reuse it */
   if (cache)
     {
+      if (cache->mapped == SANE_FALSE)
+        {
           free(cache->dark_average_data);
           free(cache->white_average_data);
+        }
+      cache->mapped = SANE_FALSE;
     }
   else
     {
@@ -3308,6 +3813,9 @@ genesys_save_calibration (Genesys_Device * dev)
   cache->last_calibration = time.tv_sec;
 #endif
 
+  /* store it at once so that other processes can use it */
+  write_calibration (dev);
+
   DBGCOMPLETED;
   return SANE_STATUS_GOOD;
 }
@@ -4334,19 +4842,103 @@ genesys_start_scan (Genesys_Device * dev, SANE_Bool lamp_off)
   return SANE_STATUS_GOOD;
 }
 
-/* this is _not_ a ringbuffer. 
-   if we need a block which does not fit at the end of our available data,
-   we move the available data to the beginning.
+/* Genesys_Buffer is a ring buffer shared between one producer (the code
+   reading scan data from USB) and one consumer (the code reordering and
+   shrinking lines). The producer only changes wpos, the consumer only
+   changes pos, and avail is updated atomically by both.
+
+   When possible, the buffer pages are mapped twice in a row, so that a
+   block starting anywhere in the ring is contiguous in memory and
+   neither side ever has to copy data around. When this mapping can't be
+   made we fall back to a plain malloc()ed buffer, and move the available
+   data to the beginning when a block does not fit at the end. This
+   fallback is _not_ safe for concurrent use, callers wanting to run
+   producer and consumer in different threads must check buf->ring.
  */
 
+#ifdef __GNUC__
+#define BUFFER_ADD(p, n) __sync_fetch_and_add ((p), (n))
+#define BUFFER_SUB(p, n) __sync_fetch_and_sub ((p), (n))
+#define BUFFER_SYNC() __sync_synchronize ()
+#else
+#define BUFFER_ADD(p, n) (*(p) += (n))
+#define BUFFER_SUB(p, n) (*(p) -= (n))
+#define BUFFER_SYNC()
+#endif
+
+/* map a memory file of at least size bytes twice in a row. returns the
+   start of the mapping and the size of one copy in *ring, or NULL */
+static SANE_Byte *
+buffer_map_mirrored (size_t size, size_t * ring)
+{
+#if defined(HAVE_MMAP) && defined(MFD_CLOEXEC)
+  long page;
+  size_t len;
+  int fd;
+  void *base, *lo, *hi;
+
+  page = sysconf (_SC_PAGESIZE);
+  if (page <= 0)
+    return NULL;
+  len = (size + page - 1) / page * page;
+
+  fd = memfd_create ("genesys-buffer", MFD_CLOEXEC);
+  if (fd < 0)
+    {
+      DBG (DBG_io2, "buffer_map_mirrored: memfd_create failed: %s\n",
+	   strerror (errno));
+      return NULL;
+    }
+  if (ftruncate (fd, len) < 0)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  /* reserve address space for both copies, then put the file in it */
+  base = mmap (NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    {
+      close (fd);
+      return NULL;
+    }
+  lo = mmap (base, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	     fd, 0);
+  hi = mmap ((SANE_Byte *) base + len, len, PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_FIXED, fd, 0);
+  close (fd);
+  if (lo != base || hi != (SANE_Byte *) base + len)
+    {
+      DBG (DBG_io2, "buffer_map_mirrored: mmap failed: %s\n",
+	   strerror (errno));
+      munmap (base, 2 * len);
+      return NULL;
+    }
+
+  *ring = len;
+  return base;
+#else
+  (void) size;
+  (void) ring;
+  return NULL;
+#endif
+}
+
 SANE_Status
 sanei_genesys_buffer_alloc (Genesys_Buffer * buf, size_t size)
 {
-  buf->buffer = (SANE_Byte *) malloc (size);
+  buf->ring = 0;
+  buf->buffer = buffer_map_mirrored (size, &buf->ring);
+  if (!buf->buffer)
+    {
+      buf->ring = 0;
+      buf->buffer = (SANE_Byte *) malloc (size);
+    }
   if (!buf->buffer)
     return SANE_STATUS_NO_MEM;
   buf->avail = 0;
   buf->pos = 0;
+  buf->wpos = 0;
   buf->size = size;
   return SANE_STATUS_GOOD;
 }
@@ -4355,12 +4947,23 @@ SANE_Status
 sanei_genesys_buffer_free (Genesys_Buffer * buf)
 {
   SANE_Byte *tmp = buf->buffer;
+  size_t ring = buf->ring;
   buf->avail = 0;
   buf->size = 0;
   buf->pos = 0;
+  buf->wpos = 0;
+  buf->ring = 0;
   buf->buffer = NULL;
-  if (tmp)
-    free (tmp);
+  if (!tmp)
+    return SANE_STATUS_GOOD;
+#ifdef HAVE_MMAP
+  if (ring)
+    {
+      munmap (tmp, 2 * ring);
+      return SANE_STATUS_GOOD;
+    }
+#endif
+  free (tmp);
   return SANE_STATUS_GOOD;
 }
 
@@ -4369,6 +4972,8 @@ sanei_genesys_buffer_get_write_pos (Genesys_Buffer * buf, size_t size)
 {
   if (buf->avail + size > buf->size)
     return NULL;
+  if (buf->ring)
+    return buf->buffer + buf->wpos;
   if (buf->pos + buf->avail + size > buf->size)
     {
       memmove (buf->buffer, buf->buffer + buf->pos, buf->avail);
@@ -4380,6 +4985,8 @@ sanei_genesys_buffer_get_write_pos (Genesys_Buffer * buf, size_t size)
 SANE_Byte *
 sanei_genesys_buffer_get_read_pos (Genesys_Buffer * buf)
 {
+  /* make sure we see the data the producer wrote before updating avail */
+  BUFFER_SYNC ();
   return buf->buffer + buf->pos;
 }
 
@@ -4388,7 +4995,9 @@ sanei_genesys_buffer_produce (Genesys_Buffer * buf, size_t size)
 {
   if (size > buf->size - buf->avail)
     return SANE_STATUS_INVAL;
-  buf->avail += size;
+  if (buf->ring)
+    buf->wpos = (buf->wpos + size) % buf->ring;
+  BUFFER_ADD (&buf->avail, size);
   return SANE_STATUS_GOOD;
 }
 
@@ -4397,8 +5006,11 @@ sanei_genesys_buffer_consume (Genesys_Buffer * buf, size_t size)
 {
   if (size > buf->avail)
     return SANE_STATUS_INVAL;
-  buf->avail -= size;
-  buf->pos += size;
+  if (buf->ring)
+    buf->pos = (buf->pos + size) % buf->ring;
+  else
+    buf->pos += size;
+  BUFFER_SUB (&buf->avail, size);
   return SANE_STATUS_GOOD;
 }
 
@@ -4617,10 +5229,10 @@ genesys_fill_segmented_buffer (Genesys_Device * dev, uint8_t *work_buffer_dst, s
 }
 
 /**
- *
+ * read at most max bytes of scan data from the scanner into read_buffer
  */
 static SANE_Status
-genesys_fill_read_buffer (Genesys_Device * dev)
+genesys_fill_read_buffer (Genesys_Device * dev, size_t max)
 {
   size_t size;
   size_t space;
@@ -4639,6 +5251,8 @@ genesys_fill_read_buffer (Genesys_Device * dev)
     }
 
   space = dev->read_buffer.size - dev->read_buffer.avail;
+  if (space > max)
+    space = max;
 
   work_buffer_dst = sanei_genesys_buffer_get_write_pos (&(dev->read_buffer),
 							space);
@@ -4713,6 +5327,205 @@ genesys_fill_read_buffer (Genesys_Device * dev)
   return SANE_STATUS_GOOD;
 }
 
+#ifdef HAVE_PTHREAD_H
+/* largest block the reader thread reads at once, so that data flows to
+ * the frontend long before a deep read buffer is full */
+#define READER_CHUNK (512 * 1024)
+
+static void
+genesys_reader_wake (Genesys_Device * dev)
+{
+  pthread_mutex_lock (&dev->reader_lock);
+  pthread_cond_broadcast (&dev->reader_cond);
+  pthread_mutex_unlock (&dev->reader_lock);
+}
+
+/**
+ * background reader: drains the scanner into read_buffer for the whole
+ * scan, so that the scanning head never has to wait for the frontend.
+ * It is the only producer of read_buffer, genesys_read_ordered_data
+ * being the only consumer. Each block read is signaled by a byte on the
+ * select pipe, which is closed once the reader is done.
+ */
+static void *
+genesys_reader_thread (void *arg)
+{
+  Genesys_Device *dev = arg;
+  SANE_Status status = SANE_STATUS_GOOD;
+  char c = 0;
+
+  DBGSTART;
+  while (dev->read_bytes_left > 0)
+    {
+      /* wait for room for at least one 256 bytes block */
+      pthread_mutex_lock (&dev->reader_lock);
+      while (dev->reader_cancel == SANE_FALSE
+	     && dev->read_buffer.size - dev->read_buffer.avail < 256)
+	pthread_cond_wait (&dev->reader_cond, &dev->reader_lock);
+      pthread_mutex_unlock (&dev->reader_lock);
+      if (dev->reader_cancel == SANE_TRUE)
+	break;
+
+      status = genesys_fill_read_buffer (dev, READER_CHUNK);
+      if (status != SANE_STATUS_GOOD)
+	break;
+
+      if (write (dev->reader_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+	DBG (DBG_io2, "genesys_reader_thread: pipe write failed: %s\n",
+	     strerror (errno));
+      genesys_reader_wake (dev);
+    }
+
+  pthread_mutex_lock (&dev->reader_lock);
+  dev->reader_status = status;
+  dev->reader_done = SANE_TRUE;
+  pthread_cond_broadcast (&dev->reader_cond);
+  pthread_mutex_unlock (&dev->reader_lock);
+
+  close (dev->reader_pipe[1]);
+  dev->reader_pipe[1] = -1;
+
+  DBG (DBG_proc, "genesys_reader_thread: completed (%s)\n",
+       sane_strstatus (status));
+  return NULL;
+}
+
+/**
+ * starts the background reader for the current scan. The read buffer is
+ * grown to the readahead size first. When the reader can't be used,
+ * data is read synchronously as before.
+ */
+static SANE_Status
+genesys_start_reader (Genesys_Device * dev, size_t depth)
+{
+  SANE_Status status;
+  int i;
+
+  DBGSTART;
+  dev->reader_running = SANE_FALSE;
+  dev->non_blocking = SANE_FALSE;
+
+  /* sheetfed scanners update the scan length while reading */
+  if (depth == 0 || dev->model->is_sheetfed == SANE_TRUE
+      || dev->read_bytes_left == 0 || dev->read_buffer.avail != 0)
+    return SANE_STATUS_GOOD;
+
+  if (depth > dev->read_bytes_left + 256)
+    depth = dev->read_bytes_left + 256;
+  if (depth > dev->read_buffer.size)
+    {
+      RIE (sanei_genesys_buffer_free (&(dev->read_buffer)));
+      RIE (sanei_genesys_buffer_alloc (&(dev->read_buffer), depth));
+    }
+
+  /* only a mirrored buffer may be shared with another thread */
+  if (dev->read_buffer.ring == 0)
+    {
+      DBG (DBG_info, "genesys_start_reader: no ring buffer, reading "
+	   "synchronously\n");
+      return SANE_STATUS_GOOD;
+    }
+
+  if (pipe (dev->reader_pipe) < 0)
+    {
+      DBG (DBG_error, "genesys_start_reader: pipe failed: %s\n",
+	   strerror (errno));
+      return SANE_STATUS_GOOD;
+    }
+  for (i = 0; i < 2; i++)
+    {
+      fcntl (dev->reader_pipe[i], F_SETFD, FD_CLOEXEC);
+      fcntl (dev->reader_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+
+  pthread_mutex_init (&dev->reader_lock, NULL);
+  pthread_cond_init (&dev->reader_cond, NULL);
+  dev->reader_done = SANE_FALSE;
+  dev->reader_cancel = SANE_FALSE;
+  dev->reader_status = SANE_STATUS_GOOD;
+  dev->reader_seen = 0;
+
+  if (pthread_create (&dev->reader, NULL, genesys_reader_thread, dev))
+    {
+      DBG (DBG_error, "genesys_start_reader: failed to create thread\n");
+      pthread_cond_destroy (&dev->reader_cond);
+      pthread_mutex_destroy (&dev->reader_lock);
+      close (dev->reader_pipe[0]);
+      close (dev->reader_pipe[1]);
+      return SANE_STATUS_GOOD;
+    }
+  dev->reader_running = SANE_TRUE;
+
+  DBG (DBG_info, "genesys_start_reader: reading %lu bytes in background, "
+       "buffer is %lu bytes\n", (u_long) dev->read_bytes_left,
+       (u_long) dev->read_buffer.size);
+  DBGCOMPLETED;
+  return SANE_STATUS_GOOD;
+}
+
+/* stops the background reader, if any, and waits for it to exit */
+static void
+genesys_stop_reader (Genesys_Device * dev)
+{
+  if (dev->reader_running == SANE_FALSE)
+    return;
+
+  DBGSTART;
+  pthread_mutex_lock (&dev->reader_lock);
+  dev->reader_cancel = SANE_TRUE;
+  pthread_cond_broadcast (&dev->reader_cond);
+  pthread_mutex_unlock (&dev->reader_lock);
+
+  pthread_join (dev->reader, NULL);
+  pthread_cond_destroy (&dev->reader_cond);
+  pthread_mutex_destroy (&dev->reader_lock);
+  close (dev->reader_pipe[0]);
+  dev->reader_pipe[0] = -1;
+
+  dev->reader_running = SANE_FALSE;
+  dev->non_blocking = SANE_FALSE;
+  DBGCOMPLETED;
+}
+
+/**
+ * consumer side of the reader: waits until read_buffer holds more data
+ * than was left by the previous call, or the reader is done. In non
+ * blocking mode, returns at once and processing goes on with whatever
+ * is available.
+ */
+static SANE_Status
+genesys_wait_read_buffer (Genesys_Device * dev)
+{
+  SANE_Status status = SANE_STATUS_GOOD;
+  char c[64];
+
+  pthread_mutex_lock (&dev->reader_lock);
+  if (dev->non_blocking == SANE_TRUE)
+    {
+      if (dev->reader_done == SANE_FALSE
+	  && dev->read_buffer.avail <= dev->reader_seen)
+	{
+	  /* nothing new: empty the select pipe, so that the frontend is
+	   * woken up by the next block read */
+	  pthread_mutex_unlock (&dev->reader_lock);
+	  while (read (dev->reader_pipe[0], c, sizeof (c)) > 0);
+	  pthread_mutex_lock (&dev->reader_lock);
+	}
+    }
+  else
+    {
+      while (dev->reader_done == SANE_FALSE
+	     && dev->read_buffer.avail <= dev->reader_seen)
+	pthread_cond_wait (&dev->reader_cond, &dev->reader_lock);
+    }
+  if (dev->reader_done == SANE_TRUE)
+    status = dev->reader_status;
+  pthread_mutex_unlock (&dev->reader_lock);
+
+  return status;
+}
+#endif /* HAVE_PTHREAD_H */
+
 /* this function does the effective data read in a manner that suits 
    the scanner. It does data reordering and resizing if need.  
    It also manages EOF and I/O errors, and line distance correction.
@@ -4874,7 +5687,12 @@ Problems with the first approach:
   total_bytes_to_read and total_bytes_read help in that case.
  */
 
-  status = genesys_fill_read_buffer (dev);
+#ifdef HAVE_PTHREAD_H
+  if (dev->reader_running == SANE_TRUE)
+    status = genesys_wait_read_buffer (dev);
+  else
+#endif
+    status = genesys_fill_read_buffer (dev, dev->read_buffer.size);
 
   if (status != SANE_STATUS_GOOD)
     {
@@ -5188,10 +6006,22 @@ Problems with the first approach:
   dev->total_bytes_read += *len;
 
   RIE (sanei_genesys_buffer_consume (src_buffer, bytes));
+
+#ifdef HAVE_PTHREAD_H
+  /* let the reader know about the room we made in read_buffer */
+  if (dev->reader_running == SANE_TRUE)
+    {
+      dev->reader_seen = dev->read_buffer.avail;
+      genesys_reader_wake (dev);
+    }
+#endif
   
   /* end scan if all needed data have been read */
    if(dev->total_bytes_read >= dev->total_bytes_to_read)
     {
+#ifdef HAVE_PTHREAD_H
+      genesys_stop_reader (dev);
+#endif
       dev->model->cmd_set->end_scan (dev, dev->reg, SANE_TRUE);
       if (dev->model->is_sheetfed == SANE_TRUE)
         {
@@ -6159,7 +6989,7 @@ attach_one_device (SANE_String_Const devname)
 static SANE_Status
 config_attach_genesys (SANEI_Config * config, const char *devname)
 {
-  /* no options yet for this backend */
+  /* the only option, readahead, is global and already stored */
   config = config;
 
   /* the devname has been processed and is ready to be used 
@@ -6178,6 +7008,9 @@ SANE_Status
 probe_genesys_devices (void)
 {
   SANEI_Config config;
+  SANE_Option_Descriptor readahead_opt;
+  SANE_Option_Descriptor *options[1];
+  void *values[1];
   SANE_Status status;
 
   DBGSTART;
@@ -6186,10 +7019,21 @@ probe_genesys_devices (void)
   new_dev_len = 0;
   new_dev_alloced = 0;
 
-  /* set configuration options structure : no option for this backend */
-  config.descriptors = NULL;
-  config.values = NULL;
-  config.count = 0;
+  /* set configuration options structure */
+  memset (&readahead_opt, 0, sizeof (readahead_opt));
+  readahead_opt.name = "readahead";
+  readahead_opt.desc = "size in MB of the background read buffer";
+  readahead_opt.type = SANE_TYPE_INT;
+  readahead_opt.unit = SANE_UNIT_NONE;
+  readahead_opt.size = sizeof (SANE_Word);
+  readahead_opt.cap = SANE_CAP_SOFT_SELECT;
+  readahead_opt.constraint_type = SANE_CONSTRAINT_RANGE;
+  readahead_opt.constraint.range = &readahead_range;
+  options[0] = &readahead_opt;
+  values[0] = &read_ahead_mb;
+  config.descriptors = options;
+  config.values = values;
+  config.count = 1;
 
   /* generic configure and attach function */
   status = sanei_configure_attach (GENESYS_CONFIG_FILE, &config,
@@ -6206,176 +7050,6 @@ probe_genesys_devices (void)
   return status;
 }
 
-/**
- * This should be changed if one of the substructures of 
-   Genesys_Calibration_Cache change, but it must be changed if there are
-   changes that don't change size -- at least for now, as we store most 
-   of Genesys_Calibration_Cache as is.
-*/
-#define CALIBRATION_VERSION 1
-
-/**
- * reads previously cached calibration data
- * from file
- */
-SANE_Status
-sanei_genesys_read_calibration (Genesys_Device * dev)
-{
-  FILE *fp;
-  uint8_t vers = 0;
-  uint32_t size = 0;
-  struct Genesys_Calibration_Cache *cache;
-  SANE_Status status=SANE_STATUS_GOOD;
-
-  DBGSTART;
-  fp = fopen (dev->calib_file, "rb");
-  if (!fp)
-    {
-      DBG (DBG_info, "Calibration: Cannot open %s\n", dev->calib_file);
-      DBGCOMPLETED;
-      return SANE_STATUS_IO_ERROR;
-    }
-
-  /* these two checks ensure that most bad things cannot happen */
-  fread (&vers, 1, 1, fp);
-  if (vers != CALIBRATION_VERSION)
-    {
-      DBG (DBG_info, "Calibration: Bad version\n");
-      fclose (fp);
-      DBGCOMPLETED;
-      return SANE_STATUS_INVAL;
-    }
-  fread (&size, 4, 1, fp);
-  if (size != sizeof (struct Genesys_Calibration_Cache))
-    {
-      DBG (DBG_info,
-	   "Calibration: Size of calibration cache struct differs\n");
-      fclose (fp);
-      DBGCOMPLETED;
-      return SANE_STATUS_INVAL;
-    }
-
-  while (!feof (fp) && status==SANE_STATUS_GOOD)
-    {
-      DBG (DBG_info, "sanei_genesys_read_calibration: reading one record\n");
-      cache = (struct Genesys_Calibration_Cache *) malloc (sizeof (*cache));
-
-      if (!cache)
-	{
-	  DBG (DBG_error,
-	       "sanei_genesys_read_calibration: could not allocate cache struct\n");
-	  break;
-	}
-
-#define BILT1( x )							\
-      do								\
-	{								\
-	  if ((x) < 1)							\
-	    {								\
-	      free(cache);						\
-	      DBG (DBG_warn, "sanei_genesys_read_calibration: partial calibration record\n"); \
-              status=SANE_STATUS_EOF;                                   \
-	      break;							\
-	    }								\
-	} while(0)
-
-
-      if (fread (&cache->used_setup, sizeof (cache->used_setup), 1, fp) < 1)
-	{			/* eof is only detected here */
-	  free (cache);
-          status=SANE_STATUS_GOOD;
-	  break;
-	}
-      BILT1 (fread (&cache->last_calibration, sizeof (cache->last_calibration), 1, fp));
-      BILT1 (fread (&cache->frontend, sizeof (cache->frontend), 1, fp));
-      /* the gamma (and later) fields are not stored */
-      BILT1 (fread (&cache->sensor, offsetof (Genesys_Sensor, red_gamma), 1, fp));
-      BILT1 (fread (&cache->calib_pixels, sizeof (cache->calib_pixels), 1, fp));
-      BILT1 (fread (&cache->calib_channels, sizeof (cache->calib_channels), 1, fp));
-      BILT1 (fread (&cache->average_size, sizeof (cache->average_size), 1, fp));
-
-      cache->white_average_data = (uint8_t *) malloc (cache->average_size);
-      cache->dark_average_data = (uint8_t *) malloc (cache->average_size);
-
-      if (!cache->white_average_data || !cache->dark_average_data)
-	{
-          status=SANE_STATUS_NO_MEM;
-	  FREE_IFNOT_NULL (cache->white_average_data);
-	  FREE_IFNOT_NULL (cache->dark_average_data);
-	  free (cache);
-	  DBG (DBG_error,
-	       "sanei_genesys_read_calibration: could not allocate space for average data\n");
-	  break;
-	}
-
-      if (fread (cache->white_average_data, cache->average_size, 1, fp) < 1)
-	{
-          status=SANE_STATUS_EOF;
-	  DBG (DBG_warn, "sanei_genesys_read_calibration: partial calibration record\n");
-	  free (cache->white_average_data);
-	  free (cache->dark_average_data);
-	  free (cache);
-	  break;
-	}
-      if (fread (cache->dark_average_data, cache->average_size, 1, fp) < 1)
-	{
-	  DBG (DBG_warn, "sanei_genesys_read_calibration: partial calibration record\n");
-	  free (cache->white_average_data);
-	  free (cache->dark_average_data);
-	  free (cache);
-          status=SANE_STATUS_EOF;
-	  break;
-	}
-#undef BILT1
-      DBG (DBG_info, "sanei_genesys_read_calibration: adding record to list\n");
-      cache->next = dev->calibration_cache;
-      dev->calibration_cache = cache;
-    }
-
-  fclose (fp);
-  DBGCOMPLETED;
-  return status;
-}
-
-static void
-write_calibration (Genesys_Device * dev)
-{
-  FILE *fp;
-  uint8_t vers = 0;
-  uint32_t size = 0;
-  struct Genesys_Calibration_Cache *cache;
-
-  DBGSTART;
-  fp = fopen (dev->calib_file, "wb");
-  if (!fp)
-    {
-      DBG (DBG_info, "write_calibration: Cannot open %s for writing\n", dev->calib_file);
-      return;
-    }
-
-  vers = CALIBRATION_VERSION;
-  fwrite (&vers, 1, 1, fp);
-  size = sizeof (struct Genesys_Calibration_Cache);
-  fwrite (&size, 4, 1, fp);
-
-  for (cache = dev->calibration_cache; cache; cache = cache->next)
-    {
-      fwrite (&cache->used_setup, sizeof (cache->used_setup), 1, fp);
-      fwrite (&cache->last_calibration, sizeof (cache->last_calibration), 1, fp);
-      fwrite (&cache->frontend, sizeof (cache->frontend), 1, fp);
-      /* the gamma (and later) fields are not stored */
-      fwrite (&cache->sensor, offsetof (Genesys_Sensor, red_gamma), 1, fp);
-
-      fwrite (&cache->calib_pixels, sizeof (cache->calib_pixels), 1, fp);
-      fwrite (&cache->calib_channels, sizeof (cache->calib_channels), 1, fp);
-      fwrite (&cache->average_size, sizeof (cache->average_size), 1, fp);
-      fwrite (cache->white_average_data, cache->average_size, 1, fp);
-      fwrite (cache->dark_average_data, cache->average_size, 1, fp);
-    }
-  DBGCOMPLETED;
-  fclose (fp);
-}
-
 /** @brief buffer scanned picture
  * In order to allow digital processing, we must be able to put all the
  * scanned picture in a buffer.
@@ -6765,6 +7439,8 @@ sane_open (SANE_String_Const devicename, SANE_Handle * handle)
   s->dev->white_average_data = NULL;
   s->dev->dark_average_data = NULL;
   s->dev->calibration_cache = NULL;
+  s->dev->calib_map = NULL;
+  s->dev->calib_map_size = 0;
   s->dev->calib_file = NULL;
   s->dev->img_buffer = NULL;
   s->dev->line_interp = 0;
@@ -6772,6 +7448,10 @@ sane_open (SANE_String_Const devicename, SANE_Handle * handle)
   s->dev->segnb = 0;
   s->dev->oe_buffer.buffer=NULL;
   s->dev->binary=NULL;
+#ifdef HAVE_PTHREAD_H
+  s->dev->reader_running = SANE_FALSE;
+  s->dev->non_blocking = SANE_FALSE;
+#endif
 
   /* insert newly opened handle into list of open handles: */
   s->next = first_handle;
@@ -6834,7 +7514,6 @@ void
 sane_close (SANE_Handle handle)
 {
   Genesys_Scanner *prev, *s;
-  Genesys_Calibration_Cache *cache, *next_cache;
   SANE_Status status;
   SANE_Range *range;
 
@@ -6854,6 +7533,10 @@ sane_close (SANE_Handle handle)
       return;			/* oops, not a handle we know about */
     }
 
+#ifdef HAVE_PTHREAD_H
+  genesys_stop_reader (s->dev);
+#endif
+
   /* eject document for sheetfed scanners */
   if (s->dev->model->is_sheetfed == SANE_TRUE)
     {
@@ -6877,14 +7560,7 @@ sane_close (SANE_Handle handle)
     
   /* here is the place to store calibration cache */
   write_calibration (s->dev);
-
-  for (cache = s->dev->calibration_cache; cache; cache = next_cache)
-    {
-      next_cache = cache->next;
-      free (cache->dark_average_data);
-      free (cache->white_average_data);
-      free (cache);
-    }
+  genesys_free_calibration_cache (s->dev);
 
   sanei_genesys_buffer_free (&(s->dev->read_buffer));
   sanei_genesys_buffer_free (&(s->dev->lines_buffer));
@@ -7052,7 +7728,12 @@ get_option_value (Genesys_Scanner * s, int option, void *val)
     case OPT_PAGE_LOADED_SW:
     case OPT_OCR_SW:
     case OPT_POWER_SW:
-      RIE (s->dev->model->cmd_set->update_hardware_sensors (s));
+#ifdef HAVE_PTHREAD_H
+      /* the background reader is the only one talking to the scanner
+       * during a scan, so give the last values read instead */
+      if (s->dev->reader_running == SANE_FALSE)
+#endif
+	RIE (s->dev->model->cmd_set->update_hardware_sensors (s));
       *(SANE_Bool *) val = s->val[option].b;
       s->last_val[option].b = *(SANE_Bool *) val;
       break;
@@ -7060,6 +7741,7 @@ get_option_value (Genesys_Scanner * s, int option, void *val)
       /* scanner needs calibration for current mode unless a matching
        * calibration cache is found */
       *(SANE_Bool *) val = SANE_TRUE;
+      genesys_refresh_calibration (s->dev);
       for (cache = s->dev->calibration_cache; cache; cache = cache->next)
 	{
 	  if (s->dev->model->
@@ -7087,7 +7769,6 @@ set_option_value (Genesys_Scanner * s, int option, void *val,
   SANE_Word *table;
   unsigned int i;
   SANE_Range *x_range, *y_range;
-  Genesys_Calibration_Cache *cache, *next_cache;
 
   switch (option)
     {
@@ -7373,17 +8054,7 @@ set_option_value (Genesys_Scanner * s, int option, void *val,
       break;
     case OPT_CLEAR_CALIBRATION:
       /* clear calibration cache */
-      if (s->dev->calibration_cache != NULL)
-	{
-	  for (cache = s->dev->calibration_cache; cache; cache = next_cache)
-	    {
-	      next_cache = cache->next;
-	      free (cache->dark_average_data);
-	      free (cache->white_average_data);
-	      free (cache);
-	    }
-	}
-      s->dev->calibration_cache = NULL;
+      genesys_free_calibration_cache (s->dev);
       /* remove file */
       unlink (s->dev->calib_file);
       /* signals that sensors will have to be read again */
@@ -7549,7 +8220,14 @@ sane_start (SANE_Handle handle)
      parameters will be overwritten below, but that's OK.  */
 
   RIE (calc_parameters (s));
+#ifdef HAVE_PTHREAD_H
+  /* reader of the previous page may still be around */
+  genesys_stop_reader (s->dev);
+#endif
   RIE (genesys_start_scan (s->dev, s->val[OPT_LAMP_OFF].w));
+#ifdef HAVE_PTHREAD_H
+  RIE (genesys_start_reader (s->dev, (size_t) read_ahead_mb * 1024 * 1024));
+#endif
 
   s->scanning = SANE_TRUE;
 
@@ -7750,6 +8428,11 @@ sane_cancel (SANE_Handle handle)
       s->dev->binary=NULL;
     }
 
+#ifdef HAVE_PTHREAD_H
+  /* the reader must be done with USB before we end the scan */
+  genesys_stop_reader (s->dev);
+#endif
+
   s->scanning = SANE_FALSE;
   s->dev->read_active = SANE_FALSE;
   if(s->dev->img_buffer!=NULL)
@@ -7824,6 +8507,14 @@ sane_set_io_mode (SANE_Handle handle, SANE_Bool non_blocking)
       DBG (DBG_error, "sane_set_io_mode: not scanning\n");
       return SANE_STATUS_INVAL;
     }
+#ifdef HAVE_PTHREAD_H
+  /* only the background reader allows to return without data */
+  if (s->dev->reader_running == SANE_TRUE)
+    {
+      s->dev->non_blocking = non_blocking;
+      return SANE_STATUS_GOOD;
+    }
+#endif
   if (non_blocking)
     return SANE_STATUS_UNSUPPORTED;
   return SANE_STATUS_GOOD;
@@ -7842,6 +8533,14 @@ sane_get_select_fd (SANE_Handle handle, SANE_Int * fd)
       DBG (DBG_error, "sane_get_select_fd: not scanning\n");
       return SANE_STATUS_INVAL;
     }
+#ifdef HAVE_PTHREAD_H
+  /* readable when the reader has stored new data or is done */
+  if (s->dev->reader_running == SANE_TRUE)
+    {
+      *fd = s->dev->reader_pipe[0];
+      return SANE_STATUS_GOOD;
+    }
+#endif
   return SANE_STATUS_UNSUPPORTED;
 }
 
@@ -52,48 +52,20 @@ FUNC_NAME(genesys_reorder_components_cis) (
     unsigned int lines, 
     unsigned int pixels) 
 {
-    unsigned int x, y;
-    uint8_t *src[3];
+    unsigned int y;
+    uint8_t *src = src_data;
     uint8_t *dst = dst_data;
-    unsigned int rest = pixels * 2 * BYTES_PER_COMPONENT;
-
-    src[0] = src_data + pixels * BYTES_PER_COMPONENT * 0;
-    src[1] = src_data + pixels * BYTES_PER_COMPONENT * 1;
-    src[2] = src_data + pixels * BYTES_PER_COMPONENT * 2;
+    unsigned int plane = pixels * BYTES_PER_COMPONENT;
 
     for(y = 0; y < lines; y++) {
-	for(x = 0; x < pixels; x++) {
-
-#ifndef DOUBLE_BYTE
-	    *dst++ = *src[0]++;
-	    *dst++ = *src[1]++;
-	    *dst++ = *src[2]++;
-#else
-#  ifndef WORDS_BIGENDIAN
-	    *dst++ = *src[0]++;
-	    *dst++ = *src[0]++;
-	    *dst++ = *src[1]++;
-	    *dst++ = *src[1]++;
-	    *dst++ = *src[2]++;
-	    *dst++ = *src[2]++;
-#  else
-	    *dst++ = src[0][1];
-	    *dst++ = src[0][0];
-	    *dst++ = src[1][1];
-	    *dst++ = src[1][0];
-	    *dst++ = src[2][1];
-	    *dst++ = src[2][0];
-	    src[0] += 2;
-	    src[1] += 2;
-	    src[2] += 2;
-#  endif
-#endif
-	}
-
-	src[0] += rest;
-	src[1] += rest;
-	src[2] += rest;
+	sanei_reorder_interleave3 (dst, src, src + plane, src + 2 * plane,
+				   pixels, BYTES_PER_COMPONENT);
+	src += 3 * plane;
+	dst += 3 * plane;
     }
+#if defined(DOUBLE_BYTE) && defined(WORDS_BIGENDIAN)
+    sanei_swap16 (dst_data, dst_data, lines * pixels * 3);
+#endif
     return SANE_STATUS_GOOD;
 }
 
@@ -104,47 +76,20 @@ FUNC_NAME(genesys_reorder_components_cis_bgr) (
     unsigned int lines, 
     unsigned int pixels) 
 {
-    unsigned int x, y;
-    uint8_t *src[3];
+    unsigned int y;
+    uint8_t *src = src_data;
     uint8_t *dst = dst_data;
-    unsigned int rest = pixels * 2 * BYTES_PER_COMPONENT;
-
-    src[0] = src_data + pixels * BYTES_PER_COMPONENT * 0;
-    src[1] = src_data + pixels * BYTES_PER_COMPONENT * 1;
-    src[2] = src_data + pixels * BYTES_PER_COMPONENT * 2;
+    unsigned int plane = pixels * BYTES_PER_COMPONENT;
 
     for(y = 0; y < lines; y++) {
-	for(x = 0; x < pixels; x++) {
-#ifndef DOUBLE_BYTE
-	    *dst++ = *src[2]++;
-	    *dst++ = *src[1]++;
-	    *dst++ = *src[0]++;
-#else
-#  ifndef WORDS_BIGENDIAN
-	    *dst++ = *src[2]++;
-	    *dst++ = *src[2]++;
-	    *dst++ = *src[1]++;
-	    *dst++ = *src[1]++;
-	    *dst++ = *src[0]++;
-	    *dst++ = *src[0]++;
-#  else
-	    *dst++ = src[2][1];
-	    *dst++ = src[2][0];
-	    *dst++ = src[1][1];
-	    *dst++ = src[1][0];
-	    *dst++ = src[0][1];
-	    *dst++ = src[0][0];
-	    src[0] += 2;
-	    src[1] += 2;
-	    src[2] += 2;
-#  endif
-#endif
-	}
-
-	src[0] += rest;
-	src[1] += rest;
-	src[2] += rest;
+	sanei_reorder_interleave3 (dst, src + 2 * plane, src + plane, src,
+				   pixels, BYTES_PER_COMPONENT);
+	src += 3 * plane;
+	dst += 3 * plane;
     }
+#if defined(DOUBLE_BYTE) && defined(WORDS_BIGENDIAN)
+    sanei_swap16 (dst_data, dst_data, lines * pixels * 3);
+#endif
     return SANE_STATUS_GOOD;
 }
 
@@ -155,37 +100,11 @@ FUNC_NAME(genesys_reorder_components_bgr) (
     unsigned int lines, 
     unsigned int pixels) 
 {
-    unsigned int c;
-    uint8_t *src = src_data;
-    uint8_t *dst = dst_data;
-
-    for(c = 0; c < lines * pixels; c++) {
-
-#ifndef DOUBLE_BYTE
-	*dst++ = src[2];
-	*dst++ = src[1];
-	*dst++ = src[0];
-	src += 3;
-#else
-#  ifndef WORDS_BIGENDIAN
-	*dst++ = src[2 * 2 + 0];
-	*dst++ = src[2 * 2 + 1];
-	*dst++ = src[1 * 2 + 0];
-	*dst++ = src[1 * 2 + 1];
-	*dst++ = src[0 * 2 + 0];
-	*dst++ = src[0 * 2 + 1];
-#  else
-	*dst++ = src[2 * 2 + 1];
-	*dst++ = src[2 * 2 + 0];
-	*dst++ = src[1 * 2 + 1];
-	*dst++ = src[1 * 2 + 0];
-	*dst++ = src[0 * 2 + 1];
-	*dst++ = src[0 * 2 + 0];
-#  endif
-	src += 3 * 2;
+    sanei_reorder_reverse3 (dst_data, src_data, lines * pixels,
+			    BYTES_PER_COMPONENT);
+#if defined(DOUBLE_BYTE) && defined(WORDS_BIGENDIAN)
+    sanei_swap16 (dst_data, dst_data, lines * pixels * 3);
 #endif
-
-    }
     return SANE_STATUS_GOOD;
 }
 
@@ -198,16 +117,8 @@ FUNC_NAME(genesys_reorder_components_endian) (
     unsigned int pixels,
     unsigned int channels) 
 {
-    unsigned int c;
-    uint8_t *src = src_data;
-    uint8_t *dst = dst_data;
-
-    for(c = 0; c < lines * pixels * channels; c++) {
-	*dst++ = src[1];
-	*dst++ = src[0];
-	src += 2;
-    }
-return SANE_STATUS_GOOD;
+    sanei_swap16 (dst_data, src_data, lines * pixels * channels);
+    return SANE_STATUS_GOOD;
 }
 #endif /*defined(DOUBLE_BYTE) && defined(WORDS_BIGENDIAN)*/
 
@@ -233,6 +144,21 @@ FUNC_NAME(genesys_reverse_ccd) (
     for (c = 0; c < component_count; c++) 
 	ccd_shift_pitch[c] = ccd_shift[c] * pitch;
 
+/* 
+ * lines hold whole pixels, so the component order is the same on every
+ * line and the whole block can be merged at once; the read buffer keeps
+ * max_shift extra lines behind it for the displaced components.
+ */
+    if (pitch % component_count == 0) {
+	size_t offsets[12];
+
+	for (c = 0; c < component_count; c++) 
+	    offsets[c] = ccd_shift_pitch[c];
+	sanei_reorder_stagger (dst_data, src_data, (size_t) lines * pitch,
+			       offsets, component_count, BYTES_PER_COMPONENT);
+	return SANE_STATUS_GOOD;
+    }
+
 /*
  * cache efficiency:
    we are processing a single line component_count times, so it should fit
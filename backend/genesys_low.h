@@ -71,6 +71,9 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei.h"
@@ -78,6 +81,8 @@
 
 #include "../include/sane/sanei_backend.h"
 #include "../include/sane/sanei_usb.h"
+#include "../include/sane/sanei_swap.h"
+#include "../include/sane/sanei_reorder.h"
 
 #include "../include/_stdint.h"
 
@@ -628,6 +633,8 @@ typedef struct Genesys_Buffer
   size_t size;
   size_t pos;	/* current position in read buffer */
   size_t avail;	/* data bytes currently in buffer */
+  size_t wpos;	/* current write position, ring buffers only */
+  size_t ring;	/* size of one copy of a mirrored mapping, 0 if none */
 } Genesys_Buffer;
 
 struct Genesys_Calibration_Cache
@@ -643,6 +650,7 @@ struct Genesys_Calibration_Cache
   size_t average_size;
   uint8_t *white_average_data;
   uint8_t *dark_average_data;
+  SANE_Bool mapped;	/* average data points into the mapped cache file */
 
   struct Genesys_Calibration_Cache *next;
 };
@@ -701,6 +709,20 @@ struct Genesys_Device
 
   size_t read_bytes_left;	/**> bytes to read from scanner */
 
+#ifdef HAVE_PTHREAD_H
+  /* background reader filling read_buffer during a scan */
+  pthread_t reader;
+  pthread_mutex_t reader_lock;
+  pthread_cond_t reader_cond;	/**> signals data produced or consumed */
+  int reader_pipe[2];		/**> select fd given to the frontend */
+  SANE_Bool reader_running;	/**> thread started and not yet joined */
+  SANE_Bool reader_done;	/**> set by the thread when it exits */
+  SANE_Bool reader_cancel;	/**> asks the thread to stop */
+  SANE_Status reader_status;	/**> status the thread exited with */
+  size_t reader_seen;		/**> read_buffer bytes left by last read */
+  SANE_Bool non_blocking;	/**> sane_read must not wait for data */
+#endif
+
   size_t total_bytes_read;	/**> total bytes read sent to frontend */
   size_t total_bytes_to_read;	/**> total bytes read to be sent to frontend */
   size_t wpl;			/**> asic's word per line */
@@ -711,6 +733,10 @@ struct Genesys_Device
   unsigned char lineart_lut[256];
 
   Genesys_Calibration_Cache *calibration_cache;
+  void *calib_map;		/**> mapping of the calibration cache file */
+  size_t calib_map_size;
+  ino_t calib_ino;		/**> identity of the mapped file, to detect */
+  time_t calib_mtime;		/**> updates made by other processes */
 
   struct Genesys_Device *next;
 
@@ -61,6 +61,8 @@ sane_init (SANE_Int * version_code,
   /* Initialize USB */
   sanei_usb_init ();
 
+  sanei_magic_init ();
+
   status = kv_enum_devices ();
   if (status)
     return status;
@@ -332,38 +334,16 @@ sane_start (SANE_Handle handle)
   /* at this point, we are only looking at the front image */
   /* of simplex or duplex data, back side has already exited */
   /* so, we do both sides now, if required */
-  if (dev->val[OPT_SWDESKEW].w){
-    buffer_deskew(dev,SIDE_FRONT);
-  }
-  if (dev->val[OPT_SWCROP].w){
-    buffer_crop(dev,SIDE_FRONT);
-  }
-  if (dev->val[OPT_SWDESPECK].w){
-    buffer_despeck(dev,SIDE_FRONT);
-  }
-  if (dev->val[OPT_SWDEROTATE].w || dev->val[OPT_ROTATE].w){
-    buffer_rotate(dev,SIDE_FRONT);
-  }
+  buffer_process (dev, SIDE_FRONT);
 
-  if (IS_DUPLEX (dev)){
-    if (dev->val[OPT_SWDESKEW].w){
-      buffer_deskew(dev,SIDE_BACK);
-    }
-    if (dev->val[OPT_SWCROP].w){
-      buffer_crop(dev,SIDE_BACK);
-    }
-    if (dev->val[OPT_SWDESPECK].w){
-      buffer_despeck(dev,SIDE_BACK);
-    }
-    if (dev->val[OPT_SWDEROTATE].w || dev->val[OPT_ROTATE].w){
-      buffer_rotate(dev,SIDE_BACK);
-    }
-  }
+  if (IS_DUPLEX (dev))
+    buffer_process (dev, SIDE_BACK);
 
   cleanup:
 
   /* check if we need to skip this page */
-  if (dev->val[OPT_SWSKIP].w && buffer_isblank(dev,dev->current_side)){
+  if (dev->val[OPT_SWSKIP].w
+      && dev->magic[dev->current_side == SIDE_FRONT ? 0 : 1].isBlank){
     DBG (DBG_proc, "sane_start: blank page, recurse\n");
     return sane_start(handle);
   }
@@ -9,6 +9,7 @@
 #define __KVS1025_LOW_H
 
 #include "kvs1025_cmds.h"
+#include "../include/sane/sanei_magic.h"
 
 #define VENDOR_ID       0x04DA
 
@@ -191,12 +192,8 @@ typedef struct kv_scanner_dev
 
   /* --------------------------------------------------------------------- */
   /* values used by the software enhancment code (deskew, crop, etc)       */
-  SANE_Status deskew_stat;
-  int deskew_vals[2];
-  double deskew_slope;
-
-  SANE_Status crop_stat;
-  int crop_vals[4];
+  SANEI_Magic_Page magic[2];
+  SANEI_Magic_Arena *magic_arena;
 
   /* Support info */
   KV_SUPPORT_INFO support_info;
@@ -281,10 +278,6 @@ SANE_Status ReadImageDataSimplex (PKV_DEV dev, int page);
 SANE_Status ReadImageDataDuplex (PKV_DEV dev, int page);
 SANE_Status ReadImageData (PKV_DEV dev, int page);
 
-SANE_Status buffer_deskew (PKV_DEV dev, int side);
-SANE_Status buffer_crop (PKV_DEV dev, int side);
-SANE_Status buffer_despeck (PKV_DEV dev, int side);
-int buffer_isblank (PKV_DEV dev, int side);
-SANE_Status buffer_rotate(PKV_DEV dev, int side);
+SANE_Status buffer_process (PKV_DEV dev, int side);
 
 #endif /* #ifndef __KVS1025_LOW_H */
@@ -63,6 +63,10 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <time.h>
 
 #include <netinet/in.h>
 #include <netdb.h> /* OS/2 needs this _after_ <netinet/in.h>, grrr... */
@@ -86,6 +90,7 @@ static AvahiServiceBrowser *avahi_browser = NULL;
 #include "../include/sane/sanei.h"
 #include "../include/sane/sanei_net.h"
 #include "../include/sane/sanei_codec_bin.h"
+#include "../include/sane/sanei_swap.h"
 #include "net.h"
 
 #define BACKEND_NAME    net
@@ -122,28 +127,17 @@ static int client_big_endian; /* 1 == big endian; 0 == little endian */
 static int server_big_endian; /* 1 == big endian; 0 == little endian */
 static int depth; /* bits per pixel */
 static int connect_timeout = -1; /* timeout for connection to saned */
+static int device_list_ttl = 0; /* seconds to reuse the device list */
+static time_t devlist_time; /* when devlist was built */
 
 #ifndef NET_USES_AF_INDEP
 static int saned_port;
 #endif /* !NET_USES_AF_INDEP */
 
-/* This variable is only needed, if the depth is 16bit/channel and
-   client/server have different endianness.  A value of -1 means, that there's
-   no hang over; otherwise the value has to be casted to SANE_Byte.  hang_over
-   means, that there is a remaining byte from a previous call to sane_read,
-   which could not be byte-swapped, e.g. because the frontend requested an odd
-   number of bytes.
-*/
-static int hang_over;
-
-/* This variable is only needed, if the depth is 16bit/channel and
-   client/server have different endianness.  A value of -1 means, that there's
-   no left over; otherwise the value has to be casted to SANE_Byte.  left_over
-   means, that there is a remaining byte from a previous call to sane_read,
-   which already is in the the correct byte order, but could not be returned,
-   e.g.  because the frontend requested only one byte per call.
-*/
-static int left_over;
+/* Only needed if the depth is 16bit/channel and client/server have
+   different endianness: a sample may be split between two reads, so
+   sane_read () holds back the odd byte until its partner arrives.  */
+static SANEI_Swap16_Stream swap_stream;
 
 
 #ifdef NET_USES_AF_INDEP
@@ -314,23 +308,146 @@ add_device (const char *name, Net_Device ** ndp)
 #endif /* NET_USES_AF_INDEP */
 
 
-#ifdef NET_USES_AF_INDEP
-static SANE_Status
-connect_dev (Net_Device * dev)
+/* Prepare the freshly connected control socket of DEV and send the
+   SANE_NET_INIT request.  The reply is collected by init_reply (), so
+   requests to several hosts can be in flight at the same time.  */
+static void
+init_request (Net_Device * dev)
 {
-  struct addrinfo *addrp;
-
-  SANE_Word version_code;
-  SANE_Init_Reply reply;
-  SANE_Status status = SANE_STATUS_IO_ERROR;
   SANE_Init_Req req;
-  SANE_Bool connected = SANE_FALSE;
 #ifdef TCP_NODELAY
   int on = 1;
   int level = -1;
 #endif
   struct timeval tv;
 
+  /* We're connected now, so reset SO_SNDTIMEO to the default value of 0 */
+  if (connect_timeout > 0)
+    {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+
+      if (setsockopt (dev->ctl, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+	{
+	  DBG (1, "init_request: failed to reset SO_SNDTIMEO (%s)\n", strerror (errno));
+	}
+    }
+
+#ifdef TCP_NODELAY
+# ifdef SOL_TCP
+  level = SOL_TCP;
+# else /* !SOL_TCP */
+  /* Look up the protocol level in the protocols database. */
+  {
+    struct protoent *p;
+    p = getprotobyname ("tcp");
+    if (p == 0)
+      DBG (1, "init_request: cannot look up `tcp' protocol number");
+    else
+      level = p->p_proto;
+  }
+# endif	/* SOL_TCP */
+
+  if (level == -1 ||
+      setsockopt (dev->ctl, level, TCP_NODELAY, &on, sizeof (on)))
+    DBG (1, "init_request: failed to put send socket in TCP_NODELAY mode (%s)",
+	 strerror (errno));
+#endif /* !TCP_NODELAY */
+
+  DBG (2, "init_request: sanei_w_init\n");
+  sanei_w_init (&dev->wire, sanei_codec_bin_init);
+  dev->wire.io.fd = dev->ctl;
+  dev->wire.io.read = read;
+  dev->wire.io.write = write;
+
+  /* exchange version codes with the server: */
+  req.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
+					SANEI_NET_PROTOCOL_VERSION
+					| SANEI_NET_CAPS);
+  req.username = getlogin ();
+  DBG (2, "init_request: net_init (user=%s, local version=%d.%d.%d, "
+       "caps=0x%x)\n", req.username, V_MAJOR, V_MINOR,
+       SANEI_NET_PROTOCOL_VERSION, SANEI_NET_CAPS);
+  sanei_w_send (&dev->wire, SANE_NET_INIT,
+		(WireCodecFunc) sanei_w_init_req, &req);
+}
+
+static SANE_Status
+init_reply (Net_Device * dev)
+{
+  SANE_Word version_code;
+  SANE_Word protocol;
+  SANE_Init_Reply reply;
+  SANE_Status status;
+
+  sanei_w_receive (&dev->wire, (WireCodecFunc) sanei_w_init_reply, &reply);
+
+  if (dev->wire.status != 0)
+    {
+      DBG (1, "init_reply: argument marshalling error (%s)\n",
+	   strerror (dev->wire.status));
+      status = SANE_STATUS_IO_ERROR;
+      goto fail;
+    }
+
+  status = reply.status;
+  version_code = reply.version_code;
+  DBG (2, "init_reply: freeing init reply (status=%s, remote "
+       "version=%d.%d.%d)\n", sane_strstatus (status),
+       SANE_VERSION_MAJOR (version_code),
+       SANE_VERSION_MINOR (version_code), SANE_VERSION_BUILD (version_code));
+  sanei_w_free (&dev->wire, (WireCodecFunc) sanei_w_init_reply, &reply);
+
+  if (status != 0)
+    {
+      DBG (1, "init_reply: access to %s denied\n", dev->name);
+      goto fail;
+    }
+  if (SANE_VERSION_MAJOR (version_code) != V_MAJOR)
+    {
+      DBG (1, "init_reply: major version mismatch: got %d, expected %d\n",
+	   SANE_VERSION_MAJOR (version_code), V_MAJOR);
+      status = SANE_STATUS_IO_ERROR;
+      goto fail;
+    }
+  protocol = SANE_VERSION_BUILD (version_code) & SANEI_NET_PROTOCOL_MASK;
+  if (protocol != SANEI_NET_PROTOCOL_VERSION && protocol != 2)
+    {
+      DBG (1, "init_reply: network protocol version mismatch: "
+	   "got %d, expected %d\n", protocol, SANEI_NET_PROTOCOL_VERSION);
+      status = SANE_STATUS_IO_ERROR;
+      goto fail;
+    }
+  dev->wire.version = protocol;
+  /* old servers don't know about the capability bits and never set them */
+  dev->caps = SANE_VERSION_BUILD (version_code) & SANEI_NET_CAPS;
+  DBG (3, "init_reply: server capabilities 0x%x\n", dev->caps);
+  DBG (4, "init_reply: done\n");
+  return SANE_STATUS_GOOD;
+
+fail:
+  DBG (2, "init_reply: closing connection to %s\n", dev->name);
+  close (dev->ctl);
+  dev->ctl = -1;
+  return status;
+}
+
+
+static SANE_Status
+init_connection (Net_Device * dev)
+{
+  init_request (dev);
+  return init_reply (dev);
+}
+
+#ifdef NET_USES_AF_INDEP
+static SANE_Status
+connect_dev (Net_Device * dev)
+{
+  struct addrinfo *addrp;
+  SANE_Bool connected = SANE_FALSE;
+  struct timeval tv;
+
   int i;
 
   DBG (2, "connect_dev: trying to connect to %s\n", dev->name);
@@ -392,14 +509,6 @@ static SANE_Status
 connect_dev (Net_Device * dev)
 {
   struct sockaddr_in *sin;
-  SANE_Word version_code;
-  SANE_Init_Reply reply;
-  SANE_Status status = SANE_STATUS_IO_ERROR;
-  SANE_Init_Req req;
-#ifdef TCP_NODELAY
-  int on = 1;
-  int level = -1;
-#endif
   struct timeval tv;
 
   DBG (2, "connect_dev: trying to connect to %s\n", dev->name);
@@ -444,134 +553,335 @@ connect_dev (Net_Device * dev)
   DBG (3, "connect_dev: connection succeeded\n");
 #endif /* NET_USES_AF_INDEP */
 
-  /* We're connected now, so reset SO_SNDTIMEO to the default value of 0 */
-  if (connect_timeout > 0)
+  return init_connection (dev);
+}
+
+/* Host discovery.  sane_get_devices () used to connect to one host
+   after the other, so every host that is down cost a full connect
+   timeout.  connect_devs () starts a non-blocking connect to every
+   host that isn't connected yet and waits for all of them together,
+   so discovery takes at most one connect_timeout no matter how many
+   hosts are unreachable.  A DEADLINE of 0 means no time limit.  */
+
+static int
+start_nonblocking_connect (int fd, const struct sockaddr *addr,
+			   socklen_t addrlen)
+{
+  int flags;
+
+  flags = fcntl (fd, F_GETFL, 0);
+  if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) < 0)
     {
-      tv.tv_sec = 0;
-      tv.tv_usec = 0;
+      DBG (1, "start_nonblocking_connect: fcntl failed (%s)\n",
+	   strerror (errno));
+      return -1;
+    }
 
-      if (setsockopt (dev->ctl, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+  if (connect (fd, addr, addrlen) < 0 && errno != EINPROGRESS)
+    {
+      DBG (1, "start_nonblocking_connect: failed to connect (%s)\n",
+	   strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+#ifdef NET_USES_AF_INDEP
+/* Start connecting to the first usable address of DEV, or to the one
+   following dev->addr_used if FIRST is false.  */
+static int
+start_connect (Net_Device * dev, SANE_Bool first)
+{
+  struct addrinfo *addrp;
+  int fd;
+
+  addrp = first ? dev->addr : dev->addr_used->ai_next;
+  for (; addrp != NULL; addrp = addrp->ai_next)
+    {
+# ifdef ENABLE_IPV6
+      if ((addrp->ai_family != AF_INET) && (addrp->ai_family != AF_INET6))
+# else /* !ENABLE_IPV6 */
+      if (addrp->ai_family != AF_INET)
+# endif /* ENABLE_IPV6 */
+	continue;
+
+      fd = socket (addrp->ai_family, SOCK_STREAM, 0);
+      if (fd < 0)
 	{
-	  DBG (1, "connect_dev: failed to reset SO_SNDTIMEO (%s)\n", strerror (errno));
+	  DBG (1, "start_connect: failed to obtain socket (%s)\n",
+	       strerror (errno));
+	  continue;
 	}
+
+      dev->addr_used = addrp;
+      if (start_nonblocking_connect (fd, addrp->ai_addr,
+				     addrp->ai_addrlen) == 0)
+	return fd;
+      close (fd);
     }
+  return -1;
+}
 
-#ifdef TCP_NODELAY
-# ifdef SOL_TCP
-  level = SOL_TCP;
-# else /* !SOL_TCP */
-  /* Look up the protocol level in the protocols database. */
-  {
-    struct protoent *p;
-    p = getprotobyname ("tcp");
-    if (p == 0)
-      DBG (1, "connect_dev: cannot look up `tcp' protocol number");
-    else
-      level = p->p_proto;
-  }
-# endif	/* SOL_TCP */
+#else /* !NET_USES_AF_INDEP */
 
-  if (level == -1 ||
-      setsockopt (dev->ctl, level, TCP_NODELAY, &on, sizeof (on)))
-    DBG (1, "connect_dev: failed to put send socket in TCP_NODELAY mode (%s)",
+static int
+start_connect (Net_Device * dev, SANE_Bool first)
+{
+  struct sockaddr_in *sin;
+  int fd;
+
+  if (!first)
+    return -1;
+
+  if (dev->addr.sa_family != AF_INET)
+    {
+      DBG (1, "start_connect: don't know how to deal with addr family %d\n",
+	   dev->addr.sa_family);
+      return -1;
+    }
+
+  fd = socket (dev->addr.sa_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      DBG (1, "start_connect: failed to obtain socket (%s)\n",
+	   strerror (errno));
+      return -1;
+    }
+  sin = (struct sockaddr_in *) &dev->addr;
+  sin->sin_port = saned_port;
+
+  if (start_nonblocking_connect (fd, &dev->addr, sizeof (dev->addr)) == 0)
+    return fd;
+  close (fd);
+  return -1;
+}
+#endif /* NET_USES_AF_INDEP */
+
+/* A control connection with an open handle on it must never be
+   dropped because a discovery reply was late.  */
+static SANE_Bool
+dev_in_use (Net_Device * dev)
+{
+  Net_Scanner *s;
+
+  for (s = first_handle; s; s = s->next)
+    if (s->hw == dev)
+      return SANE_TRUE;
+  return SANE_FALSE;
+}
+
+/* Limit blocking reads on FD to the time left until DEADLINE; a
+   DEADLINE of 0 restores the default of no timeout.  */
+static void
+set_receive_deadline (int fd, time_t deadline)
+{
+  struct timeval tv;
+  time_t now;
+
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  if (deadline)
+    {
+      now = time (NULL);
+      if (deadline > now)
+	tv.tv_sec = deadline - now;
+      else
+	/* past the deadline: only pick up replies that are already
+	   on their way */
+	tv.tv_usec = 100000;
+    }
+
+  if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0)
+    DBG (1, "set_receive_deadline: failed to set SO_RCVTIMEO (%s)\n",
 	 strerror (errno));
-#endif /* !TCP_NODELAY */
+}
 
-  DBG (2, "connect_dev: sanei_w_init\n");
-  sanei_w_init (&dev->wire, sanei_codec_bin_init);
-  dev->wire.io.fd = dev->ctl;
-  dev->wire.io.read = read;
-  dev->wire.io.write = write;
+/* sanei_w_void takes no value, so it needs wrapping to be sent alone */
+static void
+w_void (Wire * w, void *unused)
+{
+  unused = unused;
+  sanei_w_void (w);
+}
 
-  /* exchange version codes with the server: */
-  req.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
-					SANEI_NET_PROTOCOL_VERSION);
-  req.username = getlogin ();
-  DBG (2, "connect_dev: net_init (user=%s, local version=%d.%d.%d)\n",
-       req.username, V_MAJOR, V_MINOR, SANEI_NET_PROTOCOL_VERSION);
-  sanei_w_call (&dev->wire, SANE_NET_INIT,
-		(WireCodecFunc) sanei_w_init_req, &req,
-		(WireCodecFunc) sanei_w_init_reply, &reply);
+static void
+connect_devs (time_t deadline)
+{
+  Net_Device *dev;
+  Net_Device **pending, **connected;
+  int *fds;
+  int num, num_pending, num_connected, i, fd, err, flags, maxfd;
+  socklen_t errlen;
+  fd_set wfds;
+  struct timeval tv;
+  time_t now;
 
-  if (dev->wire.status != 0)
+  for (num = 0, dev = first_device; dev; dev = dev->next)
+    if (dev->ctl < 0)
+      ++num;
+  if (num == 0)
+    return;
+
+  DBG (2, "connect_devs: connecting to %d host(s)\n", num);
+
+  pending = malloc (num * sizeof (pending[0]));
+  connected = malloc (num * sizeof (connected[0]));
+  fds = malloc (num * sizeof (fds[0]));
+  if (!pending || !connected || !fds)
     {
-      DBG (1, "connect_dev: argument marshalling error (%s)\n",
-	   strerror (dev->wire.status));
-      status = SANE_STATUS_IO_ERROR;
-      goto fail;
+      DBG (1, "connect_devs: not enough memory, connecting one by one\n");
+      if (pending)
+	free (pending);
+      if (connected)
+	free (connected);
+      if (fds)
+	free (fds);
+      for (dev = first_device; dev; dev = dev->next)
+	if (dev->ctl < 0)
+	  connect_dev (dev);
+      return;
     }
 
-  status = reply.status;
-  version_code = reply.version_code;
-  DBG (2, "connect_dev: freeing init reply (status=%s, remote "
-       "version=%d.%d.%d)\n", sane_strstatus (status),
-       SANE_VERSION_MAJOR (version_code),
-       SANE_VERSION_MINOR (version_code), SANE_VERSION_BUILD (version_code));
-  sanei_w_free (&dev->wire, (WireCodecFunc) sanei_w_init_reply, &reply);
+  num_pending = 0;
+  num_connected = 0;
+  for (dev = first_device; dev; dev = dev->next)
+    {
+      if (dev->ctl >= 0)
+	continue;
+      fd = start_connect (dev, SANE_TRUE);
+      if (fd < 0)
+	{
+	  DBG (1, "connect_devs: couldn't connect to %s\n", dev->name);
+	  continue;
+	}
+      pending[num_pending] = dev;
+      fds[num_pending] = fd;
+      ++num_pending;
+    }
 
-  if (status != 0)
+  while (num_pending > 0)
     {
-      DBG (1, "connect_dev: access to %s denied\n", dev->name);
-      goto fail;
+      if (deadline)
+	{
+	  now = time (NULL);
+	  if (now >= deadline)
+	    break;
+	  tv.tv_sec = deadline - now;
+	  tv.tv_usec = 0;
+	}
+
+      FD_ZERO (&wfds);
+      maxfd = -1;
+      for (i = 0; i < num_pending; ++i)
+	{
+	  FD_SET (fds[i], &wfds);
+	  if (fds[i] > maxfd)
+	    maxfd = fds[i];
+	}
+
+      if (select (maxfd + 1, NULL, &wfds, NULL, deadline ? &tv : NULL) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  DBG (1, "connect_devs: select failed (%s)\n", strerror (errno));
+	  break;
+	}
+
+      for (i = 0; i < num_pending;)
+	{
+	  if (!FD_ISSET (fds[i], &wfds))
+	    {
+	      ++i;
+	      continue;
+	    }
+
+	  dev = pending[i];
+	  errlen = sizeof (err);
+	  if (getsockopt (fds[i], SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+	    err = errno;
+
+	  if (err == 0)
+	    {
+	      DBG (3, "connect_devs: connected to %s\n", dev->name);
+	      flags = fcntl (fds[i], F_GETFL, 0);
+	      if (flags >= 0)
+		fcntl (fds[i], F_SETFL, flags & ~O_NONBLOCK);
+	      dev->ctl = fds[i];
+	      /* get the SANE_NET_INIT request on its way right away */
+	      init_request (dev);
+	      connected[num_connected++] = dev;
+	    }
+	  else
+	    {
+	      DBG (1, "connect_devs: failed to connect to %s (%s)\n",
+		   dev->name, strerror (err));
+	      close (fds[i]);
+	      fd = start_connect (dev, SANE_FALSE);
+	      if (fd >= 0)
+		{
+		  /* try the next address in the next round */
+		  fds[i++] = fd;
+		  continue;
+		}
+	    }
+
+	  --num_pending;
+	  pending[i] = pending[num_pending];
+	  fds[i] = fds[num_pending];
+	}
     }
-  if (SANE_VERSION_MAJOR (version_code) != V_MAJOR)
+
+  for (i = 0; i < num_pending; ++i)
     {
-      DBG (1, "connect_dev: major version mismatch: got %d, expected %d\n",
-	   SANE_VERSION_MAJOR (version_code), V_MAJOR);
-      status = SANE_STATUS_IO_ERROR;
-      goto fail;
+      DBG (1, "connect_devs: timed out connecting to %s\n",
+	   pending[i]->name);
+      close (fds[i]);
     }
-  if (SANE_VERSION_BUILD (version_code) != SANEI_NET_PROTOCOL_VERSION
-      && SANE_VERSION_BUILD (version_code) != 2)
+
+  for (i = 0; i < num_connected; ++i)
     {
-      DBG (1, "connect_dev: network protocol version mismatch: "
-	   "got %d, expected %d\n",
-	   SANE_VERSION_BUILD (version_code), SANEI_NET_PROTOCOL_VERSION);
-      status = SANE_STATUS_IO_ERROR;
-      goto fail;
+      dev = connected[i];
+      if (deadline)
+	set_receive_deadline (dev->ctl, deadline);
+      if (init_reply (dev) != SANE_STATUS_GOOD)
+	{
+	  DBG (1, "connect_devs: initialization of %s failed\n", dev->name);
+	  continue;
+	}
+      if (deadline)
+	set_receive_deadline (dev->ctl, 0);
     }
-  dev->wire.version = SANE_VERSION_BUILD (version_code);
-  DBG (4, "connect_dev: done\n");
-  return SANE_STATUS_GOOD;
 
-fail:
-  DBG (2, "connect_dev: closing connection to %s\n", dev->name);
-  close (dev->ctl);
-  dev->ctl = -1;
-  return status;
+  free (pending);
+  free (connected);
+  free (fds);
 }
 
-
 static SANE_Status
-fetch_options (Net_Scanner * s)
+free_options (Net_Scanner * s)
 {
-  int option_number;
-  DBG (3, "fetch_options: %p\n", (void *) s);
-
   if (s->opt.num_options)
     {
-      DBG (2, "fetch_options: %d option descriptors cached... freeing\n",
+      DBG (2, "free_options: %d option descriptors cached... freeing\n",
 	   s->opt.num_options);
       sanei_w_set_dir (&s->hw->wire, WIRE_FREE);
       s->hw->wire.status = 0;
       sanei_w_option_descriptor_array (&s->hw->wire, &s->opt);
       if (s->hw->wire.status)
 	{
-	  DBG (1, "fetch_options: failed to free old list (%s)\n",
+	  DBG (1, "free_options: failed to free old list (%s)\n",
 	       strerror (s->hw->wire.status));
 	  return SANE_STATUS_IO_ERROR;
 	}
     }
-  DBG (3, "fetch_options: get_option_descriptors\n");
-  sanei_w_call (&s->hw->wire, SANE_NET_GET_OPTION_DESCRIPTORS,
-		(WireCodecFunc) sanei_w_word, &s->handle,
-		(WireCodecFunc) sanei_w_option_descriptor_array, &s->opt);
-  if (s->hw->wire.status)
-    {
-      DBG (1, "fetch_options: failed to get option descriptors (%s)\n",
-	   strerror (s->hw->wire.status));
-      return SANE_STATUS_IO_ERROR;
-    }
+  return SANE_STATUS_GOOD;
+}
+
+/* copy the descriptors in s->opt to the ones handed to the frontend */
+static SANE_Status
+copy_options (Net_Scanner * s)
+{
+  int option_number;
 
   if (s->local_opt.num_options == 0)
     {
@@ -615,10 +925,253 @@ fetch_options (Net_Scanner * s)
     }
   
   s->options_valid = 1;
+  return SANE_STATUS_GOOD;
+}
+
+static SANE_Status
+fetch_options (Net_Scanner * s)
+{
+  SANE_Status status;
+
+  DBG (3, "fetch_options: %p\n", (void *) s);
+
+  status = free_options (s);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
+  DBG (3, "fetch_options: get_option_descriptors\n");
+  sanei_w_call (&s->hw->wire, SANE_NET_GET_OPTION_DESCRIPTORS,
+		(WireCodecFunc) sanei_w_word, &s->handle,
+		(WireCodecFunc) sanei_w_option_descriptor_array, &s->opt);
+  if (s->hw->wire.status)
+    {
+      DBG (1, "fetch_options: failed to get option descriptors (%s)\n",
+	   strerror (s->hw->wire.status));
+      return SANE_STATUS_IO_ERROR;
+    }
+
+  status = copy_options (s);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   DBG (3, "fetch_options: %d options fetched\n", s->opt.num_options);
   return SANE_STATUS_GOOD;
 }
 
+/* Send several control option requests in one SANE_NET_CONTROL_OPTIONS
+   call.  On success the caller must free reply with sanei_w_free ().  */
+static SANE_Status
+control_options (Net_Scanner * s, SANE_Control_Option_Req * req,
+		 SANE_Word num_options, SANE_Control_Options_Reply * reply)
+{
+  SANE_Control_Options_Req batch;
+  SANE_Status status;
+
+  DBG (3, "control_options: %d requests\n", num_options);
+
+  batch.handle = s->handle;
+  batch.num_options = num_options;
+  batch.req = req;
+
+  memset (reply, 0, sizeof (*reply));
+  sanei_w_call (&s->hw->wire, SANE_NET_CONTROL_OPTIONS,
+		(WireCodecFunc) sanei_w_control_options_req, &batch,
+		(WireCodecFunc) sanei_w_control_options_reply, reply);
+  if (s->hw->wire.status)
+    {
+      DBG (1, "control_options: argument marshalling error (%s)\n",
+	   strerror (s->hw->wire.status));
+      return SANE_STATUS_IO_ERROR;
+    }
+
+  status = reply->status;
+  if (status == SANE_STATUS_GOOD && reply->num_options != num_options)
+    {
+      DBG (1, "control_options: sent %d requests, got %d replies\n",
+	   num_options, reply->num_options);
+      status = SANE_STATUS_IO_ERROR;
+    }
+
+  if (reply->opt.num_options > 0)
+    {
+      /* the options were reloaded, and the new descriptors came along */
+      DBG (3, "control_options: installing %d new option descriptors\n",
+	   reply->opt.num_options);
+      if (free_options (s) == SANE_STATUS_GOOD)
+	{
+	  s->opt = reply->opt;
+	  if (copy_options (s) != SANE_STATUS_GOOD)
+	    s->options_valid = 0;
+	}
+      else
+	{
+	  sanei_w_set_dir (&s->hw->wire, WIRE_FREE);
+	  sanei_w_option_descriptor_array (&s->hw->wire, &reply->opt);
+	  s->options_valid = 0;
+	}
+      memset (&reply->opt, 0, sizeof (reply->opt));
+    }
+
+  if (status != SANE_STATUS_GOOD)
+    sanei_w_free (&s->hw->wire,
+		  (WireCodecFunc) sanei_w_control_options_reply, reply);
+  return status;
+}
+
+static void
+invalidate_values (Net_Scanner * s)
+{
+  if (!s->values_valid)
+    return;
+
+  DBG (4, "invalidate_values: dropping %d cached values\n",
+       s->values.num_options);
+  sanei_w_free (&s->hw->wire,
+		(WireCodecFunc) sanei_w_control_options_reply, &s->values);
+  memset (&s->values, 0, sizeof (s->values));
+  free (s->value_index);
+  s->value_index = 0;
+  s->values_valid = 0;
+}
+
+/* Get the values of all software settable options in one round trip.
+   They can only change when the frontend sets an option, so they are
+   kept until then.  Read-only options such as sensors are not cached.  */
+static SANE_Status
+fetch_values (Net_Scanner * s)
+{
+  SANE_Control_Option_Req *req;
+  SANE_Option_Descriptor *desc;
+  SANE_Word *value_index;
+  SANE_Word i, n, max_size;
+  void *scratch;
+  SANE_Status status;
+
+  invalidate_values (s);
+
+  value_index = malloc (s->opt.num_options * sizeof (SANE_Word));
+  req = malloc (s->opt.num_options * sizeof (SANE_Control_Option_Req));
+  if (!value_index || !req)
+    {
+      DBG (1, "fetch_values: not enough free memory\n");
+      if (value_index)
+	free (value_index);
+      if (req)
+	free (req);
+      return SANE_STATUS_NO_MEM;
+    }
+
+  n = 0;
+  max_size = 1;
+  for (i = 0; i < s->opt.num_options; i++)
+    {
+      desc = s->opt.desc[i];
+      value_index[i] = -1;
+      if (!SANE_OPTION_IS_ACTIVE (desc->cap)
+	  || !(desc->cap & SANE_CAP_SOFT_SELECT)
+	  || desc->type == SANE_TYPE_BUTTON || desc->type == SANE_TYPE_GROUP)
+	continue;
+
+      value_index[i] = n;
+      req[n].handle = s->handle;
+      req[n].option = i;
+      req[n].action = SANE_ACTION_GET_VALUE;
+      req[n].value_type = desc->type;
+      req[n].value_size = desc->size;
+      if (desc->size > max_size)
+	max_size = desc->size;
+      n++;
+    }
+
+  /* the values we send are ignored, one zeroed buffer does for all */
+  scratch = malloc (max_size);
+  if (!scratch)
+    {
+      DBG (1, "fetch_values: not enough free memory\n");
+      free (value_index);
+      free (req);
+      return SANE_STATUS_NO_MEM;
+    }
+  memset (scratch, 0, max_size);
+  for (i = 0; i < n; i++)
+    req[i].value = scratch;
+
+  status = control_options (s, req, n, &s->values);
+  free (scratch);
+  free (req);
+  if (status != SANE_STATUS_GOOD)
+    {
+      DBG (1, "fetch_values: failed (%s)\n", sane_strstatus (status));
+      free (value_index);
+      return status;
+    }
+
+  s->value_index = value_index;
+  s->values_valid = 1;
+  DBG (3, "fetch_values: %d values fetched\n", n);
+  return SANE_STATUS_GOOD;
+}
+
+/* Keep the cache in step with an option the frontend has just set.
+   Other options can only have changed if the backend said so with
+   SANE_INFO_RELOAD_OPTIONS, and then the whole cache goes.  */
+static void
+set_cached_value (Net_Scanner * s, SANE_Int option,
+		  SANE_Control_Option_Reply * set)
+{
+  SANE_Control_Option_Reply *cached;
+  SANE_Word idx;
+
+  if (!s->values_valid)
+    return;
+
+  if (set->info & SANE_INFO_RELOAD_OPTIONS)
+    {
+      invalidate_values (s);
+      return;
+    }
+
+  idx = s->value_index[option];
+  if (idx < 0)
+    return;
+
+  /* strings come back no longer than they were sent */
+  cached = &s->values.reply[idx];
+  if (set->value_size > 0 && set->value_size <= cached->value_size)
+    {
+      memset (cached->value, 0, cached->value_size);
+      memcpy (cached->value, set->value, set->value_size);
+    }
+  else
+    /* SET_AUTO returns no value; ask the server next time */
+    cached->status = SANE_STATUS_INVAL;
+}
+
+/* Answer a get value request from the cache, if possible.  */
+static SANE_Bool
+get_cached_value (Net_Scanner * s, SANE_Int option, void *value,
+		  size_t value_size)
+{
+  SANE_Control_Option_Reply *reply;
+  SANE_Word idx;
+
+  if (!s->values_valid && fetch_values (s) != SANE_STATUS_GOOD)
+    return SANE_FALSE;
+
+  idx = s->value_index[option];
+  if (idx < 0)
+    return SANE_FALSE;
+
+  reply = &s->values.reply[idx];
+  if (reply->status != SANE_STATUS_GOOD
+      || (SANE_Word) value_size != reply->value_size)
+    return SANE_FALSE;
+
+  if (value_size > 0)
+    memcpy (value, reply->value, value_size);
+  return SANE_TRUE;
+}
+
 static SANE_Status
 do_cancel (Net_Scanner * s)
 {
@@ -1045,6 +1598,25 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
 	      continue;
 	    }
 
+	  if (strstr (device_name, "device_list_ttl") != NULL)
+	    {
+	      optval = strchr (device_name, '=');
+
+	      if (!optval)
+		continue;
+
+	      optval = sanei_config_skip_whitespace (++optval);
+	      if ((optval != NULL) && (*optval != '\0'))
+		{
+		  device_list_ttl = atoi (optval);
+
+		  DBG (2, "sane_init: device list kept for %d seconds\n",
+		       device_list_ttl);
+		}
+
+	      continue;
+	    }
+
 	  DBG (2, "sane_init: trying to add %s\n", device_name);
 	  add_device (device_name, 0);
 	}
@@ -1171,6 +1743,7 @@ sane_exit (void)
 	  free ((void *) devlist[i]);
 	}
       free (devlist);
+      devlist = NULL;
     }
   DBG (3, "sane_exit: finished.\n");
 }
@@ -1187,8 +1760,9 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
   static int devlist_size = 0, devlist_len = 0;
   static const SANE_Device *empty_devlist[1] = { 0 };
   SANE_Get_Devices_Reply reply;
-  SANE_Status status;
   Net_Device *dev;
+  SANE_Bool in_use;
+  time_t deadline;
   char *full_name;
   int i, num_devs;
   size_t len;
@@ -1217,6 +1791,15 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
       return SANE_STATUS_GOOD;
     }
 
+  if (devlist && device_list_ttl > 0
+      && time (NULL) - devlist_time < device_list_ttl)
+    {
+      DBG (2, "sane_get_devices: reusing device list (%d devices)\n",
+	   devlist_len - 1);
+      *device_list = devlist;
+      return SANE_STATUS_GOOD;
+    }
+
   if (devlist)
     {
       DBG (2, "sane_get_devices: freeing devlist\n");
@@ -1236,21 +1819,43 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
   devlist_len = 0;
   devlist_size = 0;
 
+  deadline = (connect_timeout > 0) ? time (NULL) + connect_timeout : 0;
+  connect_devs (deadline);
+
+  /* send all requests first, so the servers work on them in parallel */
+  for (dev = first_device; dev; dev = dev->next)
+    if (dev->ctl >= 0)
+      sanei_w_send (&dev->wire, SANE_NET_GET_DEVICES, w_void, 0);
+
   for (dev = first_device; dev; dev = dev->next)
     {
       if (dev->ctl < 0)
 	{
-	  status = connect_dev (dev);
-	  if (status != SANE_STATUS_GOOD)
+	  DBG (1, "sane_get_devices: ignoring failure to connect to %s\n",
+	       dev->name);
+	  continue;
+	}
+
+      in_use = dev_in_use (dev);
+      if (deadline && !in_use)
+	set_receive_deadline (dev->ctl, deadline);
+      sanei_w_receive (&dev->wire,
+		       (WireCodecFunc) sanei_w_get_devices_reply, &reply);
+      if (dev->wire.status != 0)
+	{
+	  DBG (1, "sane_get_devices: no reply from %s (%s)\n",
+	       dev->name, strerror (dev->wire.status));
+	  /* the connection is out of step now; reconnect next time */
+	  if (!in_use)
 	    {
-	      DBG (1, "sane_get_devices: ignoring failure to connect to %s\n",
-		   dev->name);
-	      continue;
+	      close (dev->ctl);
+	      dev->ctl = -1;
 	    }
+	  continue;
 	}
-      sanei_w_call (&dev->wire, SANE_NET_GET_DEVICES,
-		    (WireCodecFunc) sanei_w_void, 0,
-		    (WireCodecFunc) sanei_w_get_devices_reply, &reply);
+      if (deadline && !in_use)
+	set_receive_deadline (dev->ctl, 0);
+
       if (reply.status != SANE_STATUS_GOOD)
 	{
 	  DBG (1, "sane_get_devices: ignoring rpc-returned status %s\n",
@@ -1349,6 +1954,7 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
   devlist[devlist_len++] = 0;
 
   *device_list = devlist;
+  devlist_time = time (NULL);
   DBG (2, "sane_get_devices: finished (%d devices)\n", devlist_len - 1);
   return SANE_STATUS_GOOD;
 }
@@ -1651,6 +2257,8 @@ sane_close (SANE_Handle handle)
 	     "(%s)\n", sane_strstatus (s->hw->wire.status));
     }
 
+  invalidate_values (s);
+
   DBG (2, "sane_close: removing local option descriptors\n");
   for (option_number = 0; option_number < s->local_opt.num_options;
        option_number++)
@@ -1762,6 +2370,67 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
 
   local_info = 0;
 
+  if (s->hw->caps & SANEI_NET_CAP_BATCH_OPTIONS)
+    {
+      SANE_Control_Options_Reply batch_reply;
+
+      if (action == SANE_ACTION_GET_VALUE)
+	{
+	  if (get_cached_value (s, option, value, value_size))
+	    {
+	      if (info)
+		*info = 0;
+	      DBG (2, "sane_control_option: done (cached value)\n");
+	      return SANE_STATUS_GOOD;
+	    }
+	}
+      else
+	{
+	  /* still one round trip per set, the SANE API has no way to
+	     hand us several at once */
+	  DBG (3, "sane_control_option: remote control option (batch)\n");
+	  status = control_options (s, &req, 1, &batch_reply);
+	  if (status != SANE_STATUS_GOOD)
+	    return status;
+
+	  /* authorization needs the single option call */
+	  if (batch_reply.reply[0].status != SANE_STATUS_ACCESS_DENIED)
+	    {
+	      status = batch_reply.reply[0].status;
+	      if (status == SANE_STATUS_GOOD)
+		{
+		  local_info = batch_reply.reply[0].info;
+		  if (info)
+		    *info = local_info;
+		  set_cached_value (s, option, &batch_reply.reply[0]);
+		  if (value_size > 0)
+		    {
+		      if ((SANE_Word) value_size
+			  == batch_reply.reply[0].value_size)
+			memcpy (value, batch_reply.reply[0].value,
+				value_size);
+		      else
+			DBG (1, "sane_control_option: size changed from "
+			     "%d to %d\n", s->opt.desc[option]->size,
+			     batch_reply.reply[0].value_size);
+		    }
+		}
+	      sanei_w_free (&s->hw->wire,
+			    (WireCodecFunc) sanei_w_control_options_reply,
+			    &batch_reply);
+	      DBG (2, "sane_control_option: done (%s, info %x)\n",
+		   sane_strstatus (status), local_info);
+	      return status;
+	    }
+	  sanei_w_free (&s->hw->wire,
+			(WireCodecFunc) sanei_w_control_options_reply,
+			&batch_reply);
+
+	  /* the single option call below does not keep the cache */
+	  invalidate_values (s);
+	}
+    }
+
   DBG (3, "sane_control_option: remote control option\n");
   sanei_w_call (&s->hw->wire, SANE_NET_CONTROL_OPTION,
 		(WireCodecFunc) sanei_w_control_option_req, &req,
@@ -1875,8 +2544,9 @@ sane_start (SANE_Handle handle)
 
   DBG (3, "sane_start\n");
 
-  hang_over = -1;
-  left_over = -1;
+  invalidate_values (s);
+
+  sanei_swap16_stream_init (&swap_stream);
 
   if (s->data >= 0)
     {
@@ -2010,8 +2680,9 @@ sane_start (SANE_Handle handle)
 
   DBG (3, "sane_start\n");
 
-  hang_over = -1;
-  left_over = -1;
+  invalidate_values (s);
+
+  sanei_swap16_stream_init (&swap_stream);
 
   if (s->data >= 0)
     {
@@ -2109,12 +2780,8 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
 {
   Net_Scanner *s = handle;
   ssize_t nread;
-  SANE_Int cnt;
-  SANE_Int start_cnt;
-  SANE_Int end_cnt;
-  SANE_Byte swap_buf;
-  SANE_Byte temp_hang_over;
-  int is_even;
+  SANE_Bool swap;
+  size_t start = 0;
 
   DBG (3, "sane_read: handle=%p, data=%p, max_length=%d, length=%p\n",
        handle, data, max_length, (void *) length);
@@ -2124,23 +2791,20 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
       return SANE_STATUS_INVAL;
     }
 
-  is_even = 1;
   *length = 0;
 
-  /* If there's a left over, i.e. a byte already in the correct byte order,
-     return it immediately; otherwise read may fail with a SANE_STATUS_EOF and
-     the caller never can read the last byte */
-  if ((depth == 16) && (server_big_endian != client_big_endian))
+  swap = (depth == 16) && (server_big_endian != client_big_endian);
+  if (swap)
     {
-      if (left_over > -1)
+      start = sanei_swap16_stream_begin (&swap_stream, data, max_length);
+      /* If there's a byte already in the correct byte order, return it
+	 immediately; otherwise read may fail with a SANE_STATUS_EOF and
+	 the caller never can read the last byte */
+      if (start > 0 && swap_stream.swapped)
 	{
-	  DBG (3, "sane_read: left_over from previous call, return "
+	  DBG (3, "sane_read: left over from previous call, return "
 	       "immediately\n");
-	  /* return the byte, we've currently scanned; hang_over becomes 
-	     left_over */
-	  *data = (SANE_Byte) left_over;
-	  left_over = -1;
-	  *length = 1;
+	  *length = sanei_swap16_stream_end (&swap_stream, data, start);
 	  return SANE_STATUS_GOOD;
 	}
     }
@@ -2211,10 +2875,12 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
 	}
     }
 
+  /* a byte held back by the swap stream is already in data[0] */
+  max_length -= start;
   if (max_length > (SANE_Int) s->bytes_remaining)
     max_length = s->bytes_remaining;
 
-  nread = read (s->data, data, max_length);
+  nread = read (s->data, data + start, max_length);
   
   if (nread < 0)
     {
@@ -2232,90 +2898,14 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
   s->bytes_remaining -= nread;
 
   *length = nread;
-  /* Check whether we are scanning with a depth of 16 bits/pixel and whether
-     server and client have different byte order. If this is true, then it's
-     neccessary to check whether read returned an odd number. If an odd number
-     has been returned, we must save the last byte.
-  */
-  if ((depth == 16) && (server_big_endian != client_big_endian))
-    {
-      DBG (1,"sane_read: client/server have different byte order; "
+  /* Swap the bytes of 16 bit samples if server and client have different
+     byte order.  The stream code takes care of samples split between two
+     reads.  */
+  if (swap)
+    {
+      DBG (4, "sane_read: client/server have different byte order; "
 	   "must swap\n");
-      /* special case: 1 byte scanned and hang_over */
-      if ((nread == 1) && (hang_over > -1))
-	{
-	  /* return the byte, we've currently scanned; hang_over becomes 
-	     left_over */
-	  left_over = hang_over;
-	  hang_over = -1;
-	  return SANE_STATUS_GOOD;
-	}
-      /* check whether an even or an odd number of bytes has been scanned */
-      if ((nread % 2) == 0)
-        is_even = 1;
-      else
-        is_even = 0;
-      /* check, whether there's a hang over from a previous call;
-	 in this case we memcopy the data up one byte */
-      if ((nread > 1) && (hang_over > -1))
-	{
-	  /* store last byte */
-	  temp_hang_over = *(data + nread - 1);
-	  memmove (data + 1, data, nread - 1);
-	  *data = (SANE_Byte) hang_over;
-	  /* what happens with the last byte depends on whether the number
-	     of bytes is even or odd */
-	  if (is_even == 1)
-	    {
-	      /* number of bytes is even; no new hang_over, exchange last
-		 byte with hang over; last byte becomes left_over */
-	      left_over = *(data + nread - 1);
-	      *(data + nread - 1) = temp_hang_over;
-	      hang_over = -1;
-	      start_cnt = 0;
-	      /* last byte already swapped */
-	      end_cnt = nread - 2;
-	    }
-	  else
-	    {
-	      /* number of bytes is odd; last byte becomes new hang_over */
-	      hang_over = temp_hang_over;
-	      left_over = -1;
-	      start_cnt = 0;
-	      end_cnt = nread - 1;
-	    }
-	}
-      else if (nread == 1)
-	{
-	  /* if only one byte has been read, save it as hang_over and return
-	     length=0 */
-	  hang_over = (int) *data;
-	  *length = 0;
-	  return SANE_STATUS_GOOD;
-	}
-      else
-	{
-	  /* no hang_over; test for even or odd byte number */
-	  if(is_even == 1)
-	    {
-	      start_cnt = 0;
-	      end_cnt = *length;
-	    }
-	  else
-	    {
-	      start_cnt = 0;
-	      hang_over = *(data + *length - 1);
-	      *length -= 1;
-	      end_cnt = *length;
-	    }
-	}
-      /* swap the bytes */
-      for (cnt = start_cnt; cnt < end_cnt - 1; cnt += 2)
-	{
-	  swap_buf = *(data + cnt);
-	  *(data + cnt) = *(data + cnt + 1);
-	  *(data + cnt + 1) = swap_buf;
-	}
+      *length = sanei_swap16_stream_end (&swap_stream, data, start + nread);
     }
   DBG (3, "sane_read: %lu bytes read, %lu remaining\n", (u_long) nread,
        (u_long) s->bytes_remaining);
@@ -2335,6 +2925,7 @@ sane_cancel (SANE_Handle handle)
 		(WireCodecFunc) sanei_w_word, &s->handle,
 		(WireCodecFunc) sanei_w_word, &ack);
   do_cancel (s);
+  invalidate_values (s);
   DBG (4, "sane_cancel: done\n");
 }
 
@@ -62,6 +62,7 @@ typedef struct Net_Device
     int ctl;			/* socket descriptor (or -1) */
     Wire wire;
     int auth_active;
+    SANE_Word caps;		/* SANEI_NET_CAP_* agreed with the server */
   }
 Net_Device;
 
@@ -73,6 +74,11 @@ typedef struct Net_Scanner
     int options_valid;			/* are the options current? */
     SANE_Option_Descriptor_Array opt, local_opt;
 
+    /* option values prefetched with SANE_NET_CONTROL_OPTIONS: */
+    int values_valid;
+    SANE_Control_Options_Reply values;
+    SANE_Word *value_index;	/* option number -> values.reply[] or -1 */
+
     SANE_Word handle;		/* remote handle (it's a word, not a ptr!) */
 
     int data;			/* data socket descriptor */
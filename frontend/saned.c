@@ -75,6 +75,7 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include <sys/wait.h>
@@ -261,6 +262,15 @@ static char *remote_ip;
 static in_port_t data_port_lo;
 static in_port_t data_port_hi;
 
+/* record size for clients that support large data records; 0 disables */
+#define SANED_DEFAULT_RECORD_SIZE (1024 * 1024)
+#define SANED_MIN_RECORD_SIZE     8192
+#define SANED_MAX_RECORD_SIZE     (8 * 1024 * 1024)
+static size_t data_record_size = SANED_DEFAULT_RECORD_SIZE;
+
+/* SANEI_NET_CAP_* bits announced by the client */
+static SANE_Word client_caps;
+
 #ifdef SANED_USES_AF_INDEP
 static union {
   struct sockaddr_storage ss;
@@ -1366,6 +1376,8 @@ init (Wire * w)
   w->version = SANEI_NET_PROTOCOL_VERSION;
   if (req.username)
     default_username = strdup (req.username);
+  client_caps = SANE_VERSION_BUILD (req.version_code) & SANEI_NET_CAPS;
+  DBG (DBG_MSG, "init: client capabilities 0x%x\n", client_caps);
 
   sanei_w_free (w, (WireCodecFunc) sanei_w_init_req, &req);
   if (w->status)
@@ -1374,8 +1386,10 @@ init (Wire * w)
       return -1;
     }
 
+  /* only answer with capability bits to clients that know about them */
   reply.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
-					  SANEI_NET_PROTOCOL_VERSION);
+					  SANEI_NET_PROTOCOL_VERSION
+					  | client_caps);
 
   DBG (DBG_WARN, "init: access granted to %s@%s\n",
        default_username, remote_ip);
@@ -1801,6 +1815,243 @@ do_scan (Wire * w, int h, int data_fd)
   handle[h].scanning = 0;
 }
 
+/* drop n written bytes from the front of an iovec array */
+static int
+consume_iov (struct iovec *iov, int iovcnt, size_t n)
+{
+  while (iovcnt > 0 && n >= iov[0].iov_len)
+    {
+      n -= iov[0].iov_len;
+      memmove (iov, iov + 1, (iovcnt - 1) * sizeof (struct iovec));
+      iovcnt--;
+    }
+  if (iovcnt > 0)
+    {
+      iov[0].iov_base = (char *) iov[0].iov_base + n;
+      iov[0].iov_len -= n;
+    }
+  return iovcnt;
+}
+
+/* true if a read on fd would not block, without waiting */
+static int
+fd_readable (int fd)
+{
+  struct timeval tv;
+  fd_set set;
+
+  FD_ZERO (&set);
+  FD_SET (fd, &set);
+  memset (&tv, 0, sizeof (tv));
+  return select (fd + 1, &set, 0, 0, &tv) > 0;
+}
+
+/* Variant of do_scan () for clients that announced
+   SANEI_NET_CAP_LARGE_RECORDS.  The backend fills a record of up to
+   data_record_size bytes directly behind its length header, and the
+   record plus the final status (if any) go out with one writev ().  The
+   record format is the same as for do_scan (), records are just bigger. */
+static void
+do_scan_records (Wire * w, int h, int data_fd)
+{
+  int num_fds, be_fd = -1, iovcnt = 0;
+  SANE_Handle be_handle = handle[h].handle;
+  struct timeval tv, *timeout = 0;
+  fd_set rd_set, rd_mask, wr_set;
+  struct iovec iov[2];
+  SANE_Byte *buf, trailer[5];
+  SANE_Status status;
+  ssize_t nwritten;
+  SANE_Int length;
+  size_t fill;
+
+  buf = malloc (data_record_size + 4);
+  if (!buf)
+    {
+      DBG (DBG_ERR, "do_scan_records: can't allocate %lu bytes, "
+	   "falling back to small records\n", (u_long) data_record_size);
+      do_scan (w, h, data_fd);
+      return;
+    }
+
+  DBG (3, "do_scan_records: start, record size %lu\n",
+       (u_long) data_record_size);
+
+  FD_ZERO (&rd_mask);
+  FD_SET (w->io.fd, &rd_mask);
+  num_fds = w->io.fd + 1;
+  if (data_fd >= num_fds)
+    num_fds = data_fd + 1;
+
+  fcntl (data_fd, F_SETFL, O_NONBLOCK);
+
+  sane_set_io_mode (be_handle, SANE_TRUE);
+  if (sane_get_select_fd (be_handle, &be_fd) == SANE_STATUS_GOOD)
+    {
+      FD_SET (be_fd, &rd_mask);
+      if (be_fd >= num_fds)
+	num_fds = be_fd + 1;
+    }
+  else
+    {
+      memset (&tv, 0, sizeof (tv));
+      timeout = &tv;
+    }
+
+  status = SANE_STATUS_GOOD;
+  do
+    {
+      rd_set = rd_mask;
+      FD_ZERO (&wr_set);
+      if (iovcnt > 0)
+	FD_SET (data_fd, &wr_set);
+
+      /* don't poll the backend while a record is still on its way out */
+      if (select (num_fds, &rd_set, &wr_set, 0, iovcnt > 0 ? 0 : timeout)
+	  < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (be_fd >= 0 && errno == EBADF)
+	    {
+	      /* the backend closed its select fd at the end of the frame */
+	      FD_CLR (be_fd, &rd_mask);
+	      be_fd = -1;
+	      if (status == SANE_STATUS_GOOD)
+		{
+		  status = SANE_STATUS_EOF;
+		  store_reclen (trailer, sizeof (trailer), 0, 0xffffffff);
+		  trailer[4] = status;
+		  iov[iovcnt].iov_base = (void *) trailer;
+		  iov[iovcnt].iov_len = sizeof (trailer);
+		  iovcnt++;
+		}
+	      DBG (DBG_INFO, "do_scan_records: select_fd was closed --> EOF\n");
+	      continue;
+	    }
+	  status = SANE_STATUS_IO_ERROR;
+	  DBG (DBG_ERR, "do_scan_records: select failed (%s)\n",
+	       strerror (errno));
+	  break;
+	}
+
+      if (iovcnt > 0)
+	{
+	  if (FD_ISSET (data_fd, &wr_set))
+	    {
+	      nwritten = writev (data_fd, iov, iovcnt);
+	      DBG (DBG_INFO, "do_scan_records: wrote %ld bytes to client\n",
+		   (long) nwritten);
+	      if (nwritten < 0)
+		{
+		  if (errno != EAGAIN && errno != EINTR)
+		    {
+		      DBG (DBG_ERR, "do_scan_records: write failed (%s)\n",
+			   strerror (errno));
+		      status = SANE_STATUS_CANCELLED;
+		      break;
+		    }
+		}
+	      else
+		iovcnt = consume_iov (iov, iovcnt, nwritten);
+	    }
+	}
+      else if (status == SANE_STATUS_GOOD
+	       && (timeout || FD_ISSET (be_fd, &rd_set)))
+	{
+	  /* fill the record until it is full or the backend has no more,
+	     but send what we have as soon as the client has a request,
+	     so a cancel is not stuck behind a whole record of reads */
+	  fill = 0;
+	  do
+	    {
+	      length = 0;
+	      status = sane_read (be_handle, buf + 4 + fill,
+				  data_record_size - fill, &length);
+	      if (status != SANE_STATUS_GOOD)
+		break;
+	      fill += length;
+	      if (length > 0 && fill < data_record_size
+		  && fd_readable (w->io.fd))
+		{
+		  FD_SET (w->io.fd, &rd_set);
+		  break;
+		}
+	    }
+	  while (length > 0 && fill < data_record_size);
+
+	  DBG (DBG_INFO, "do_scan_records: read %lu bytes from scanner\n",
+	       (u_long) fill);
+	  reset_watchdog ();
+
+	  if (fill > 0)
+	    {
+	      store_reclen (buf, 4, 0, fill);
+	      iov[iovcnt].iov_base = (void *) buf;
+	      iov[iovcnt].iov_len = fill + 4;
+	      iovcnt++;
+	    }
+	  if (status != SANE_STATUS_GOOD)
+	    {
+	      DBG (DBG_MSG, "do_scan_records: status = `%s'\n",
+		   sane_strstatus (status));
+	      store_reclen (trailer, sizeof (trailer), 0, 0xffffffff);
+	      trailer[4] = status;
+	      iov[iovcnt].iov_base = (void *) trailer;
+	      iov[iovcnt].iov_len = sizeof (trailer);
+	      iovcnt++;
+	    }
+	}
+
+      if (FD_ISSET (w->io.fd, &rd_set))
+	{
+	  DBG (DBG_MSG,
+	       "do_scan_records: processing RPC request on fd %d\n",
+	       w->io.fd);
+	  process_request (w);
+	  if (handle[h].docancel)
+	    break;
+	}
+    }
+  while (status == SANE_STATUS_GOOD || iovcnt > 0);
+  DBG (DBG_MSG, "do_scan_records: done, status=%s\n",
+       sane_strstatus (status));
+  free (buf);
+  handle[h].docancel = 0;
+  handle[h].scanning = 0;
+}
+
+/* collect the backend's option descriptors; free opt->desc when done */
+static void
+get_option_descriptors (SANE_Handle be_handle,
+			SANE_Option_Descriptor_Array * opt)
+{
+  union
+  {
+    const SANE_Option_Descriptor *c;
+    SANE_Option_Descriptor *d;
+  } desc;
+  int i;
+
+  opt->num_options = 0;
+  sane_control_option (be_handle, 0, SANE_ACTION_GET_VALUE,
+		       &opt->num_options, 0);
+
+  opt->desc = malloc (opt->num_options * sizeof (opt->desc[0]));
+  if (!opt->desc)
+    {
+      DBG (DBG_ERR, "get_option_descriptors: not enough free memory\n");
+      opt->num_options = 0;
+      return;
+    }
+  /* the wire array is not const, but is only ever encoded from */
+  for (i = 0; i < opt->num_options; ++i)
+    {
+      desc.c = sane_get_option_descriptor (be_handle, i);
+      opt->desc[i] = desc.d;
+    }
+}
+
 static int
 process_request (Wire * w)
 {
@@ -1951,14 +2202,7 @@ process_request (Wire * w)
 	h = decode_handle (w, "get_option_descriptors");
 	if (h < 0)
 	  return 1;
-	be_handle = handle[h].handle;
-	sane_control_option (be_handle, 0, SANE_ACTION_GET_VALUE,
-			     &opt.num_options, 0);
-
-	opt.desc = malloc (opt.num_options * sizeof (opt.desc[0]));
-	for (i = 0; i < opt.num_options; ++i)
-	  opt.desc[i] = (SANE_Option_Descriptor *)
-	    sane_get_option_descriptor (be_handle, i);
+	get_option_descriptors (handle[h].handle, &opt);
 
 	sanei_w_reply (w,(WireCodecFunc) sanei_w_option_descriptor_array,
 		       &opt);
@@ -2002,6 +2246,82 @@ process_request (Wire * w)
       }
       break;
 
+    case SANE_NET_CONTROL_OPTIONS:
+      {
+	SANE_Control_Options_Req req;
+	SANE_Control_Options_Reply reply;
+	SANE_Control_Option_Req *opt_req;
+	SANE_Control_Option_Reply *opt_reply;
+	SANE_Word reload = 0;
+
+	sanei_w_control_options_req (w, &req);
+	if (w->status || (unsigned) req.handle >= (unsigned) num_handles
+	    || !handle[req.handle].inuse)
+	  {
+	    DBG (DBG_ERR,
+		 "process_request: (control_options) "
+		 "error while decoding args h=%d (%s)\n"
+		 , req.handle, strerror (w->status));
+	    return 1;
+	  }
+
+	DBG (DBG_MSG, "process_request: (control_options) %d options\n",
+	     req.num_options);
+
+	/* can_authorize stays 0: options that need authorization fail with
+	   SANE_STATUS_ACCESS_DENIED and the client repeats them alone */
+	memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
+	be_handle = handle[req.handle].handle;
+	reply.status = SANE_STATUS_GOOD;
+	if (req.num_options > 0)
+	  {
+	    reply.reply = malloc (req.num_options * sizeof (reply.reply[0]));
+	    if (!reply.reply)
+	      reply.status = SANE_STATUS_NO_MEM;
+	    else
+	      {
+		memset (reply.reply, 0,
+			req.num_options * sizeof (reply.reply[0]));
+		reply.num_options = req.num_options;
+	      }
+	  }
+
+	for (i = 0; i < reply.num_options; ++i)
+	  {
+	    opt_req = req.req + i;
+	    opt_reply = reply.reply + i;
+
+	    if (opt_req->handle != req.handle)
+	      opt_reply->status = SANE_STATUS_INVAL;
+	    else
+	      opt_reply->status = sane_control_option (be_handle,
+							opt_req->option,
+							opt_req->action,
+							opt_req->value,
+							&opt_reply->info);
+	    opt_reply->value_type = opt_req->value_type;
+	    opt_reply->value_size = opt_req->value_size;
+	    opt_reply->value = opt_req->value;
+
+	    if (opt_reply->status == SANE_STATUS_GOOD)
+	      reload |= opt_reply->info;
+	  }
+
+	/* save the client the extra round trip to reload the options */
+	if (reload & SANE_INFO_RELOAD_OPTIONS)
+	  get_option_descriptors (be_handle, &reply.opt);
+
+	sanei_w_reply (w, (WireCodecFunc) sanei_w_control_options_reply,
+		       &reply);
+
+	if (reply.opt.desc)
+	  free (reply.opt.desc);
+	if (reply.reply)
+	  free (reply.reply);
+	sanei_w_free (w, (WireCodecFunc) sanei_w_control_options_req, &req);
+      }
+      break;
+
     case SANE_NET_GET_PARAMETERS:
       {
 	SANE_Get_Parameters_Reply reply;
@@ -2134,7 +2454,11 @@ process_request (Wire * w)
 	      }
 	    fcntl (data_fd, F_SETFL, 1);      /* set non-blocking */
 	    shutdown (data_fd, 0);
-	    do_scan (w, h, data_fd);
+	    if (data_record_size
+		&& (client_caps & SANEI_NET_CAP_LARGE_RECORDS))
+	      do_scan_records (w, h, data_fd);
+	    else
+	      do_scan (w, h, data_fd);
 	    close (data_fd);
 	  }
       }
@@ -2694,6 +3018,30 @@ read_config (void)
                   DBG (DBG_INFO, "read_config: data port range: %d - %d\n", data_port_lo, data_port_hi);
                 }
             }
+          else if (strstr(config_line, "data_record_size") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              if ((optval != NULL) && (*optval != '\0'))
+                {
+		  val = strtol (optval, &endval, 10);
+		  if (optval == endval)
+		    {
+		      DBG (DBG_ERR, "read_config: invalid value for data_record_size\n");
+		      continue;
+		    }
+		  else if ((val != 0) && ((val < SANED_MIN_RECORD_SIZE)
+					  || (val > SANED_MAX_RECORD_SIZE)))
+		    {
+		      DBG (DBG_ERR, "read_config: data_record_size must be 0 or between %d and %d\n",
+			   SANED_MIN_RECORD_SIZE, SANED_MAX_RECORD_SIZE);
+		      continue;
+		    }
+
+		  data_record_size = val;
+
+                  DBG (DBG_INFO, "read_config: data record size: %lu\n", (u_long) data_record_size);
+                }
+            }
         }
       fclose (fp);
       DBG (DBG_INFO, "read_config: done reading config\n");
@@ -40,6 +40,13 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "../include/_stdint.h"
 
@@ -76,6 +83,8 @@ Image;
 #define OPTION_BATCH_DOUBLE	1005
 #define OPTION_BATCH_INCREMENT	1006
 #define OPTION_BATCH_PROMPT    1007
+#define OPTION_STATS	1008
+#define OPTION_COMPRESSION	1009
 
 #define BATCH_COUNT_UNLIMITED -1
 
@@ -100,6 +109,8 @@ static struct option basic_options[] = {
   {"accept-md5-only", no_argument, NULL, OPTION_MD5},
   {"icc-profile", required_argument, NULL, 'i'},
   {"dont-scan", no_argument, NULL, 'n'},
+  {"stats", no_argument, NULL, OPTION_STATS},
+  {"compression", required_argument, NULL, OPTION_COMPRESSION},
   {0, 0, NULL, 0}
 };
 
@@ -115,6 +126,7 @@ static int *option_number;
 static SANE_Handle device;
 static int verbose;
 static int progress = 0;
+static int stats = 0;
 static int test;
 static int all;
 static int output_format = OUTPUT_PNM;
@@ -131,6 +143,7 @@ static int window_val_user[2];	/* is x,y user-specified? */
 
 static int accept_only_md5_auth = 0;
 static const char *icc_profile = NULL;
+static int compression = TIFF_COMPRESSION_NONE;
 
 static void fetch_options (SANE_Device * device);
 static void scanimage_exit (void);
@@ -1182,6 +1195,217 @@ advance (Image * image)
   return image->data;
 }
 
+/* Output queue: scan_it() reads into one buffer while a writer thread
+   writes the others to stdout, so slow output does not stall the
+   scanner.  Without threads the buffers are written right away.  Each
+   buffer has a spare byte in front, for the byte held back by the
+   16 bit byte swapping.  */
+
+#define OUTPUT_BUFFERS 3
+
+static struct
+{
+  SANE_Byte *data[OUTPUT_BUFFERS];
+  SANE_Byte *out[OUTPUT_BUFFERS];
+  size_t len[OUTPUT_BUFFERS];
+  int first, count;		/* oldest buffer queued, buffers queued */
+  TIFF_Writer *tiff;		/* compressed TIFF, or NULL for stdout */
+  double read_time, read_wait, write_time, write_wait;
+#ifdef HAVE_PTHREAD_H
+  int started, running, done;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+}
+output;
+
+static double
+now (void)
+{
+#ifdef HAVE_SYS_TIME_H
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+#else
+  return 0;
+#endif
+}
+
+static void
+output_write (SANE_Byte * data, size_t len)
+{
+  if (output.tiff)
+    sanei_tiff_writer_write (output.tiff, data, len);
+  else
+    fwrite (data, 1, len, stdout);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+output_writer (void *arg)
+{
+  double start;
+  int i;
+
+  (void) arg;
+
+  pthread_mutex_lock (&output.lock);
+  for (;;)
+    {
+      start = now ();
+      while (!output.count && !output.done)
+	pthread_cond_wait (&output.cond, &output.lock);
+      output.write_wait += now () - start;
+
+      if (!output.count)
+	break;
+
+      i = output.first;
+      pthread_mutex_unlock (&output.lock);
+
+      start = now ();
+      output_write (output.out[i], output.len[i]);
+
+      pthread_mutex_lock (&output.lock);
+      output.write_time += now () - start;
+      output.first = (i + 1) % OUTPUT_BUFFERS;
+      output.count--;
+      pthread_cond_signal (&output.cond);
+    }
+  pthread_mutex_unlock (&output.lock);
+
+  return NULL;
+}
+#endif
+
+static SANE_Status
+output_start (void)
+{
+  int i;
+
+  memset (&output, 0, sizeof (output));
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init (&output.lock, NULL);
+  pthread_cond_init (&output.cond, NULL);
+  output.started = 1;
+#endif
+
+  for (i = 0; i < OUTPUT_BUFFERS; i++)
+    {
+      output.data[i] = malloc (buffer_size + 1);
+      if (!output.data[i])
+	return SANE_STATUS_NO_MEM;
+    }
+
+#ifdef HAVE_PTHREAD_H
+  if (pthread_create (&output.thread, NULL, output_writer, NULL) == 0)
+    output.running = 1;
+  else if (verbose)
+    fprintf (stderr, "%s: no writer thread, writing in between reads\n",
+	     prog_name);
+#endif
+  return SANE_STATUS_GOOD;
+}
+
+/* the next buffer to read into, once the writer is done with it */
+static SANE_Byte *
+output_buffer (void)
+{
+  int i;
+
+#ifdef HAVE_PTHREAD_H
+  double start = now ();
+
+  pthread_mutex_lock (&output.lock);
+  while (output.count == OUTPUT_BUFFERS)
+    pthread_cond_wait (&output.cond, &output.lock);
+  i = (output.first + output.count) % OUTPUT_BUFFERS;
+  pthread_mutex_unlock (&output.lock);
+  output.read_wait += now () - start;
+#else
+  i = 0;
+#endif
+  return output.data[i];
+}
+
+/* queue len bytes at data, which lie in the last buffer returned */
+static void
+output_queue (SANE_Byte * data, size_t len)
+{
+  double start;
+
+#ifdef HAVE_PTHREAD_H
+  if (output.running)
+    {
+      int i;
+
+      pthread_mutex_lock (&output.lock);
+      i = (output.first + output.count) % OUTPUT_BUFFERS;
+      output.out[i] = data;
+      output.len[i] = len;
+      output.count++;
+      pthread_cond_signal (&output.cond);
+      pthread_mutex_unlock (&output.lock);
+      return;
+    }
+#endif
+
+  start = now ();
+  output_write (data, len);
+  output.write_time += now () - start;
+}
+
+/* write out everything queued and stop the writer */
+static void
+output_finish (void)
+{
+  int i;
+
+#ifdef HAVE_PTHREAD_H
+  if (output.running)
+    {
+      pthread_mutex_lock (&output.lock);
+      output.done = 1;
+      pthread_cond_signal (&output.cond);
+      pthread_mutex_unlock (&output.lock);
+      pthread_join (output.thread, NULL);
+      output.running = 0;
+    }
+  if (output.started)
+    {
+      pthread_cond_destroy (&output.cond);
+      pthread_mutex_destroy (&output.lock);
+      output.started = 0;
+    }
+#endif
+
+  for (i = 0; i < OUTPUT_BUFFERS; i++)
+    {
+      if (output.data[i])
+	free (output.data[i]);
+      output.data[i] = NULL;
+    }
+}
+
+/* finish the compressed TIFF image, if there is one */
+static SANE_Status
+output_close_tiff (void)
+{
+  SANE_Status status;
+
+  if (!output.tiff)
+    return SANE_STATUS_GOOD;
+
+  status = sanei_tiff_writer_close (output.tiff);
+  output.tiff = NULL;
+  if (status != SANE_STATUS_GOOD)
+    fprintf (stderr, "%s: can't write TIFF image: %s\n",
+	     prog_name, sane_strstatus (status));
+  return status;
+}
+
 static SANE_Status
 scan_it (void)
 {
@@ -1195,6 +1419,16 @@ scan_it (void)
   };
   SANE_Word total_bytes = 0, expected_bytes;
   SANE_Int hang_over = -1;
+  SANE_Byte *data, *out;
+  double start;
+
+  status = output_start ();
+  if (status != SANE_STATUS_GOOD)
+    {
+      fprintf (stderr, "%s: can't allocate output buffers\n", prog_name);
+      output_finish ();
+      return status;
+    }
 
   do
     {
@@ -1269,7 +1503,21 @@ scan_it (void)
 		}
 	      else
 		{
-		  if (output_format == OUTPUT_TIFF)
+		  if (output_format == OUTPUT_TIFF
+		      && compression != TIFF_COMPRESSION_NONE)
+		    {
+		      output.tiff =
+			sanei_tiff_writer_open (stdout, parm.format,
+						parm.pixels_per_line,
+						parm.depth, resolution_value,
+						icc_profile, compression);
+		      if (!output.tiff)
+			{
+			  status = SANE_STATUS_NO_MEM;
+			  goto cleanup;
+			}
+		    }
+		  else if (output_format == OUTPUT_TIFF)
 		    sanei_write_tiff_header (parm.format,
 					     parm.pixels_per_line, parm.lines,
 					     parm.depth, resolution_value,
@@ -1323,7 +1571,11 @@ scan_it (void)
       while (1)
 	{
 	  double progr;
-	  status = sane_read (device, buffer, buffer_size, &len);
+	  data = output_buffer ();
+	  out = data + 1;
+	  start = now ();
+	  status = sane_read (device, out, buffer_size, &len);
+	  output.read_time += now () - start;
 	  total_bytes += (SANE_Word) len;
           progr = ((total_bytes * 100.) / (double) hundred_percent);
           if (progr > 100.)
@@ -1340,7 +1592,7 @@ scan_it (void)
 		{
 		  fprintf (stderr, "%s: sane_read: %s\n",
 			   prog_name, sane_strstatus (status));
-		  return status;
+		  goto cleanup;
 		}
 	      break;
 	    }
@@ -1354,7 +1606,7 @@ scan_it (void)
 		case SANE_FRAME_BLUE:
 		  for (i = 0; i < len; ++i)
 		    {
-		      image.data[offset + 3 * i] = buffer[i];
+		      image.data[offset + 3 * i] = out[i];
 		      if (!advance (&image))
 			{
 			  status = SANE_STATUS_NO_MEM;
@@ -1367,7 +1619,7 @@ scan_it (void)
 		case SANE_FRAME_RGB:
 		  for (i = 0; i < len; ++i)
 		    {
-		      image.data[offset + i] = buffer[i];
+		      image.data[offset + i] = out[i];
 		      if (!advance (&image))
 			  {
 			    status = SANE_STATUS_NO_MEM;
@@ -1380,7 +1632,7 @@ scan_it (void)
 		case SANE_FRAME_GRAY:
 		  for (i = 0; i < len; ++i)
 		    {
-		      image.data[offset + i] = buffer[i];
+		      image.data[offset + i] = out[i];
 		      if (!advance (&image))
 			  {
 			    status = SANE_STATUS_NO_MEM;
@@ -1397,60 +1649,90 @@ scan_it (void)
 	  else			/* ! must_buffer */
 	    {
 	      if ((output_format == OUTPUT_TIFF) || (parm.depth != 16))
-		fwrite (buffer, 1, len, stdout);
+		output_queue (out, len);
 	      else
 		{
 #if !defined(WORDS_BIGENDIAN)
 		  int i, start = 0;
 
-		  /* check if we have saved one byte from the last sane_read */
+		  /* check if we have saved one byte from the last sane_read,
+		     it goes after the first byte of this one */
 		  if (hang_over > -1)
 		    {
 		      if (len > 0)
 			{
-			  fwrite (buffer, 1, 1, stdout);
-			  buffer[0] = (SANE_Byte) hang_over;
+			  out = data;
+			  out[0] = out[1];
+			  out[1] = (SANE_Byte) hang_over;
 			  hang_over = -1;
-			  start = 1;
+			  len++;
+			  start = 2;
 			}
 		    }
 		  /* now do the byte-swapping */
 		  for (i = start; i < (len - 1); i += 2)
 		    {
 		      unsigned char LSB;
-		      LSB = buffer[i];
-		      buffer[i] = buffer[i + 1];
-		      buffer[i + 1] = LSB;
+		      LSB = out[i];
+		      out[i] = out[i + 1];
+		      out[i + 1] = LSB;
 		    }
 		  /* check if we have an odd number of bytes */
 		  if (((len - start) % 2) != 0)
 		    {
-		      hang_over = buffer[len - 1];
+		      hang_over = out[len - 1];
 		      len--;
 		    }
 #endif
-		  fwrite (buffer, 1, len, stdout);
+		  output_queue (out, len);
 		}
 	    }
 
 	  if (verbose && parm.depth == 8)
 	    {
 	      for (i = 0; i < len; ++i)
-		if (buffer[i] >= max)
-		  max = buffer[i];
-		else if (buffer[i] < min)
-		  min = buffer[i];
+		if (out[i] >= max)
+		  max = out[i];
+		else if (out[i] < min)
+		  min = out[i];
 	    }
 	}
       first_frame = 0;
     }
   while (!parm.last_frame);
 
+  output_finish ();
+  if (output_close_tiff () != SANE_STATUS_GOOD)
+    {
+      status = SANE_STATUS_IO_ERROR;
+      goto cleanup;
+    }
+
   if (must_buffer)
     {
       image.height = image.y;
 
-      if (output_format == OUTPUT_TIFF)
+      if (output_format == OUTPUT_TIFF
+	  && compression != TIFF_COMPRESSION_NONE)
+	{
+	  output.tiff =
+	    sanei_tiff_writer_open (stdout, parm.format, parm.pixels_per_line,
+				    parm.depth, resolution_value, icc_profile,
+				    compression);
+	  if (!output.tiff)
+	    {
+	      status = SANE_STATUS_NO_MEM;
+	      goto cleanup;
+	    }
+	  sanei_tiff_writer_write (output.tiff, image.data,
+				   image.height * image.width);
+	  if (output_close_tiff () != SANE_STATUS_GOOD)
+	    {
+	      status = SANE_STATUS_IO_ERROR;
+	      goto cleanup;
+	    }
+	}
+      else if (output_format == OUTPUT_TIFF)
 	sanei_write_tiff_header (parm.format, parm.pixels_per_line,
 				 image.height, parm.depth, resolution_value,
 				 icc_profile);
@@ -1474,6 +1756,8 @@ scan_it (void)
 	}
 #endif
 
+      if (compression == TIFF_COMPRESSION_NONE
+	  || output_format != OUTPUT_TIFF)
 	fwrite (image.data, 1, image.height * image.width, stdout);
     }
 
@@ -1481,9 +1765,17 @@ scan_it (void)
   fflush( stdout );
 
 cleanup:
+  output_finish ();
+  output_close_tiff ();
   if (image.data)
     free (image.data);
 
+  if (stats)
+    fprintf (stderr, "%s: reading %.2f s, waiting for output %.2f s; "
+	     "writing %.2f s, waiting for data %.2f s\n", prog_name,
+	     output.read_time, output.read_wait, output.write_time,
+	     output.write_wait);
+
 
   expected_bytes = parm.bytes_per_line * parm.lines *
     ((parm.format == SANE_FRAME_RGB
@@ -1778,6 +2070,9 @@ main (int argc, char **argv)
 	case OPTION_BATCH_PROMPT:
 	  batch_prompt = 1;
 	  break;
+	case OPTION_STATS:
+	  stats = 1;
+	  break;
 	case OPTION_BATCH_INCREMENT:
 	  batch_increment = atoi (optarg);
 	  break;
@@ -1791,6 +2086,22 @@ main (int argc, char **argv)
 	  batch_count = atoi (optarg);
 	  batch = 1;
 	  break;
+	case OPTION_COMPRESSION:
+	  if (strcmp (optarg, "none") == 0)
+	    compression = TIFF_COMPRESSION_NONE;
+	  else if (strcmp (optarg, "packbits") == 0)
+	    compression = TIFF_COMPRESSION_PACKBITS;
+	  else if (strcmp (optarg, "lzw") == 0)
+	    compression = TIFF_COMPRESSION_LZW;
+	  else if (strcmp (optarg, "g4") == 0)
+	    compression = TIFF_COMPRESSION_CCITT_G4;
+	  else
+	    {
+	      fprintf (stderr, "%s: unknown compression `%s'\n",
+		       prog_name, optarg);
+	      exit (1);
+	    }
+	  break;
 	case OPTION_FORMAT:
 	  if (strcmp (optarg, "tiff") == 0)
 	    output_format = OUTPUT_TIFF;
@@ -1944,8 +2255,11 @@ standard output.\n\
 Parameters are separated by a blank from single-character options (e.g.\n\
 -d epson) and by a \"=\" from multi-character options (e.g. --device-name=epson).\n\
 -d, --device-name=DEVICE   use a given scanner device (e.g. hp:/dev/scanner)\n\
-    --format=pnm|tiff      file format of output file\n\
--i, --icc-profile=PROFILE  include this ICC profile into TIFF file\n", prog_name);
+    --format=pnm|tiff      file format of output file\n", prog_name);
+      printf ("\
+    --compression=none|packbits|lzw|g4\n\
+                           compression of TIFF files (g4 for lineart)\n\
+-i, --icc-profile=PROFILE  include this ICC profile into TIFF file\n");
       printf ("\
 -L, --list-devices         show available scanner devices\n\
 -f, --formatted-device-list=FORMAT similar to -L, but the FORMAT of the output\n\
@@ -1964,6 +2278,8 @@ Parameters are separated by a blank from single-character options (e.g.\n\
     --accept-md5-only      only accept authorization requests using md5\n");
       printf ("\
 -p, --progress             print progress messages\n\
+    --stats                print time spent reading and writing data\n");
+      printf ("\
 -n, --dont-scan            only set options, don't actually scan\n\
 -T, --test                 test backend thoroughly\n\
 -A, --all-options          list all available backend options\n\
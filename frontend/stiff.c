@@ -27,8 +27,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "../include/sane/config.h"
+
+#include <unistd.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "../include/sane/sane.h"
 
 #include "stiff.h"
@@ -144,17 +151,20 @@ write_i4 (FILE *fptr, int val, int motorola)
 }
 
 static void
-write_ifd (FILE *fptr, IFD *ifd, int motorola)
-{int k;
-    IFD_ENTRY *ifde;
-
-    if (!ifd) return;
-
+write_tiff_file_header (FILE *fptr, int ifd_offset, int motorola)
+{
     if (motorola) putc ('M', fptr), putc ('M', fptr);
     else putc ('I', fptr), putc ('I', fptr);
 
     write_i2 (fptr, 42, motorola);  /* Magic */
-    write_i4 (fptr, 8, motorola);   /* Offset to first IFD */
+    write_i4 (fptr, ifd_offset, motorola);   /* Offset to first IFD */
+}
+
+static void
+write_ifd_entries (FILE *fptr, IFD *ifd, int motorola)
+{int k;
+    IFD_ENTRY *ifde;
+
     write_i2 (fptr, ifd->ntags, motorola);
 
     for (k = 0; k < ifd->ntags; k++)
@@ -176,6 +186,15 @@ write_ifd (FILE *fptr, IFD *ifd, int motorola)
     write_i4 (fptr, 0, motorola); /* End of IFD chain */
 }
 
+static void
+write_ifd (FILE *fptr, IFD *ifd, int motorola)
+{
+    if (!ifd) return;
+
+    write_tiff_file_header (fptr, 8, motorola);
+    write_ifd_entries (fptr, ifd, motorola);
+}
+
 
 static void
 write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
@@ -608,3 +627,954 @@ sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
         break;
     }
 }
+
+
+/* Compressed TIFF files.  The image is cut into strips of about
+   TIFF_STRIP_SIZE bytes which are compressed one by one, so several
+   threads can encode strips while the scan goes on.  Strips are written
+   in order as soon as they are done, and the IFD with the strip offset
+   and byte count tables follows them at the end of the file.  The
+   header is then pointed at the IFD; if the output can't seek (a pipe),
+   the compressed strips are kept in memory and the whole file is
+   written when the image is complete.  */
+
+#define TIFF_STRIP_SIZE   (128 * 1024)
+#define TIFF_MAX_THREADS  8
+
+#define STRIP_FREE    0         /* being filled, or not in use */
+#define STRIP_QUEUED  1         /* full, waiting for a thread */
+#define STRIP_BUSY    2         /* being compressed */
+#define STRIP_DONE    3         /* compressed, waiting to be written */
+
+typedef struct {
+    SANE_Byte *raw;             /* the rows as scanned */
+    SANE_Byte *data;            /* the compressed strip */
+    size_t size, len;           /* allocated and used bytes of data */
+    int rows, state, error;
+} TIFF_STRIP;
+
+struct TIFF_Writer {
+    FILE *fptr;
+    int width, depth, resolution, compression;
+    const char *icc_profile;
+    int samples, motorola;
+    size_t row_bytes, strip_bytes;
+    int rows_per_strip, rows;
+    long base;                  /* file position of the header, or -1 */
+    long pos;                   /* bytes of strips written so far */
+    size_t fill;                /* bytes in the strip being filled */
+    TIFF_STRIP strip[2 * TIFF_MAX_THREADS + 1];
+    int nslots, head, cur;      /* oldest strip not written, strip filled */
+    long *offsets, *counts;     /* strip tables, relative to first strip */
+    SANE_Byte **held;           /* strips kept in memory for a pipe */
+    int nstrips, maxstrips;
+    SANE_Status status;
+#ifdef HAVE_PTHREAD_H
+    int nthreads, quit;
+    pthread_t thread[TIFF_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+typedef struct {
+    TIFF_STRIP *s;
+    unsigned long acc;
+    int nbits;
+} BIT_OUT;
+
+typedef struct {
+    unsigned short code, len;
+} G4_CODE;
+
+/* white runs 0 to 63, then 64 to 1728 in steps of 64 */
+static const G4_CODE g4_white[91] = {
+    {0x035,  8}, {0x007,  6}, {0x007,  4}, {0x008,  4}, {0x00b,  4},
+    {0x00c,  4}, {0x00e,  4}, {0x00f,  4}, {0x013,  5}, {0x014,  5},
+    {0x007,  5}, {0x008,  5}, {0x008,  6}, {0x003,  6}, {0x034,  6},
+    {0x035,  6}, {0x02a,  6}, {0x02b,  6}, {0x027,  7}, {0x00c,  7},
+    {0x008,  7}, {0x017,  7}, {0x003,  7}, {0x004,  7}, {0x028,  7},
+    {0x02b,  7}, {0x013,  7}, {0x024,  7}, {0x018,  7}, {0x002,  8},
+    {0x003,  8}, {0x01a,  8}, {0x01b,  8}, {0x012,  8}, {0x013,  8},
+    {0x014,  8}, {0x015,  8}, {0x016,  8}, {0x017,  8}, {0x028,  8},
+    {0x029,  8}, {0x02a,  8}, {0x02b,  8}, {0x02c,  8}, {0x02d,  8},
+    {0x004,  8}, {0x005,  8}, {0x00a,  8}, {0x00b,  8}, {0x052,  8},
+    {0x053,  8}, {0x054,  8}, {0x055,  8}, {0x024,  8}, {0x025,  8},
+    {0x058,  8}, {0x059,  8}, {0x05a,  8}, {0x05b,  8}, {0x04a,  8},
+    {0x04b,  8}, {0x032,  8}, {0x033,  8}, {0x034,  8}, {0x01b,  5},
+    {0x012,  5}, {0x017,  6}, {0x037,  7}, {0x036,  8}, {0x037,  8},
+    {0x064,  8}, {0x065,  8}, {0x068,  8}, {0x067,  8}, {0x0cc,  9},
+    {0x0cd,  9}, {0x0d2,  9}, {0x0d3,  9}, {0x0d4,  9}, {0x0d5,  9},
+    {0x0d6,  9}, {0x0d7,  9}, {0x0d8,  9}, {0x0d9,  9}, {0x0da,  9},
+    {0x0db,  9}, {0x098,  9}, {0x099,  9}, {0x09a,  9}, {0x018,  6},
+    {0x09b,  9}
+};
+
+/* black runs 0 to 63, then 64 to 1728 in steps of 64 */
+static const G4_CODE g4_black[91] = {
+    {0x037, 10}, {0x002,  3}, {0x003,  2}, {0x002,  2}, {0x003,  3},
+    {0x003,  4}, {0x002,  4}, {0x003,  5}, {0x005,  6}, {0x004,  6},
+    {0x004,  7}, {0x005,  7}, {0x007,  7}, {0x004,  8}, {0x007,  8},
+    {0x018,  9}, {0x017, 10}, {0x018, 10}, {0x008, 10}, {0x067, 11},
+    {0x068, 11}, {0x06c, 11}, {0x037, 11}, {0x028, 11}, {0x017, 11},
+    {0x018, 11}, {0x0ca, 12}, {0x0cb, 12}, {0x0cc, 12}, {0x0cd, 12},
+    {0x068, 12}, {0x069, 12}, {0x06a, 12}, {0x06b, 12}, {0x0d2, 12},
+    {0x0d3, 12}, {0x0d4, 12}, {0x0d5, 12}, {0x0d6, 12}, {0x0d7, 12},
+    {0x06c, 12}, {0x06d, 12}, {0x0da, 12}, {0x0db, 12}, {0x054, 12},
+    {0x055, 12}, {0x056, 12}, {0x057, 12}, {0x064, 12}, {0x065, 12},
+    {0x052, 12}, {0x053, 12}, {0x024, 12}, {0x037, 12}, {0x038, 12},
+    {0x027, 12}, {0x028, 12}, {0x058, 12}, {0x059, 12}, {0x02b, 12},
+    {0x02c, 12}, {0x05a, 12}, {0x066, 12}, {0x067, 12}, {0x00f, 10},
+    {0x0c8, 12}, {0x0c9, 12}, {0x05b, 12}, {0x033, 12}, {0x034, 12},
+    {0x035, 12}, {0x06c, 13}, {0x06d, 13}, {0x04a, 13}, {0x04b, 13},
+    {0x04c, 13}, {0x04d, 13}, {0x072, 13}, {0x073, 13}, {0x074, 13},
+    {0x075, 13}, {0x076, 13}, {0x077, 13}, {0x052, 13}, {0x053, 13},
+    {0x054, 13}, {0x055, 13}, {0x05a, 13}, {0x05b, 13}, {0x064, 13},
+    {0x065, 13}
+};
+
+/* runs 1792 to 2560 in steps of 64, of either colour */
+static const G4_CODE g4_extended[13] = {
+    {0x008, 11}, {0x00c, 11}, {0x00d, 11}, {0x012, 12}, {0x013, 12},
+    {0x014, 12}, {0x015, 12}, {0x016, 12}, {0x017, 12}, {0x01c, 12},
+    {0x01d, 12}, {0x01e, 12}, {0x01f, 12}
+};
+
+static int
+strip_put (TIFF_STRIP *s, int byte)
+{
+    if (s->len == s->size)
+    {SANE_Byte *data;
+        size_t size = s->size ? 2 * s->size : 4096;
+
+        data = (SANE_Byte *)realloc (s->data, size);
+        if (data == NULL) return -1;
+        s->data = data;
+        s->size = size;
+    }
+    s->data[s->len++] = byte;
+    return 0;
+}
+
+/* append len bits of code, most significant bit first */
+static int
+put_bits (BIT_OUT *b, unsigned int code, int len)
+{
+    b->acc = (b->acc << len) | code;
+    b->nbits += len;
+    while (b->nbits >= 8)
+    {
+        b->nbits -= 8;
+        if (strip_put (b->s, (b->acc >> b->nbits) & 0xff)) return -1;
+    }
+    return 0;
+}
+
+static int
+flush_bits (BIT_OUT *b)
+{
+    if (b->nbits > 0) return put_bits (b, 0, 8 - b->nbits);
+    return 0;
+}
+
+/* PackBits: runs of a repeated byte, or up to 128 literal bytes.  Each
+   row is packed on its own, as TIFF requires.  */
+static int
+encode_packbits (TIFF_Writer *tw, TIFF_STRIP *s)
+{int r;
+    size_t i, j, run, n = tw->row_bytes;
+    SANE_Byte *p;
+
+    for (r = 0; r < s->rows; r++)
+    {
+        p = s->raw + r * n;
+        i = 0;
+        while (i < n)
+        {
+            run = 1;
+            while (i + run < n && run < 128 && p[i + run] == p[i]) run++;
+
+            if (run > 1)
+            {
+                if (strip_put (s, (1 - (int) run) & 0xff)
+                    || strip_put (s, p[i])) return -1;
+                i += run;
+                continue;
+            }
+
+            /* a literal, up to the next pair of equal bytes */
+            j = i + 1;
+            while (j < n && j - i < 128 && !(j + 1 < n && p[j] == p[j + 1]))
+                j++;
+            if (strip_put (s, (int) (j - i - 1))) return -1;
+            while (i < j)
+                if (strip_put (s, p[i++])) return -1;
+        }
+    }
+    return 0;
+}
+
+/* horizontal differencing (predictor 2), which lets LZW find the
+   repeats in smooth areas of gray and color images */
+static void
+predict_rows (TIFF_Writer *tw, TIFF_STRIP *s)
+{int r, x, n;
+
+    n = tw->width * tw->samples;
+    for (r = 0; r < s->rows; r++)
+    {
+        if (tw->depth == 16)
+        {unsigned short *p = (unsigned short *)(s->raw + r * tw->row_bytes);
+
+            for (x = n - 1; x >= tw->samples; x--)
+                p[x] -= p[x - tw->samples];
+        }
+        else
+        {SANE_Byte *p = s->raw + r * tw->row_bytes;
+
+            for (x = n - 1; x >= tw->samples; x--)
+                p[x] -= p[x - tw->samples];
+        }
+    }
+}
+
+#define LZW_CLEAR     256
+#define LZW_EOI       257
+#define LZW_FIRST     258
+#define LZW_MAX       4095
+#define LZW_HASH_SIZE 9001      /* prime, about twice LZW_MAX */
+
+/* LZW as libtiff writes it: codes of 9 to 12 bits, switched one code
+   early, and a clear code whenever the table fills up */
+static int
+encode_lzw (TIFF_Writer *tw, TIFF_STRIP *s)
+{BIT_OUT b;
+    long *key;
+    short *code;
+    long k;
+    int h, ent, next = LZW_FIRST, nbits = 9, maxcode = 511;
+    size_t i, n = tw->row_bytes * s->rows;
+
+    key = (long *)malloc (LZW_HASH_SIZE * sizeof (long));
+    code = (short *)malloc (LZW_HASH_SIZE * sizeof (short));
+    if (key == NULL || code == NULL)
+    {
+        free (key);
+        free (code);
+        return -1;
+    }
+    for (h = 0; h < LZW_HASH_SIZE; h++) key[h] = -1;
+
+    b.s = s;
+    b.acc = 0;
+    b.nbits = 0;
+    if (put_bits (&b, LZW_CLEAR, nbits)) goto nomem;
+
+    ent = s->raw[0];
+    for (i = 1; i < n; i++)
+    {
+        k = ((long) ent << 8) | s->raw[i];
+        h = (int) (((long) s->raw[i] << 4 ^ ent) % LZW_HASH_SIZE);
+        while (key[h] != -1 && key[h] != k)
+            if (++h == LZW_HASH_SIZE) h = 0;
+        if (key[h] == k)
+        {
+            ent = code[h];
+            continue;
+        }
+
+        if (put_bits (&b, ent, nbits)) goto nomem;
+        ent = s->raw[i];
+        key[h] = k;
+        code[h] = next++;
+        if (next == LZW_MAX - 1)
+        {
+            if (put_bits (&b, LZW_CLEAR, nbits)) goto nomem;
+            for (h = 0; h < LZW_HASH_SIZE; h++) key[h] = -1;
+            next = LZW_FIRST;
+            nbits = 9;
+            maxcode = 511;
+        }
+        else if (next > maxcode)
+        {
+            nbits++;
+            maxcode = (1 << nbits) - 1;
+        }
+    }
+
+    /* the decoder adds a table entry for the last code as well */
+    if (put_bits (&b, ent, nbits)) goto nomem;
+    next++;
+    if (next == LZW_MAX - 1)
+    {
+        if (put_bits (&b, LZW_CLEAR, nbits)) goto nomem;
+        nbits = 9;
+    }
+    else if (next > maxcode)
+        nbits++;
+    if (put_bits (&b, LZW_EOI, nbits) || flush_bits (&b)) goto nomem;
+
+    free (key);
+    free (code);
+    return 0;
+
+nomem:
+    free (key);
+    free (code);
+    return -1;
+}
+
+static int
+g4_pixel (const SANE_Byte *row, int x, int width)
+{
+    if (x >= width) return 0;
+    return (row[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+/* the first pixel from x on that is not of colour, or width */
+static int
+g4_find (const SANE_Byte *row, int x, int width, int colour)
+{int skip = colour ? 0xff : 0;
+
+    while (x < width && (x & 7))
+    {
+        if (g4_pixel (row, x, width) != colour) return x;
+        x++;
+    }
+    while (x + 8 <= width && row[x >> 3] == skip) x += 8;
+    while (x < width && g4_pixel (row, x, width) == colour) x++;
+    return x;
+}
+
+static int
+g4_put_code (BIT_OUT *b, const G4_CODE *c)
+{
+    return put_bits (b, c->code, c->len);
+}
+
+/* a run: makeup codes for multiples of 64, then a terminating code */
+static int
+g4_put_run (BIT_OUT *b, const G4_CODE *tab, int run)
+{int m;
+
+    while (run >= 2560 + 64)
+    {
+        if (g4_put_code (b, &g4_extended[12])) return -1;
+        run -= 2560;
+    }
+    if (run >= 64)
+    {
+        m = run >> 6;
+        if (g4_put_code (b, m <= 27 ? &tab[63 + m] : &g4_extended[m - 28]))
+            return -1;
+        run &= 63;
+    }
+    return g4_put_code (b, &tab[run]);
+}
+
+/* CCITT T.6: every row is coded against the one above it, the first
+   row of a strip against an imaginary white row */
+static int
+encode_g4 (TIFF_Writer *tw, TIFF_STRIP *s)
+{static const G4_CODE pass = {0x1, 4}, horiz = {0x1, 3};
+    static const G4_CODE vert[7] = {
+        {0x03, 7}, {0x03, 6}, {0x03, 3}, {0x1, 1}, {0x2, 3}, {0x02, 6}, {0x02, 7}
+    };
+    BIT_OUT b;
+    SANE_Byte *white, *ref, *cur;
+    int r, a0, a1, a2, b1, b2, d, colour, width = tw->width;
+
+    white = (SANE_Byte *)calloc (tw->row_bytes, 1);
+    if (white == NULL) return -1;
+
+    b.s = s;
+    b.acc = 0;
+    b.nbits = 0;
+    ref = white;
+    for (r = 0; r < s->rows; r++, ref = cur)
+    {
+        cur = s->raw + r * tw->row_bytes;
+
+        /* a0 starts as a white pixel in front of the row */
+        a0 = 0;
+        colour = 0;
+        a1 = g4_pixel (cur, 0, width) ? 0 : g4_find (cur, 0, width, 0);
+        b1 = g4_pixel (ref, 0, width) ? 0 : g4_find (ref, 0, width, 0);
+        for (;;)
+        {
+            b2 = g4_find (ref, b1, width, g4_pixel (ref, b1, width));
+            if (b2 < a1)
+            {
+                if (g4_put_code (&b, &pass)) goto nomem;
+                a0 = b2;
+            }
+            else if ((d = b1 - a1) >= -3 && d <= 3)
+            {
+                if (g4_put_code (&b, &vert[d + 3])) goto nomem;
+                a0 = a1;
+                colour = !colour;
+            }
+            else
+            {
+                a2 = g4_find (cur, a1, width, !colour);
+                if (g4_put_code (&b, &horiz)
+                    || g4_put_run (&b, colour ? g4_black : g4_white, a1 - a0)
+                    || g4_put_run (&b, colour ? g4_white : g4_black, a2 - a1))
+                    goto nomem;
+                a0 = a2;
+            }
+            if (a0 >= width) break;
+
+            a1 = g4_find (cur, a0, width, colour);
+            b1 = g4_find (ref, a0, width, !colour);
+            b1 = g4_find (ref, b1, width, colour);
+        }
+    }
+
+    /* end of facsimile block: two EOLs */
+    if (put_bits (&b, 1, 12) || put_bits (&b, 1, 12) || flush_bits (&b))
+        goto nomem;
+    free (white);
+    return 0;
+
+nomem:
+    free (white);
+    return -1;
+}
+
+static int
+encode_strip (TIFF_Writer *tw, TIFF_STRIP *s)
+{
+    s->len = 0;
+    switch (tw->compression)
+    {
+    case TIFF_COMPRESSION_PACKBITS:
+        return encode_packbits (tw, s);
+
+    case TIFF_COMPRESSION_LZW:
+        if (tw->depth > 1) predict_rows (tw, s);
+        return encode_lzw (tw, s);
+
+    case TIFF_COMPRESSION_CCITT_G4:
+        return encode_g4 (tw, s);
+
+    default:
+        {size_t i, n = tw->row_bytes * s->rows;
+
+            for (i = 0; i < n; i++)
+                if (strip_put (s, s->raw[i])) return -1;
+        }
+        return 0;
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+tiff_worker (void *arg)
+{TIFF_Writer *tw = (TIFF_Writer *)arg;
+    TIFF_STRIP *s;
+    int k;
+
+    pthread_mutex_lock (&tw->lock);
+    for (;;)
+    {
+        /* the oldest queued strip is needed first */
+        for (k = 0, s = NULL; k < tw->nslots; k++)
+        {
+            s = &tw->strip[(tw->head + k) % tw->nslots];
+            if (s->state == STRIP_QUEUED) break;
+        }
+        if (k == tw->nslots)
+        {
+            if (tw->quit) break;
+            pthread_cond_wait (&tw->cond, &tw->lock);
+            continue;
+        }
+
+        s->state = STRIP_BUSY;
+        pthread_mutex_unlock (&tw->lock);
+        s->error = encode_strip (tw, s);
+        pthread_mutex_lock (&tw->lock);
+        s->state = STRIP_DONE;
+        pthread_cond_broadcast (&tw->cond);
+    }
+    pthread_mutex_unlock (&tw->lock);
+
+    return NULL;
+}
+#endif
+
+/* write out the oldest strip, once it is compressed */
+static void
+write_strip (TIFF_Writer *tw)
+{TIFF_STRIP *s = &tw->strip[tw->head];
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (&tw->lock);
+    while (s->state != STRIP_DONE)
+        pthread_cond_wait (&tw->cond, &tw->lock);
+    pthread_mutex_unlock (&tw->lock);
+#endif
+
+    if (s->error && tw->status == SANE_STATUS_GOOD)
+        tw->status = SANE_STATUS_NO_MEM;
+
+    if (tw->nstrips == tw->maxstrips && tw->status == SANE_STATUS_GOOD)
+    {long *offsets, *counts;
+        SANE_Byte **held;
+        int max = tw->maxstrips ? 2 * tw->maxstrips : 64;
+
+        offsets = (long *)realloc (tw->offsets, max * sizeof (long));
+        if (offsets) tw->offsets = offsets;
+        counts = (long *)realloc (tw->counts, max * sizeof (long));
+        if (counts) tw->counts = counts;
+        held = (SANE_Byte **)realloc (tw->held, max * sizeof (SANE_Byte *));
+        if (held) tw->held = held;
+
+        if (offsets && counts && held) tw->maxstrips = max;
+        else tw->status = SANE_STATUS_NO_MEM;
+    }
+
+    if (tw->status == SANE_STATUS_GOOD)
+    {
+        tw->offsets[tw->nstrips] = tw->pos;
+        tw->counts[tw->nstrips] = s->len;
+        tw->held[tw->nstrips] = NULL;
+        if (tw->base < 0)
+        {
+            tw->held[tw->nstrips] = s->data;
+            s->data = NULL;
+            s->size = 0;
+        }
+        else if (fwrite (s->data, 1, s->len, tw->fptr) != s->len)
+            tw->status = SANE_STATUS_IO_ERROR;
+        tw->pos += s->len;
+        tw->nstrips++;
+    }
+
+    s->len = 0;
+    s->state = STRIP_FREE;
+    tw->head = (tw->head + 1) % tw->nslots;
+}
+
+/* hand the strip being filled over for compression */
+static void
+queue_strip (TIFF_Writer *tw, int rows)
+{TIFF_STRIP *s = &tw->strip[tw->cur];
+
+    s->rows = rows;
+    tw->rows += rows;
+
+#ifdef HAVE_PTHREAD_H
+    if (tw->nthreads > 0)
+    {
+        pthread_mutex_lock (&tw->lock);
+        s->state = STRIP_QUEUED;
+        pthread_cond_broadcast (&tw->cond);
+        pthread_mutex_unlock (&tw->lock);
+    }
+    else
+#endif
+    {
+        s->error = encode_strip (tw, s);
+        s->state = STRIP_DONE;
+    }
+
+    tw->cur = (tw->cur + 1) % tw->nslots;
+    tw->fill = 0;
+    if (tw->strip[tw->cur].state != STRIP_FREE)
+        write_strip (tw);
+}
+
+static FILE *
+open_icc_profile (const char *icc_profile, int *icc_len)
+{FILE *icc_file;
+
+    *icc_len = -1;
+    if (!icc_profile) return NULL;
+
+    icc_file = fopen (icc_profile, "r");
+    if (!icc_file)
+    {
+        fprintf (stderr, "Could not open ICC profile %s\n", icc_profile);
+        return NULL;
+    }
+    *icc_len = 16777216 * fgetc (icc_file) + 65536 * fgetc (icc_file)
+               + 256 * fgetc (icc_file) + fgetc (icc_file);
+    rewind (icc_file);
+    return icc_file;
+}
+
+/* number of IFD entries, and size of the values that don't fit */
+static int
+tiff_writer_ntags (TIFF_Writer *tw, int icc_len, int *data_size)
+{int ntags = 11;
+
+    *data_size = 0;
+    if (tw->samples == 1 && tw->depth == 1) ntags += 1;
+    else ntags += 2;
+    if (tw->samples == 3) *data_size += 3*2 + 3*2 + 3*2;
+    if (tw->nstrips > 1) *data_size += 2 * tw->nstrips*4;
+    if (tw->resolution > 0)
+    {
+        ntags += 3;
+        *data_size += 2*4 + 2*4;
+    }
+    if (tw->compression == TIFF_COMPRESSION_CCITT_G4) ntags += 1;
+    if (tw->compression == TIFF_COMPRESSION_LZW && tw->depth > 1) ntags += 1;
+    if (icc_len > 0)
+    {
+        ntags += 1;
+        *data_size += icc_len;
+    }
+    return ntags;
+}
+
+/* the IFD and the values that don't fit into it, at ifd_offset */
+static void
+write_tiff_writer_ifd (TIFF_Writer *tw, int ifd_offset, int strip_offset,
+                       FILE *icc_file, int icc_len)
+{IFD *ifd;
+    int ntags, data_offset, data_size, k;
+    int maxsamplevalue, bw = (tw->samples == 1 && tw->depth == 1);
+    int predictor = (tw->compression == TIFF_COMPRESSION_LZW && !bw);
+
+    ifd = create_ifd ();
+    maxsamplevalue = (tw->depth <= 8) ? 255 : 65535;
+
+    ntags = tiff_writer_ntags (tw, icc_len, &data_size);
+    data_offset = ifd_offset + 2 + ntags*12 + 4;
+
+    /* New subfile type */
+    add_ifd_entry (ifd, 254, IFDE_TYP_LONG, 1, 0);
+    /* image width */
+    add_ifd_entry (ifd, 256, (tw->width > 0xffff) ? IFDE_TYP_LONG : IFDE_TYP_SHORT,
+                   1, tw->width);
+    /* image length */
+    add_ifd_entry (ifd, 257, (tw->rows > 0xffff) ? IFDE_TYP_LONG : IFDE_TYP_SHORT,
+                   1, tw->rows);
+    /* bits per sample */
+    if (tw->samples == 3)
+    {
+        add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 3, data_offset);
+        data_offset += 3*2;
+    }
+    else
+        add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 1, tw->depth);
+    /* compression */
+    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, tw->compression);
+    /* photometric interpretation */
+    add_ifd_entry (ifd, 262, IFDE_TYP_SHORT, 1,
+                   (tw->samples == 3) ? 2 : (bw ? 0 : 1));
+    /* fill order */
+    if (bw)
+        add_ifd_entry (ifd, 266, IFDE_TYP_SHORT, 1, 1);
+    /* strip offsets */
+    if (tw->nstrips == 1)
+        add_ifd_entry (ifd, 273, IFDE_TYP_LONG, 1, strip_offset);
+    else
+    {
+        add_ifd_entry (ifd, 273, IFDE_TYP_LONG, tw->nstrips, data_offset);
+        data_offset += tw->nstrips*4;
+    }
+    /* orientation */
+    add_ifd_entry (ifd, 274, IFDE_TYP_SHORT, 1, 1);
+    /* samples per pixel */
+    add_ifd_entry (ifd, 277, IFDE_TYP_SHORT, 1, tw->samples);
+    /* rows per strip */
+    add_ifd_entry (ifd, 278, IFDE_TYP_LONG, 1, tw->rows_per_strip);
+    /* strip bytecounts */
+    if (tw->nstrips == 1)
+        add_ifd_entry (ifd, 279, IFDE_TYP_LONG, 1, (int) tw->counts[0]);
+    else
+    {
+        add_ifd_entry (ifd, 279, IFDE_TYP_LONG, tw->nstrips, data_offset);
+        data_offset += tw->nstrips*4;
+    }
+    if (!bw)
+    {
+        /* min/max sample value */
+        if (tw->samples == 3)
+        {
+            add_ifd_entry (ifd, 280, IFDE_TYP_SHORT, 3, data_offset);
+            data_offset += 3*2;
+            add_ifd_entry (ifd, 281, IFDE_TYP_SHORT, 3, data_offset);
+            data_offset += 3*2;
+        }
+        else
+        {
+            add_ifd_entry (ifd, 280, IFDE_TYP_SHORT, 1, 0);
+            add_ifd_entry (ifd, 281, IFDE_TYP_SHORT, 1, maxsamplevalue);
+        }
+    }
+    if (tw->resolution > 0)
+    {
+        /* x resolution */
+        add_ifd_entry (ifd, 282, IFDE_TYP_RATIONAL, 1, data_offset);
+        data_offset += 2*4;
+        /* y resolution */
+        add_ifd_entry (ifd, 283, IFDE_TYP_RATIONAL, 1, data_offset);
+        data_offset += 2*4;
+    }
+    if (tw->compression == TIFF_COMPRESSION_CCITT_G4)
+    {
+        /* T6 options (none) */
+        add_ifd_entry (ifd, 293, IFDE_TYP_LONG, 1, 0);
+    }
+    if (tw->resolution > 0)
+    {
+        /* resolution unit (dpi) */
+        add_ifd_entry (ifd, 296, IFDE_TYP_SHORT, 1, 2);
+    }
+    if (predictor)
+    {
+        /* predictor (horizontal differencing) */
+        add_ifd_entry (ifd, 317, IFDE_TYP_SHORT, 1, 2);
+    }
+    if (icc_len > 0) /* add ICC-profile TAG */
+    {
+      add_ifd_entry(ifd, 34675, 7, icc_len, data_offset);
+      data_offset += icc_len;
+    }
+
+    write_ifd_entries (tw->fptr, ifd, tw->motorola);
+
+    /* the values, in the order of their tags */
+    if (tw->samples == 3)
+        for (k = 0; k < 3; k++)
+            write_i2 (tw->fptr, tw->depth, tw->motorola);
+    if (tw->nstrips > 1)
+    {
+        for (k = 0; k < tw->nstrips; k++)
+            write_i4 (tw->fptr, (int) (strip_offset + tw->offsets[k]),
+                      tw->motorola);
+        for (k = 0; k < tw->nstrips; k++)
+            write_i4 (tw->fptr, (int) tw->counts[k], tw->motorola);
+    }
+    if (tw->samples == 3)
+    {
+        for (k = 0; k < 3; k++)
+            write_i2 (tw->fptr, 0, tw->motorola);
+        for (k = 0; k < 3; k++)
+            write_i2 (tw->fptr, maxsamplevalue, tw->motorola);
+    }
+    if (tw->resolution > 0)
+    {
+        write_i4 (tw->fptr, tw->resolution, tw->motorola);
+        write_i4 (tw->fptr, 1, tw->motorola);
+        write_i4 (tw->fptr, tw->resolution, tw->motorola);
+        write_i4 (tw->fptr, 1, tw->motorola);
+    }
+    if (icc_len > 0)
+    {
+      int i;
+      for (i=0; i<icc_len; i++)
+      {
+        if (!feof(icc_file))
+        {
+          fputc(fgetc(icc_file), tw->fptr);
+        }
+        else
+        {
+          fprintf(stderr, "ICC profile %s is too short\n", tw->icc_profile);
+          break;
+        }
+      }
+    }
+
+    free_ifd (ifd);
+}
+
+TIFF_Writer *
+sanei_tiff_writer_open (FILE *fptr, SANE_Frame format, int width, int depth,
+                        int resolution, const char *icc_profile,
+                        int compression)
+{TIFF_Writer *tw;
+    int k;
+
+    tw = (TIFF_Writer *)calloc (1, sizeof (TIFF_Writer));
+    if (tw == NULL) return NULL;
+
+    tw->fptr = fptr;
+    tw->width = width;
+    tw->depth = depth;
+    tw->resolution = resolution;
+    tw->icc_profile = icc_profile;
+    tw->status = SANE_STATUS_GOOD;
+
+    tw->samples = (format == SANE_FRAME_GRAY) ? 1 : 3;
+    if (tw->samples == 1 && depth == 1)
+        tw->row_bytes = (width + 7) / 8;
+    else
+        tw->row_bytes = width * tw->samples * ((depth <= 8) ? 1 : 2);
+
+    if (compression == TIFF_COMPRESSION_CCITT_G4
+        && (tw->samples != 1 || depth != 1))
+    {
+        fprintf (stderr, "CCITT G4 needs a lineart image, using LZW\n");
+        compression = TIFF_COMPRESSION_LZW;
+    }
+    tw->compression = compression;
+
+    /* as for the uncompressed headers: motorola, but for 16 bit, */
+    /* the image format is defined by SANE to be the native byte order */
+    if (depth <= 8)
+    {
+        tw->motorola = 1;
+    }
+    else
+    {int check = 1;
+        tw->motorola = ((*((char *)&check)) == 0);
+    }
+
+    tw->rows_per_strip = TIFF_STRIP_SIZE / tw->row_bytes;
+    if (tw->rows_per_strip < 1) tw->rows_per_strip = 1;
+    tw->strip_bytes = tw->rows_per_strip * tw->row_bytes;
+
+    tw->nslots = 1;
+#ifdef HAVE_PTHREAD_H
+    tw->nthreads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    tw->nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (tw->nthreads < 1) tw->nthreads = 1;
+    if (tw->nthreads > TIFF_MAX_THREADS) tw->nthreads = TIFF_MAX_THREADS;
+#endif
+    tw->nslots = 2 * tw->nthreads + 1;
+#endif
+
+    for (k = 0; k < tw->nslots; k++)
+    {
+        tw->strip[k].raw = (SANE_Byte *)malloc (tw->strip_bytes);
+        if (tw->strip[k].raw == NULL)
+        {
+            while (k-- > 0) free (tw->strip[k].raw);
+            free (tw);
+            return NULL;
+        }
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init (&tw->lock, NULL);
+    pthread_cond_init (&tw->cond, NULL);
+    for (k = 0; k < tw->nthreads; k++)
+        if (pthread_create (&tw->thread[k], NULL, tiff_worker, tw) != 0)
+            break;
+    tw->nthreads = k;           /* with none, strips are encoded in turn */
+#endif
+
+#ifdef __EMX__	/* OS2 - write in binary mode. */
+    if (fptr == stdout) _fsetmode(stdout, "b");
+#endif
+
+    /* point the header at the IFD once it is written, if we can */
+    tw->base = ftell (fptr);
+    if (tw->base >= 0 && fseek (fptr, tw->base, SEEK_SET) != 0)
+        tw->base = -1;
+    if (tw->base >= 0)
+        write_tiff_file_header (fptr, 0, tw->motorola);
+
+    return tw;
+}
+
+SANE_Status
+sanei_tiff_writer_write (TIFF_Writer *tw, const SANE_Byte *data, size_t len)
+{size_t n;
+
+    while (len > 0)
+    {
+        n = tw->strip_bytes - tw->fill;
+        if (n > len) n = len;
+        memcpy (tw->strip[tw->cur].raw + tw->fill, data, n);
+        tw->fill += n;
+        data += n;
+        len -= n;
+
+        if (tw->fill == tw->strip_bytes)
+            queue_strip (tw, tw->rows_per_strip);
+    }
+    return tw->status;
+}
+
+SANE_Status
+sanei_tiff_writer_close (TIFF_Writer *tw)
+{SANE_Status status;
+    FILE *icc_file;
+    int k, icc_len, rows, data_size, ifd_offset;
+
+    /* a partial last row is padded */
+    if (tw->fill > 0)
+    {
+        rows = (tw->fill + tw->row_bytes - 1) / tw->row_bytes;
+        memset (tw->strip[tw->cur].raw + tw->fill, 0,
+                rows * tw->row_bytes - tw->fill);
+        queue_strip (tw, rows);
+    }
+    while (tw->strip[tw->head].state != STRIP_FREE)
+        write_strip (tw);
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (&tw->lock);
+    tw->quit = 1;
+    pthread_cond_broadcast (&tw->cond);
+    pthread_mutex_unlock (&tw->lock);
+    for (k = 0; k < tw->nthreads; k++)
+        pthread_join (tw->thread[k], NULL);
+    pthread_cond_destroy (&tw->cond);
+    pthread_mutex_destroy (&tw->lock);
+#endif
+
+    if (tw->status == SANE_STATUS_GOOD && tw->nstrips > 0)
+    {
+        icc_file = open_icc_profile (tw->icc_profile, &icc_len);
+
+        if (tw->base >= 0)
+        {
+            /* strips, then the IFD at an even offset */
+            if (tw->pos & 1)
+            {
+                putc (0, tw->fptr);
+                tw->pos++;
+            }
+            ifd_offset = 8 + tw->pos;
+            write_tiff_writer_ifd (tw, ifd_offset, 8, icc_file, icc_len);
+            if (fseek (tw->fptr, tw->base + 4, SEEK_SET) == 0)
+            {
+                write_i4 (tw->fptr, ifd_offset, tw->motorola);
+                fseek (tw->fptr, 0, SEEK_END);
+            }
+            else
+                tw->status = SANE_STATUS_IO_ERROR;
+        }
+        else
+        {
+            /* the IFD, then the strips kept back */
+            k = tiff_writer_ntags (tw, icc_len, &data_size);
+            write_tiff_file_header (tw->fptr, 8, tw->motorola);
+            write_tiff_writer_ifd (tw, 8, 8 + 2 + k*12 + 4 + data_size,
+                                   icc_file, icc_len);
+            for (k = 0; k < tw->nstrips; k++)
+                if (fwrite (tw->held[k], 1, tw->counts[k], tw->fptr)
+                    != (size_t) tw->counts[k])
+                    tw->status = SANE_STATUS_IO_ERROR;
+        }
+
+        if (icc_file) fclose (icc_file);
+        if (ferror (tw->fptr)) tw->status = SANE_STATUS_IO_ERROR;
+    }
+
+    status = tw->status;
+    for (k = 0; k < tw->nslots; k++)
+    {
+        free (tw->strip[k].raw);
+        free (tw->strip[k].data);
+    }
+    if (tw->held)
+        for (k = 0; k < tw->nstrips; k++)
+            free (tw->held[k]);
+    free (tw->held);
+    free (tw->offsets);
+    free (tw->counts);
+    free (tw);
+
+    return status;
+}
@@ -18,3 +18,27 @@
 void
 sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
                          int resolution, const char *icc_profile);
+
+/* TIFF compression schemes */
+#define TIFF_COMPRESSION_NONE      1
+#define TIFF_COMPRESSION_CCITT_G4  4
+#define TIFF_COMPRESSION_LZW       5
+#define TIFF_COMPRESSION_PACKBITS  32773
+
+typedef struct TIFF_Writer TIFF_Writer;
+
+/* Start a compressed TIFF image on fptr.  Image data is passed to
+   sanei_tiff_writer_write in any amounts, the height is found from it.
+   CCITT G4 is only used for lineart, other images get LZW instead.
+   Returns NULL if out of memory.  */
+TIFF_Writer *
+sanei_tiff_writer_open (FILE *fptr, SANE_Frame format, int width, int depth,
+                        int resolution, const char *icc_profile,
+                        int compression);
+
+SANE_Status
+sanei_tiff_writer_write (TIFF_Writer *tw, const SANE_Byte *data, size_t len);
+
+/* Finish the image and free tw.  */
+SANE_Status
+sanei_tiff_writer_close (TIFF_Writer *tw);
@@ -49,6 +49,7 @@
  * - Despeckle (replace dots of significantly different color with background)
  * - Blank detection (check if density is over a threshold)
  * - Rotate (detect and correct 90 degree increment rotations)
+ * Large images can be split into bands, and processed by several threads.
  *
  * Note that these functions are simplistic, and are expected to change.
  * Patches and suggestions are welcome.
@@ -63,6 +64,51 @@
  */
 extern void sanei_magic_init( void );
 
+/** Set the number of threads used by each image operation.
+ * The default is 1, or the value of the SANE_MAGIC_THREADS environment
+ * variable. Output does not depend on the thread count. With more than
+ * one thread, sanei_magic_despeck works on bands of rows and does a band
+ * again in order when the band above changed the rows they share.
+ * Without pthread support, the count is always 1.
+ * @param threads number of threads, 0 means one per online cpu
+ */
+extern void sanei_magic_setThreads (int threads);
+
+/** Choose the method used to find the top edge of the media when
+ * detecting skew. The default is a Hough transform over the top edge
+ * transitions, the older method repeatedly bins pairs of transitions.
+ * Can also be set with the SANE_MAGIC_SKEW environment variable.
+ * @param name "hough" or "bins", NULL for the default
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_UNSUPPORTED - unknown method
+ */
+extern SANE_Status sanei_magic_selectSkew (const char * name);
+
+/** Choose the implementation used by sanei_magic_despeck. The default
+ * uses running minimums and summed-area tables, so the time taken does
+ * not grow with the diameter. The older loop visits every pixel of every
+ * window. Both give the same output, the loop is kept for comparison.
+ * Can also be set with the SANE_MAGIC_DESPECK environment variable.
+ * @param name "filter" or "loop", NULL for the default
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_UNSUPPORTED - unknown method
+ */
+extern SANE_Status sanei_magic_selectDespeck (const char * name);
+
+/** Choose how sanei_magic_rotate samples gray and color images. The
+ * default takes the nearest source pixel, bilinear blends the four
+ * around it, which is smoother but slower. Binary images always use
+ * the nearest pixel. Can also be set with the SANE_MAGIC_ROTATE
+ * environment variable.
+ * @param name "nearest" or "bilinear", NULL for the default
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_UNSUPPORTED - unknown method
+ */
+extern SANE_Status sanei_magic_selectRotate (const char * name);
+
 /** Update the image buffer, replacing dots with surrounding background color
  *
  * @param params describes image
@@ -98,6 +144,10 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   int dpiX, int dpiY, int * centerX, int * centerY, double * finSlope);
 
 /** Correct the skew of the media inside the image, via simple rotation
+ *
+ * Source positions are computed in fixed point, so a pixel whose source
+ * lies within about 1e-6 of a pixel edge may come from the neighbouring
+ * pixel.
  *
  * @param params describes image
  * @param buffer contains image data
@@ -115,6 +165,53 @@ extern SANE_Status
 sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
   int centerX, int centerY, double slope, int bg_color);
 
+/** Opaque working memory which can be reused by many rotations
+ * @sa sanei_magic_arenaNew
+ */
+typedef struct sanei_magic_arena SANEI_Magic_Arena;
+
+/** Create an arena for sanei_magic_rotateArena
+ *
+ * The arena keeps the largest buffer needed so far, so a backend which
+ * deskews every page does not allocate and fault in a new one for each.
+ * An arena must not be used by two rotations at the same time.
+ *
+ * @param[out] arena new arena, free with sanei_magic_arenaFree
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ */
+extern SANE_Status
+sanei_magic_arenaNew (SANEI_Magic_Arena ** arena);
+
+/** Correct the skew of the media, same as sanei_magic_rotate, building
+ * the rotated image in the arena before copying it back
+ *
+ * @param params describes image
+ * @param buffer contains image data
+ * @param centerX horizontal coordinate of center of rotation
+ * @param centerY vertical coordinate of center of rotation
+ * @param slope slope of rotation
+ * @param bg_color the replacement color for edges exposed by rotation
+ * @param arena arena from sanei_magic_arenaNew, NULL to allocate
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - invalid image parameters
+ */
+extern SANE_Status
+sanei_magic_rotateArena (SANE_Parameters * params, SANE_Byte * buffer,
+  int centerX, int centerY, double slope, int bg_color,
+  SANEI_Magic_Arena * arena);
+
+/** Release an arena and its buffer
+ *
+ * @param arena arena from sanei_magic_arenaNew, may be NULL
+ */
+extern void
+sanei_magic_arenaFree (SANEI_Magic_Arena * arena);
+
 /** Find the edges of the media inside the image, parallel to image edges
  *
  * @param params describes image
@@ -201,4 +298,159 @@ extern SANE_Status
 sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
   int angle);
 
+/** Operations for sanei_magic_process, run in this order
+ * @sa SANEI_Magic_Page
+ */
+#define SANEI_MAGIC_DESKEW  0x01 /**< find the skew, and rotate to correct */
+#define SANEI_MAGIC_CROP    0x02 /**< find the edges, and crop to them */
+#define SANEI_MAGIC_DESPECK 0x04 /**< remove small dots */
+#define SANEI_MAGIC_TURN    0x08 /**< turn by multiples of 90 degrees */
+#define SANEI_MAGIC_BLANK   0x10 /**< check if the result is blank */
+
+/** Opaque state of an incremental page analysis
+ * @sa sanei_magic_streamStart
+ */
+typedef struct sanei_magic_stream SANEI_Magic_Stream;
+
+/** One side of a page, the operations to run on it, and their results
+ *
+ * The backend fills in the first group of fields, and zeroes the rest.
+ * The results are kept, so the back side of a sheet can reuse them.
+ */
+typedef struct sanei_magic_page
+{
+  SANE_Parameters * params; /**< describes image, updated as it changes */
+  SANE_Byte * buffer;       /**< image data, changed in place */
+  int dpiX;                 /**< horizontal resolution */
+  int dpiY;                 /**< vertical resolution */
+  int ops;                  /**< SANEI_MAGIC_* operations to run */
+  int bgColor;              /**< fill for corners exposed by deskew */
+  int keepTop;              /**< do not crop the top, it has no edge */
+  int despeckDiam;          /**< maximum dot diameter to remove */
+  int findTurn;             /**< detect the turn needed first */
+  int turnAngle;            /**< added to the detected turn */
+  double blankThresh;       /**< maximum % density for blankness */
+  SANEI_Magic_Stream * stream; /**< all rows of buffer, already fed to a
+                            * stream, so skew and edges are read from it
+                            * instead of the buffer, or NULL */
+
+  SANE_Status skewStatus;   /**< result of finding the skew */
+  int skewX;                /**< horizontal center of rotation */
+  int skewY;                /**< vertical center of rotation */
+  double skewSlope;         /**< slope of rotation */
+  SANE_Status edgeStatus;   /**< result of finding the edges */
+  int top;                  /**< upper edge of media */
+  int bot;                  /**< lower edge of media */
+  int left;                 /**< left edge of media */
+  int right;                /**< right edge of media */
+  int isBlank;              /**< page was found to be blank */
+} SANEI_Magic_Page;
+
+/** Run several operations on an image, with as few copies as possible
+ *
+ * Deskew, crop, despeck, turn and blank detection are run in that
+ * order, as selected by page->ops. A deskewed image is left in the
+ * arena, and cropping copies it back, so the two together copy the
+ * image once. Operations which fail are skipped, and the others still
+ * run. Not finding the skew or edges of the media is not an error.
+ * A stream is only used while it holds exactly the rows of the buffer,
+ * and its edges only when the image was not rotated first.
+ *
+ * @param page describes image, operations and results
+ * @param mirror already processed front side of the same sheet, whose
+ * skew and edges are flipped and reused instead of detecting them
+ * again, or NULL
+ * @param arena arena from sanei_magic_arenaNew, NULL to allocate
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory for an operation
+ * - SANE_STATUS_INVAL - invalid image parameters for an operation
+ */
+extern SANE_Status
+sanei_magic_process (SANEI_Magic_Page * page,
+  const SANEI_Magic_Page * mirror, SANEI_Magic_Arena * arena);
+
+/** Start analysing a page which arrives a few rows at a time
+ *
+ * Only a small number of rows are kept, so a backend does not need to
+ * buffer the whole page to detect blank pages, edges or skew. The
+ * results of the query functions are the same as calling
+ * sanei_magic_isBlank, sanei_magic_findEdges or sanei_magic_findSkew on
+ * a buffer holding the rows seen so far. Queries may be made at any time,
+ * and more rows added afterwards.
+ *
+ * @param params describes image, lines is ignored and may be -1
+ * @param dpiX horizontal resolution
+ * @param dpiY vertical resolution
+ * @param[out] stream new stream, free with sanei_magic_streamFree
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - invalid image parameters
+ */
+extern SANE_Status
+sanei_magic_streamStart (SANE_Parameters * params, int dpiX, int dpiY,
+  SANEI_Magic_Stream ** stream);
+
+/** Add rows to a stream
+ * @param stream stream from sanei_magic_streamStart
+ * @param buffer contains lines rows of image data
+ * @param lines number of rows in buffer
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ */
+extern SANE_Status
+sanei_magic_streamRows (SANEI_Magic_Stream * stream, SANE_Byte * buffer,
+  int lines);
+
+/** Determine if rows seen so far are blank
+ * @param stream stream from sanei_magic_streamStart
+ * @param thresh maximum % density for blankness (0-100)
+ * @return
+ * - SANE_STATUS_GOOD - page is not blank
+ * - SANE_STATUS_NO_DOCS - page is blank
+ * - SANE_STATUS_INVAL - no rows seen yet
+ */
+extern SANE_Status
+sanei_magic_streamIsBlank (SANEI_Magic_Stream * stream, double thresh);
+
+/** Find the edges of the media in the rows seen so far
+ * @param stream stream from sanei_magic_streamStart
+ * @param[out] top vertical offset to upper edge of media
+ * @param[out] bot vertical offset to lower edge of media
+ * @param[out] left horizontal offset to left edge of media
+ * @param[out] right horizontal offset to right edge of media
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - no rows seen yet
+ * - SANE_STATUS_UNSUPPORTED - edges could not be detected
+ */
+extern SANE_Status
+sanei_magic_streamFindEdges (SANEI_Magic_Stream * stream,
+  int * top, int * bot, int * left, int * right);
+
+/** Find the skew of the media in the rows seen so far
+ * @param stream stream from sanei_magic_streamStart
+ * @param[out] centerX horizontal coordinate of center of rotation
+ * @param[out] centerY vertical coordinate of center of rotation
+ * @param[out] finSlope slope of rotation
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - no rows seen yet
+ * - SANE_STATUS_UNSUPPORTED - slope angle too shallow to detect
+ */
+extern SANE_Status
+sanei_magic_streamFindSkew (SANEI_Magic_Stream * stream,
+  int * centerX, int * centerY, double * finSlope);
+
+/** Release a stream
+ * @param stream stream from sanei_magic_streamStart, may be NULL
+ */
+extern void
+sanei_magic_streamFree (SANEI_Magic_Stream * stream);
+
 #endif /* SANEI_MAGIC_H */
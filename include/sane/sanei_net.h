@@ -22,6 +22,17 @@
 
 #define SANEI_NET_PROTOCOL_VERSION	3
 
+/* A client may add capability bits to the build number of the version
+   code it sends with SANE_NET_INIT.  Servers that don't know about them
+   ignore them.  A server that does answers with the protocol version
+   plus the bits it supports too, so each side only uses an extension
+   when both understand it.  */
+#define SANEI_NET_PROTOCOL_MASK		0x00ff
+#define SANEI_NET_CAP_LARGE_RECORDS	0x0100	/* big data channel records */
+#define SANEI_NET_CAP_BATCH_OPTIONS	0x0200	/* SANE_NET_CONTROL_OPTIONS */
+#define SANEI_NET_CAPS			(SANEI_NET_CAP_LARGE_RECORDS \
+					 | SANEI_NET_CAP_BATCH_OPTIONS)
+
 typedef enum
   {
     SANE_NET_LITTLE_ENDIAN = 0x1234,
@@ -41,7 +52,8 @@ typedef enum
     SANE_NET_START,
     SANE_NET_CANCEL,
     SANE_NET_AUTHORIZE,
-    SANE_NET_EXIT
+    SANE_NET_EXIT,
+    SANE_NET_CONTROL_OPTIONS	/* only with SANEI_NET_CAP_BATCH_OPTIONS */
   }
 SANE_Net_Procedure_Number;
 
@@ -103,6 +115,30 @@ typedef struct
   }
 SANE_Control_Option_Reply;
 
+/* Several control option requests for one handle, applied in order.
+   Every element must carry the same handle as the batch.  */
+typedef struct
+  {
+    SANE_Word handle;
+    SANE_Word num_options;
+    SANE_Control_Option_Req *req;
+  }
+SANE_Control_Options_Req;
+
+/* One reply per request, in the same order.  If any of them reported
+   SANE_INFO_RELOAD_OPTIONS, opt holds the new option descriptors,
+   otherwise opt.num_options is 0.  Authorization can't be requested
+   in a batch; such options report SANE_STATUS_ACCESS_DENIED and must
+   be repeated with SANE_NET_CONTROL_OPTION.  */
+typedef struct
+  {
+    SANE_Status status;
+    SANE_Word num_options;
+    SANE_Control_Option_Reply *reply;
+    SANE_Option_Descriptor_Array opt;
+  }
+SANE_Control_Options_Reply;
+
 typedef struct
   {
     SANE_Status status;
@@ -136,6 +172,10 @@ extern void sanei_w_option_descriptor_array (Wire *w,
 extern void sanei_w_control_option_req (Wire *w, SANE_Control_Option_Req *req);
 extern void sanei_w_control_option_reply (Wire *w,
 					  SANE_Control_Option_Reply *reply);
+extern void sanei_w_control_options_req (Wire *w,
+					 SANE_Control_Options_Req *req);
+extern void sanei_w_control_options_reply (Wire *w,
+					   SANE_Control_Options_Reply *reply);
 extern void sanei_w_get_parameters_reply (Wire *w,
 					  SANE_Get_Parameters_Reply *reply);
 extern void sanei_w_start_reply (Wire *w, SANE_Start_Reply *reply);
@@ -0,0 +1,123 @@
+/* sane - Scanner Access Now Easy.
+
+   Copyright (C) 2026 The SANE developers
+
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_reorder.h
+ * Reordering of the samples of colour scan lines.
+ *
+ * Many scanners deliver colour data in an order different from the one
+ * required by SANE: one plane per colour for each line (CIS sensors), BGR
+ * instead of RGB, or with the colours of a pixel scanned on different
+ * lines (CCD line distance and stagger).  These functions do the common
+ * reordering steps with SSSE3 when the CPU supports it and with plain C
+ * otherwise.  Every implementation gives the same result.
+ *
+ * Samples are 1 or 2 bytes wide; 2 byte samples are copied as they are,
+ * without any byte swapping.
+ */
+
+#ifndef SANEI_REORDER_H
+#define SANEI_REORDER_H
+
+#include <stddef.h>
+
+/** Interleave three colour planes into pixels.
+ *
+ * @param dst output, count pixels of three samples each
+ * @param p0 samples for the first component of each pixel
+ * @param p1 samples for the second component of each pixel
+ * @param p2 samples for the third component of each pixel
+ * @param count number of pixels
+ * @param bytes_per_sample 1 or 2
+ */
+extern void
+sanei_reorder_interleave3 (SANE_Byte * dst, const SANE_Byte * p0,
+			   const SANE_Byte * p1, const SANE_Byte * p2,
+			   size_t count, int bytes_per_sample);
+
+/** Reverse the order of the three samples of each pixel (RGB <-> BGR).
+ *
+ * @param dst output; must not overlap src
+ * @param src input pixels
+ * @param count number of pixels
+ * @param bytes_per_sample 1 or 2
+ */
+extern void
+sanei_reorder_reverse3 (SANE_Byte * dst, const SANE_Byte * src,
+			size_t count, int bytes_per_sample);
+
+/** Merge samples that were scanned with a fixed displacement.
+ *
+ * Sample i of dst is sample i + offsets[i % num_offsets] of src.  This
+ * undoes the line distance of colour CCDs and the stagger of staggered
+ * sensors, with offsets given as a number of lines times the samples per
+ * line.
+ *
+ * @param dst output; must not overlap src
+ * @param src input; must hold count plus the largest offset samples
+ * @param count number of samples
+ * @param offsets displacement for each phase, in samples
+ * @param num_offsets number of phases, 1 to 12
+ * @param bytes_per_sample 1 or 2
+ */
+extern void
+sanei_reorder_stagger (SANE_Byte * dst, const SANE_Byte * src, size_t count,
+		       const size_t * offsets, int num_offsets,
+		       int bytes_per_sample);
+
+/** Return the name of the implementation in use.
+ *
+ * @return "ssse3" or "scalar"
+ */
+extern const char *sanei_reorder_impl (void);
+
+/** Force the implementation, for testing and benchmarking.
+ *
+ * @param name implementation name as returned by sanei_reorder_impl(), or
+ *             NULL to select the fastest one again
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_UNSUPPORTED - not available in this build or on this CPU
+ */
+extern SANE_Status sanei_reorder_select (const char *name);
+
+#endif /* SANEI_REORDER_H */
@@ -319,6 +319,92 @@ extern void sanei_scsi_req_flush_all (void);
  */
 extern void sanei_scsi_req_flush_all_extended (int fd);
 
+/** Read ahead
+ *
+ * A sequence of READ commands kept in flight by
+ * sanei_scsi_read_ahead_start(), see there.
+ */
+typedef struct sanei_scsi_read_ahead SANEI_SCSI_Read_Ahead;
+
+/** Build a read ahead command
+ *
+ * Called by the read ahead functions whenever a buffer is free, to get
+ * the next READ command.  The commands are called for, and their data
+ * handed back, in the order of their index.
+ *
+ * @param arg the argument given to sanei_scsi_read_ahead_start()
+ * @param index number of this read, counting from 0
+ * @param cmd buffer for the SCSI command, of 16 bytes
+ * @param cmd_size set to the size of the command
+ * @param size on input, the buffer size; set to the number of bytes to read
+ *
+ * @return
+ * - SANE_STATUS_GOOD - the command is to be entered
+ * - SANE_STATUS_EOF - there is nothing left to read
+ * - any other status stops the read ahead with that status
+ */
+typedef SANE_Status (*SANEI_SCSI_Read_Command) (void *arg, int index,
+						SANE_Byte * cmd,
+						size_t * cmd_size,
+						size_t * size);
+
+/** Start reading ahead
+ *
+ * Keeps up to depth READ commands queued with sanei_scsi_req_enter2(),
+ * each into its own buffer of buffer_size bytes, so the device can go on
+ * transferring while the backend works on the data already read.  The
+ * data is handed back in order by sanei_scsi_read_ahead_next().  While
+ * the caller holds one buffer, depth - 1 reads stay in flight.  On
+ * systems without queued SCSI commands the reads are done one by one.
+ *
+ * @param fd file descriptor
+ * @param depth number of buffers, at least 2 for any overlap
+ * @param buffer_size size of each buffer, at most sanei_scsi_max_request_size
+ * @param command called to build each READ command
+ * @param arg passed to command
+ * @param rap set to the new read ahead
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_NO_MEM - if malloc failed (not enough memory)
+ * - any status returned by command or sanei_scsi_req_enter2()
+ *
+ * @sa sanei_scsi_read_ahead_next(), sanei_scsi_read_ahead_stop()
+ */
+extern SANE_Status sanei_scsi_read_ahead_start (int fd, int depth,
+						size_t buffer_size,
+						SANEI_SCSI_Read_Command
+						command, void *arg,
+						SANEI_SCSI_Read_Ahead ** rap);
+
+/** Get the next buffer read ahead
+ *
+ * Waits for the oldest READ in flight, after queueing more READs into
+ * the buffer handed back by the previous call.  The data stays valid
+ * until the next call.  If the READ failed, its buffer is handed back
+ * all the same, with the status of sanei_scsi_req_wait().
+ *
+ * @param ra the read ahead
+ * @param data set to the data read, or NULL
+ * @param len set to the number of bytes read
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_EOF - if all reads have been handed back
+ * - any status of the READ, of command or of sanei_scsi_req_enter2()
+ */
+extern SANE_Status sanei_scsi_read_ahead_next (SANEI_SCSI_Read_Ahead * ra,
+					       SANE_Byte ** data,
+					       size_t * len);
+
+/** Stop reading ahead
+ *
+ * Flushes the READs still in flight and frees the read ahead.
+ *
+ * @param ra the read ahead
+ */
+extern void sanei_scsi_read_ahead_stop (SANEI_SCSI_Read_Ahead * ra);
+
 /** Close a SCSI device
  *
  * @param fd file descriptor
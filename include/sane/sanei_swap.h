@@ -0,0 +1,137 @@
+/* sane - Scanner Access Now Easy.
+
+   Copyright (C) 2026 The SANE developers
+
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_swap.h
+ * Byte swapping of 16 bit sample data.
+ *
+ * Scanners, saned and frontends do not always agree on the byte order of
+ * 16 bit samples.  These functions swap whole buffers of samples with the
+ * fastest method the CPU supports (AVX2, SSE2 or NEON, with a plain C
+ * fallback), chosen at runtime on first use.
+ *
+ * Data that arrives in pieces of arbitrary length (e.g. from a socket) may
+ * split a sample between two pieces; the sanei_swap16_stream functions keep
+ * the odd byte until its partner arrives.
+ */
+
+#ifndef SANEI_SWAP_H
+#define SANEI_SWAP_H
+
+#include <stddef.h>
+
+/** Swap the two bytes of each 16 bit sample.
+ *
+ * @param dst output buffer; may be the same as src, but must not
+ *            partially overlap it
+ * @param src input samples
+ * @param count number of samples (not bytes)
+ */
+extern void
+sanei_swap16 (SANE_Byte * dst, const SANE_Byte * src, size_t count);
+
+/** Return the name of the implementation used by sanei_swap16().
+ *
+ * @return "avx2", "sse2", "neon" or "scalar"
+ */
+extern const char *sanei_swap16_impl (void);
+
+/** Force the implementation used by sanei_swap16().
+ *
+ * This is meant for testing and benchmarking.
+ *
+ * @param name implementation name as returned by sanei_swap16_impl(), or
+ *             NULL to select the fastest one again
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_UNSUPPORTED - not available in this build or on this CPU
+ */
+extern SANE_Status sanei_swap16_select (const char *name);
+
+/** State of a byte stream of 16 bit samples that is swapped piecewise. */
+typedef struct
+{
+  int carry;			/**< byte held back between pieces, or -1 */
+  SANE_Bool swapped;		/**< carry is already in output byte order */
+  SANE_Bool placed;		/**< carry was stored by the last _begin */
+}
+SANEI_Swap16_Stream;
+
+/** Reset a stream, e.g. at the start of a frame.
+ *
+ * @param st stream state
+ */
+extern void sanei_swap16_stream_init (SANEI_Swap16_Stream * st);
+
+/** Prepare a buffer for the next piece of the stream.
+ *
+ * A byte held back from the previous piece is stored at the start of buf.
+ * The caller then appends at most max minus the returned number of bytes
+ * and passes the total to sanei_swap16_stream_end().  If st->swapped is set
+ * after this call, the stored byte is ready for output as it is, so the
+ * caller may also return it without appending anything.
+ *
+ * @param st stream state
+ * @param buf buffer
+ * @param max size of buf
+ *
+ * @return number of bytes stored at the start of buf (0 or 1)
+ */
+extern size_t
+sanei_swap16_stream_begin (SANEI_Swap16_Stream * st, SANE_Byte * buf,
+			   size_t max);
+
+/** Swap a piece of the stream in place.
+ *
+ * @param st stream state
+ * @param buf buffer prepared by sanei_swap16_stream_begin()
+ * @param len number of valid bytes in buf, including those stored by
+ *            sanei_swap16_stream_begin()
+ *
+ * @return number of bytes at the start of buf that are ready for output;
+ *         a trailing odd byte is held back in st
+ */
+extern size_t
+sanei_swap16_stream_end (SANEI_Swap16_Stream * st, SANE_Byte * buf,
+			 size_t len);
+
+#endif /* SANEI_SWAP_H */
@@ -0,0 +1,74 @@
+/* sane - Scanner Access Now Easy.
+
+   Copyright (C) 2026 The SANE developers
+
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_tiles.h
+ * Splitting image work into tiles shared by several threads.
+ *
+ * The caller cuts its work into tiles, usually bands of lines, and
+ * gives a function that does one tile.  Tiles are handed out in order
+ * to the calling thread and to threads started for the call, which are
+ * joined before sanei_tiles_run returns.  Without pthreads every tile
+ * is done by the caller, in order.
+ */
+
+#ifndef SANEI_TILES_H
+#define SANEI_TILES_H
+
+/** The most threads sanei_tiles_run uses, counting the caller */
+#define SANEI_TILES_MAX_THREADS 64
+
+/** Call func once for each tile, on up to threads threads.
+ *
+ * The caller works on tiles too, and the call returns when all are
+ * finished.  If a thread cannot be started, the others do more tiles.
+ * Tiles must not write to memory used by other tiles.
+ *
+ * @param threads most threads to use, counting the caller
+ * @param func called with arg and a tile number from 0 to tiles - 1
+ * @param arg passed to func
+ * @param tiles number of tiles
+ */
+extern void
+sanei_tiles_run (int threads, void (*func) (void *arg, int tile), void *arg,
+		 int tiles);
+
+#endif /* SANEI_TILES_H */
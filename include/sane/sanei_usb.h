@@ -331,6 +331,75 @@ extern SANE_Status sanei_usb_reset (SANE_Int dn);
 extern SANE_Status
 sanei_usb_read_bulk (SANE_Int dn, SANE_Byte * buffer, size_t * size);
 
+/** Start streaming from the bulk-in endpoint.
+ *
+ * Sets up a ring of num_buffers buffers of buffer_size bytes each and queues
+ * a bulk-in request for every one of them, so the device can keep sending
+ * while the backend is busy with data it already got. With libusb-1.0 the
+ * requests are asynchronous transfers; with the other access methods each
+ * buffer is read synchronously by sanei_usb_stream_next().
+ *
+ * If total is not 0, no more than total bytes are requested from the device
+ * in all, so the stream never reads past the end of the expected data.
+ * The synchronous functions must not be used on the bulk-in endpoint while
+ * a stream is active.
+ *
+ * @param dn device number
+ * @param num_buffers number of buffers (requests in flight)
+ * @param buffer_size size of each buffer
+ * @param total number of bytes to read in all, or 0 for no limit
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_NO_MEM - if the buffers couldn't be allocated
+ * - SANE_STATUS_INVAL - on every other error
+ *
+ * @sa sanei_usb_stream_next(), sanei_usb_stream_stop()
+ */
+extern SANE_Status
+sanei_usb_stream_start (SANE_Int dn, SANE_Int num_buffers,
+			size_t buffer_size, size_t total);
+
+/** Get the next filled buffer of a stream.
+ *
+ * Buffers are returned in the order the data arrived. The returned buffer
+ * belongs to the backend until the next call of sanei_usb_stream_next() or
+ * sanei_usb_stream_stop(); it is then queued again.
+ *
+ * @param dn device number
+ * @param block if SANE_FALSE, return SANE_STATUS_DEVICE_BUSY instead of
+ *   waiting when no buffer is filled yet (only libusb-1.0 can tell)
+ * @param buffer set to the filled buffer
+ * @param size set to the number of bytes in the buffer
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_DEVICE_BUSY - if block is SANE_FALSE and no data is ready
+ * - SANE_STATUS_EOF - if zero bytes have been read or total has been reached
+ * - SANE_STATUS_IO_ERROR - if an error occured during the read
+ * - SANE_STATUS_INVAL - on every other error
+ *
+ * After anything but SANE_STATUS_GOOD or SANE_STATUS_DEVICE_BUSY, no more
+ * requests are queued and the stream should be stopped.
+ */
+extern SANE_Status
+sanei_usb_stream_next (SANE_Int dn, SANE_Bool block, SANE_Byte ** buffer,
+		       size_t * size);
+
+/** Stop a stream.
+ *
+ * Cancels the requests still in flight and frees the buffers. Data that
+ * has been received but not fetched is lost. sanei_usb_close() stops an
+ * active stream itself.
+ *
+ * @param dn device number
+ */
+extern void sanei_usb_stream_stop (SANE_Int dn);
+
+/** Check if the sanei_usb_stream functions are available.
+ */
+#define HAVE_SANEI_USB_STREAM
+
 /** Initiate a bulk transfer write.
  *
  * Write up to size bytes from buffer to the device. After the write size
@@ -123,6 +123,12 @@ extern void sanei_w_array (Wire *w, SANE_Word *len, void **v,
 			   WireCodecFunc w_element, size_t element_size);
 
 extern void sanei_w_set_dir (Wire *w, WireDirection dir);
+/* sanei_w_call () is sanei_w_send () followed by sanei_w_receive ().
+   Callers that talk to several peers can send all requests first and
+   collect the replies afterwards.  */
+extern void sanei_w_send (Wire *w, SANE_Word proc_num,
+			  WireCodecFunc w_arg, void *arg);
+extern void sanei_w_receive (Wire *w, WireCodecFunc w_reply, void *reply);
 extern void sanei_w_call (Wire *w, SANE_Word proc_num,
 			  WireCodecFunc w_arg, void *arg,
 			  WireCodecFunc w_reply, void *reply);
@@ -50,11 +50,20 @@
 #include <errno.h>
 #include <math.h>
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #define BACKEND_NAME sanei_magic      /* name of this module for debugging */
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei_debug.h"
 #include "../include/sane/sanei_magic.h"
+#include "../include/sane/sanei_tiles.h"
 
 /* prototypes for utility functions defined at bottom of file */
 int * sanei_magic_getTransY (
@@ -63,9 +72,22 @@ int * sanei_magic_getTransY (
 int * sanei_magic_getTransX (
   SANE_Parameters * params, int dpi, SANE_Byte * buffer, int left);
 
+static SANE_Status findEdgesBufs (int width, int height, int * topBuf,
+  int * botBuf, int * leftBuf, int * rightBuf,
+  int * top, int * bot, int * left, int * right);
+
+static SANE_Status findSkewBufs (int pwidth, int height, int dpiY,
+  int * topBuf, int * botBuf, int * centerX, int * centerY, double * finSlope);
+
 static SANE_Status getTopEdge (int width, int height, int resolution,
   int * buff, double * finSlope, int * finXInter, int * finYInter);
 
+static SANE_Status getTopEdgeBins (int width, int height, int resolution,
+  int * buff, double * finSlope, int * finXInter, int * finYInter);
+
+static SANE_Status getTopEdgeHough (int width, int height, int resolution,
+  int * buff, double * finSlope, int * finXInter, int * finYInter);
+
 static SANE_Status getLeftEdge (int width, int height, int * top, int * bot,
  double slope, int * finXInter, int * finYInter);
 
@@ -74,10 +96,239 @@ static SANE_Status getLine (int height, int width, int * buff,
   int offsets, int minOffset, int maxOffset,
   double * finSlope, int * finOffset, int * finDensity);
 
+static SANE_Byte * arenaBuffer (SANEI_Magic_Arena * arena, size_t size);
+
+static SANE_Status rotateInto (SANE_Parameters * params, SANE_Byte * buffer,
+  SANE_Byte * outbuf, int centerX, int centerY, double slope, int bg_color);
+
+static SANE_Status cropInto (SANE_Parameters * params, SANE_Byte * buffer,
+  SANE_Byte * outbuf, int top, int bot, int left, int right);
+
+static SANE_Status turnArena (SANE_Parameters * params, SANE_Byte * buffer,
+  int angle, SANEI_Magic_Arena * arena);
+
+static void filterTrans (int * buff, int len, int dpi, int none);
+
+static double rowDensity (SANE_Parameters * params, SANE_Byte * ptr);
+
+static int transXRow (SANE_Parameters * params, SANE_Byte * row,
+  int firstCol, int lastCol, int direction);
+
+static void despeckRows (SANE_Parameters * params, SANE_Byte * buffer,
+  int diam, int first, int last);
+
+static int despeckAt (SANE_Parameters * params, SANE_Byte * buffer,
+  int diam, int r, int j);
+
+static int despeckFilter (SANE_Parameters * params, SANE_Byte * buffer,
+  int diam, int first, int last);
+
+static int streamMatches (SANEI_Magic_Stream * s, SANE_Parameters * params);
+
+static void minRun (int * out, int * in, int n, int w, int step,
+  int * g, int * h);
+
+/* upper limit on workers per operation, and rows or columns per tile */
+#define MAGIC_MAX_THREADS SANEI_TILES_MAX_THREADS
+#define MAGIC_TILE_SIZE 64
+
+/* number of threads each operation may use, 1 runs everything inline */
+static int magic_threads = 1;
+
+/* Hough transform for top edge: angles within 45 degrees of level in
+ * steps of HOUGH_STEP degrees, sin/cos scaled by 1<<HOUGH_SHIFT. The fine
+ * pass splits two coarse steps into HOUGH_FINE_ANGLES, and pixels into
+ * 1<<HOUGH_FINE_BITS parts */
+#define HOUGH_STEP 0.5
+#define HOUGH_ANGLES 181
+#define HOUGH_SHIFT 14
+#define HOUGH_FINE_ANGLES 33
+#define HOUGH_FINE_BITS 2
+
+static int houghSin[HOUGH_ANGLES];
+static int houghCos[HOUGH_ANGLES];
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t houghOnce = PTHREAD_ONCE_INIT;
+#else
+static int houghReady = 0;
+#endif
+
+/* use the older getLine based search for top edge */
+static int magic_skew_bins = 0;
+
+/* use the older per window loop for despeckle */
+static int magic_despeck_loop = 0;
+
+/* rotation steps through the source image in fixed point, with
+ * ROTATE_SHIFT fractional bits */
+#define ROTATE_SHIFT 24
+#define ROTATE_ONE (1 << ROTATE_SHIFT)
+
+/* below this many columns per source row, about 5 degrees, rotation
+ * goes one pixel at a time instead of copying runs */
+#define ROTATE_MIN_RUN (12.0 / ROTATE_ONE)
+
+/* blend four source pixels for gray and color rotation */
+static int magic_rotate_bilinear = 0;
+
+/* reusable output buffer for rotations and turns */
+struct sanei_magic_arena {
+  SANE_Byte * buffer;
+  size_t size;
+};
+
 void
 sanei_magic_init( void )
 {
+  char * env;
+
   DBG_INIT();
+
+  env = getenv("SANE_MAGIC_THREADS");
+  if(env){
+    sanei_magic_setThreads(atoi(env));
+  }
+
+  env = getenv("SANE_MAGIC_SKEW");
+  if(env && sanei_magic_selectSkew(env)){
+    DBG (5, "sanei_magic_init: unknown skew method %s\n", env);
+  }
+
+  env = getenv("SANE_MAGIC_DESPECK");
+  if(env && sanei_magic_selectDespeck(env)){
+    DBG (5, "sanei_magic_init: unknown despeck method %s\n", env);
+  }
+
+  env = getenv("SANE_MAGIC_ROTATE");
+  if(env && sanei_magic_selectRotate(env)){
+    DBG (5, "sanei_magic_init: unknown rotate method %s\n", env);
+  }
+}
+
+/* choose top edge detector, NULL for the default */
+SANE_Status
+sanei_magic_selectSkew (const char * name)
+{
+  if(!name || !strcmp(name, "hough")){
+    magic_skew_bins = 0;
+  }
+  else if(!strcmp(name, "bins")){
+    magic_skew_bins = 1;
+  }
+  else{
+    return SANE_STATUS_UNSUPPORTED;
+  }
+
+  DBG (10, "sanei_magic_selectSkew: %s\n", magic_skew_bins ? "bins" : "hough");
+  return SANE_STATUS_GOOD;
+}
+
+/* choose despeckle implementation, NULL for the default */
+SANE_Status
+sanei_magic_selectDespeck (const char * name)
+{
+  if(!name || !strcmp(name, "filter")){
+    magic_despeck_loop = 0;
+  }
+  else if(!strcmp(name, "loop")){
+    magic_despeck_loop = 1;
+  }
+  else{
+    return SANE_STATUS_UNSUPPORTED;
+  }
+
+  DBG (10, "sanei_magic_selectDespeck: %s\n",
+    magic_despeck_loop ? "loop" : "filter");
+  return SANE_STATUS_GOOD;
+}
+
+/* choose sampling used by rotation, NULL for the default */
+SANE_Status
+sanei_magic_selectRotate (const char * name)
+{
+  if(!name || !strcmp(name, "nearest")){
+    magic_rotate_bilinear = 0;
+  }
+  else if(!strcmp(name, "bilinear")){
+    magic_rotate_bilinear = 1;
+  }
+  else{
+    return SANE_STATUS_UNSUPPORTED;
+  }
+
+  DBG (10, "sanei_magic_selectRotate: %s\n",
+    magic_rotate_bilinear ? "bilinear" : "nearest");
+  return SANE_STATUS_GOOD;
+}
+
+/* set number of threads used to process each image, 0 means one per cpu */
+void
+sanei_magic_setThreads (int threads)
+{
+#ifdef HAVE_PTHREAD_H
+  if(threads < 1){
+    threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1)
+      threads = 1;
+#endif
+  }
+
+  if(threads > MAGIC_MAX_THREADS)
+    threads = MAGIC_MAX_THREADS;
+#else
+  threads = 1;
+#endif
+
+  DBG (10, "sanei_magic_setThreads: %d\n", threads);
+  magic_threads = threads;
+}
+
+/* despeck arguments, shared by all bands of one group */
+struct despeckArgs {
+  SANE_Parameters * params;
+  SANE_Byte * buffer;
+  int diam;
+  int rows;
+  int first;
+  SANE_Byte ** copy;
+};
+
+/* window rows of band n are first to last-1 */
+static void
+despeckBandRows (int n, int rows, int * first, int * last)
+{
+  *first = 1 + n * MAGIC_TILE_SIZE;
+  *last = *first + MAGIC_TILE_SIZE;
+
+  if(*last > rows)
+    *last = rows;
+}
+
+/* despeck one band of the group in a copy of the rows its windows read.
+ * the copy is followed by the diam rows at its top as they were, which
+ * the band above may still change */
+static void
+despeckBand (void * arg, int tile)
+{
+  struct despeckArgs * a = arg;
+  int bw = a->params->bytes_per_line;
+  int first, last, n;
+  SANE_Byte * copy;
+
+  despeckBandRows(a->first + tile, a->rows, &first, &last);
+  n = last - first + a->diam + 1;
+
+  copy = malloc((n + a->diam) * bw);
+  a->copy[tile] = copy;
+  if(!copy)
+    return;
+
+  memcpy(copy, a->buffer + (first-1)*bw, n*bw);
+  memcpy(copy + n*bw, copy, a->diam*bw);
+
+  despeckRows(a->params, copy, a->diam, 1, 1 + last - first);
 }
 
 /* find small spots and replace them with image background color */
@@ -88,77 +339,173 @@ sanei_magic_despeck (SANE_Parameters * params, SANE_Byte * buffer,
 
   SANE_Status ret = SANE_STATUS_GOOD;
 
+  /* windows start between the first and last row, leaving room for border */
+  int rows = params->lines - 1 - diam;
+  int bands;
+
+  DBG (10, "sanei_magic_despeck: start\n");
+
+  if(params->format != SANE_FRAME_RGB
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 8)
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 1)
+  ){
+    DBG (5, "sanei_magic_despeck: unsupported format/depth\n");
+    ret = SANE_STATUS_INVAL;
+    goto cleanup;
+  }
+
+  if(rows <= 1)
+    goto cleanup;
+
+  bands = (rows - 1 + MAGIC_TILE_SIZE - 1) / MAGIC_TILE_SIZE;
+
+  /* one thread, or window too big for bands: scan whole image in order */
+  if(magic_threads < 2 || bands < 2 || diam >= MAGIC_TILE_SIZE){
+    despeckRows(params, buffer, diam, 1, rows);
+  }
+
+  /* threads despeck groups of bands in copies, then the bands are put
+   * back in order. a window reads the row above it and diam rows below,
+   * so the only rows of a band which the bands above can change are the
+   * diam at its top. if those still match the copy, the band came out as
+   * the in order scan would have it, otherwise it is done again in place */
+  else{
+    struct despeckArgs a;
+    SANE_Byte * copy[MAGIC_MAX_THREADS * 4];
+    int bw = params->bytes_per_line;
+    int group = magic_threads * 4;
+    int redone = 0;
+    int i;
+
+    a.params = params;
+    a.buffer = buffer;
+    a.diam = diam;
+    a.rows = rows;
+    a.copy = copy;
+
+    for(a.first=0; a.first<bands; a.first+=group){
+      int count = bands - a.first < group ? bands - a.first : group;
+
+      sanei_tiles_run(magic_threads, despeckBand, &a, count);
+
+      for(i=0; i<count; i++){
+        int first, last, n;
+
+        despeckBandRows(a.first + i, rows, &first, &last);
+        n = last - first + diam + 1;
+
+        if(copy[i] && !memcmp(copy[i] + n*bw, buffer + (first-1)*bw,
+          diam*bw)){
+          memcpy(buffer + first*bw, copy[i] + bw, (n-2) * bw);
+        }
+        else{
+          despeckRows(params, buffer, diam, first, last);
+          redone++;
+        }
+
+        free(copy[i]);
+      }
+    }
+
+    DBG (15, "sanei_magic_despeck: %d of %d bands redone\n", redone, bands);
+  }
+
+  cleanup:
+  DBG (10, "sanei_magic_despeck: finish\n");
+  return ret;
+}
+
+/* despeck windows starting in rows first to last-1, in order */
+static void
+despeckRows (SANE_Parameters * params, SANE_Byte * buffer,
+  int diam, int first, int last)
+{
   int pw = params->pixels_per_line;
-  int bw = params->bytes_per_line;
-  int h  = params->lines;
-  int bt = bw*h;
+  int i,j;
 
-  int i,j,k,l,n;
+  /* very small windows are quicker to visit directly */
+  if(!magic_despeck_loop && diam > 2
+    && !despeckFilter(params, buffer, diam, first, last))
+    return;
 
-  DBG (10, "sanei_magic_despeck: start\n");
+  for(i=first; i<last; i++){
+    for(j=1; j<pw-1-diam; j++){
+      despeckAt(params, buffer, diam, i, j);
+    }
+  }
+}
 
-  if(params->format == SANE_FRAME_RGB){
+/* check one window at row r, column j, and replace it with the color
+ * around it if it is a dot. returns 1 if the image was changed */
+static int
+despeckAt (SANE_Parameters * params, SANE_Byte * buffer,
+  int diam, int r, int j)
+{
+  int bw = params->bytes_per_line;
+  int i = r*bw;
+  int changed = 0;
 
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
+  int k,l,n;
 
-        int thresh = 255*3;
-        int outer[] = {0,0,0};
-        int hits = 0;
+  if(params->format == SANE_FRAME_RGB){
 
-        /* loop over rows and columns in window */
-        /* find darkest pixel */
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            int tmp = 0;
+    int thresh = 255*3;
+    int outer[] = {0,0,0};
+    int hits = 0;
 
-            for(n=0; n<3; n++){
-              tmp += buffer[i + j*3 + k*bw + l*3 + n];
-            }
+    /* loop over rows and columns in window */
+    /* find darkest pixel */
+    for(k=0; k<diam; k++){
+      for(l=0; l<diam; l++){
+        int tmp = 0;
 
-            if(tmp < thresh)
-              thresh = tmp;
-          }
+        for(n=0; n<3; n++){
+          tmp += buffer[i + j*3 + k*bw + l*3 + n];
         }
 
-        /* convert darkest pixel into a brighter threshold */
-        thresh = (thresh + 255*3 + 255*3)/3;
-  
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
+        if(tmp < thresh)
+          thresh = tmp;
+      }
+    }
 
-            int tmp[3];
-  
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            for(n=0; n<3; n++){
-              tmp[n] = buffer[i + j*3 + k*bw + l*3 + n];
-              outer[n] += tmp[n];
-            }
-            if(tmp[0]+tmp[1]+tmp[2] < thresh){
-              hits++;
-              break;
-            }
-          }
+    /* convert darkest pixel into a brighter threshold */
+    thresh = (thresh + 255*3 + 255*3)/3;
+
+    /*loop over rows and columns around window */
+    for(k=-1; k<diam+1; k++){
+      for(l=-1; l<diam+1; l++){
+
+        int tmp[3];
+
+        /* dont count pixels in the window */
+        if(k != -1 && k != diam && l != -1 && l != diam)
+          continue;
+
+        for(n=0; n<3; n++){
+          tmp[n] = buffer[i + j*3 + k*bw + l*3 + n];
+          outer[n] += tmp[n];
+        }
+        if(tmp[0]+tmp[1]+tmp[2] < thresh){
+          hits++;
+          break;
         }
+      }
+    }
 
-        /*no hits, overwrite with avg surrounding color*/
-        if(!hits){
+    /*no hits, overwrite with avg surrounding color*/
+    if(!hits){
 
-          /* per channel replacement color */
-          for(n=0; n<3; n++){
-            outer[n] /= (4*diam + 4);
-          }
+      /* per channel replacement color */
+      for(n=0; n<3; n++){
+        outer[n] /= (4*diam + 4);
+      }
 
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              for(n=0; n<3; n++){
-                buffer[i + j*3 + k*bw + l*3 + n] = outer[n];
-              }
-            }
+      for(k=0; k<diam; k++){
+        for(l=0; l<diam; l++){
+          for(n=0; n<3; n++){
+            if(buffer[i + j*3 + k*bw + l*3 + n] != outer[n])
+              changed = 1;
+            buffer[i + j*3 + k*bw + l*3 + n] = outer[n];
           }
         }
       }
@@ -166,170 +513,448 @@ sanei_magic_despeck (SANE_Parameters * params, SANE_Byte * buffer,
   }
 
   else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
 
-        int thresh = 255;
-        int outer = 0;
-        int hits = 0;
+    int thresh = 255;
+    int outer = 0;
+    int hits = 0;
 
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            if(buffer[i + j + k*bw + l] < thresh)
-              thresh = buffer[i + j + k*bw + l];
-          }
-        }
+    for(k=0; k<diam; k++){
+      for(l=0; l<diam; l++){
+        if(buffer[i + j + k*bw + l] < thresh)
+          thresh = buffer[i + j + k*bw + l];
+      }
+    }
 
-        /* convert darkest pixel into a brighter threshold */
-        thresh = (thresh + 255 + 255)/3;
-  
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
+    /* convert darkest pixel into a brighter threshold */
+    thresh = (thresh + 255 + 255)/3;
 
-            int tmp = 0;
+    /*loop over rows and columns around window */
+    for(k=-1; k<diam+1; k++){
+      for(l=-1; l<diam+1; l++){
 
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            tmp = buffer[i + j + k*bw + l];
+        int tmp = 0;
 
-            if(tmp < thresh){
-              hits++;
-              break;
-            }
+        /* dont count pixels in the window */
+        if(k != -1 && k != diam && l != -1 && l != diam)
+          continue;
 
-            outer += tmp;
-          }
+        tmp = buffer[i + j + k*bw + l];
+
+        if(tmp < thresh){
+          hits++;
+          break;
         }
 
-        /*no hits, overwrite with avg surrounding color*/
-        if(!hits){
-          /* replacement color */
-          outer /= (4*diam + 4);
+        outer += tmp;
+      }
+    }
+
+    /*no hits, overwrite with avg surrounding color*/
+    if(!hits){
+      /* replacement color */
+      outer /= (4*diam + 4);
 
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              buffer[i + j + k*bw + l] = outer;
-            }
-          }
+      for(k=0; k<diam; k++){
+        for(l=0; l<diam; l++){
+          if(buffer[i + j + k*bw + l] != outer)
+            changed = 1;
+          buffer[i + j + k*bw + l] = outer;
         }
       }
     }
   }
 
   else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
-        
-        int curr = 0;
-        int hits = 0;
 
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            curr += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
-          }
-        }
+    int curr = 0;
+    int hits = 0;
 
-        if(!curr)
-          continue;
+    for(k=0; k<diam; k++){
+      for(l=0; l<diam; l++){
+        curr += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
+      }
+    }
 
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
+    if(!curr)
+      return 0;
 
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            hits += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
+    /*loop over rows and columns around window */
+    for(k=-1; k<diam+1; k++){
+      for(l=-1; l<diam+1; l++){
 
-            if(hits)
-              break;
-          }
-        }
+        /* dont count pixels in the window */
+        if(k != -1 && k != diam && l != -1 && l != diam)
+          continue;
 
-        /*no hits, overwrite with white*/
-        if(!hits){
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              buffer[i + k*bw + (j+l)/8] &= ~(1 << (7-(j+l)%8));
-            }
-          }
-        }
+        hits += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
+
+        if(hits)
+          break;
       }
     }
-  }
 
-  else{
-    DBG (5, "sanei_magic_despeck: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
+    /*no hits, overwrite with white*/
+    if(!hits){
+      for(k=0; k<diam; k++){
+        for(l=0; l<diam; l++){
+          buffer[i + k*bw + (j+l)/8] &= ~(1 << (7-(j+l)%8));
+        }
+      }
+      changed = 1;
+    }
   }
 
-  DBG (10, "sanei_magic_despeck: finish\n");
-  return ret;
+  return changed;
 }
 
-/* find likely edges of media inside image background color */
-SANE_Status
-sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
-  int dpiX, int dpiY, int * top, int * bot, int * left, int * right)
+/* sliding minimum of w values, at each of n-w+1 positions. in and out are
+ * read and written every step elements, and may be the same. g and h hold
+ * n values, the minimum from the start and end of each block of w. cost
+ * does not depend on w (van Herk, Gil and Werman) */
+static void
+minRun (int * out, int * in, int n, int w, int step, int * g, int * h)
 {
+  int k;
 
-  SANE_Status ret = SANE_STATUS_GOOD;
+  for(k=0; k<n; k++){
+    int x = in[k*step];
+    g[k] = (k % w && g[k-1] < x) ? g[k-1] : x;
+  }
 
-  int width = params->pixels_per_line;
-  int height = params->lines;
+  for(k=n-1; k>=0; k--){
+    int x = in[k*step];
+    h[k] = (k % w != w-1 && k != n-1 && h[k+1] < x) ? h[k+1] : x;
+  }
 
-  int * topBuf = NULL, * botBuf = NULL;
-  int * leftBuf = NULL, * rightBuf = NULL;
+  for(k=0; k+w<=n; k++){
+    out[k*step] = h[k] < g[k+w-1] ? h[k] : g[k+w-1];
+  }
+}
 
-  int topCount = 0, botCount = 0;
-  int leftCount = 0, rightCount = 0;
+/* Same result as despeckAt on every window, in the same order, but most
+ * windows are ruled out with sliding minimums and summed-area tables,
+ * so the cost does not grow with diam. Windows are worked on in bands of
+ * rows. A window near one which changed the image must be checked again
+ * by despeckAt, so columns remember the last row still affected by an
+ * earlier change. Returns nonzero if the buffers cannot be allocated. */
+static int
+despeckFilter (SANE_Parameters * params, SANE_Byte * buffer,
+  int diam, int first, int last)
+{
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int depth = 0;
+  int top = 255;
 
-  int i;
+  int rows = MAGIC_TILE_SIZE + diam + 1;
+  int sw = pw + 1;
+  int size = rows * pw;
 
-  DBG (10, "sanei_magic_findEdges: start\n");
+  /* per band: value compared to threshold, and its horizontal minimums.
+   * color also has packed pixel, with minimum and maximum, and a summed
+   * area table for each channel */
+  int * val = NULL, * hmin = NULL, * hring = NULL;
+  int * pix = NULL, * pmin = NULL, * pmax = NULL;
+  int * sat = NULL;
+  int * g = NULL, * h = NULL;
+  int * dirty = NULL;
 
-  /* get buffers to find sides and bottom */
-  topBuf = sanei_magic_getTransY(params,dpiY,buffer,1);
-  if(!topBuf){
-    DBG (5, "sanei_magic_findEdges: no topBuf\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
+  int ret = 1;
+  int a, i, j, k, l, n;
+
+  if(params->format == SANE_FRAME_RGB){
+    depth = 3;
+    top = 255*3;
+  }
+  else if(params->depth == 8){
+    depth = 1;
   }
 
-  botBuf = sanei_magic_getTransY(params,dpiY,buffer,0);
-  if(!botBuf){
-    DBG (5, "sanei_magic_findEdges: no botBuf\n");
-    ret = SANE_STATUS_NO_MEM;
+  if(pw < diam + 3)
+    return 1;
+
+  val = malloc(size * sizeof(int));
+  hmin = malloc(size * sizeof(int));
+  hring = malloc(size * sizeof(int));
+  g = malloc((rows > pw ? rows : pw) * sizeof(int));
+  h = malloc((rows > pw ? rows : pw) * sizeof(int));
+  dirty = malloc(pw * sizeof(int));
+  if(!val || !hmin || !hring || !g || !h || !dirty){
+    DBG (5, "despeckFilter: no buffers\n");
     goto cleanup;
   }
 
-  leftBuf = sanei_magic_getTransX(params,dpiX,buffer,1);
-  if(!leftBuf){
-    DBG (5, "sanei_magic_findEdges: no leftBuf\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
+  if(depth){
+    pix = malloc(size * sizeof(int));
+    pmin = malloc(size * sizeof(int));
+    pmax = malloc(size * sizeof(int));
+    sat = calloc((rows+1) * sw * depth, sizeof(int));
+    if(!pix || !pmin || !pmax || !sat){
+      DBG (5, "despeckFilter: no color buffers\n");
+      goto cleanup;
+    }
   }
 
-  rightBuf = sanei_magic_getTransX(params,dpiX,buffer,0);
-  if(!rightBuf){
-    DBG (5, "sanei_magic_findEdges: no rightBuf\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
+  for(j=0; j<pw; j++){
+    dirty[j] = -1;
   }
 
-  /* loop thru left and right lists, look for top and bottom extremes */
-  *top = height;
-  for(i=0; i<height; i++){
-    if(rightBuf[i] > leftBuf[i]){
-      if(*top > i){
-        *top = i;
-      }
+  for(a=first; a<last; a+=MAGIC_TILE_SIZE){
+    int b = a + MAGIC_TILE_SIZE < last ? a + MAGIC_TILE_SIZE : last;
+    int r0 = a - 1;
+    int nrows = b - a + diam + 1;
 
-      topCount++;
+    /* load values, binary is inverted so white is the larger value */
+    for(k=0; k<nrows; k++){
+      SANE_Byte * row = buffer + (r0+k)*bw;
+      int * v = val + k*pw;
+
+      if(!depth){
+        for(j=0; j<pw; j++){
+          v[j] = !(row[j/8] >> (7-(j%8)) & 1);
+        }
+        continue;
+      }
+
+      for(j=0; j<pw; j++){
+        int sum = 0, packed = 0;
+
+        for(n=0; n<depth; n++){
+          sum += row[j*depth+n];
+          packed = packed << 8 | row[j*depth+n];
+        }
+
+        v[j] = sum;
+        pix[k*pw+j] = packed;
+      }
+
+      /* summed area table, one extra row and column of zeros */
+      for(n=0; n<depth; n++){
+        int * s = sat + n*(rows+1)*sw;
+        int run = 0;
+
+        for(j=0; j<pw; j++){
+          run += row[j*depth+n];
+          s[(k+1)*sw + j+1] = s[k*sw + j+1] + run;
+        }
+      }
+    }
+
+    /* minimums along rows, for window and for top and bottom of ring */
+    for(k=0; k<nrows; k++){
+      minRun(hmin + k*pw, val + k*pw, pw, diam, 1, g, h);
+      minRun(hring + k*pw, val + k*pw, pw, diam+2, 1, g, h);
+
+      if(depth){
+        minRun(pmin + k*pw, pix + k*pw, pw, diam, 1, g, h);
+        for(j=0; j<pw; j++){
+          pix[k*pw+j] = -pix[k*pw+j];
+        }
+        minRun(pmax + k*pw, pix + k*pw, pw, diam, 1, g, h);
+      }
+    }
+
+    /* then down columns. hmin becomes minimum over window, val becomes
+     * minimum of a column as tall as the window, for sides of ring */
+    for(j=0; j<pw; j++){
+      minRun(hmin + j, hmin + j, nrows, diam, pw, g, h);
+      minRun(val + j, val + j, nrows, diam, pw, g, h);
+
+      if(depth){
+        minRun(pmin + j, pmin + j, nrows, diam, pw, g, h);
+        minRun(pmax + j, pmax + j, nrows, diam, pw, g, h);
+      }
+    }
+
+    for(i=a; i<b; i++){
+      int li = i - r0;
+
+      for(j=1; j<pw-1-diam; j++){
+        int winMin, ringMin, thresh, packed = 0;
+        int outer[3];
+
+        /* window near an earlier change, check it the slow way */
+        if(dirty[j] >= i){
+          if(despeckAt(params, buffer, diam, i, j)){
+            for(l=j-diam; l<=j+diam; l++){
+              if(l >= 0 && l < pw && dirty[l] < i+diam)
+                dirty[l] = i+diam;
+            }
+          }
+          continue;
+        }
+
+        winMin = hmin[li*pw + j];
+        ringMin = hring[(li-1)*pw + j-1];
+        if(ringMin > hring[(li+diam)*pw + j-1])
+          ringMin = hring[(li+diam)*pw + j-1];
+        if(ringMin > val[li*pw + j-1])
+          ringMin = val[li*pw + j-1];
+        if(ringMin > val[li*pw + j+diam])
+          ringMin = val[li*pw + j+diam];
+
+        /* binary: black in the window, and none around it */
+        if(!depth){
+          if(winMin || !ringMin)
+            continue;
+
+          for(k=0; k<diam; k++){
+            for(l=0; l<diam; l++){
+              buffer[(i+k)*bw + (j+l)/8] &= ~(1 << (7-(j+l)%8));
+            }
+          }
+        }
+
+        /* gray and color: nothing around the window darker than
+         * threshold, and the replacement color changes something */
+        else{
+          thresh = (winMin + top + top)/3;
+          if(ringMin < thresh)
+            continue;
+
+          for(n=0; n<depth; n++){
+            int * s = sat + n*(rows+1)*sw;
+            int t = li-1, bt = li+diam+1, lf = j-1, rt = j+diam+1;
+            int ring = s[bt*sw + rt] - s[t*sw + rt] - s[bt*sw + lf]
+              + s[t*sw + lf];
+
+            t = li; bt = li+diam; lf = j; rt = j+diam;
+            ring -= s[bt*sw + rt] - s[t*sw + rt] - s[bt*sw + lf]
+              + s[t*sw + lf];
+
+            outer[n] = ring / (4*diam + 4);
+            packed = packed << 8 | outer[n];
+          }
+
+          if(pmin[li*pw + j] == -pmax[li*pw + j]
+            && pmin[li*pw + j] == packed)
+            continue;
+
+          for(k=0; k<diam; k++){
+            for(l=0; l<diam; l++){
+              for(n=0; n<depth; n++){
+                buffer[(i+k)*bw + (j+l)*depth + n] = outer[n];
+              }
+            }
+          }
+        }
+
+        for(l=j-diam; l<=j+diam; l++){
+          if(l >= 0 && l < pw && dirty[l] < i+diam)
+            dirty[l] = i+diam;
+        }
+      }
+    }
+  }
+
+  ret = 0;
+
+  cleanup:
+  if(val)
+    free(val);
+  if(hmin)
+    free(hmin);
+  if(hring)
+    free(hring);
+  if(pix)
+    free(pix);
+  if(pmin)
+    free(pmin);
+  if(pmax)
+    free(pmax);
+  if(sat)
+    free(sat);
+  if(g)
+    free(g);
+  if(h)
+    free(h);
+  if(dirty)
+    free(dirty);
+
+  return ret;
+}
+
+/* find likely edges of media inside image background color */
+SANE_Status
+sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
+  int dpiX, int dpiY, int * top, int * bot, int * left, int * right)
+{
+
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  int width = params->pixels_per_line;
+  int height = params->lines;
+
+  int * topBuf = NULL, * botBuf = NULL;
+  int * leftBuf = NULL, * rightBuf = NULL;
+
+  DBG (10, "sanei_magic_findEdges: start\n");
+
+  /* get buffers to find sides and bottom */
+  topBuf = sanei_magic_getTransY(params,dpiY,buffer,1);
+  if(!topBuf){
+    DBG (5, "sanei_magic_findEdges: no topBuf\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  botBuf = sanei_magic_getTransY(params,dpiY,buffer,0);
+  if(!botBuf){
+    DBG (5, "sanei_magic_findEdges: no botBuf\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  leftBuf = sanei_magic_getTransX(params,dpiX,buffer,1);
+  if(!leftBuf){
+    DBG (5, "sanei_magic_findEdges: no leftBuf\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  rightBuf = sanei_magic_getTransX(params,dpiX,buffer,0);
+  if(!rightBuf){
+    DBG (5, "sanei_magic_findEdges: no rightBuf\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  ret = findEdgesBufs(width, height, topBuf, botBuf, leftBuf, rightBuf,
+    top, bot, left, right);
+
+  cleanup:
+  if(topBuf)
+    free(topBuf);
+  if(botBuf)
+    free(botBuf);
+  if(leftBuf)
+    free(leftBuf);
+  if(rightBuf)
+    free(rightBuf);
+
+  DBG (10, "sanei_magic_findEdges: finish\n");
+  return ret;
+}
+
+/* find extremes of media, given transition arrays from all four sides */
+static SANE_Status
+findEdgesBufs (int width, int height, int * topBuf, int * botBuf,
+  int * leftBuf, int * rightBuf, int * top, int * bot, int * left, int * right)
+{
+  int topCount = 0, botCount = 0;
+  int leftCount = 0, rightCount = 0;
+
+  int i;
+
+  /* loop thru left and right lists, look for top and bottom extremes */
+  *top = height;
+  for(i=0; i<height; i++){
+    if(rightBuf[i] > leftBuf[i]){
+      if(*top > i){
+        *top = i;
+      }
+
+      topCount++;
       if(topCount > 3){
         break;
       }
@@ -361,8 +986,7 @@ sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
   /* could not find top/bot edges */
   if(*top > *bot){
     DBG (5, "sanei_magic_findEdges: bad t/b edges\n");
-    ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
+    return SANE_STATUS_UNSUPPORTED;
   }
 
   /* loop thru top and bottom lists, look for l and r extremes
@@ -411,25 +1035,13 @@ sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
   /* could not find left/right edges */
   if(*left > *right){
     DBG (5, "sanei_magic_findEdges: bad l/r edges\n");
-    ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
+    return SANE_STATUS_UNSUPPORTED;
   }
 
   DBG (15, "sanei_magic_findEdges: t:%d b:%d l:%d r:%d\n",
     *top,*bot,*left,*right);
 
-  cleanup:
-  if(topBuf)
-    free(topBuf);
-  if(botBuf)
-    free(botBuf);
-  if(leftBuf)
-    free(leftBuf);
-  if(rightBuf)
-    free(rightBuf);
-
-  DBG (10, "sanei_magic_findEdges: finish\n");
-  return ret;
+  return SANE_STATUS_GOOD;
 }
 
 /* crop image to given size. updates params with new dimensions */
@@ -437,6 +1049,15 @@ SANE_Status
 sanei_magic_crop(SANE_Parameters * params, SANE_Byte * buffer,
   int top, int bot, int left, int right)
 {
+  return cropInto(params, buffer, buffer, top, bot, left, right);
+}
+
+/* copy the cropped rows of buffer to the start of outbuf, which may be
+ * the same buffer. rows only ever move down, so memmove is enough */
+static SANE_Status
+cropInto(SANE_Parameters * params, SANE_Byte * buffer, SANE_Byte * outbuf,
+  int top, int bot, int left, int right)
+{
 
   SANE_Status ret = SANE_STATUS_GOOD;
 
@@ -444,7 +1065,6 @@ sanei_magic_crop(SANE_Parameters * params, SANE_Byte * buffer,
 
   int pixels = 0;
   int bytes = 0;
-  unsigned char * line = NULL;
   int pos = 0, i;
 
   DBG (10, "sanei_magic_crop: start\n");
@@ -474,16 +1094,8 @@ sanei_magic_crop(SANE_Parameters * params, SANE_Byte * buffer,
 
   DBG (15, "sanei_magic_crop: l:%d r:%d p:%d b:%d\n",left,right,pixels,bytes);
 
-  line = malloc(bytes);
-  if(!line){
-    DBG (5, "sanei_magic_crop: no line\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
-  }
-
   for(i=top; i<bot; i++){
-    memcpy(line, buffer + i*bwidth + left, bytes);
-    memcpy(buffer + pos, line, bytes);
+    memmove(outbuf + pos, buffer + i*bwidth + left, bytes);
     pos += bytes;
   }
 
@@ -493,9 +1105,6 @@ sanei_magic_crop(SANE_Parameters * params, SANE_Byte * buffer,
   params->bytes_per_line = bytes;
 
   cleanup:
-  if(line)
-    free(line);
-
   DBG (10, "sanei_magic_crop: finish\n");
   return ret;
 }
@@ -510,21 +1119,6 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   int pwidth = params->pixels_per_line;
   int height = params->lines;
 
-  double TSlope = 0;
-  int TXInter = 0;
-  int TYInter = 0;
-  double TSlopeHalf = 0;
-  int TOffsetHalf = 0;
-
-  double LSlope = 0;
-  int LXInter = 0;
-  int LYInter = 0;
-  double LSlopeHalf = 0;
-  int LOffsetHalf = 0;
-
-  int rotateX = 0;
-  int rotateY = 0;
-
   int * topBuf = NULL, * botBuf = NULL;
 
   DBG (10, "sanei_magic_findSkew: start\n");
@@ -546,12 +1140,47 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
     goto cleanup;
   }
 
+  ret = findSkewBufs(pwidth, height, dpiY, topBuf, botBuf,
+    centerX, centerY, finSlope);
+
+  cleanup:
+  if(topBuf)
+    free(topBuf);
+  if(botBuf)
+    free(botBuf);
+
+  DBG (10, "sanei_magic_findSkew: finish\n");
+  return ret;
+}
+
+/* find angle and center of rotation, given top and bottom transitions */
+static SANE_Status
+findSkewBufs (int pwidth, int height, int dpiY, int * topBuf, int * botBuf,
+  int * centerX, int * centerY, double * finSlope)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  double TSlope = 0;
+  int TXInter = 0;
+  int TYInter = 0;
+  double TSlopeHalf = 0;
+  int TOffsetHalf = 0;
+
+  double LSlope = 0;
+  int LXInter = 0;
+  int LYInter = 0;
+  double LSlopeHalf = 0;
+  int LOffsetHalf = 0;
+
+  int rotateX = 0;
+  int rotateY = 0;
+
   /* find best top line */
   ret = getTopEdge (pwidth, height, dpiY, topBuf,
     &TSlope, &TXInter, &TYInter);
   if(ret){
     DBG(5,"sanei_magic_findSkew: gTE error: %d",ret);
-    goto cleanup;
+    return ret;
   }
   DBG(15,"top: %04.04f %d %d\n",TSlope,TXInter,TYInter);
 
@@ -559,7 +1188,7 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   if(fabs(TSlope) < 0.0001){
     DBG(15,"sanei_magic_findSkew: slope too shallow: %0.08f\n",TSlope);
     ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
+    return ret;
   }
 
   /* find best left line, perpendicular to top line */
@@ -568,7 +1197,7 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
     &LXInter, &LYInter);
   if(ret){
     DBG(5,"sanei_magic_findSkew: gLE error: %d",ret);
-    goto cleanup;
+    return ret;
   }
   DBG(15,"sanei_magic_findSkew: left: %04.04f %d %d\n",LSlope,LXInter,LYInter);
 
@@ -589,183 +1218,587 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   *centerY = rotateY;
   *finSlope = TSlope;
 
-  cleanup:
-  if(topBuf)
-    free(topBuf);
-  if(botBuf)
-    free(botBuf);
-
-  DBG (10, "sanei_magic_findSkew: finish\n");
   return ret;
 }
 
-/* function to do a simple rotation by a given slope, around
- * a given point. The point can be outside of image to get
- * proper edge alignment. Unused areas filled with bg color
- * FIXME: Do in-place rotation to save memory */
-SANE_Status
-sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
-  int centerX, int centerY, double slope, int bg_color)
+/* rotate arguments, each tile is a band of output rows */
+struct rotateArgs {
+  SANE_Parameters * params;
+  SANE_Byte * buffer;
+  unsigned char * outbuf;
+  int centerX;
+  int centerY;
+  double slopeSin;
+  double slopeCos;
+  int bg_color;
+  int depth;
+
+  /* source position moves by -cos, -sin for each output column */
+  int stepXi, stepXf;
+  int stepYi, stepYf;
+
+  /* columns per unit of x and y fraction, for guessing run lengths */
+  double runX, runY;
+};
+
+/* a source position in fixed point, whole and fractional parts.
+ * x is shiftX*cos + shiftY*sin, y is -shiftY*cos + shiftX*sin */
+struct rotatePos {
+  int xi, xf;
+  int yi, yf;
+};
+
+/* split x into whole and fractional parts, floor(x) and ROTATE_ONE
+ * times the remainder */
+static void
+rotateFixed (double x, int * whole, int * frac)
 {
+  double f = floor(x);
 
-  SANE_Status ret = SANE_STATUS_GOOD;
+  *whole = (int)f;
+  *frac = (int)((x - f) * ROTATE_ONE + 0.5);
+  if(*frac >= ROTATE_ONE){
+    *whole += 1;
+    *frac -= ROTATE_ONE;
+  }
+}
 
-  double slopeRad = -atan(slope);
-  double slopeSin = sin(slopeRad);
-  double slopeCos = cos(slopeRad);
+/* position n columns after start, n is less than MAGIC_TILE_SIZE
+ * so the fractional part cannot overflow */
+static void
+rotateAt (struct rotateArgs * a, struct rotatePos * start, int n,
+  struct rotatePos * pos)
+{
+  pos->xf = start->xf + n * a->stepXf;
+  pos->xi = start->xi + n * a->stepXi + (pos->xf >> ROTATE_SHIFT);
+  pos->xf &= ROTATE_ONE - 1;
 
-  int pwidth = params->pixels_per_line;
-  int bwidth = params->bytes_per_line;
-  int height = params->lines;
-  int depth = 1;
+  pos->yf = start->yf + n * a->stepYf;
+  pos->yi = start->yi + n * a->stepYi + (pos->yf >> ROTATE_SHIFT);
+  pos->yf &= ROTATE_ONE - 1;
+}
 
-  unsigned char * outbuf;
-  int i, j, k;
+/* nearest source pixel, offsets are rounded toward the center */
+static void
+rotateNearest (struct rotateArgs * a, struct rotatePos * pos,
+  int * sourceX, int * sourceY)
+{
+  *sourceX = a->centerX - (pos->xi + (pos->xi < 0 && pos->xf));
+  *sourceY = a->centerY + (pos->yi + (pos->yi < 0 && pos->yf));
+}
 
-  DBG(10,"sanei_magic_rotate: start: %d %d\n",centerX,centerY);
+/* likely number of columns from pos, up to max, whose nearest source
+ * pixels are a straight run along one source row. x advances a pixel
+ * each column until its fraction carries, y stays until its fraction
+ * wraps. the guess can be off near the center, so it is checked */
+static int
+rotateRun (struct rotateArgs * a, struct rotatePos * pos, int max)
+{
+  double len = max;
+  double d;
 
-  outbuf = malloc(bwidth*height);
-  if(!outbuf){
-    DBG(15,"sanei_magic_rotate: no outbuf\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
-  }
+  if(a->stepXi != -1)
+    return 1;
 
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+  d = (ROTATE_ONE - 1 - pos->xf) * a->runX + 1;
+  if(d < len)
+    len = d;
 
-    if(params->format == SANE_FRAME_RGB)
-      depth = 3;
+  /* moving up, y goes down a row when the fraction does not carry */
+  if(a->stepYi == -1)
+    d = pos->yf * a->runY + 1;
 
-    memset(outbuf,bg_color,bwidth*height);
+  /* moving down, y goes up a row when the fraction carries */
+  else if(a->stepYi == 0)
+    d = (ROTATE_ONE - 1 - pos->yf) * a->runY + 1;
 
-    for (i=0; i<height; i++) {
-      int shiftY = centerY - i;
-    
-      for (j=0; j<pwidth; j++) {
-        int shiftX = centerX - j;
-        int sourceX, sourceY;
-    
-        sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-        if (sourceX < 0 || sourceX >= pwidth)
-          continue;
-    
-        sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-        if (sourceY < 0 || sourceY >= height)
-          continue;
-    
-        for (k=0; k<depth; k++) {
-          outbuf[i*bwidth+j*depth+k]
-            = buffer[sourceY*bwidth+sourceX*depth+k];
+  else
+    return 1;
+
+  if(d < len)
+    len = d;
+
+  return (int)len;
+}
+
+/* copy nearest source pixels to output row i, columns col to col+last-1.
+ * source x never goes back and moves at most one pixel per column, and
+ * source y only moves one way, so if the ends of a span are on one source
+ * row, and as far apart as in the output, the whole span is a straight
+ * run, and can be copied at once */
+static void
+rotateSpan (struct rotateArgs * a, struct rotatePos * start, int i,
+  int col, int last)
+{
+  int pwidth = a->params->pixels_per_line;
+  int bwidth = a->params->bytes_per_line;
+  int height = a->params->lines;
+  int depth = a->depth;
+  unsigned char * out = a->outbuf + i*bwidth;
+  struct rotatePos pos;
+  int x0, y0, x1, y1;
+  int j, n, len;
+
+  rotateAt(a, start, 0, &pos);
+  rotateNearest(a, &pos, &x0, &y0);
+  rotateAt(a, start, last-1, &pos);
+  rotateNearest(a, &pos, &x1, &y1);
+
+  /* whole block is off one side of the source, leave background */
+  if((x0 < 0 && x1 < 0) || (x0 >= pwidth && x1 >= pwidth)
+    || (y0 < 0 && y1 < 0) || (y0 >= height && y1 >= height))
+    return;
+
+  for(n=0; n<last; n+=len){
+    SANE_Byte * in;
+
+    rotateAt(a, start, n, &pos);
+    rotateNearest(a, &pos, &x0, &y0);
+
+    len = 1;
+    if (x0 < 0 || x0 >= pwidth || y0 < 0 || y0 >= height)
+      continue;
+
+    /* longest straight run from here, shortened until it checks out.
+     * rounding can make the guess one too long, so try that first */
+    len = rotateRun(a, &pos, last-n);
+    while(len > 1){
+      rotateAt(a, start, n+len-1, &pos);
+      rotateNearest(a, &pos, &x1, &y1);
+      if(y1 == y0 && x1 - x0 == len-1 && x1 < pwidth)
+        break;
+      if(len > 2 && !(len & 1))
+        len--;
+      else
+        len /= 2;
+    }
+
+    in = a->buffer + y0*bwidth;
+
+    /* short runs are quicker to copy by hand */
+    if(depth){
+      if(len*depth > 16){
+        memcpy(out + (col+n)*depth, in + x0*depth, len*depth);
+      }
+      else{
+        SANE_Byte * src = in + x0*depth;
+        SANE_Byte * dst = out + (col+n)*depth;
+        for(j=0; j<len*depth; j++){
+          dst[j] = src[j];
         }
       }
+      continue;
     }
-  }
 
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    for(j=col+n; j<col+n+len; j++, x0++){
+      /* wipe out old bit */
+      out[j/8] &= ~(1 << (7-(j%8)));
 
-    if(bg_color)
-      bg_color = 0xff;
+      /* fill in new bit */
+      out[j/8] |= ((in[x0/8] >> (7-(x0%8))) & 1) << (7-(j%8));
+    }
+  }
+}
 
-    memset(outbuf,bg_color,bwidth*height);
+/* copy nearest source pixels to output row i one at a time, stepping the
+ * position from column to column. used when runs would be very short */
+static void
+rotatePixels (struct rotateArgs * a, struct rotatePos * start, int i,
+  int col, int last)
+{
+  int pwidth = a->params->pixels_per_line;
+  int bwidth = a->params->bytes_per_line;
+  int height = a->params->lines;
+  int depth = a->depth;
+  unsigned char * out = a->outbuf + i*bwidth;
+  SANE_Byte * buffer = a->buffer;
+  int centerX = a->centerX, centerY = a->centerY;
+  int stepXi = a->stepXi, stepXf = a->stepXf;
+  int stepYi = a->stepYi, stepYf = a->stepYf;
+  int xi = start->xi, xf = start->xf;
+  int yi = start->yi, yf = start->yf;
+  int j;
+
+  for(j=col; j<col+last; j++){
+
+    /* same rounding as rotateNearest */
+    int sourceX = centerX - (xi + (xi < 0 && xf));
+    int sourceY = centerY + (yi + (yi < 0 && yf));
+
+    xf += stepXf;
+    xi += stepXi + (xf >> ROTATE_SHIFT);
+    xf &= ROTATE_ONE - 1;
+
+    yf += stepYf;
+    yi += stepYi + (yf >> ROTATE_SHIFT);
+    yf &= ROTATE_ONE - 1;
+
+    if (sourceX < 0 || sourceX >= pwidth
+      || sourceY < 0 || sourceY >= height)
+      continue;
+
+    if (depth) {
+      int k;
+      for (k=0; k<depth; k++) {
+        out[j*depth+k] = buffer[sourceY*bwidth+sourceX*depth+k];
+      }
+    }
+    else {
+      /* wipe out old bit */
+      out[j/8] &= ~(1 << (7-(j%8)));
 
-    for (i=0; i<height; i++) {
-      int shiftY = centerY - i;
-    
-      for (j=0; j<pwidth; j++) {
-        int shiftX = centerX - j;
-        int sourceX, sourceY;
-    
-        sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-        if (sourceX < 0 || sourceX >= pwidth)
-          continue;
-    
-        sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-        if (sourceY < 0 || sourceY >= height)
-          continue;
+      /* fill in new bit */
+      out[j/8] |= ((buffer[sourceY*bwidth + sourceX/8]
+        >> (7-(sourceX%8))) & 1) << (7-(j%8));
+    }
+  }
+}
 
-        /* wipe out old bit */
-        outbuf[i*bwidth + j/8] &= ~(1 << (7-(j%8)));
+/* blend the four source pixels around each output pixel of a block,
+ * with weights out of 256. pixels with no nearest source are left */
+static void
+rotateBilinear (struct rotateArgs * a, struct rotatePos * start, int i,
+  int col, int last)
+{
+  int pwidth = a->params->pixels_per_line;
+  int bwidth = a->params->bytes_per_line;
+  int height = a->params->lines;
+  int depth = a->depth;
+  unsigned char * out = a->outbuf + i*bwidth;
+  struct rotatePos pos;
+  int j, k;
+
+  for(j=0; j<last; j++){
+    int sourceX, sourceY;
+    int x0, y0, x1, y1, wx, wy;
+    SANE_Byte * r0, * r1;
+
+    rotateAt(a, start, j, &pos);
+    rotateNearest(a, &pos, &sourceX, &sourceY);
+
+    if (sourceX < 0 || sourceX >= pwidth
+      || sourceY < 0 || sourceY >= height)
+      continue;
+
+    /* source x is centerX - x, source y is centerY + y */
+    x0 = a->centerX - pos.xi - (pos.xf != 0);
+    y0 = a->centerY + pos.yi;
+    wx = pos.xf ? (ROTATE_ONE - pos.xf) >> (ROTATE_SHIFT-8) : 0;
+    wy = pos.yf >> (ROTATE_SHIFT-8);
+    x1 = x0 + 1;
+    y1 = y0 + 1;
+
+    if(x0 < 0)
+      x0 = 0;
+    if(y0 < 0)
+      y0 = 0;
+    if(x1 >= pwidth)
+      x1 = pwidth - 1;
+    if(y1 >= height)
+      y1 = height - 1;
+
+    r0 = a->buffer + y0*bwidth;
+    r1 = a->buffer + y1*bwidth;
+
+    for (k=0; k<depth; k++) {
+      int top = r0[x0*depth+k] * (256-wx) + r0[x1*depth+k] * wx;
+      int bot = r1[x0*depth+k] * (256-wx) + r1[x1*depth+k] * wx;
+
+      out[(col+j)*depth+k] = (top * (256-wy) + bot * wy + 32768) >> 16;
+    }
+  }
+}
 
-        /* fill in new bit */
-        outbuf[i*bwidth + j/8] |= 
-          ((buffer[sourceY*bwidth + sourceX/8]
-          >> (7-(sourceX%8))) & 1) << (7-(j%8));
-      }
+static void
+rotateRows (void * arg, int tile)
+{
+  struct rotateArgs * a = arg;
+
+  int pwidth = a->params->pixels_per_line;
+  int bwidth = a->params->bytes_per_line;
+  int height = a->params->lines;
+
+  int first = tile * MAGIC_TILE_SIZE;
+  int last = first + MAGIC_TILE_SIZE;
+  int i, col;
+
+  if(last > height)
+    last = height;
+
+  memset(a->outbuf + first*bwidth, a->bg_color, (last-first)*bwidth);
+
+  /* rows are done in order, so source rows are read nearly in order too.
+   * the position is worked out again at the start of each block of
+   * columns, so rounding in the steps never adds up to a whole pixel */
+  for (i=first; i<last; i++) {
+    int shiftY = a->centerY - i;
+
+    for (col=0; col<pwidth; col+=MAGIC_TILE_SIZE) {
+      int shiftX = a->centerX - col;
+      int end = col + MAGIC_TILE_SIZE;
+      struct rotatePos start;
+
+      if(end > pwidth)
+        end = pwidth;
+
+      rotateFixed(shiftX * a->slopeCos + shiftY * a->slopeSin,
+        &start.xi, &start.xf);
+      rotateFixed(-shiftY * a->slopeCos + shiftX * a->slopeSin,
+        &start.yi, &start.yf);
+
+      if(a->depth && magic_rotate_bilinear)
+        rotateBilinear(a, &start, i, col, end-col);
+      else if(a->runY < ROTATE_MIN_RUN)
+        rotatePixels(a, &start, i, col, end-col);
+      else
+        rotateSpan(a, &start, i, col, end-col);
     }
   }
-  else{
-    DBG (5, "sanei_magic_rotate: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
+}
+
+/* function to do a simple rotation by a given slope, around
+ * a given point. The point can be outside of image to get
+ * proper edge alignment. Unused areas filled with bg color */
+SANE_Status
+sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
+  int centerX, int centerY, double slope, int bg_color)
+{
+  return sanei_magic_rotateArena(params, buffer, centerX, centerY,
+    slope, bg_color, NULL);
+}
+
+/* same as above, but builds the rotated image in a buffer kept in the
+ * arena between calls, instead of allocating one for every image */
+SANE_Status
+sanei_magic_rotateArena (SANE_Parameters * params, SANE_Byte * buffer,
+  int centerX, int centerY, double slope, int bg_color,
+  SANEI_Magic_Arena * arena)
+{
+
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  size_t size = (size_t)params->bytes_per_line * params->lines;
+
+  unsigned char * outbuf = NULL;
+
+  DBG(10,"sanei_magic_rotate: start: %d %d\n",centerX,centerY);
+
+  if(arena)
+    outbuf = arenaBuffer(arena, size);
+  else
+    outbuf = malloc(size);
+
+  if(!outbuf){
+    DBG(15,"sanei_magic_rotate: no outbuf\n");
+    ret = SANE_STATUS_NO_MEM;
     goto cleanup;
   }
 
-  memcpy(buffer,outbuf,bwidth*height);
+  ret = rotateInto(params, buffer, outbuf, centerX, centerY, slope,
+    bg_color);
+  if(ret)
+    goto cleanup;
+
+  memcpy(buffer,outbuf,size);
 
   cleanup:
 
-  if(outbuf)
+  if(!arena && outbuf)
     free(outbuf);
 
   DBG(10,"sanei_magic_rotate: finish\n");
 
-  return 0;
+  return ret;
+}
+
+/* rotate the image in buffer into outbuf, which must be as large */
+static SANE_Status
+rotateInto (SANE_Parameters * params, SANE_Byte * buffer,
+  SANE_Byte * outbuf, int centerX, int centerY, double slope, int bg_color)
+{
+  double slopeRad = -atan(slope);
+  int height = params->lines;
+  struct rotateArgs a;
+
+  if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    if(bg_color)
+      bg_color = 0xff;
+  }
+  else if(params->format != SANE_FRAME_RGB &&
+    (params->format != SANE_FRAME_GRAY || params->depth != 8)
+  ){
+    DBG (5, "sanei_magic_rotate: unsupported format/depth\n");
+    return SANE_STATUS_INVAL;
+  }
+
+  /* output rows are independent, so each band can be done separately */
+  a.params = params;
+  a.buffer = buffer;
+  a.outbuf = outbuf;
+  a.centerX = centerX;
+  a.centerY = centerY;
+  a.slopeSin = sin(slopeRad);
+  a.slopeCos = cos(slopeRad);
+  a.bg_color = bg_color;
+  a.depth = 0;
+
+  if(params->format == SANE_FRAME_RGB)
+    a.depth = 3;
+  else if(params->depth == 8)
+    a.depth = 1;
+
+  rotateFixed(-a.slopeCos, &a.stepXi, &a.stepXf);
+  rotateFixed(-a.slopeSin, &a.stepYi, &a.stepYf);
+
+  a.runX = a.stepXf ? 1.0 / a.stepXf : ROTATE_ONE;
+  a.runY = ROTATE_ONE;
+  if(a.stepYi == -1 && a.stepYf < ROTATE_ONE)
+    a.runY = 1.0 / (ROTATE_ONE - a.stepYf);
+  else if(a.stepYi == 0 && a.stepYf)
+    a.runY = 1.0 / a.stepYf;
+
+  sanei_tiles_run(magic_threads, rotateRows, &a,
+    (height + MAGIC_TILE_SIZE - 1) / MAGIC_TILE_SIZE);
+
+  return SANE_STATUS_GOOD;
 }
 
+/* create an empty arena, the buffer is allocated when first needed */
 SANE_Status
-sanei_magic_isBlank (SANE_Parameters * params, SANE_Byte * buffer,
-  double thresh)
+sanei_magic_arenaNew (SANEI_Magic_Arena ** arena)
 {
-  SANE_Status ret = SANE_STATUS_GOOD;
-  double imagesum = 0;
-  int i, j;
+  *arena = calloc(1, sizeof(**arena));
+  if(!*arena){
+    DBG (5, "sanei_magic_arenaNew: no arena\n");
+    return SANE_STATUS_NO_MEM;
+  }
 
-  DBG(10,"sanei_magic_isBlank: start: %f\n",thresh);
+  return SANE_STATUS_GOOD;
+}
 
-  /*convert thresh from percent (0-100) to 0-1 range*/
-  thresh /= 100;
+void
+sanei_magic_arenaFree (SANEI_Magic_Arena * arena)
+{
+  if(!arena)
+    return;
+
+  if(arena->buffer)
+    free(arena->buffer);
+
+  free(arena);
+}
+
+/* grow the arena's buffer to at least size bytes, contents are lost */
+static SANE_Byte *
+arenaBuffer (SANEI_Magic_Arena * arena, size_t size)
+{
+  if(arena->size < size){
+    if(arena->buffer)
+      free(arena->buffer);
+    arena->size = 0;
+    arena->buffer = malloc(size);
+    if(arena->buffer)
+      arena->size = size;
+  }
+
+  return arena->buffer;
+}
+
+/* isBlank arguments, each tile fills in density of a band of rows */
+struct blankArgs {
+  SANE_Parameters * params;
+  SANE_Byte * buffer;
+  double * density;
+};
+
+/* fraction of a row which is dark, 0 to 1 */
+static double
+rowDensity (SANE_Parameters * params, SANE_Byte * ptr)
+{
+  int rowsum = 0;
+  int j;
 
   if(params->format == SANE_FRAME_RGB || 
     (params->format == SANE_FRAME_GRAY && params->depth == 8)
   ){
 
-    /* loop over all rows, find density of each */
-    for(i=0; i<params->lines; i++){
-      int rowsum = 0;
-      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
-
-      /* loop over all columns, sum the 'darkness' of the pixels */
-      for(j=0; j<params->bytes_per_line; j++){
-        rowsum += 255 - ptr[j];
-      }
-
-      imagesum += (double)rowsum/params->bytes_per_line/255;
+    /* loop over all columns, sum the 'darkness' of the pixels */
+    for(j=0; j<params->bytes_per_line; j++){
+      rowsum += 255 - ptr[j];
     }
 
+    return (double)rowsum/params->bytes_per_line/255;
   }
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
 
-    /* loop over all rows, find density of each */
-    for(i=0; i<params->lines; i++){
-      int rowsum = 0;
-      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
+  /* loop over all columns, sum the pixels */
+  for(j=0; j<params->pixels_per_line; j++){
+    rowsum += ptr[j/8] >> (7-(j%8)) & 1;
+  }
 
-      /* loop over all columns, sum the pixels */
-      for(j=0; j<params->pixels_per_line; j++){
-        rowsum += ptr[j/8] >> (7-(j%8)) & 1;
-      }
+  return (double)rowsum/params->pixels_per_line;
+}
 
-      imagesum += (double)rowsum/params->pixels_per_line;
-    }
+static void
+blankRows (void * arg, int tile)
+{
+  struct blankArgs * a = arg;
+  SANE_Parameters * params = a->params;
+
+  int first = tile * MAGIC_TILE_SIZE;
+  int last = first + MAGIC_TILE_SIZE;
+  int i;
 
+  if(last > params->lines)
+    last = params->lines;
+
+  /* loop over all rows, find density of each */
+  for(i=first; i<last; i++){
+    a->density[i] = rowDensity(params, a->buffer + params->bytes_per_line*i);
   }
-  else{
+}
+
+SANE_Status
+sanei_magic_isBlank (SANE_Parameters * params, SANE_Byte * buffer,
+  double thresh)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  double imagesum = 0;
+  struct blankArgs a;
+  int i;
+
+  DBG(10,"sanei_magic_isBlank: start: %f\n",thresh);
+
+  a.density = NULL;
+
+  /*convert thresh from percent (0-100) to 0-1 range*/
+  thresh /= 100;
+
+  if(params->format != SANE_FRAME_RGB
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 8)
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 1)
+  ){
     DBG (5, "sanei_magic_isBlank: unsupported format/depth\n");
     ret = SANE_STATUS_INVAL;
     goto cleanup;
   }
 
+  a.density = calloc(params->lines + 1, sizeof(double));
+  if(!a.density){
+    DBG (5, "sanei_magic_isBlank: no density\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+  a.params = params;
+  a.buffer = buffer;
+
+  sanei_tiles_run(magic_threads, blankRows, &a,
+    (params->lines + MAGIC_TILE_SIZE - 1) / MAGIC_TILE_SIZE);
+
+  /* sum in row order, so the total does not depend on thread count */
+  for(i=0; i<params->lines; i++){
+    imagesum += a.density[i];
+  }
+
   DBG (5, "sanei_magic_isBlank: sum:%f lines:%d thresh:%f density:%f\n",
     imagesum,params->lines,thresh,imagesum/params->lines);
 
@@ -776,6 +1809,9 @@ sanei_magic_isBlank (SANE_Parameters * params, SANE_Byte * buffer,
 
   cleanup:
 
+  if(a.density)
+    free(a.density);
+
   DBG(10,"sanei_magic_isBlank: finish\n");
 
   return ret;
@@ -943,226 +1979,1097 @@ sanei_magic_findTurn(SANE_Parameters * params, SANE_Byte * buffer,
     *angle = 90;
   }
 
-  cleanup:
+  cleanup:
+
+  DBG(10,"sanei_magic_findTurn: finish\n");
+
+  return ret;
+}
+
+/* FIXME: Do in-place rotation to save memory */
+SANE_Status
+sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
+  int angle)
+{
+  return turnArena(params, buffer, angle, NULL);
+}
+
+/* same as above, optionally building the turned image in an arena */
+static SANE_Status
+turnArena(SANE_Parameters * params, SANE_Byte * buffer, int angle,
+  SANEI_Magic_Arena * arena)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  int opwidth, ipwidth = params->pixels_per_line;
+  int obwidth, ibwidth = params->bytes_per_line;
+  int oheight, iheight = params->lines;
+  int depth = 1;
+
+  unsigned char * outbuf = NULL;
+  int i, j, k;
+
+  DBG(10,"sanei_magic_turn: start %d\n",angle);
+
+  if(params->format == SANE_FRAME_RGB)
+    depth = 3;
+
+  /*clean angle and convert to 0-3*/
+  angle = (angle % 360) / 90;
+
+  /*figure size of output image*/
+  switch(angle){
+    case 1:
+    case 3:
+      opwidth = iheight;
+      oheight = ipwidth;
+
+      /*gray and color, 1 or 3 bytes per pixel*/
+      if ( params->format == SANE_FRAME_RGB
+        || (params->format == SANE_FRAME_GRAY && params->depth == 8)
+      ){
+        obwidth = opwidth*depth;
+      }
+
+      /*clamp binary to byte width. must be <= input image*/
+      else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+        obwidth = opwidth/8;
+        opwidth = obwidth*8;
+      }
+
+      else{
+        DBG(10,"sanei_magic_turn: bad params\n");
+        ret = SANE_STATUS_INVAL;
+        goto cleanup;
+      }
+
+      break;
+
+    case 2:
+      opwidth = ipwidth;
+      obwidth = ibwidth;
+      oheight = iheight;
+      break;
+
+    default:
+      DBG(10,"sanei_magic_turn: no turn\n");
+      goto cleanup;
+  }
+
+  /*get output image buffer*/
+  if(arena)
+    outbuf = arenaBuffer(arena, (size_t)obwidth*oheight);
+  else
+    outbuf = malloc(obwidth*oheight);
+  if(!outbuf){
+    DBG(15,"sanei_magic_turn: no outbuf\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  /*turn color & gray image*/
+  if(params->format == SANE_FRAME_RGB || 
+    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  ){
+
+    switch (angle) {
+
+      /*rotate 90 clockwise*/
+      case 1:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            for (k=0; k<depth; k++) {
+              outbuf[i*obwidth + j*depth + k]
+                = buffer[(iheight-j-1)*ibwidth + i*depth + k];
+            }
+          }
+        }
+        break;
+
+      /*rotate 180 clockwise*/
+      case 2:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            for (k=0; k<depth; k++) {
+              outbuf[i*obwidth + j*depth + k]
+                = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)*depth + k];
+            }
+          }
+        }
+        break;
+
+      /*rotate 270 clockwise*/
+      case 3:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            for (k=0; k<depth; k++) {
+              outbuf[i*obwidth + j*depth + k]
+                = buffer[j*ibwidth + (ipwidth-i-1)*depth + k];
+            }
+          }
+        }
+        break;
+    } /*end switch*/
+  }
+
+  /*turn binary image*/
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+
+    switch (angle) {
+
+      /*rotate 90 clockwise*/
+      case 1:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            unsigned char curr
+              = buffer[(iheight-j-1)*ibwidth + i/8] >> (7-(i%8)) & 1;
+
+            unsigned char mask = 1 << (7-(j%8));
+
+            if(curr){
+              outbuf[i*obwidth + j/8] |= mask;
+            }
+            else{
+              outbuf[i*obwidth + j/8] &= (~mask);
+            }
+
+          }
+        }
+        break;
+
+      /*rotate 180 clockwise*/
+      case 2:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            unsigned char curr
+              = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)/8] >> (j%8) & 1;
+
+            unsigned char mask = 1 << (7-(j%8));
+
+            if(curr){
+              outbuf[i*obwidth + j/8] |= mask;
+            }
+            else{
+              outbuf[i*obwidth + j/8] &= (~mask);
+            }
+
+          }
+        }
+        break;
+
+      /*rotate 270 clockwise*/
+      case 3:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            unsigned char curr
+              = buffer[j*ibwidth + (ipwidth-i-1)/8] >> (i%8) & 1;
+
+            unsigned char mask = 1 << (7-(j%8));
+
+            if(curr){
+              outbuf[i*obwidth + j/8] |= mask;
+            }
+            else{
+              outbuf[i*obwidth + j/8] &= (~mask);
+            }
+
+          }
+        }
+        break;
+    } /*end switch*/
+  }
+
+  else{
+    DBG (5, "sanei_magic_turn: unsupported format/depth\n");
+    ret = SANE_STATUS_INVAL;
+    goto cleanup;
+  }
+
+  /*copy output back into input buffer*/
+  memcpy(buffer,outbuf,obwidth*oheight);
+
+  /*update input params*/
+  params->pixels_per_line = opwidth;
+  params->bytes_per_line = obwidth;
+  params->lines = oheight;
+
+  cleanup:
+
+  if(!arena && outbuf)
+    free(outbuf);
+
+  DBG(10,"sanei_magic_turn: finish\n");
+
+  return ret;
+}
+
+/* run the requested operations on one side of a page, in order.
+ * the image is rotated into the arena, and when it is then cropped,
+ * the rows are copied straight back from there, so deskew and crop
+ * together copy the page only once */
+SANE_Status
+sanei_magic_process (SANEI_Magic_Page * page, const SANEI_Magic_Page * mirror,
+  SANEI_Magic_Arena * arena)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  SANE_Status stat;
+
+  SANE_Parameters * params = page->params;
+  SANEI_Magic_Arena * own = NULL;
+  SANE_Byte * image = page->buffer;
+
+  DBG (10, "sanei_magic_process: start %x\n", page->ops);
+
+  page->skewStatus = SANE_STATUS_UNSUPPORTED;
+  page->edgeStatus = SANE_STATUS_UNSUPPORTED;
+  page->isBlank = 0;
+
+  if(!arena && (page->ops & (SANEI_MAGIC_DESKEW|SANEI_MAGIC_TURN))){
+    if(sanei_magic_arenaNew(&own) == SANE_STATUS_GOOD)
+      arena = own;
+  }
+
+  /* find the skew, or use a 'flipped' version of the front side's */
+  if(page->ops & SANEI_MAGIC_DESKEW){
+
+    if(mirror && mirror->skewStatus == SANE_STATUS_GOOD){
+      page->skewX = params->pixels_per_line - mirror->skewX;
+      page->skewY = mirror->skewY;
+      page->skewSlope = -mirror->skewSlope;
+      page->skewStatus = SANE_STATUS_GOOD;
+    }
+    else if(streamMatches(page->stream, params)){
+      page->skewStatus = sanei_magic_streamFindSkew(page->stream,
+        &page->skewX, &page->skewY, &page->skewSlope);
+    }
+    else{
+      page->skewStatus = sanei_magic_findSkew(params, page->buffer,
+        page->dpiX, page->dpiY,
+        &page->skewX, &page->skewY, &page->skewSlope);
+    }
+
+    if(page->skewStatus){
+      DBG (5, "sanei_magic_process: no skew %d\n", page->skewStatus);
+      if(page->skewStatus != SANE_STATUS_UNSUPPORTED && !ret)
+        ret = page->skewStatus;
+    }
+    else if(!arena || !arenaBuffer(arena,
+      (size_t)params->bytes_per_line * params->lines)){
+      DBG (5, "sanei_magic_process: no rotate buffer\n");
+      if(!ret)
+        ret = SANE_STATUS_NO_MEM;
+    }
+    else{
+      /* leave the rotated image in the arena for now */
+      stat = rotateInto(params, page->buffer, arena->buffer,
+        page->skewX, page->skewY, page->skewSlope, page->bgColor);
+      if(stat){
+        DBG (5, "sanei_magic_process: rotate error %d\n", stat);
+        if(!ret)
+          ret = stat;
+      }
+      else
+        image = arena->buffer;
+    }
+  }
+
+  /* find the edges, or use a 'flipped' version of the front side's */
+  if(page->ops & SANEI_MAGIC_CROP){
+
+    if(mirror && mirror->edgeStatus == SANE_STATUS_GOOD){
+      page->top = mirror->top;
+      page->bot = mirror->bot;
+      page->left = params->pixels_per_line - mirror->right;
+      page->right = params->pixels_per_line - mirror->left;
+      page->edgeStatus = SANE_STATUS_GOOD;
+    }
+    else{
+      /* the stream saw the rows before any rotation */
+      if(image == page->buffer && streamMatches(page->stream, params))
+        page->edgeStatus = sanei_magic_streamFindEdges(page->stream,
+          &page->top, &page->bot, &page->left, &page->right);
+      else
+        page->edgeStatus = sanei_magic_findEdges(params, image,
+          page->dpiX, page->dpiY,
+          &page->top, &page->bot, &page->left, &page->right);
+
+      /* some scanners do not pad the top, so there is no edge there */
+      if(!page->edgeStatus && page->keepTop)
+        page->top = 0;
+    }
+
+    if(page->edgeStatus){
+      DBG (5, "sanei_magic_process: no edges %d\n", page->edgeStatus);
+      if(page->edgeStatus != SANE_STATUS_UNSUPPORTED && !ret)
+        ret = page->edgeStatus;
+    }
+    else{
+      DBG (15, "sanei_magic_process: t:%d b:%d l:%d r:%d\n",
+        page->top, page->bot, page->left, page->right);
+
+      stat = cropInto(params, image, page->buffer,
+        page->top, page->bot, page->left, page->right);
+      if(stat){
+        DBG (5, "sanei_magic_process: crop error %d\n", stat);
+        if(!ret)
+          ret = stat;
+      }
+      else
+        image = page->buffer;
+    }
+  }
+
+  /* not cropped, so the rotated image is still in the arena */
+  if(image != page->buffer){
+    memcpy(page->buffer, image,
+      (size_t)params->bytes_per_line * params->lines);
+  }
+
+  if(page->ops & SANEI_MAGIC_DESPECK){
+    stat = sanei_magic_despeck(params, page->buffer, page->despeckDiam);
+    if(stat){
+      DBG (5, "sanei_magic_process: despeck error %d\n", stat);
+      if(!ret)
+        ret = stat;
+    }
+  }
+
+  if(page->ops & SANEI_MAGIC_TURN){
+    int angle = 0;
+
+    stat = SANE_STATUS_GOOD;
+    if(page->findTurn)
+      stat = sanei_magic_findTurn(params, page->buffer,
+        page->dpiX, page->dpiY, &angle);
+
+    if(!stat)
+      stat = turnArena(params, page->buffer, angle + page->turnAngle,
+        arena);
+
+    if(stat){
+      DBG (5, "sanei_magic_process: turn error %d\n", stat);
+      if(!ret)
+        ret = stat;
+    }
+  }
+
+  if(page->ops & SANEI_MAGIC_BLANK){
+    stat = sanei_magic_isBlank(params, page->buffer, page->blankThresh);
+    if(stat == SANE_STATUS_NO_DOCS){
+      DBG (5, "sanei_magic_process: blank!\n");
+      page->isBlank = 1;
+    }
+    else if(stat){
+      DBG (5, "sanei_magic_process: blank error %d\n", stat);
+      if(!ret)
+        ret = stat;
+    }
+  }
+
+  sanei_magic_arenaFree(own);
+
+  DBG (10, "sanei_magic_process: finish %d\n", ret);
+  return ret;
+}
+
+/* Incremental page analysis. Rows are fed in as they arrive, and only
+ * enough of them are kept to rebuild the sliding windows of getTransY.
+ * Results match the whole-page functions run on the rows seen so far. */
+
+/* rows in each getTransY window, and rows kept to slide both windows */
+#define STREAM_WIN 9
+#define STREAM_ROWS (STREAM_WIN*2+1)
+
+struct sanei_magic_stream {
+  SANE_Parameters params;  /* lines is the number of rows seen so far */
+  int dpiX;
+  int dpiY;
+  int depth;               /* bytes per pixel, 0 for binary */
+
+  SANE_Byte * ring;        /* last STREAM_ROWS rows, by row % STREAM_ROWS */
+
+  int * near;              /* per column window ending at newest row,
+                            * binary: value of first row */
+  int * far;               /* per column window before near */
+  int * topBuf;            /* first transition from top, -1 if none */
+  int * botBuf;            /* lowest transition from bottom, not counting
+                            * the last rows of page, -1 if none,
+                            * binary: last row which is set */
+  int * clearBuf;          /* binary: last row which is clear */
+
+  int * leftBuf;           /* per row transitions from left and right */
+  int * rightBuf;
+  int size;                /* rows allocated in leftBuf and rightBuf */
+
+  double imagesum;         /* sum of row densities */
+};
+
+/* gray value of one column of a row, summed over channels */
+static int
+streamPixel (SANEI_Magic_Stream * s, SANE_Byte * row, int col)
+{
+  int sum = 0;
+  int k;
+
+  for(k=0; k<s->depth; k++){
+    sum += row[col*s->depth + k];
+  }
+
+  return sum;
+}
+
+/* one of the last STREAM_ROWS rows */
+static SANE_Byte *
+streamRow (SANEI_Magic_Stream * s, int row)
+{
+  return s->ring + (row % STREAM_ROWS) * s->params.bytes_per_line;
+}
+
+/* same test as getTransY uses to find a significant transition */
+static int
+streamTrans (SANEI_Magic_Stream * s, int near, int far)
+{
+  return abs(near - far) > 50*STREAM_WIN*s->depth - near*40/255;
+}
+
+/* true if stream holds exactly the rows of an image described by params */
+static int
+streamMatches (SANEI_Magic_Stream * s, SANE_Parameters * params)
+{
+  if(!s)
+    return 0;
+
+  if(s->params.format != params->format
+    || s->params.depth != params->depth
+    || s->params.pixels_per_line != params->pixels_per_line
+    || s->params.bytes_per_line != params->bytes_per_line
+    || s->params.lines != params->lines
+  ){
+    DBG (5, "streamMatches: stream has %d rows of %d, image %d of %d\n",
+      s->params.lines, s->params.pixels_per_line,
+      params->lines, params->pixels_per_line);
+    return 0;
+  }
+
+  return 1;
+}
+
+SANE_Status
+sanei_magic_streamStart (SANE_Parameters * params, int dpiX, int dpiY,
+  SANEI_Magic_Stream ** stream)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  SANEI_Magic_Stream * s = NULL;
+  int width = params->pixels_per_line;
+
+  DBG (10, "sanei_magic_streamStart: start\n");
+
+  *stream = NULL;
+
+  if(params->format != SANE_FRAME_RGB
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 8)
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 1)
+  ){
+    DBG (5, "sanei_magic_streamStart: unsupported format/depth\n");
+    return SANE_STATUS_INVAL;
+  }
+
+  s = calloc(1, sizeof(*s));
+  if(!s){
+    DBG (5, "sanei_magic_streamStart: no stream\n");
+    return SANE_STATUS_NO_MEM;
+  }
+
+  s->params = *params;
+  s->params.lines = 0;
+  s->dpiX = dpiX;
+  s->dpiY = dpiY;
+
+  if(params->format == SANE_FRAME_RGB)
+    s->depth = 3;
+  else if(params->depth == 8)
+    s->depth = 1;
+
+  /* length of page is often unknown, grow these as needed */
+  s->size = params->lines > 0 ? params->lines : 1024;
+
+  s->ring = malloc(STREAM_ROWS * params->bytes_per_line);
+  s->near = calloc(width, sizeof(int));
+  s->far = calloc(width, sizeof(int));
+  s->topBuf = calloc(width, sizeof(int));
+  s->botBuf = calloc(width, sizeof(int));
+  s->clearBuf = calloc(width, sizeof(int));
+  s->leftBuf = calloc(s->size, sizeof(int));
+  s->rightBuf = calloc(s->size, sizeof(int));
+
+  if(!s->ring || !s->near || !s->far || !s->topBuf || !s->botBuf
+    || !s->clearBuf || !s->leftBuf || !s->rightBuf
+  ){
+    DBG (5, "sanei_magic_streamStart: no buffers\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  memset(s->topBuf, 0xff, width*sizeof(int));
+  memset(s->botBuf, 0xff, width*sizeof(int));
+  memset(s->clearBuf, 0xff, width*sizeof(int));
+
+  *stream = s;
+
+  cleanup:
+  if(ret)
+    sanei_magic_streamFree(s);
+
+  DBG (10, "sanei_magic_streamStart: finish\n");
+  return ret;
+}
+
+SANE_Status
+sanei_magic_streamRows (SANEI_Magic_Stream * s, SANE_Byte * buffer,
+  int lines)
+{
+  SANE_Parameters * params = &s->params;
+  int width = params->pixels_per_line;
+  int i, j;
+
+  DBG (15, "sanei_magic_streamRows: %d + %d\n", params->lines, lines);
+
+  for(j=0; j<lines; j++){
+    SANE_Byte * row = buffer + j*params->bytes_per_line;
+    int r = params->lines;
+
+    /* make room for side transitions */
+    if(r >= s->size){
+      int size = s->size * 2;
+      int * left = realloc(s->leftBuf, size * sizeof(int));
+      int * right;
+
+      if(left)
+        s->leftBuf = left;
+
+      right = realloc(s->rightBuf, size * sizeof(int));
+      if(!left || !right){
+        DBG (5, "sanei_magic_streamRows: no side buffers\n");
+        return SANE_STATUS_NO_MEM;
+      }
+      s->rightBuf = right;
+      s->size = size;
+    }
+
+    memcpy(streamRow(s, r), row, params->bytes_per_line);
+
+    s->imagesum += rowDensity(params, row);
+    s->leftBuf[r] = transXRow(params, row, 0, width, 1);
+    s->rightBuf[r] = transXRow(params, row, width-1, -1, -1);
+
+    /* binary just tracks first and last change of each column */
+    if(!s->depth){
+      for(i=0; i<width; i++){
+        int curr = row[i/8] >> (7-(i%8)) & 1;
+
+        if(!r)
+          s->near[i] = curr;
+        else if(s->topBuf[i] < 0 && curr != s->near[i])
+          s->topBuf[i] = r;
+
+        if(curr)
+          s->botBuf[i] = r;
+        else
+          s->clearBuf[i] = r;
+      }
+    }
+
+    /* gray and color slide a pair of windows down each column */
+    else{
+      for(i=0; i<width; i++){
+        int nearLine, farLine;
+
+        if(!r){
+          s->near[i] = streamPixel(s, row, i) * STREAM_WIN;
+          s->far[i] = s->near[i];
+          continue;
+        }
+
+        farLine = r - STREAM_WIN*2;
+        nearLine = r - STREAM_WIN;
+        if(farLine < 0)
+          farLine = 0;
+        if(nearLine < 0)
+          nearLine = 0;
+
+        s->far[i] += streamPixel(s, streamRow(s, nearLine), i)
+          - streamPixel(s, streamRow(s, farLine), i);
+        s->near[i] += streamPixel(s, row, i)
+          - streamPixel(s, streamRow(s, nearLine), i);
+
+        if(s->topBuf[i] < 0 && streamTrans(s, s->near[i], s->far[i]))
+          s->topBuf[i] = r;
+
+        /* windows are also the bottom-up pair for the row above both.
+         * lower rows see the end of page, and are done in streamTransY */
+        if(r >= STREAM_WIN*2-1 && streamTrans(s, s->far[i], s->near[i]))
+          s->botBuf[i] = r - (STREAM_WIN*2-1);
+      }
+    }
+
+    params->lines++;
+  }
+
+  return SANE_STATUS_GOOD;
+}
+
+/* build the array getTransY would return for the rows seen so far */
+static int *
+streamTransY (SANEI_Magic_Stream * s, int top)
+{
+  int width = s->params.pixels_per_line;
+  int height = s->params.lines;
+  int * buff;
+  int i, j, k;
+
+  buff = calloc(width, sizeof(int));
+  if(!buff){
+    DBG (5, "streamTransY: no buff\n");
+    return NULL;
+  }
+
+  for(i=0; i<width; i++){
+
+    if(top){
+      buff[i] = s->topBuf[i] < 0 ? height : s->topBuf[i];
+      continue;
+    }
+
+    if(!s->depth){
+      SANE_Byte * last = streamRow(s, height-1);
+
+      if(last[i/8] >> (7-(i%8)) & 1)
+        buff[i] = s->clearBuf[i];
+      else
+        buff[i] = s->botBuf[i];
+      continue;
+    }
+
+    /* windows which run off the end of the page repeat the last row */
+    buff[i] = s->botBuf[i];
+    for(j=height-2; j>=0 && j>height-STREAM_WIN*2; j--){
+      int near = 0;
+      int far = 0;
+
+      for(k=j; k<j+STREAM_WIN*2; k++){
+        int pix = streamPixel(s, streamRow(s, k<height ? k : height-1), i);
+
+        if(k < j+STREAM_WIN)
+          near += pix;
+        else
+          far += pix;
+      }
+
+      if(streamTrans(s, near, far)){
+        buff[i] = j;
+        break;
+      }
+    }
+  }
+
+  filterTrans(buff, width, s->dpiY, top ? height : -1);
+
+  return buff;
+}
+
+/* build the array getTransX would return for the rows seen so far */
+static int *
+streamTransX (SANEI_Magic_Stream * s, int left)
+{
+  int height = s->params.lines;
+  int * buff;
+
+  buff = calloc(height, sizeof(int));
+  if(!buff){
+    DBG (5, "streamTransX: no buff\n");
+    return NULL;
+  }
+
+  memcpy(buff, left ? s->leftBuf : s->rightBuf, height * sizeof(int));
+
+  filterTrans(buff, height, s->dpiX,
+    left ? s->params.pixels_per_line : -1);
+
+  return buff;
+}
+
+SANE_Status
+sanei_magic_streamIsBlank (SANEI_Magic_Stream * s, double thresh)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  int lines = s->params.lines;
+
+  DBG (10, "sanei_magic_streamIsBlank: start: %f\n", thresh);
+
+  if(!lines){
+    DBG (5, "sanei_magic_streamIsBlank: no rows\n");
+    return SANE_STATUS_INVAL;
+  }
+
+  /*convert thresh from percent (0-100) to 0-1 range*/
+  thresh /= 100;
+
+  DBG (5, "sanei_magic_streamIsBlank: sum:%f lines:%d thresh:%f density:%f\n",
+    s->imagesum, lines, thresh, s->imagesum/lines);
+
+  if(s->imagesum/lines <= thresh){
+    DBG (5, "sanei_magic_streamIsBlank: blank!\n");
+    ret = SANE_STATUS_NO_DOCS;
+  }
+
+  DBG (10, "sanei_magic_streamIsBlank: finish\n");
+  return ret;
+}
+
+SANE_Status
+sanei_magic_streamFindEdges (SANEI_Magic_Stream * s,
+  int * top, int * bot, int * left, int * right)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  int * topBuf = NULL, * botBuf = NULL;
+  int * leftBuf = NULL, * rightBuf = NULL;
+
+  DBG (10, "sanei_magic_streamFindEdges: start\n");
+
+  if(!s->params.lines){
+    DBG (5, "sanei_magic_streamFindEdges: no rows\n");
+    return SANE_STATUS_INVAL;
+  }
+
+  topBuf = streamTransY(s, 1);
+  botBuf = streamTransY(s, 0);
+  leftBuf = streamTransX(s, 1);
+  rightBuf = streamTransX(s, 0);
+  if(!topBuf || !botBuf || !leftBuf || !rightBuf){
+    DBG (5, "sanei_magic_streamFindEdges: no buffers\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  ret = findEdgesBufs(s->params.pixels_per_line, s->params.lines,
+    topBuf, botBuf, leftBuf, rightBuf, top, bot, left, right);
+
+  cleanup:
+  if(topBuf)
+    free(topBuf);
+  if(botBuf)
+    free(botBuf);
+  if(leftBuf)
+    free(leftBuf);
+  if(rightBuf)
+    free(rightBuf);
+
+  DBG (10, "sanei_magic_streamFindEdges: finish\n");
+  return ret;
+}
+
+SANE_Status
+sanei_magic_streamFindSkew (SANEI_Magic_Stream * s,
+  int * centerX, int * centerY, double * finSlope)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  int * topBuf = NULL, * botBuf = NULL;
+
+  DBG (10, "sanei_magic_streamFindSkew: start\n");
+
+  if(!s->params.lines){
+    DBG (5, "sanei_magic_streamFindSkew: no rows\n");
+    return SANE_STATUS_INVAL;
+  }
+
+  topBuf = streamTransY(s, 1);
+  botBuf = streamTransY(s, 0);
+  if(!topBuf || !botBuf){
+    DBG (5, "sanei_magic_streamFindSkew: no buffers\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  ret = findSkewBufs(s->params.pixels_per_line, s->params.lines, s->dpiY,
+    topBuf, botBuf, centerX, centerY, finSlope);
 
-  DBG(10,"sanei_magic_findTurn: finish\n");
+  cleanup:
+  if(topBuf)
+    free(topBuf);
+  if(botBuf)
+    free(botBuf);
 
+  DBG (10, "sanei_magic_streamFindSkew: finish\n");
   return ret;
 }
 
-/* FIXME: Do in-place rotation to save memory */
-SANE_Status
-sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
-  int angle)
+void
+sanei_magic_streamFree (SANEI_Magic_Stream * s)
 {
-  SANE_Status ret = SANE_STATUS_GOOD;
-  int opwidth, ipwidth = params->pixels_per_line;
-  int obwidth, ibwidth = params->bytes_per_line;
-  int oheight, iheight = params->lines;
-  int depth = 1;
+  if(!s)
+    return;
+
+  if(s->ring)
+    free(s->ring);
+  if(s->near)
+    free(s->near);
+  if(s->far)
+    free(s->far);
+  if(s->topBuf)
+    free(s->topBuf);
+  if(s->botBuf)
+    free(s->botBuf);
+  if(s->clearBuf)
+    free(s->clearBuf);
+  if(s->leftBuf)
+    free(s->leftBuf);
+  if(s->rightBuf)
+    free(s->rightBuf);
+
+  free(s);
+}
 
-  unsigned char * outbuf = NULL;
-  int i, j, k;
+/* Utility functions, not used outside this file */
 
-  DBG(10,"sanei_magic_turn: start %d\n",angle);
+/* find the most likely upper line of the paper inside the image */
+static SANE_Status
+getTopEdge(int width, int height, int resolution,
+  int * buff, double * finSlope, int * finXInter, int * finYInter)
+{
+  if(magic_skew_bins)
+    return getTopEdgeBins(width, height, resolution, buff,
+      finSlope, finXInter, finYInter);
 
-  if(params->format == SANE_FRAME_RGB)
-    depth = 3;
+  return getTopEdgeHough(width, height, resolution, buff,
+    finSlope, finXInter, finYInter);
+}
 
-  /*clean angle and convert to 0-3*/
-  angle = (angle % 360) / 90;
+/* fill the fixed point tables for getTopEdgeHough */
+static void
+houghFill (void)
+{
+  int i;
 
-  /*figure size of output image*/
-  switch(angle){
-    case 1:
-    case 3:
-      opwidth = iheight;
-      oheight = ipwidth;
+  for(i=0; i<HOUGH_ANGLES; i++){
+    double t = (i - HOUGH_ANGLES/2) * HOUGH_STEP * M_PI / 180;
+    houghSin[i] = floor(sin(t) * (1 << HOUGH_SHIFT) + 0.5);
+    houghCos[i] = floor(cos(t) * (1 << HOUGH_SHIFT) + 0.5);
+  }
+}
 
-      /*gray and color, 1 or 3 bytes per pixel*/
-      if ( params->format == SANE_FRAME_RGB
-        || (params->format == SANE_FRAME_GRAY && params->depth == 8)
-      ){
-        obwidth = opwidth*depth;
-      }
+/* fill the tables on first use. backends may find the skew of both
+ * sides of a sheet at once, so only one thread may fill them, and the
+ * others must wait until it is done */
+static void
+houghTables (void)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_once(&houghOnce, houghFill);
+#else
+  if(!houghReady){
+    houghFill();
+    houghReady = 1;
+  }
+#endif
+}
 
-      /*clamp binary to byte width. must be <= input image*/
-      else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
-        obwidth = opwidth/8;
-        opwidth = obwidth*8;
-      }
+/* Find the top edge with one integer Hough transform over the transition
+ * array, instead of repeated calls to getLine. Each valid transition votes
+ * for every line thru it, at angles within 45 degrees of level, using
+ * fixed point sin/cos tables. The best line is then refined with a second,
+ * finer transform over just the points near it. */
+static SANE_Status
+getTopEdgeHough(int width, int height, int resolution,
+  int * buff, double * finSlope, int * finXInter, int * finYInter)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
 
-      else{
-        DBG(10,"sanei_magic_turn: bad params\n");
-        ret = SANE_STATUS_INVAL;
-        goto cleanup;
-      }
+  int hWidth = width/2;
+  int rhos = resolution*2 + 1;
+  int * acc = NULL;
+  int * pts = NULL;
+  int npts = 0;
+
+  int fineSin[HOUGH_FINE_ANGLES];
+  int fineCos[HOUGH_FINE_ANGLES];
+  int fineRhos;
+  int fineMin;
+
+  int best = 0, bestAngle = 0, bestRho = 0;
+  double theta, offset;
+  int i, j, k;
 
-      break;
+  DBG(10,"getTopEdgeHough: start\n");
 
-    case 2:
-      opwidth = ipwidth;
-      obwidth = ibwidth;
-      oheight = iheight;
-      break;
+  houghTables();
 
-    default:
-      DBG(10,"sanei_magic_turn: no turn\n");
-      goto cleanup;
+  *finSlope = 0;
+  *finXInter = 0;
+  *finYInter = 0;
+
+  /* collect usable transitions, relative to center of width.
+   * points too far down cannot be near the top, and would overflow */
+  pts = malloc(width * 2 * sizeof(int));
+  if(!pts){
+    DBG(5,"getTopEdgeHough: no pts\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
   }
 
-  /*get output image buffer*/
-  outbuf = malloc(obwidth*oheight);
-  if(!outbuf){
-    DBG(15,"sanei_magic_turn: no outbuf\n");
+  for(i=0; i<width; i++){
+    if(buff[i] < 0 || buff[i] >= height || buff[i] > 2*(resolution+hWidth))
+      continue;
+    pts[npts*2] = i - hWidth;
+    pts[npts*2+1] = buff[i];
+    npts++;
+  }
+
+  /* coarse pass: all angles, rho in whole pixels within an inch of top */
+  acc = calloc(HOUGH_ANGLES * rhos, sizeof(int));
+  if(!acc){
+    DBG(5,"getTopEdgeHough: no acc\n");
     ret = SANE_STATUS_NO_MEM;
     goto cleanup;
   }
 
-  /*turn color & gray image*/
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
-
-    switch (angle) {
+  for(k=0; k<npts; k++){
+    int x = pts[k*2];
+    int y = pts[k*2+1];
+    int * row = acc;
 
-      /*rotate 90 clockwise*/
-      case 1:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            for (k=0; k<depth; k++) {
-              outbuf[i*obwidth + j*depth + k]
-                = buffer[(iheight-j-1)*ibwidth + i*depth + k];
-            }
-          }
-        }
-        break;
+    for(i=0; i<HOUGH_ANGLES; i++, row += rhos){
+      int rho = y*houghCos[i] - x*houghSin[i] + (resolution << HOUGH_SHIFT)
+        + (1 << (HOUGH_SHIFT-1));
+      if(rho < 0)
+        continue;
+      rho >>= HOUGH_SHIFT;
+      if(rho < rhos)
+        row[rho]++;
+    }
+  }
 
-      /*rotate 180 clockwise*/
-      case 2:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            for (k=0; k<depth; k++) {
-              outbuf[i*obwidth + j*depth + k]
-                = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)*depth + k];
-            }
-          }
-        }
-        break;
+  /* best pair of neighboring bins, so a line on a bin boundary is not
+   * split. on a tie, the more level line wins */
+  for(i=0; i<HOUGH_ANGLES; i++){
+    int a = (i & 1) ? HOUGH_ANGLES/2 + (i+1)/2 : HOUGH_ANGLES/2 - i/2;
+    int * row = acc + a * rhos;
 
-      /*rotate 270 clockwise*/
-      case 3:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            for (k=0; k<depth; k++) {
-              outbuf[i*obwidth + j*depth + k]
-                = buffer[j*ibwidth + (ipwidth-i-1)*depth + k];
-            }
-          }
-        }
-        break;
-    } /*end switch*/
+    for(j=0; j<rhos-1; j++){
+      if(row[j] + row[j+1] > best){
+        best = row[j] + row[j+1];
+        bestAngle = a;
+        bestRho = j;
+      }
+    }
   }
 
-  /*turn binary image*/
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
-
-    switch (angle) {
+  DBG(15,"getTopEdgeHough: coarse %d %d %d of %d\n",
+    bestAngle,bestRho,best,npts);
 
-      /*rotate 90 clockwise*/
-      case 1:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            unsigned char curr
-              = buffer[(iheight-j-1)*ibwidth + i/8] >> (7-(i%8)) & 1;
+  /* not enough of the image on one line,
+   * give up instead of fixating on some small, pointless feature */
+  if(best < width/10){
+    DBG(5,"getTopEdgeHough: density too small %d %d\n",best,width);
+    goto cleanup;
+  }
 
-            unsigned char mask = 1 << (7-(j%8));
+  /* fine pass: angles between the coarse neighbors, rho in fractions of
+   * a pixel, only for points within a few pixels of the coarse line */
+  for(i=0; i<HOUGH_FINE_ANGLES; i++){
+    double t = (bestAngle - HOUGH_ANGLES/2
+      + (double)(i - HOUGH_FINE_ANGLES/2) / (HOUGH_FINE_ANGLES/2))
+      * HOUGH_STEP * M_PI / 180;
+    fineSin[i] = floor(sin(t) * (1 << HOUGH_SHIFT) + 0.5);
+    fineCos[i] = floor(cos(t) * (1 << HOUGH_SHIFT) + 0.5);
+  }
 
-            if(curr){
-              outbuf[i*obwidth + j/8] |= mask;
-            }
-            else{
-              outbuf[i*obwidth + j/8] &= (~mask);
-            }
+  /* rho moves by less than half width times one coarse step in radians */
+  fineRhos = ((hWidth * 9 / 512 + 4) * 2 + 2) * (1 << HOUGH_FINE_BITS);
+  fineMin = (bestRho - hWidth * 9 / 512 - 4) * (1 << HOUGH_FINE_BITS);
 
-          }
-        }
-        break;
+  free(acc);
+  acc = calloc(HOUGH_FINE_ANGLES * fineRhos, sizeof(int));
+  if(!acc){
+    DBG(5,"getTopEdgeHough: no fine acc\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
 
-      /*rotate 180 clockwise*/
-      case 2:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            unsigned char curr
-              = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)/8] >> (j%8) & 1;
+  for(k=0; k<npts; k++){
+    int x = pts[k*2];
+    int y = pts[k*2+1];
+    int * row = acc;
+    int rho = y*houghCos[bestAngle] - x*houghSin[bestAngle]
+      + (resolution << HOUGH_SHIFT) + (1 << (HOUGH_SHIFT-1));
 
-            unsigned char mask = 1 << (7-(j%8));
+    /* skip points not near the coarse line */
+    if(rho < 0 || (rho >> HOUGH_SHIFT) < bestRho - 2
+      || (rho >> HOUGH_SHIFT) > bestRho + 3)
+      continue;
 
-            if(curr){
-              outbuf[i*obwidth + j/8] |= mask;
-            }
-            else{
-              outbuf[i*obwidth + j/8] &= (~mask);
-            }
+    for(i=0; i<HOUGH_FINE_ANGLES; i++, row += fineRhos){
+      rho = y*fineCos[i] - x*fineSin[i] + (resolution << HOUGH_SHIFT);
+      if(rho < 0)
+        continue;
+      rho = (rho >> (HOUGH_SHIFT-HOUGH_FINE_BITS)) - fineMin;
+      if(rho >= 0 && rho < fineRhos)
+        row[rho]++;
+    }
+  }
 
-          }
-        }
-        break;
+  /* best window of one pixel, centered on the line */
+  best = 0;
+  for(i=0; i<HOUGH_FINE_ANGLES; i++){
+    int a = (i & 1) ? HOUGH_FINE_ANGLES/2 + (i+1)/2 : HOUGH_FINE_ANGLES/2 - i/2;
+    int * row = acc + a * fineRhos;
+    int sum = 0;
 
-      /*rotate 270 clockwise*/
-      case 3:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            unsigned char curr
-              = buffer[j*ibwidth + (ipwidth-i-1)/8] >> (i%8) & 1;
+    for(j=0; j<fineRhos; j++){
+      sum += row[j];
+      if(j >= 1 << HOUGH_FINE_BITS)
+        sum -= row[j - (1 << HOUGH_FINE_BITS)];
+      if(sum > best){
+        best = sum;
+        bestAngle = a;
+        bestRho = j;
+      }
+    }
+  }
 
-            unsigned char mask = 1 << (7-(j%8));
+  theta = atan2(fineSin[bestAngle], fineCos[bestAngle]);
+  offset = (bestRho + fineMin - ((1 << HOUGH_FINE_BITS) - 2) / 2.0)
+    / (1 << HOUGH_FINE_BITS) - resolution;
 
-            if(curr){
-              outbuf[i*obwidth + j/8] |= mask;
-            }
-            else{
-              outbuf[i*obwidth + j/8] &= (~mask);
-            }
+  DBG(15,"getTopEdgeHough: fine %+0.6f %f %d\n",theta,offset,best);
 
-          }
-        }
-        break;
-    } /*end switch*/
-  }
+  /* line is y*cos - x*sin = rho, with x from center of the image.
+   * convert to slope, and offset in the center of the image */
+  *finSlope = tan(theta);
+  offset /= cos(theta);
 
-  else{
-    DBG (5, "sanei_magic_turn: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
-    goto cleanup;
+  if(*finSlope != 0){
+    *finYInter = offset - *finSlope * width/2;
+    *finXInter = *finYInter / -*finSlope;
   }
 
-  /*copy output back into input buffer*/
-  memcpy(buffer,outbuf,obwidth*oheight);
-
-  /*update input params*/
-  params->pixels_per_line = opwidth;
-  params->bytes_per_line = obwidth;
-  params->lines = oheight;
-
   cleanup:
+  if(acc)
+    free(acc);
+  if(pts)
+    free(pts);
 
-  if(outbuf)
-    free(outbuf);
-
-  DBG(10,"sanei_magic_turn: finish\n");
+  DBG(10,"getTopEdgeHough: finish\n");
 
   return ret;
 }
 
-/* Utility functions, not used outside this file */
-
 /* Repeatedly call getLine to find the best range of slope and offset.
  * Shift the ranges thru 4 different positions to avoid splitting data
  * across multiple bins (false positive). Home-in on the most likely upper
  * line of the paper inside the image. Return the 'best' edge. */
 static SANE_Status
-getTopEdge(int width, int height, int resolution,
+getTopEdgeBins(int width, int height, int resolution,
   int * buff, double * finSlope, int * finXInter, int * finYInter)
 {
   SANE_Status ret = SANE_STATUS_GOOD;
@@ -1242,31 +3149,96 @@ getTopEdge(int width, int height, int resolution,
       go = 1;
     }
 
-    /* cannot zoom in more, bail out */
-    if(!go){
-      break;
-    }
+    /* cannot zoom in more, bail out */
+    if(!go){
+      break;
+    }
+
+    DBG(15,"getTopEdge: zoom: %+0.4f %+0.4f %d %d\n",
+      minSlope,maxSlope,minOffset,maxOffset);
+  }
+
+  /* topOffset is in the center of the image,
+   * convert to x and y intercept */
+  if(topSlope != 0){
+    *finYInter = topOffset - topSlope * width/2;
+    *finXInter = *finYInter / -topSlope;
+    *finSlope = topSlope;
+  }
+  else{
+    *finYInter = 0;
+    *finXInter = 0;
+    *finSlope = 0;
+  }
+
+  DBG(10,"getTopEdge: finish\n");
+
+  return 0;
+}
+
+/* getLine arguments, each tile bins the pairs starting in a range
+ * of columns into its own histogram, which are summed afterwards */
+struct lineArgs {
+  int * buff;
+  int width;
+  int slopes;
+  double minSlope;
+  double maxSlope;
+  int offsets;
+  int minOffset;
+  int maxOffset;
+  int step;
+  int * bins;
+};
+
+static void
+lineBins (void * arg, int tile)
+{
+  struct lineArgs * a = arg;
+  int * buff = a->buff;
+  int * bins = a->bins + tile * a->slopes * a->offsets;
+  int width = a->width;
+  int hWidth = width/2;
+
+  int first = tile * a->step;
+  int last = first + a->step;
+  int i, j;
+  int rise, run;
+  double slope;
+  int offset;
+  int sIndex, oIndex;
+
+  if(last > width)
+    last = width;
+
+  for(i=first;i<last;i++){
+    for(j=i+1;j<width && j<i+width/3;j++){
+
+      /*FIXME: check for invalid (min/max) values?*/
+      rise = buff[j] - buff[i];
+      run = j-i;
+
+      slope = (double)rise/run;
+      if(slope >= a->maxSlope || slope < a->minSlope)
+        continue;
 
-    DBG(15,"getTopEdge: zoom: %+0.4f %+0.4f %d %d\n",
-      minSlope,maxSlope,minOffset,maxOffset);
-  }
+      /* offset in center of width, not y intercept! */
+      offset = slope * hWidth + buff[i] - slope * i;
+      if(offset >= a->maxOffset || offset < a->minOffset)
+        continue;
 
-  /* topOffset is in the center of the image,
-   * convert to x and y intercept */
-  if(topSlope != 0){
-    *finYInter = topOffset - topSlope * width/2;
-    *finXInter = *finYInter / -topSlope;
-    *finSlope = topSlope;
-  }
-  else{
-    *finYInter = 0;
-    *finXInter = 0;
-    *finSlope = 0;
-  }
+      sIndex = (slope - a->minSlope) * a->slopes/(a->maxSlope-a->minSlope);
+      if(sIndex >= a->slopes)
+        continue;
 
-  DBG(10,"getTopEdge: finish\n");
+      oIndex = (offset - a->minOffset) * a->offsets
+        / (a->maxOffset-a->minOffset);
+      if(oIndex >= a->offsets)
+        continue;
 
-  return 0;
+      bins[sIndex * a->offsets + oIndex]++;
+    }
+  }
 }
 
 /* Loop thru a transition array, and use a simplified Hough transform
@@ -1281,12 +3253,9 @@ getLine (int height, int width, int * buff,
   SANE_Status ret = 0;
 
   int ** lines = NULL;
-  int i, j;
-  int rise, run;
-  double slope;
-  int offset;
-  int sIndex, oIndex;
-  int hWidth = width/2;
+  int i, j, k;
+  struct lineArgs a;
+  int tiles = 1;
 
   double * slopeCenter = NULL;
   int * slopeScale = NULL;
@@ -1385,34 +3354,44 @@ getLine (int height, int width, int * buff,
     }
   }
 
-  for(i=0;i<width;i++){
-    for(j=i+1;j<width && j<i+width/3;j++){
-
-      /*FIXME: check for invalid (min/max) values?*/
-      rise = buff[j] - buff[i];
-      run = j-i;
-
-      slope = (double)rise/run;
-      if(slope >= maxSlope || slope < minSlope)
-        continue;
-
-      /* offset in center of width, not y intercept! */
-      offset = slope * hWidth + buff[i] - slope * i;
-      if(offset >= maxOffset || offset < minOffset)
-        continue;
-
-      sIndex = (slope - minSlope) * slopes/(maxSlope-minSlope);
-      if(sIndex >= slopes)
-        continue;
+  /* several tiles per thread, since later columns have fewer pairs */
+  if(magic_threads > 1)
+    tiles = magic_threads * 4;
+  if(tiles > width)
+    tiles = width;
+  if(tiles < 1)
+    tiles = 1;
+
+  a.buff = buff;
+  a.width = width;
+  a.slopes = slopes;
+  a.minSlope = minSlope;
+  a.maxSlope = maxSlope;
+  a.offsets = offsets;
+  a.minOffset = minOffset;
+  a.maxOffset = maxOffset;
+  a.step = (width + tiles - 1) / tiles;
+
+  a.bins = calloc(tiles * slopes * offsets, sizeof(int));
+  if(!a.bins){
+    DBG(5,"getLine: cant load bins\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
 
-      oIndex = (offset - minOffset) * offsets/(maxOffset-minOffset);
-      if(oIndex >= offsets)
-        continue;
+  sanei_tiles_run(magic_threads, lineBins, &a, tiles);
 
-      lines[sIndex][oIndex]++;
+  for(k=0;k<tiles;k++){
+    int * bins = a.bins + k * slopes * offsets;
+    for(i=0;i<slopes;i++){
+      for(j=0;j<offsets;j++){
+        lines[i][j] += bins[i * offsets + j];
+      }
     }
   }
 
+  free(a.bins);
+
   /* go thru array, and find most dense line (highest number) */
   for(i=0;i<slopes;i++){
     for(j=0;j<offsets;j++){
@@ -1570,13 +3549,23 @@ getLeftEdge (int width, int height, int * top, int * bot,
   return 0;
 }
 
-/* Loop thru the image and look for first color change in each column.
- * Return a malloc'd array. Caller is responsible for freeing. */
-int * 
-sanei_magic_getTransY (
-  SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top)
-{
+/* transition arguments, each tile scans a band of columns or rows */
+struct transArgs {
+  SANE_Parameters * params;
+  SANE_Byte * buffer;
   int * buff;
+  int firstPos;
+  int lastPos;
+  int direction;
+};
+
+static void
+transYCols (void * arg, int tile)
+{
+  struct transArgs * a = arg;
+  SANE_Parameters * params = a->params;
+  SANE_Byte * buffer = a->buffer;
+  int * buff = a->buff;
 
   int i, j, k;
   int winLen = 9;
@@ -1585,31 +3574,16 @@ sanei_magic_getTransY (
   int height = params->lines;
   int depth = 1;
 
-  /* defaults for bottom-up */
-  int firstLine = height-1;
-  int lastLine = -1;
-  int direction = -1;
-
-  DBG (10, "sanei_magic_getTransY: start\n");
+  int firstLine = a->firstPos;
+  int lastLine = a->lastPos;
+  int direction = a->direction;
 
-  /* override for top-down */
-  if(top){
-    firstLine = 0;
-    lastLine = height;
-    direction = 1;
-  }
+  int first = tile * MAGIC_TILE_SIZE;
+  int last = first + MAGIC_TILE_SIZE;
 
-  /* build output and preload with impossible value */
-  buff = calloc(width,sizeof(int));
-  if(!buff){
-    DBG (5, "sanei_magic_getTransY: no buff\n");
-    return NULL;
-  }
-  for(i=0; i<width; i++)
-    buff[i] = lastLine;
+  if(last > width)
+    last = width;
 
-  /* load the buff array with y value for first color change from edge
-   * gray/color uses a different algo from binary/halftone */
   if(params->format == SANE_FRAME_RGB || 
     (params->format == SANE_FRAME_GRAY && params->depth == 8)
   ){
@@ -1618,7 +3592,7 @@ sanei_magic_getTransY (
       depth = 3;
 
     /* loop over all columns, find first transition */
-    for(i=0; i<width; i++){
+    for(i=first; i<last; i++){
 
       int near = 0;
       int far = 0;
@@ -1660,48 +3634,184 @@ sanei_magic_getTransY (
     }
   }
 
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+  else{
 
     int near = 0;
+    int bwidth = params->bytes_per_line;
 
-    for(i=0; i<width; i++){
+    for(i=first; i<last; i++){
   
       /* load the near window with first pixel */
-      near = buffer[(firstLine*width+i)/8] >> (7-(i%8)) & 1;
+      near = buffer[firstLine*bwidth + i/8] >> (7-(i%8)) & 1;
   
-      /* move */
+      /* move, rows may be padded past width */
       for(j=firstLine+direction; j!=lastLine; j+=direction){
-        if((buffer[(j*width+i)/8] >> (7-(i%8)) & 1) != near){
+        if((buffer[j*bwidth + i/8] >> (7-(i%8)) & 1) != near){
           buff[i] = j;
           break;
         }
       }
     }
   }
+}
 
-  /* some other format? */
-  else{
+/* Loop thru the image and look for first color change in each column.
+ * Return a malloc'd array. Caller is responsible for freeing. */
+int * 
+sanei_magic_getTransY (
+  SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top)
+{
+  int * buff;
+
+  int i;
+  struct transArgs a;
+
+  int width = params->pixels_per_line;
+  int height = params->lines;
+
+  /* defaults for bottom-up */
+  int firstLine = height-1;
+  int lastLine = -1;
+  int direction = -1;
+
+  DBG (10, "sanei_magic_getTransY: start\n");
+
+  /* override for top-down */
+  if(top){
+    firstLine = 0;
+    lastLine = height;
+    direction = 1;
+  }
+
+  /* build output and preload with impossible value */
+  buff = calloc(width,sizeof(int));
+  if(!buff){
+    DBG (5, "sanei_magic_getTransY: no buff\n");
+    return NULL;
+  }
+  for(i=0; i<width; i++)
+    buff[i] = lastLine;
+
+  /* load the buff array with y value for first color change from edge
+   * gray/color uses a different algo from binary/halftone */
+  if(params->format != SANE_FRAME_RGB
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 8)
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 1)
+  ){
     DBG (5, "sanei_magic_getTransY: unsupported format/depth\n");
     free(buff);
     return NULL;
   }
 
-  /* ignore transitions with few neighbors within .5 inch */
-  for(i=0;i<width-7;i++){
-    int sum = 0;
-    for(j=1;j<=7;j++){
-      if(abs(buff[i+j] - buff[i]) < dpi/2)
-        sum++;
-    }
-    if(sum < 2)
-      buff[i] = lastLine;
-  }
+  /* columns are independent, so each band can be done separately */
+  a.params = params;
+  a.buffer = buffer;
+  a.buff = buff;
+  a.firstPos = firstLine;
+  a.lastPos = lastLine;
+  a.direction = direction;
+
+  sanei_tiles_run(magic_threads, transYCols, &a,
+    (width + MAGIC_TILE_SIZE - 1) / MAGIC_TILE_SIZE);
+
+  filterTrans(buff, width, dpi, lastLine);
 
   DBG (10, "sanei_magic_getTransY: finish\n");
 
   return buff;
 }
 
+/* find first color change in one row, or lastCol if none */
+static int
+transXRow (SANE_Parameters * params, SANE_Byte * row,
+  int firstCol, int lastCol, int direction)
+{
+  int j, k;
+  int winLen = 9;
+
+  int width = params->pixels_per_line;
+  int depth = 1;
+
+  if(params->format == SANE_FRAME_RGB || 
+    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  ){
+
+    int near = 0;
+    int far = 0;
+
+    if(params->format == SANE_FRAME_RGB)
+      depth = 3;
+
+    /* load the near and far windows with repeated copy of first pixel */
+    for(k=0; k<depth; k++){
+      near += row[k];
+    }
+    near *= winLen;
+    far = near;
+
+    /* move windows, check delta */
+    for(j=firstCol+direction; j!=lastCol; j+=direction){
+
+      int farCol = j-winLen*2*direction;
+      int nearCol = j-winLen*direction;
+
+      if(farCol < 0 || farCol >= width){
+        farCol = firstCol;
+      }
+      if(nearCol < 0 || nearCol >= width){
+        nearCol = firstCol;
+      }
+
+      for(k=0; k<depth; k++){
+        far -= row[farCol*depth + k];
+        far += row[nearCol*depth + k];
+
+        near -= row[nearCol*depth + k];
+        near += row[j*depth + k];
+      }
+
+      if(abs(near - far) > 50*winLen*depth - near*40/255){
+        return j;
+      }
+    }
+  }
+
+  else{
+
+    /* load the near window with first pixel */
+    int near = row[firstCol/8] >> (7-(firstCol%8)) & 1;
+
+    /* move */
+    for(j=firstCol+direction; j!=lastCol; j+=direction){
+      if((row[j/8] >> (7-(j%8)) & 1) != near){
+        return j;
+      }
+    }
+  }
+
+  return lastCol;
+}
+
+static void
+transXRows (void * arg, int tile)
+{
+  struct transArgs * a = arg;
+  SANE_Parameters * params = a->params;
+
+  int first = tile * MAGIC_TILE_SIZE;
+  int last = first + MAGIC_TILE_SIZE;
+  int i;
+
+  if(last > params->lines)
+    last = params->lines;
+
+  /* loop over all rows, find first transition */
+  for(i=first; i<last; i++){
+    a->buff[i] = transXRow(params, a->buffer + i*params->bytes_per_line,
+      a->firstPos, a->lastPos, a->direction);
+  }
+}
+
 /* Loop thru the image height and look for first color change in each row.
  * Return a malloc'd array. Caller is responsible for freeing. */
 int * 
@@ -1710,13 +3820,11 @@ sanei_magic_getTransX (
 {
   int * buff;
 
-  int i, j, k;
-  int winLen = 9;
+  int i;
+  struct transArgs a;
 
-  int bwidth = params->bytes_per_line;
   int width = params->pixels_per_line;
   int height = params->lines;
-  int depth = 1;
 
   /* defaults for right-first */
   int firstCol = width-1;
@@ -1743,94 +3851,46 @@ sanei_magic_getTransX (
 
   /* load the buff array with x value for first color change from edge
    * gray/color uses a different algo from binary/halftone */
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  if(params->format != SANE_FRAME_RGB
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 8)
+    && !(params->format == SANE_FRAME_GRAY && params->depth == 1)
   ){
+    DBG (5, "sanei_magic_getTransX: unsupported format/depth\n");
+    free(buff);
+    return NULL;
+  }
 
-    if(params->format == SANE_FRAME_RGB)
-      depth = 3;
-
-    /* loop over all columns, find first transition */
-    for(i=0; i<height; i++){
-
-      int near = 0;
-      int far = 0;
-
-      /* load the near and far windows with repeated copy of first pixel */
-      for(k=0; k<depth; k++){
-        near += buffer[i*bwidth + k];
-      }
-      near *= winLen;
-      far = near;
-  
-      /* move windows, check delta */
-      for(j=firstCol+direction; j!=lastCol; j+=direction){
-  
-        int farCol = j-winLen*2*direction;
-        int nearCol = j-winLen*direction;
-
-        if(farCol < 0 || farCol >= width){
-          farCol = firstCol;
-        }
-        if(nearCol < 0 || nearCol >= width){
-          nearCol = firstCol;
-        }
-
-        for(k=0; k<depth; k++){
-          far -= buffer[i*bwidth + farCol*depth + k];
-          far += buffer[i*bwidth + nearCol*depth + k];
+  /* rows are independent, so each band can be done separately */
+  a.params = params;
+  a.buffer = buffer;
+  a.buff = buff;
+  a.firstPos = firstCol;
+  a.lastPos = lastCol;
+  a.direction = direction;
 
-          near -= buffer[i*bwidth + nearCol*depth + k];
-          near += buffer[i*bwidth + j*depth + k];
-        }
-  
-        if(abs(near - far) > 50*winLen*depth - near*40/255){
-          buff[i] = j;
-          break;
-        }
-      }
-    }
-  }
+  sanei_tiles_run(magic_threads, transXRows, &a,
+    (height + MAGIC_TILE_SIZE - 1) / MAGIC_TILE_SIZE);
 
-  else if (params->format == SANE_FRAME_GRAY && params->depth == 1){
+  filterTrans(buff, height, dpi, lastCol);
 
-    int near = 0;
+  DBG (10, "sanei_magic_getTransX: finish\n");
 
-    for(i=0; i<height; i++){
-  
-      /* load the near window with first pixel */
-      near = buffer[i*bwidth + firstCol/8] >> (7-(firstCol%8)) & 1;
-  
-      /* move */
-      for(j=firstCol+direction; j!=lastCol; j+=direction){
-        if((buffer[i*bwidth + j/8] >> (7-(j%8)) & 1) != near){
-          buff[i] = j;
-          break;
-        }
-      }
-    }
-  }
+  return buff;
+}
 
-  /* some other format? */
-  else{
-    DBG (5, "sanei_magic_getTransX: unsupported format/depth\n");
-    free(buff);
-    return NULL;
-  }
+/* ignore transitions with few neighbors within .5 inch */
+static void
+filterTrans (int * buff, int len, int dpi, int none)
+{
+  int i, j;
 
-  /* ignore transitions with few neighbors within .5 inch */
-  for(i=0;i<height-7;i++){
+  for(i=0;i<len-7;i++){
     int sum = 0;
     for(j=1;j<=7;j++){
       if(abs(buff[i+j] - buff[i]) < dpi/2)
         sum++;
     }
     if(sum < 2)
-      buff[i] = lastCol;
+      buff[i] = none;
   }
-
-  DBG (10, "sanei_magic_getTransX: finish\n");
-
-  return buff;
 }
-
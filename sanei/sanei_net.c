@@ -161,6 +161,25 @@ sanei_w_control_option_reply (Wire *w, SANE_Control_Option_Reply *reply)
   sanei_w_string (w, &reply->resource_to_authorize);
 }
 
+void
+sanei_w_control_options_req (Wire *w, SANE_Control_Options_Req *req)
+{
+  sanei_w_word (w, &req->handle);
+  sanei_w_array (w, &req->num_options, (void **) &req->req,
+		 (WireCodecFunc) sanei_w_control_option_req,
+		 sizeof (req->req[0]));
+}
+
+void
+sanei_w_control_options_reply (Wire *w, SANE_Control_Options_Reply *reply)
+{
+  sanei_w_status (w, &reply->status);
+  sanei_w_array (w, &reply->num_options, (void **) &reply->reply,
+		 (WireCodecFunc) sanei_w_control_option_reply,
+		 sizeof (reply->reply[0]));
+  sanei_w_option_descriptor_array (w, &reply->opt);
+}
+
 void
 sanei_w_get_parameters_reply (Wire *w, SANE_Get_Parameters_Reply *reply)
 {
@@ -0,0 +1,383 @@
+/*
+ * sanei_reorder - Reordering of the samples of colour scan lines
+
+   Copyright (C) 2026 The SANE developers
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+ */
+
+#include "../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BACKEND_NAME sanei_reorder      /* name of this module for debugging */
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_debug.h"
+#include "../include/sane/sanei_reorder.h"
+
+#if defined (__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+  && (defined (__x86_64__) || defined (__i386__))
+# define REORDER_X86
+# include <immintrin.h>
+#endif
+
+#define MAX_OFFSETS 12
+
+/* plain C versions; these define the expected results */
+
+static void
+interleave3_scalar (SANE_Byte * dst, const SANE_Byte * p0,
+		    const SANE_Byte * p1, const SANE_Byte * p2,
+		    size_t count, int bps)
+{
+  if (bps == 1)
+    {
+      while (count--)
+	{
+	  *dst++ = *p0++;
+	  *dst++ = *p1++;
+	  *dst++ = *p2++;
+	}
+      return;
+    }
+
+  while (count--)
+    {
+      *dst++ = *p0++;
+      *dst++ = *p0++;
+      *dst++ = *p1++;
+      *dst++ = *p1++;
+      *dst++ = *p2++;
+      *dst++ = *p2++;
+    }
+}
+
+static void
+reverse3_scalar (SANE_Byte * dst, const SANE_Byte * src, size_t count,
+		 int bps)
+{
+  if (bps == 1)
+    {
+      for (; count--; src += 3)
+	{
+	  *dst++ = src[2];
+	  *dst++ = src[1];
+	  *dst++ = src[0];
+	}
+      return;
+    }
+
+  for (; count--; src += 6)
+    {
+      *dst++ = src[4];
+      *dst++ = src[5];
+      *dst++ = src[2];
+      *dst++ = src[3];
+      *dst++ = src[0];
+      *dst++ = src[1];
+    }
+}
+
+static void
+stagger_scalar (SANE_Byte * dst, const SANE_Byte * src, size_t count,
+		const size_t * offsets, int n, int bps)
+{
+  const SANE_Byte *s;
+  size_t i;
+  int c = 0;
+
+  for (i = 0; i < count; i++)
+    {
+      s = src + (i + offsets[c]) * bps;
+      *dst++ = s[0];
+      if (bps == 2)
+	*dst++ = s[1];
+      if (++c == n)
+	c = 0;
+    }
+}
+
+#ifdef REORDER_X86
+/* Interleaving and reversing both map 48 input bytes to 48 output bytes.
+   PERM gives the input byte for each output byte; inputs 0-15 come from
+   SRC0, 16-31 from SRC1 and 32-47 from SRC2.  Every output register is
+   put together from three byte shuffles.  */
+__attribute__ ((target ("ssse3")))
+static size_t
+permute48_ssse3 (SANE_Byte * dst, const SANE_Byte * src0,
+		 const SANE_Byte * src1, const SANE_Byte * src2,
+		 size_t src_step, size_t blocks, const SANE_Byte * perm)
+{
+  SANE_Byte table[3][3][16];
+  __m128i mask[3][3];
+  __m128i in0, in1, in2, out;
+  size_t b;
+  int v, k, j;
+
+  for (v = 0; v < 3; v++)
+    for (k = 0; k < 3; k++)
+      {
+	for (j = 0; j < 16; j++)
+	  table[v][k][j] = (perm[16 * v + j] / 16 == k)
+	    ? perm[16 * v + j] % 16 : 0x80;
+	mask[v][k] = _mm_loadu_si128 ((const __m128i *) table[v][k]);
+      }
+
+  for (b = 0; b < blocks; b++)
+    {
+      in0 = _mm_loadu_si128 ((const __m128i *) src0);
+      in1 = _mm_loadu_si128 ((const __m128i *) src1);
+      in2 = _mm_loadu_si128 ((const __m128i *) src2);
+      for (v = 0; v < 3; v++)
+	{
+	  out = _mm_or_si128 (_mm_shuffle_epi8 (in0, mask[v][0]),
+			      _mm_shuffle_epi8 (in1, mask[v][1]));
+	  out = _mm_or_si128 (out, _mm_shuffle_epi8 (in2, mask[v][2]));
+	  _mm_storeu_si128 ((__m128i *) (dst + 16 * v), out);
+	}
+      src0 += src_step;
+      src1 += src_step;
+      src2 += src_step;
+      dst += 48;
+    }
+  return blocks;
+}
+
+__attribute__ ((target ("ssse3")))
+static void
+interleave3_ssse3 (SANE_Byte * dst, const SANE_Byte * p0,
+		   const SANE_Byte * p1, const SANE_Byte * p2,
+		   size_t count, int bps)
+{
+  SANE_Byte perm[48];
+  size_t done;
+  int j, s;
+
+  /* one block is 16 bytes from each plane */
+  for (j = 0; j < 48; j++)
+    {
+      s = j / bps;
+      perm[j] = (s % 3) * 16 + (s / 3) * bps + j % bps;
+    }
+
+  done = permute48_ssse3 (dst, p0, p1, p2, 16, count * bps / 16, perm)
+    * 16 / bps;
+  interleave3_scalar (dst + done * 3 * bps, p0 + done * bps,
+		      p1 + done * bps, p2 + done * bps, count - done, bps);
+}
+
+__attribute__ ((target ("ssse3")))
+static void
+reverse3_ssse3 (SANE_Byte * dst, const SANE_Byte * src, size_t count,
+		int bps)
+{
+  SANE_Byte perm[48];
+  size_t done;
+  int j, s;
+
+  /* one block is 48 consecutive bytes */
+  for (j = 0; j < 48; j++)
+    {
+      s = j / bps;
+      perm[j] = ((s / 3) * 3 + 2 - s % 3) * bps + j % bps;
+    }
+
+  done = permute48_ssse3 (dst, src, src + 16, src + 32, 48,
+			  count * 3 * bps / 48, perm) * 16 / bps;
+  reverse3_scalar (dst + done * 3 * bps, src + done * 3 * bps,
+		   count - done, bps);
+}
+
+/* Each 48 byte block of output holds a whole number of phases, so each
+   output register is the OR of one masked load per phase.  */
+__attribute__ ((target ("sse2")))
+static void
+stagger_sse2 (SANE_Byte * dst, const SANE_Byte * src, size_t count,
+	      const size_t * offsets, int n, int bps)
+{
+  SANE_Byte table[16];
+  __m128i mask[3][MAX_OFFSETS];
+  __m128i out;
+  const SANE_Byte *s[MAX_OFFSETS];
+  size_t blocks, b, done;
+  int v, c, j;
+
+  if (48 % (n * bps) != 0)
+    {
+      stagger_scalar (dst, src, count, offsets, n, bps);
+      return;
+    }
+
+  for (v = 0; v < 3; v++)
+    for (c = 0; c < n; c++)
+      {
+	for (j = 0; j < 16; j++)
+	  table[j] = ((16 * v + j) / bps % n == c) ? 0xff : 0;
+	mask[v][c] = _mm_loadu_si128 ((const __m128i *) table);
+      }
+  for (c = 0; c < n; c++)
+    s[c] = src + offsets[c] * bps;
+
+  blocks = count * bps / 48;
+  for (b = 0; b < blocks; b++)
+    {
+      for (v = 0; v < 3; v++)
+	{
+	  out = _mm_setzero_si128 ();
+	  for (c = 0; c < n; c++)
+	    out = _mm_or_si128 (out, _mm_and_si128
+				(_mm_loadu_si128 ((const __m128i *) s[c]),
+				 mask[v][c]));
+	  _mm_storeu_si128 ((__m128i *) dst, out);
+	  for (c = 0; c < n; c++)
+	    s[c] += 16;
+	  dst += 16;
+	}
+    }
+
+  /* a whole number of blocks is a whole number of phases */
+  done = blocks * 48 / bps;
+  stagger_scalar (dst, src + done * bps, count - done, offsets, n, bps);
+}
+
+static int
+have_ssse3 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("ssse3");
+}
+#endif /* REORDER_X86 */
+
+static int
+always (void)
+{
+  return 1;
+}
+
+/* fastest first */
+static const struct
+{
+  const char *name;
+  void (*interleave3) (SANE_Byte *, const SANE_Byte *, const SANE_Byte *,
+		       const SANE_Byte *, size_t, int);
+  void (*reverse3) (SANE_Byte *, const SANE_Byte *, size_t, int);
+  void (*stagger) (SANE_Byte *, const SANE_Byte *, size_t, const size_t *,
+		   int, int);
+  int (*supported) (void);
+}
+impls[] = {
+#ifdef REORDER_X86
+  {"ssse3", interleave3_ssse3, reverse3_ssse3, stagger_sse2, have_ssse3},
+#endif
+  {"scalar", interleave3_scalar, reverse3_scalar, stagger_scalar, always}
+};
+
+#define NUM_IMPLS ((int) (sizeof (impls) / sizeof (impls[0])))
+
+/* index into impls, or -1 until the first call */
+static int current = -1;
+
+SANE_Status
+sanei_reorder_select (const char *name)
+{
+  int i;
+
+  DBG_INIT ();
+
+  for (i = 0; i < NUM_IMPLS; i++)
+    {
+      if (name && strcmp (name, impls[i].name) != 0)
+	continue;
+      if (!(*impls[i].supported) ())
+	continue;
+
+      DBG (5, "sanei_reorder_select: using %s\n", impls[i].name);
+      current = i;
+      return SANE_STATUS_GOOD;
+    }
+
+  DBG (1, "sanei_reorder_select: %s not available\n", name);
+  return SANE_STATUS_UNSUPPORTED;
+}
+
+const char *
+sanei_reorder_impl (void)
+{
+  if (current < 0)
+    sanei_reorder_select (NULL);
+  return impls[current].name;
+}
+
+void
+sanei_reorder_interleave3 (SANE_Byte * dst, const SANE_Byte * p0,
+			   const SANE_Byte * p1, const SANE_Byte * p2,
+			   size_t count, int bytes_per_sample)
+{
+  if (current < 0)
+    sanei_reorder_select (NULL);
+  (*impls[current].interleave3) (dst, p0, p1, p2, count, bytes_per_sample);
+}
+
+void
+sanei_reorder_reverse3 (SANE_Byte * dst, const SANE_Byte * src,
+			size_t count, int bytes_per_sample)
+{
+  if (current < 0)
+    sanei_reorder_select (NULL);
+  (*impls[current].reverse3) (dst, src, count, bytes_per_sample);
+}
+
+void
+sanei_reorder_stagger (SANE_Byte * dst, const SANE_Byte * src, size_t count,
+		       const size_t * offsets, int num_offsets,
+		       int bytes_per_sample)
+{
+  if (num_offsets < 1 || num_offsets > MAX_OFFSETS)
+    {
+      DBG (1, "sanei_reorder_stagger: %d offsets not supported\n",
+	   num_offsets);
+      return;
+    }
+  if (current < 0)
+    sanei_reorder_select (NULL);
+  (*impls[current].stagger) (dst, src, count, offsets, num_offsets,
+			     bytes_per_sample);
+}
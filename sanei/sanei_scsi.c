@@ -6169,6 +6169,173 @@ sanei_scsi_find_devices (const char *findvendor, const char *findmodel,
 			    src_size - cmd_size, dst, dst_size);
   }
 
+  /* Read ahead: a ring of depth buffers.  The reads in flight are the
+     count buffers from head on; the buffer just before head may be held
+     by the caller.  */
+
+  struct sanei_scsi_read_ahead
+  {
+    int fd;
+    int depth;
+    size_t buffer_size;
+    SANEI_SCSI_Read_Command command;
+    void *arg;
+    int index;			/* of the next read to enter */
+    int head, count;
+    int held;			/* buffer handed back, or -1 */
+    int eof;			/* command had nothing more to read */
+    SANE_Byte **buf;
+    size_t *len;
+    void **id;
+  };
+
+  static SANE_Status read_ahead_enter (SANEI_SCSI_Read_Ahead * ra)
+  {
+    SANE_Byte cmd[16];
+    size_t cmd_size;
+    SANE_Status status;
+    int i;
+
+    while (!ra->eof && ra->count < ra->depth)
+      {
+	i = (ra->head + ra->count) % ra->depth;
+	if (i == ra->held)
+	  break;
+
+	cmd_size = sizeof (cmd);
+	ra->len[i] = ra->buffer_size;
+	status = ra->command (ra->arg, ra->index, cmd, &cmd_size, &ra->len[i]);
+	if (status == SANE_STATUS_EOF)
+	  {
+	    ra->eof = 1;
+	    break;
+	  }
+	if (status != SANE_STATUS_GOOD)
+	  return status;
+	if (ra->len[i] > ra->buffer_size)
+	  {
+	    DBG (1, "sanei_scsi_read_ahead: read %d of %lu bytes is larger "
+		 "than the buffers\n", ra->index, (u_long) ra->len[i]);
+	    return SANE_STATUS_INVAL;
+	  }
+
+	status = sanei_scsi_req_enter2 (ra->fd, cmd, cmd_size, NULL, 0,
+					ra->buf[i], &ra->len[i], &ra->id[i]);
+	if (status != SANE_STATUS_GOOD)
+	  return status;
+
+	DBG (4, "sanei_scsi_read_ahead: entered read %d, %lu bytes\n",
+	     ra->index, (u_long) ra->len[i]);
+	ra->index++;
+	ra->count++;
+      }
+    return SANE_STATUS_GOOD;
+  }
+
+  SANE_Status
+    sanei_scsi_read_ahead_start (int fd, int depth, size_t buffer_size,
+				 SANEI_SCSI_Read_Command command, void *arg,
+				 SANEI_SCSI_Read_Ahead ** rap)
+  {
+    SANEI_SCSI_Read_Ahead *ra;
+    SANE_Status status;
+    int i;
+
+    *rap = NULL;
+    if (depth < 1)
+      depth = 1;
+
+    ra = calloc (1, sizeof (*ra));
+    if (!ra)
+      return SANE_STATUS_NO_MEM;
+    ra->fd = fd;
+    ra->depth = depth;
+    ra->buffer_size = buffer_size;
+    ra->command = command;
+    ra->arg = arg;
+    ra->held = -1;
+
+    ra->buf = calloc (depth, sizeof (ra->buf[0]));
+    ra->len = calloc (depth, sizeof (ra->len[0]));
+    ra->id = calloc (depth, sizeof (ra->id[0]));
+    if (!ra->buf || !ra->len || !ra->id)
+      {
+	sanei_scsi_read_ahead_stop (ra);
+	return SANE_STATUS_NO_MEM;
+      }
+    for (i = 0; i < depth; i++)
+      {
+	ra->buf[i] = malloc (buffer_size);
+	if (!ra->buf[i])
+	  {
+	    sanei_scsi_read_ahead_stop (ra);
+	    return SANE_STATUS_NO_MEM;
+	  }
+      }
+
+    status = read_ahead_enter (ra);
+    if (status != SANE_STATUS_GOOD)
+      {
+	sanei_scsi_read_ahead_stop (ra);
+	return status;
+      }
+
+    DBG (4, "sanei_scsi_read_ahead_start: %d buffers of %lu bytes\n",
+	 depth, (u_long) buffer_size);
+    *rap = ra;
+    return SANE_STATUS_GOOD;
+  }
+
+  SANE_Status
+    sanei_scsi_read_ahead_next (SANEI_SCSI_Read_Ahead * ra,
+				SANE_Byte ** data, size_t * len)
+  {
+    SANE_Status status;
+    int i;
+
+    *data = NULL;
+    *len = 0;
+
+    /* the buffer handed back last time is free again */
+    ra->held = -1;
+    status = read_ahead_enter (ra);
+    if (status != SANE_STATUS_GOOD)
+      return status;
+
+    if (ra->count == 0)
+      return SANE_STATUS_EOF;
+
+    i = ra->head;
+    status = sanei_scsi_req_wait (ra->id[i]);
+    ra->id[i] = NULL;
+    ra->head = (i + 1) % ra->depth;
+    ra->count--;
+    ra->held = i;
+
+    *data = ra->buf[i];
+    *len = ra->len[i];
+    return status;
+  }
+
+  void sanei_scsi_read_ahead_stop (SANEI_SCSI_Read_Ahead * ra)
+  {
+    int i;
+
+    if (!ra)
+      return;
+
+    if (ra->count > 0)
+      sanei_scsi_req_flush_all_extended (ra->fd);
+
+    if (ra->buf)
+      for (i = 0; i < ra->depth; i++)
+	free (ra->buf[i]);
+    free (ra->buf);
+    free (ra->len);
+    free (ra->id);
+    free (ra);
+  }
+
 
 
 #ifndef WE_HAVE_FIND_DEVICES
@@ -0,0 +1,283 @@
+/*
+ * sanei_swap - Byte swapping of 16 bit sample data
+
+   Copyright (C) 2026 The SANE developers
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+ */
+
+#include "../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BACKEND_NAME sanei_swap      /* name of this module for debugging */
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_debug.h"
+#include "../include/sane/sanei_swap.h"
+
+/* The vector versions need the intrinsics headers and GCC's target
+   attribute, so that they can be built without -mavx2 and are only
+   called when the CPU has the instructions.  */
+#if defined (__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) \
+  && (defined (__x86_64__) || defined (__i386__))
+# define SWAP16_X86
+# include <immintrin.h>
+#endif
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+# define SWAP16_NEON
+# include <arm_neon.h>
+#endif
+
+typedef void (*swap16_func) (SANE_Byte * dst, const SANE_Byte * src,
+			     size_t count);
+
+static void
+swap16_scalar (SANE_Byte * dst, const SANE_Byte * src, size_t count)
+{
+  SANE_Byte tmp;
+
+  while (count--)
+    {
+      tmp = src[0];
+      dst[0] = src[1];
+      dst[1] = tmp;
+      src += 2;
+      dst += 2;
+    }
+}
+
+#ifdef SWAP16_X86
+__attribute__ ((target ("sse2")))
+static void
+swap16_sse2 (SANE_Byte * dst, const SANE_Byte * src, size_t count)
+{
+  __m128i v;
+
+  /* 8 samples per register; SSE2 has no byte shuffle, so use shifts */
+  for (; count >= 8; count -= 8, src += 16, dst += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) src);
+      v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+      _mm_storeu_si128 ((__m128i *) dst, v);
+    }
+  swap16_scalar (dst, src, count);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+swap16_avx2 (SANE_Byte * dst, const SANE_Byte * src, size_t count)
+{
+  __m256i mask, v, w;
+
+  mask = _mm256_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6,
+			   9, 8, 11, 10, 13, 12, 15, 14,
+			   1, 0, 3, 2, 5, 4, 7, 6,
+			   9, 8, 11, 10, 13, 12, 15, 14);
+
+  /* two registers (32 samples) per iteration hide the load latency */
+  for (; count >= 32; count -= 32, src += 64, dst += 64)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) src);
+      w = _mm256_loadu_si256 ((const __m256i *) (src + 32));
+      _mm256_storeu_si256 ((__m256i *) dst, _mm256_shuffle_epi8 (v, mask));
+      _mm256_storeu_si256 ((__m256i *) (dst + 32),
+			   _mm256_shuffle_epi8 (w, mask));
+    }
+  for (; count >= 16; count -= 16, src += 32, dst += 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) src);
+      _mm256_storeu_si256 ((__m256i *) dst, _mm256_shuffle_epi8 (v, mask));
+    }
+  swap16_scalar (dst, src, count);
+}
+
+static int
+have_sse2 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("sse2");
+}
+
+static int
+have_avx2 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2");
+}
+#endif /* SWAP16_X86 */
+
+#ifdef SWAP16_NEON
+static void
+swap16_neon (SANE_Byte * dst, const SANE_Byte * src, size_t count)
+{
+  for (; count >= 8; count -= 8, src += 16, dst += 16)
+    vst1q_u8 (dst, vrev16q_u8 (vld1q_u8 (src)));
+  swap16_scalar (dst, src, count);
+}
+#endif /* SWAP16_NEON */
+
+static int
+always (void)
+{
+  return 1;
+}
+
+/* fastest first */
+static const struct
+{
+  const char *name;
+  swap16_func swap;
+  int (*supported) (void);
+}
+impls[] = {
+#ifdef SWAP16_X86
+  {"avx2", swap16_avx2, have_avx2},
+  {"sse2", swap16_sse2, have_sse2},
+#endif
+#ifdef SWAP16_NEON
+  {"neon", swap16_neon, always},
+#endif
+  {"scalar", swap16_scalar, always}
+};
+
+#define NUM_IMPLS ((int) (sizeof (impls) / sizeof (impls[0])))
+
+/* index into impls, or -1 until the first call */
+static int current = -1;
+
+SANE_Status
+sanei_swap16_select (const char *name)
+{
+  int i;
+
+  DBG_INIT ();
+
+  for (i = 0; i < NUM_IMPLS; i++)
+    {
+      if (name && strcmp (name, impls[i].name) != 0)
+	continue;
+      if (!(*impls[i].supported) ())
+	continue;
+
+      DBG (5, "sanei_swap16_select: using %s\n", impls[i].name);
+      current = i;
+      return SANE_STATUS_GOOD;
+    }
+
+  DBG (1, "sanei_swap16_select: %s not available\n", name);
+  return SANE_STATUS_UNSUPPORTED;
+}
+
+const char *
+sanei_swap16_impl (void)
+{
+  if (current < 0)
+    sanei_swap16_select (NULL);
+  return impls[current].name;
+}
+
+void
+sanei_swap16 (SANE_Byte * dst, const SANE_Byte * src, size_t count)
+{
+  if (current < 0)
+    sanei_swap16_select (NULL);
+  (*impls[current].swap) (dst, src, count);
+}
+
+void
+sanei_swap16_stream_init (SANEI_Swap16_Stream * st)
+{
+  st->carry = -1;
+  st->swapped = SANE_FALSE;
+  st->placed = SANE_FALSE;
+}
+
+size_t
+sanei_swap16_stream_begin (SANEI_Swap16_Stream * st, SANE_Byte * buf,
+			   size_t max)
+{
+  st->placed = SANE_FALSE;
+
+  /* an unswapped carry needs room for its partner behind it; with a
+     one byte buffer the partner is read first, see _end */
+  if (st->carry < 0 || max < 1 || (!st->swapped && max < 2))
+    return 0;
+
+  buf[0] = (SANE_Byte) st->carry;
+  st->placed = SANE_TRUE;
+  return 1;
+}
+
+size_t
+sanei_swap16_stream_end (SANEI_Swap16_Stream * st, SANE_Byte * buf,
+			 size_t len)
+{
+  size_t ready = 0;
+
+  if (len == 0)
+    return 0;
+
+  if (st->carry >= 0 && !st->placed)
+    {
+      /* one byte buffer: buf[0] is the second half of the carried
+         sample, i.e. the first one to output; the carry follows */
+      st->swapped = SANE_TRUE;
+      return 1;
+    }
+
+  if (st->placed && st->swapped)
+    {
+      /* buf[0] is ready, complete samples follow */
+      buf++;
+      len--;
+      ready = 1;
+    }
+  st->carry = -1;
+  st->swapped = SANE_FALSE;
+  st->placed = SANE_FALSE;
+
+  sanei_swap16 (buf, buf, len / 2);
+  if (len & 1)
+    st->carry = buf[len - 1];
+
+  return ready + (len & ~(size_t) 1);
+}
@@ -0,0 +1,134 @@
+/*
+ * sanei_tiles - Splitting image work into tiles shared by several threads
+
+   Copyright (C) 2026 The SANE developers
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+ */
+
+#include "../include/sane/config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "../include/sane/sanei_tiles.h"
+
+#ifdef HAVE_PTHREAD_H
+/* a job split into tiles, which threads claim in order until none remain */
+struct tiles_job
+{
+  void (*func) (void *arg, int tile);
+  void *arg;
+  int tiles;
+  int next;
+  pthread_mutex_t lock;
+};
+
+static void *
+tiles_worker (void *arg)
+{
+  struct tiles_job *job = arg;
+  int tile;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&job->lock);
+      tile = job->next++;
+      pthread_mutex_unlock (&job->lock);
+
+      if (tile >= job->tiles)
+	break;
+
+      job->func (job->arg, tile);
+    }
+
+  return NULL;
+}
+#endif
+
+void
+sanei_tiles_run (int threads, void (*func) (void *arg, int tile), void *arg,
+		 int tiles)
+{
+  int i;
+
+#ifdef HAVE_PTHREAD_H
+  if (threads > SANEI_TILES_MAX_THREADS)
+    threads = SANEI_TILES_MAX_THREADS;
+  if (threads > tiles)
+    threads = tiles;
+
+  /* the workers are started for each call: that costs tens of
+     microseconds, against milliseconds for the tiles of a page or a
+     block, and no thread is left behind when a backend is unloaded */
+  if (threads > 1)
+    {
+      struct tiles_job job;
+      pthread_t workers[SANEI_TILES_MAX_THREADS];
+      int started = 0;
+
+      job.func = func;
+      job.arg = arg;
+      job.tiles = tiles;
+      job.next = 0;
+      pthread_mutex_init (&job.lock, NULL);
+
+      for (i = 0; i < threads - 1; i++)
+	{
+	  if (pthread_create (&workers[started], NULL, tiles_worker, &job))
+	    break;
+	  started++;
+	}
+
+      tiles_worker (&job);
+
+      for (i = 0; i < started; i++)
+	pthread_join (workers[i], NULL);
+
+      pthread_mutex_destroy (&job.lock);
+      return;
+    }
+#else
+  (void) threads;
+#endif
+
+  for (i = 0; i < tiles; i++)
+    func (arg, i);
+}
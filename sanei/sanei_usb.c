@@ -127,6 +127,49 @@ typedef enum
 }
 sanei_usb_access_method_type;
 
+/* state of one buffer of a bulk-in stream */
+typedef enum
+{
+  sanei_usb_stream_slot_idle = 0,	/* not queued, free for reuse */
+  sanei_usb_stream_slot_queued,		/* transfer in flight */
+  sanei_usb_stream_slot_filled,		/* data waiting for the backend */
+  sanei_usb_stream_slot_held		/* handed out to the backend */
+}
+sanei_usb_stream_slot_state;
+
+struct stream_type;
+
+typedef struct
+{
+  SANE_Byte *data;
+  size_t requested;			/* bytes asked for */
+  size_t length;			/* bytes received */
+  SANE_Status status;			/* result of the transfer */
+  sanei_usb_stream_slot_state state;
+  struct stream_type *stream;
+#ifdef HAVE_LIBUSB_1_0
+  struct libusb_transfer *transfer;
+#endif /* HAVE_LIBUSB_1_0 */
+}
+stream_slot_type;
+
+/* ring of bulk-in buffers set up by sanei_usb_stream_start () */
+typedef struct stream_type
+{
+  SANE_Int dn;
+  SANE_Int num_slots;
+  size_t slot_size;
+  stream_slot_type *slots;
+  SANE_Int head;			/* next slot handed to the backend */
+  SANE_Int tail;			/* next slot to queue */
+  SANE_Int in_flight;			/* number of queued transfers */
+  SANE_Bool bounded;			/* total length known in advance */
+  size_t remaining;			/* bytes not yet queued if bounded */
+  SANE_Bool eof;			/* no more transfers will be queued */
+  SANE_Bool error;			/* a transfer failed, clear halt */
+}
+stream_type;
+
 typedef struct
 {
   SANE_Bool open;
@@ -153,6 +196,7 @@ typedef struct
   libusb_device *lu_device;
   libusb_device_handle *lu_handle;
 #endif /* HAVE_LIBUSB_1_0 */
+  stream_type *stream;
 }
 device_list_type;
 
@@ -2000,6 +2044,8 @@ sanei_usb_close (SANE_Int dn)
 	   dn);
       return;
     }
+  if (devices[dn].stream)
+    sanei_usb_stream_stop (dn);
   if (devices[dn].method == sanei_usb_method_scanner_driver)
     close (devices[dn].fd);
   else if (devices[dn].method == sanei_usb_method_usbcalls)
@@ -2283,6 +2329,370 @@ sanei_usb_read_bulk (SANE_Int dn, SANE_Byte * buffer, size_t * size)
   return SANE_STATUS_GOOD;
 }
 
+/* Bulk-in streaming.
+ *
+ * A stream keeps up to num_slots bulk-in requests queued on the device so
+ * the bus does not go idle while the backend processes a buffer. With
+ * libusb-1.0 the requests are real asynchronous transfers. With the other
+ * access methods the slots are filled by synchronous reads when the backend
+ * asks for them, so backends can use the same code everywhere.
+ */
+
+static void
+stream_free (stream_type * stream)
+{
+  SANE_Int i;
+
+  for (i = 0; i < stream->num_slots; i++)
+    {
+#ifdef HAVE_LIBUSB_1_0
+      if (stream->slots[i].transfer)
+	libusb_free_transfer (stream->slots[i].transfer);
+#endif /* HAVE_LIBUSB_1_0 */
+      if (stream->slots[i].data)
+	free (stream->slots[i].data);
+    }
+  free (stream->slots);
+  free (stream);
+}
+
+#ifdef HAVE_LIBUSB_1_0
+static void LIBUSB_CALL
+stream_transfer_callback (struct libusb_transfer *transfer)
+{
+  stream_slot_type *slot = transfer->user_data;
+  stream_type *stream = slot->stream;
+
+  stream->in_flight--;
+  slot->length = transfer->actual_length;
+
+  switch (transfer->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+      slot->status = slot->length ? SANE_STATUS_GOOD : SANE_STATUS_EOF;
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      slot->status = SANE_STATUS_CANCELLED;
+      break;
+    default:
+      DBG (1, "stream_transfer_callback: transfer failed, status %d\n",
+	   transfer->status);
+      slot->status = SANE_STATUS_IO_ERROR;
+      stream->error = SANE_TRUE;
+      break;
+    }
+
+  /* a short packet ends the transfer early, the rest is still to come */
+  if (stream->bounded && slot->status == SANE_STATUS_GOOD
+      && slot->length < slot->requested)
+    stream->remaining += slot->requested - slot->length;
+
+  slot->state = sanei_usb_stream_slot_filled;
+}
+#endif /* HAVE_LIBUSB_1_0 */
+
+/* queue requests for all free slots, in ring order */
+static void
+stream_queue (stream_type * stream)
+{
+  stream_slot_type *slot;
+  size_t length;
+
+  while (!stream->eof)
+    {
+      slot = &stream->slots[stream->tail];
+      if (slot->state != sanei_usb_stream_slot_idle)
+	break;
+      if (stream->bounded && stream->remaining == 0)
+	break;
+
+      length = stream->slot_size;
+      if (stream->bounded && length > stream->remaining)
+	length = stream->remaining;
+
+      slot->requested = length;
+      slot->length = 0;
+      slot->status = SANE_STATUS_GOOD;
+
+#ifdef HAVE_LIBUSB_1_0
+      if (devices[stream->dn].method == sanei_usb_method_libusb)
+	{
+	  int ret;
+
+	  libusb_fill_bulk_transfer (slot->transfer,
+				     devices[stream->dn].lu_handle,
+				     devices[stream->dn].bulk_in_ep,
+				     slot->data, (int) length,
+				     stream_transfer_callback, slot,
+				     libusb_timeout);
+	  ret = libusb_submit_transfer (slot->transfer);
+	  if (ret < 0)
+	    {
+	      DBG (1, "stream_queue: submitting transfer failed: %s\n",
+		   sanei_libusb_strerror (ret));
+	      /* report the failure when the backend reaches this slot */
+	      slot->status = SANE_STATUS_IO_ERROR;
+	      slot->state = sanei_usb_stream_slot_filled;
+	      stream->error = SANE_TRUE;
+	      stream->eof = SANE_TRUE;
+	      break;
+	    }
+	  stream->in_flight++;
+	}
+#endif /* HAVE_LIBUSB_1_0 */
+
+      slot->state = sanei_usb_stream_slot_queued;
+      if (stream->bounded)
+	stream->remaining -= length;
+      stream->tail = (stream->tail + 1) % stream->num_slots;
+    }
+}
+
+SANE_Status
+sanei_usb_stream_start (SANE_Int dn, SANE_Int num_buffers,
+			size_t buffer_size, size_t total)
+{
+  stream_type *stream;
+  SANE_Int i;
+
+  if (dn >= device_number || dn < 0)
+    {
+      DBG (1, "sanei_usb_stream_start: dn >= device number || dn < 0\n");
+      return SANE_STATUS_INVAL;
+    }
+  if (!devices[dn].open)
+    {
+      DBG (1, "sanei_usb_stream_start: device %d not open\n", dn);
+      return SANE_STATUS_INVAL;
+    }
+  if (devices[dn].stream)
+    {
+      DBG (1, "sanei_usb_stream_start: stream already active on %d\n", dn);
+      return SANE_STATUS_INVAL;
+    }
+  if (num_buffers < 1 || buffer_size == 0)
+    {
+      DBG (1, "sanei_usb_stream_start: invalid geometry (%d x %lu)\n",
+	   num_buffers, (unsigned long) buffer_size);
+      return SANE_STATUS_INVAL;
+    }
+  if (devices[dn].method == sanei_usb_method_libusb
+      && !devices[dn].bulk_in_ep)
+    {
+      DBG (1, "sanei_usb_stream_start: can't read without a bulk-in "
+	   "endpoint\n");
+      return SANE_STATUS_INVAL;
+    }
+
+  DBG (5, "sanei_usb_stream_start: %d buffers of %lu bytes, total %lu\n",
+       num_buffers, (unsigned long) buffer_size, (unsigned long) total);
+
+  stream = malloc (sizeof (stream_type));
+  if (!stream)
+    return SANE_STATUS_NO_MEM;
+  memset (stream, 0, sizeof (stream_type));
+  stream->dn = dn;
+  stream->num_slots = num_buffers;
+  stream->slot_size = buffer_size;
+  stream->bounded = (total != 0);
+  stream->remaining = total;
+
+  stream->slots = malloc (num_buffers * sizeof (stream_slot_type));
+  if (!stream->slots)
+    {
+      free (stream);
+      return SANE_STATUS_NO_MEM;
+    }
+  memset (stream->slots, 0, num_buffers * sizeof (stream_slot_type));
+
+  for (i = 0; i < num_buffers; i++)
+    {
+      stream->slots[i].stream = stream;
+      stream->slots[i].data = malloc (buffer_size);
+      if (!stream->slots[i].data)
+	{
+	  stream_free (stream);
+	  return SANE_STATUS_NO_MEM;
+	}
+#ifdef HAVE_LIBUSB_1_0
+      if (devices[dn].method == sanei_usb_method_libusb)
+	{
+	  stream->slots[i].transfer = libusb_alloc_transfer (0);
+	  if (!stream->slots[i].transfer)
+	    {
+	      stream_free (stream);
+	      return SANE_STATUS_NO_MEM;
+	    }
+	}
+#endif /* HAVE_LIBUSB_1_0 */
+    }
+
+  devices[dn].stream = stream;
+  stream_queue (stream);
+
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sanei_usb_stream_next (SANE_Int dn, SANE_Bool block, SANE_Byte ** buffer,
+		       size_t * size)
+{
+  stream_type *stream;
+  stream_slot_type *slot;
+
+#ifndef HAVE_LIBUSB_1_0
+  (void) block;			/* only libusb-1.0 reads asynchronously */
+#endif
+
+  if (!buffer || !size)
+    {
+      DBG (1, "sanei_usb_stream_next: buffer or size == NULL\n");
+      return SANE_STATUS_INVAL;
+    }
+  if (dn >= device_number || dn < 0)
+    {
+      DBG (1, "sanei_usb_stream_next: dn >= device number || dn < 0\n");
+      return SANE_STATUS_INVAL;
+    }
+  stream = devices[dn].stream;
+  if (!stream)
+    {
+      DBG (1, "sanei_usb_stream_next: no stream active on %d\n", dn);
+      return SANE_STATUS_INVAL;
+    }
+
+  *buffer = NULL;
+  *size = 0;
+
+  /* the buffer returned by the previous call goes back into the ring */
+  slot = &stream->slots[stream->head];
+  if (slot->state == sanei_usb_stream_slot_held)
+    {
+      slot->state = sanei_usb_stream_slot_idle;
+      stream->head = (stream->head + 1) % stream->num_slots;
+    }
+  stream_queue (stream);
+
+  slot = &stream->slots[stream->head];
+  if (slot->state == sanei_usb_stream_slot_idle)
+    {
+      DBG (5, "sanei_usb_stream_next: stream exhausted\n");
+      return SANE_STATUS_EOF;
+    }
+
+  while (slot->state == sanei_usb_stream_slot_queued)
+    {
+#ifdef HAVE_LIBUSB_1_0
+      if (devices[dn].method == sanei_usb_method_libusb)
+	{
+	  int ret;
+
+	  if (block)
+	    ret = libusb_handle_events (sanei_usb_ctx);
+	  else
+	    {
+	      struct timeval tv;
+
+	      tv.tv_sec = 0;
+	      tv.tv_usec = 0;
+	      ret = libusb_handle_events_timeout (sanei_usb_ctx, &tv);
+	      if (ret == 0 && slot->state == sanei_usb_stream_slot_queued)
+		return SANE_STATUS_DEVICE_BUSY;
+	    }
+	  if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+	    {
+	      DBG (1, "sanei_usb_stream_next: event handling failed: %s\n",
+		   sanei_libusb_strerror (ret));
+	      stream->eof = SANE_TRUE;
+	      return SANE_STATUS_IO_ERROR;
+	    }
+	  continue;
+	}
+#endif /* HAVE_LIBUSB_1_0 */
+      /* no asynchronous I/O for this access method, read it now */
+      slot->length = slot->requested;
+      slot->status = sanei_usb_read_bulk (dn, slot->data, &slot->length);
+      if (stream->bounded && slot->status == SANE_STATUS_GOOD
+	  && slot->length < slot->requested)
+	stream->remaining += slot->requested - slot->length;
+      slot->state = sanei_usb_stream_slot_filled;
+    }
+
+  slot->state = sanei_usb_stream_slot_held;
+  if (slot->status != SANE_STATUS_GOOD)
+    {
+      DBG (3, "sanei_usb_stream_next: stream ended, status %d\n",
+	   slot->status);
+      stream->eof = SANE_TRUE;
+      return slot->status;
+    }
+
+  if (debug_level > 10)
+    print_buffer (slot->data, slot->length);
+  DBG (5, "sanei_usb_stream_next: got %lu bytes\n",
+       (unsigned long) slot->length);
+
+  *buffer = slot->data;
+  *size = slot->length;
+  return SANE_STATUS_GOOD;
+}
+
+void
+sanei_usb_stream_stop (SANE_Int dn)
+{
+  stream_type *stream;
+
+  if (dn >= device_number || dn < 0)
+    {
+      DBG (1, "sanei_usb_stream_stop: dn >= device number || dn < 0\n");
+      return;
+    }
+  stream = devices[dn].stream;
+  if (!stream)
+    return;
+
+  DBG (5, "sanei_usb_stream_stop: stopping stream on %d\n", dn);
+
+#ifdef HAVE_LIBUSB_1_0
+  if (devices[dn].method == sanei_usb_method_libusb)
+    {
+      SANE_Int i;
+      int ret;
+
+      for (i = 0; i < stream->num_slots; i++)
+	if (stream->slots[i].state == sanei_usb_stream_slot_queued)
+	  libusb_cancel_transfer (stream->slots[i].transfer);
+
+      /* the transfers may only be freed once their callbacks have run */
+      while (stream->in_flight > 0)
+	{
+	  ret = libusb_handle_events (sanei_usb_ctx);
+	  if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+	    {
+	      DBG (1, "sanei_usb_stream_stop: event handling failed: %s\n",
+		   sanei_libusb_strerror (ret));
+	      break;
+	    }
+	}
+
+      if (stream->error)
+	libusb_clear_halt (devices[dn].lu_handle, devices[dn].bulk_in_ep);
+
+      if (stream->in_flight > 0)
+	{
+	  /* leak rather than free memory libusb still owns */
+	  DBG (1, "sanei_usb_stream_stop: %d transfers still pending\n",
+	       stream->in_flight);
+	  devices[dn].stream = NULL;
+	  return;
+	}
+    }
+#endif /* HAVE_LIBUSB_1_0 */
+
+  stream_free (stream);
+  devices[dn].stream = NULL;
+}
+
 SANE_Status
 sanei_usb_write_bulk (SANE_Int dn, const SANE_Byte * buffer, size_t * size)
 {
@@ -597,29 +597,49 @@ sanei_w_set_dir (Wire * w, WireDirection dir)
 }
 
 void
-sanei_w_call (Wire * w,
-	      SANE_Word procnum,
-	      WireCodecFunc w_arg, void *arg,
-	      WireCodecFunc w_reply, void *reply)
+sanei_w_send (Wire * w, SANE_Word procnum, WireCodecFunc w_arg, void *arg)
 {
-
-  DBG (3, "sanei_w_call: wire %d (old status %d)\n", w->io.fd, w->status);
+  DBG (3, "sanei_w_send: wire %d (old status %d)\n", w->io.fd, w->status);
   w->status = 0;
   sanei_w_set_dir (w, WIRE_ENCODE);
 
-  DBG (4, "sanei_w_call: sending request (procedure number: %d)\n", procnum);
+  DBG (4, "sanei_w_send: sending request (procedure number: %d)\n", procnum);
   sanei_w_word (w, &procnum);
   (*w_arg) (w, arg);
 
+  /* switching to decode flushes the request */
+  if (w->status == 0)
+    sanei_w_set_dir (w, WIRE_DECODE);
+
+  if (w->status != 0)
+    DBG (2, "sanei_w_send: error status %d\n", w->status);
+  DBG (4, "sanei_w_send: done\n");
+}
+
+void
+sanei_w_receive (Wire * w, WireCodecFunc w_reply, void *reply)
+{
+  DBG (3, "sanei_w_receive: wire %d (old status %d)\n", w->io.fd, w->status);
   if (w->status == 0)
     {
-      DBG (4, "sanei_w_call: receiving reply\n");
-      sanei_w_set_dir (w, WIRE_DECODE);
+      DBG (4, "sanei_w_receive: receiving reply\n");
       (*w_reply) (w, reply);
     }
 
   if (w->status != 0)
-    DBG (2, "sanei_w_call: error status %d\n", w->status);
+    DBG (2, "sanei_w_receive: error status %d\n", w->status);
+  DBG (4, "sanei_w_receive: done\n");
+}
+
+void
+sanei_w_call (Wire * w,
+	      SANE_Word procnum,
+	      WireCodecFunc w_arg, void *arg,
+	      WireCodecFunc w_reply, void *reply)
+{
+  DBG (3, "sanei_w_call: wire %d (old status %d)\n", w->io.fd, w->status);
+  sanei_w_send (w, procnum, w_arg, arg);
+  sanei_w_receive (w, w_reply, reply);
   DBG (4, "sanei_w_call: done\n");
 }
 
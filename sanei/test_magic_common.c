@@ -0,0 +1,136 @@
+/* test_magic_common.c -- shared pages for the sanei_magic checks
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+ */
+
+#include "../include/sane/config.h"
+#include <stdlib.h>
+#include <math.h>
+
+#include "test_magic_common.h"
+
+int failures;
+unsigned long seed = 1;
+
+int
+noise (void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0xff;
+}
+
+SANE_Byte *
+new_page (SANE_Parameters * params, int width, int height, int frame,
+	  int depth)
+{
+  params->format = frame;
+  params->depth = depth;
+  params->pixels_per_line = width;
+  params->lines = height;
+  params->last_frame = SANE_TRUE;
+
+  if (frame == SANE_FRAME_RGB)
+    params->bytes_per_line = width * 3;
+  else if (depth == 1)
+    params->bytes_per_line = (width + 7) / 8;
+  else
+    params->bytes_per_line = width;
+
+  return calloc (params->bytes_per_line, height);
+}
+
+void
+put_pixel (SANE_Parameters * params, SANE_Byte * buf, int x, int y,
+	   int val)
+{
+  SANE_Byte *row = buf + y * params->bytes_per_line;
+  int k;
+
+  if (params->format == SANE_FRAME_RGB)
+    for (k = 0; k < 3; k++)
+      row[x * 3 + k] = val;
+  else if (params->depth == 1)
+    {
+      if (val < 128)
+	row[x / 8] |= 0x80 >> (x % 8);
+      else
+	row[x / 8] &= ~(0x80 >> (x % 8));
+    }
+  else
+    row[x] = val;
+}
+
+SANE_Byte *
+make_sheet (SANE_Parameters * params, int frame, int depth, int width,
+	    int height, int dpi, double angle, int top, int back)
+{
+  SANE_Byte *buf;
+  double a = angle * M_PI / 180;
+  double sa = sin (a), ca = cos (a);
+  double pw = width - dpi / 2.0, ph = height - dpi;
+  double cx = width / 2.0;
+  double cy = top + ph / 2 / ca;
+  int x, y;
+
+  buf = new_page (params, width, height, frame, depth);
+  if (!buf)
+    return NULL;
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+	int xx = back ? width - 1 - x : x;
+	double u = (xx - cx) * ca + (y - cy) * sa;
+	double v = -(xx - cx) * sa + (y - cy) * ca;
+	int val;
+
+	/* a little jitter on the edge, like a real sheet */
+	if (fabs (u) < pw / 2 && v > -ph / 2 + (noise () % 3) - 1
+	    && v < ph / 2)
+	  {
+	    val = 215 + noise () % 40;
+
+	    /* lines of print, away from the edges */
+	    if (fabs (u) < pw / 2 - dpi / 2 && v > -ph / 2 + dpi
+		&& ((int) (v / (dpi / 6))) % 2 && noise () % 3)
+	      val = noise () % 60;
+
+	    /* and the odd speck */
+	    if (noise () % 4000 == 0)
+	      val = 0;
+	  }
+	else
+	  val = 25 + noise () % 30;
+
+	put_pixel (params, buf, x, y, val);
+      }
+
+  return buf;
+}
+
+double
+elapsed (struct timeval *start)
+{
+  struct timeval end;
+  double secs;
+
+  gettimeofday (&end, NULL);
+  secs = (end.tv_sec - start->tv_sec)
+    + (end.tv_usec - start->tv_usec) / 1e6;
+  return secs > 0 ? secs : 1e-6;
+}
@@ -0,0 +1,57 @@
+/* test_magic_common.h -- shared pages for the sanei_magic checks
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+ */
+
+#ifndef TEST_MAGIC_COMMON_H
+#define TEST_MAGIC_COMMON_H
+
+#include <sys/time.h>
+
+#include "../include/sane/sane.h"
+
+/* number of failed checks, the exit status of each test */
+extern int failures;
+
+/* state of noise (), reset it to repeat a page */
+extern unsigned long seed;
+
+/* cheap and repeatable noise, 0 to 255 */
+extern int noise (void);
+
+/* allocate a cleared page of the given size and format */
+extern SANE_Byte *new_page (SANE_Parameters * params, int width,
+			    int height, int frame, int depth);
+
+/* store a gray value at x, y: all channels alike, lineart is set below
+   128 */
+extern void put_pixel (SANE_Parameters * params, SANE_Byte * buf, int x,
+		       int y, int val);
+
+/* a sheet half an inch narrower and an inch shorter than the page, on a
+   dark background, rotated by angle degrees with its top edge near top
+   pixels down.  The paper is noisy, with a ragged edge, lines of print
+   and a few dots.  back mirrors the page left to right.  */
+extern SANE_Byte *make_sheet (SANE_Parameters * params, int frame,
+			      int depth, int width, int height, int dpi,
+			      double angle, int top, int back);
+
+/* seconds since start */
+extern double elapsed (struct timeval *start);
+
+#endif /* TEST_MAGIC_COMMON_H */
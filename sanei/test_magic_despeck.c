@@ -0,0 +1,349 @@
+/* test_magic_despeck.c -- check the despeckle methods of sanei_magic
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+ */
+
+#include "../include/sane/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+#include "test_magic_common.h"
+
+/* Despeckle regression corpus: synthetic gray, color and lineart pages
+   with white paper, saturated areas, noisy areas, print and dots of
+   many sizes.  Each page is despeckled by every method at several
+   diameters and thread counts, and the results must be identical to
+   the original loop below, which scans the whole page in order.
+   Also reports the time taken by each method on one thread.  */
+
+static const char *method_names[] = { "loop", "filter", 0 };
+
+static const int diameters[] = { 1, 2, 3, 5, 9, 17 };
+
+static const int threads[] = { 1, 2, 4 };
+
+#define NUM_DIAMS (sizeof (diameters) / sizeof (diameters[0]))
+#define NUM_THREADS (sizeof (threads) / sizeof (threads[0]))
+#define NUM_METHODS 2
+
+/* sanei_magic_despeck as it was before the filter and the threads */
+static void
+original_despeck (SANE_Parameters * params, SANE_Byte * buffer, int diam)
+{
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int h = params->lines;
+  int bt = bw * h;
+  int i, j, k, l, n;
+
+  if (params->format == SANE_FRAME_RGB)
+    {
+      for (i = bw; i < bt - bw - (bw * diam); i += bw)
+	for (j = 1; j < pw - 1 - diam; j++)
+	  {
+	    int thresh = 255 * 3;
+	    int outer[] = { 0, 0, 0 };
+	    int hits = 0;
+
+	    /* find darkest pixel in window */
+	    for (k = 0; k < diam; k++)
+	      for (l = 0; l < diam; l++)
+		{
+		  int tmp = 0;
+
+		  for (n = 0; n < 3; n++)
+		    tmp += buffer[i + j * 3 + k * bw + l * 3 + n];
+
+		  if (tmp < thresh)
+		    thresh = tmp;
+		}
+
+	    thresh = (thresh + 255 * 3 + 255 * 3) / 3;
+
+	    /* look for darker pixels around window */
+	    for (k = -1; k < diam + 1; k++)
+	      for (l = -1; l < diam + 1; l++)
+		{
+		  int tmp[3];
+
+		  if (k != -1 && k != diam && l != -1 && l != diam)
+		    continue;
+
+		  for (n = 0; n < 3; n++)
+		    {
+		      tmp[n] = buffer[i + j * 3 + k * bw + l * 3 + n];
+		      outer[n] += tmp[n];
+		    }
+		  if (tmp[0] + tmp[1] + tmp[2] < thresh)
+		    {
+		      hits++;
+		      break;
+		    }
+		}
+
+	    /* none, fill window with average color around it */
+	    if (!hits)
+	      {
+		for (n = 0; n < 3; n++)
+		  outer[n] /= (4 * diam + 4);
+
+		for (k = 0; k < diam; k++)
+		  for (l = 0; l < diam; l++)
+		    for (n = 0; n < 3; n++)
+		      buffer[i + j * 3 + k * bw + l * 3 + n] = outer[n];
+	      }
+	  }
+    }
+
+  else if (params->depth == 8)
+    {
+      for (i = bw; i < bt - bw - (bw * diam); i += bw)
+	for (j = 1; j < pw - 1 - diam; j++)
+	  {
+	    int thresh = 255;
+	    int outer = 0;
+	    int hits = 0;
+
+	    for (k = 0; k < diam; k++)
+	      for (l = 0; l < diam; l++)
+		if (buffer[i + j + k * bw + l] < thresh)
+		  thresh = buffer[i + j + k * bw + l];
+
+	    thresh = (thresh + 255 + 255) / 3;
+
+	    for (k = -1; k < diam + 1; k++)
+	      for (l = -1; l < diam + 1; l++)
+		{
+		  int tmp;
+
+		  if (k != -1 && k != diam && l != -1 && l != diam)
+		    continue;
+
+		  tmp = buffer[i + j + k * bw + l];
+
+		  if (tmp < thresh)
+		    {
+		      hits++;
+		      break;
+		    }
+
+		  outer += tmp;
+		}
+
+	    if (!hits)
+	      {
+		outer /= (4 * diam + 4);
+
+		for (k = 0; k < diam; k++)
+		  for (l = 0; l < diam; l++)
+		    buffer[i + j + k * bw + l] = outer;
+	      }
+	  }
+    }
+
+  else
+    {
+      for (i = bw; i < bt - bw - (bw * diam); i += bw)
+	for (j = 1; j < pw - 1 - diam; j++)
+	  {
+	    int curr = 0;
+	    int hits = 0;
+
+	    for (k = 0; k < diam; k++)
+	      for (l = 0; l < diam; l++)
+		curr += buffer[i + k * bw + (j + l) / 8] >> (7 - (j + l) % 8) & 1;
+
+	    if (!curr)
+	      continue;
+
+	    for (k = -1; k < diam + 1; k++)
+	      for (l = -1; l < diam + 1; l++)
+		{
+		  if (k != -1 && k != diam && l != -1 && l != diam)
+		    continue;
+
+		  hits += buffer[i + k * bw + (j + l) / 8] >> (7 - (j + l) % 8) & 1;
+
+		  if (hits)
+		    break;
+		}
+
+	    /* none, clear window to white */
+	    if (!hits)
+	      for (k = 0; k < diam; k++)
+		for (l = 0; l < diam; l++)
+		  buffer[i + k * bw + (j + l) / 8] &= ~(1 << (7 - (j + l) % 8));
+	  }
+    }
+}
+
+/* value of a gray page at x, y: paper, print, a noisy strip and dots */
+static int
+page_value (int dpi, int x, int y)
+{
+  int val = 255;
+
+  /* slightly noisy paper in the middle third, saturated elsewhere */
+  if (y > dpi && y < dpi * 2)
+    val = 200 + noise () % 56;
+
+  /* scattered dots everywhere near the bottom, across band seams */
+  else if (y > dpi * 5 / 2)
+    val = noise () % 4 ? 200 + noise () % 56 : noise () % 100;
+
+  /* lines of print */
+  if (x > dpi / 4 && y > dpi / 3 && (y / (dpi / 10)) % 3 == 0
+      && noise () % 4)
+    val = noise () % 80;
+
+  /* dots of one to twenty pixels, on a grid */
+  if ((x / 40) % 2 && (y / 40) % 2)
+    {
+      int size = 1 + ((x / 80) + (y / 80)) % 20;
+      if (x % 40 < size && y % 40 < size)
+	val = noise () % 100;
+    }
+
+  return val;
+}
+
+static SANE_Byte *
+make_page (SANE_Parameters * params, int dpi, int frame, int depth)
+{
+  SANE_Byte *buf;
+  int width = dpi * 3 + 5;
+  int height = dpi * 3;
+  int x, y, k;
+
+  buf = new_page (params, width, height, frame, depth);
+  if (!buf)
+    return NULL;
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+	int val = page_value (dpi, x, y);
+
+	/* tint the print, so channels differ */
+	if (frame == SANE_FRAME_RGB && val < 128)
+	  for (k = 0; k < 3; k++)
+	    buf[y * params->bytes_per_line + x * 3 + k] = val + k * 40;
+	else
+	  put_pixel (params, buf, x, y, val);
+      }
+
+  return buf;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int frames[][2] = {
+    {SANE_FRAME_GRAY, 8}, {SANE_FRAME_RGB, 8}, {SANE_FRAME_GRAY, 1}
+  };
+  static const char *frame_names[] = { "gray", "color", "lineart" };
+  SANE_Parameters params;
+  SANE_Byte *page, *ref, *out;
+  double secs[NUM_METHODS][NUM_DIAMS];
+  struct timeval start;
+  size_t d, f, t;
+  int m;
+
+  (void) argc;
+  (void) argv;
+
+  sanei_magic_init ();
+  memset (secs, 0, sizeof (secs));
+
+  for (f = 0; f < sizeof (frames) / sizeof (frames[0]); f++)
+    {
+      size_t size;
+
+      seed = 1;
+      page = make_page (&params, 150, frames[f][0], frames[f][1]);
+      if (!page)
+	{
+	  printf ("out of memory\n");
+	  return 1;
+	}
+      size = params.bytes_per_line * params.lines;
+
+      ref = malloc (size);
+      out = malloc (size);
+      if (!ref || !out)
+	{
+	  printf ("out of memory\n");
+	  return 1;
+	}
+
+      for (d = 0; d < NUM_DIAMS; d++)
+	{
+	  memcpy (ref, page, size);
+	  original_despeck (&params, ref, diameters[d]);
+
+	  if (!memcmp (ref, page, size) && frames[f][1] == 8)
+	    printf ("%s, diameter %d: nothing removed\n",
+		    frame_names[f], diameters[d]);
+
+	  /* bands meet at different times, but must give the same image */
+	  for (m = 0; method_names[m]; m++)
+	    for (t = 0; t < NUM_THREADS; t++)
+	      {
+		memcpy (out, page, size);
+
+		sanei_magic_selectDespeck (method_names[m]);
+		sanei_magic_setThreads (threads[t]);
+
+		gettimeofday (&start, NULL);
+		sanei_magic_despeck (&params, out, diameters[d]);
+		if (threads[t] == 1)
+		  secs[m][d] += elapsed (&start);
+
+		if (memcmp (ref, out, size))
+		  {
+		    printf ("%s: %s, diameter %d, %d threads differs from "
+			    "original\n", method_names[m], frame_names[f],
+			    diameters[d], threads[t]);
+		    failures++;
+		  }
+	      }
+	}
+
+      free (out);
+      free (ref);
+      free (page);
+    }
+
+  for (m = 0; method_names[m]; m++)
+    {
+      printf ("%-6s", method_names[m]);
+      for (d = 0; d < NUM_DIAMS; d++)
+	printf (" d%-2d %6.1f ms", diameters[d], secs[m][d] * 1000 / 3);
+      printf ("\n");
+    }
+
+  sanei_magic_selectDespeck (NULL);
+  sanei_magic_setThreads (1);
+
+  if (failures)
+    printf ("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+/* test_magic_process.c -- check sanei_magic_process against single calls
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+ */
+
+#include "../include/sane/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+#include "test_magic_common.h"
+
+/* sanei_magic_process must give the same image as calling each
+   operation in turn, for every format, with and without an arena, and
+   when the back side reuses the skew and edges of the front.  The
+   skew may also come from a stream which was fed the rows first.  */
+
+/* the same operations, one call at a time, as the backends did */
+static void
+by_hand (SANEI_Magic_Page * p, const SANEI_Magic_Page * mirror)
+{
+  SANE_Parameters *params = p->params;
+  int angle = 0;
+
+  if (mirror && mirror->skewStatus == SANE_STATUS_GOOD)
+    {
+      p->skewX = params->pixels_per_line - mirror->skewX;
+      p->skewY = mirror->skewY;
+      p->skewSlope = -mirror->skewSlope;
+      p->skewStatus = SANE_STATUS_GOOD;
+    }
+  else
+    p->skewStatus = sanei_magic_findSkew (params, p->buffer, p->dpiX,
+					  p->dpiY, &p->skewX, &p->skewY,
+					  &p->skewSlope);
+  if (!p->skewStatus)
+    sanei_magic_rotate (params, p->buffer, p->skewX, p->skewY,
+			p->skewSlope, p->bgColor);
+
+  if (mirror && mirror->edgeStatus == SANE_STATUS_GOOD)
+    {
+      p->top = mirror->top;
+      p->bot = mirror->bot;
+      p->left = params->pixels_per_line - mirror->right;
+      p->right = params->pixels_per_line - mirror->left;
+      p->edgeStatus = SANE_STATUS_GOOD;
+    }
+  else
+    {
+      p->edgeStatus = sanei_magic_findEdges (params, p->buffer, p->dpiX,
+					     p->dpiY, &p->top, &p->bot,
+					     &p->left, &p->right);
+      if (!p->edgeStatus && p->keepTop)
+	p->top = 0;
+    }
+  if (!p->edgeStatus)
+    sanei_magic_crop (params, p->buffer, p->top, p->bot, p->left,
+		      p->right);
+
+  sanei_magic_despeck (params, p->buffer, p->despeckDiam);
+
+  if (!sanei_magic_findTurn (params, p->buffer, p->dpiX, p->dpiY, &angle))
+    sanei_magic_turn (params, p->buffer, angle + p->turnAngle);
+
+  p->isBlank = sanei_magic_isBlank (params, p->buffer, p->blankThresh)
+    == SANE_STATUS_NO_DOCS;
+}
+
+static void
+setup (SANEI_Magic_Page * p, SANE_Parameters * params, SANE_Byte * buf,
+       int dpi)
+{
+  memset (p, 0, sizeof (*p));
+  p->params = params;
+  p->buffer = buf;
+  p->dpiX = p->dpiY = dpi;
+  p->ops = SANEI_MAGIC_DESKEW | SANEI_MAGIC_CROP | SANEI_MAGIC_DESPECK
+    | SANEI_MAGIC_TURN | SANEI_MAGIC_BLANK;
+  p->bgColor = 0xd6;
+  p->keepTop = 1;
+  p->despeckDiam = 2;
+  p->findTurn = 1;
+  p->turnAngle = 90;
+  p->blankThresh = 1.0;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int frames[][2] = {
+    {SANE_FRAME_GRAY, 8}, {SANE_FRAME_RGB, 8}, {SANE_FRAME_GRAY, 1}
+  };
+  static const char *frame_names[] = { "gray", "color", "lineart" };
+  SANEI_Magic_Arena *arena;
+  SANEI_Magic_Page hand[2], proc[2];
+  SANE_Parameters hp[2], pp[2];
+  SANEI_Magic_Stream *stream[2];
+  SANE_Byte *hb[2], *pb[2];
+  size_t f;
+  int side, mode, use_arena, use_stream;
+
+  (void) argc;
+  (void) argv;
+
+  sanei_magic_init ();
+  if (sanei_magic_arenaNew (&arena))
+    {
+      printf ("out of memory\n");
+      return 1;
+    }
+
+  for (f = 0; f < sizeof (frames) / sizeof (frames[0]); f++)
+    for (mode = 0; mode < 4; mode++)
+      {
+	use_arena = mode & 1;
+	use_stream = mode >> 1;
+
+	for (side = 0; side < 2; side++)
+	  {
+	    seed = 1;
+	    hb[side] = make_sheet (&hp[side], frames[f][0], frames[f][1],
+				   500, 600, 100, 3.1, 50, side);
+	    seed = 1;
+	    pb[side] = make_sheet (&pp[side], frames[f][0], frames[f][1],
+				   500, 600, 100, 3.1, 50, side);
+	    if (!hb[side] || !pb[side])
+	      {
+		printf ("out of memory\n");
+		return 1;
+	      }
+
+	    setup (&hand[side], &hp[side], hb[side], 100);
+	    setup (&proc[side], &pp[side], pb[side], 100);
+
+	    stream[side] = NULL;
+	    if (use_stream
+		&& (sanei_magic_streamStart (&pp[side], 100, 100,
+					     &stream[side])
+		    || sanei_magic_streamRows (stream[side], pb[side],
+					       pp[side].lines)))
+	      {
+		printf ("out of memory\n");
+		return 1;
+	      }
+	    proc[side].stream = stream[side];
+
+	    by_hand (&hand[side], side ? &hand[0] : NULL);
+	    sanei_magic_process (&proc[side], side ? &proc[0] : NULL,
+				 use_arena ? arena : NULL);
+
+	    if (memcmp (&hp[side], &pp[side], sizeof (hp[side]))
+		|| memcmp (hb[side], pb[side],
+			   (size_t) hp[side].bytes_per_line * hp[side].lines)
+		|| hand[side].isBlank != proc[side].isBlank)
+	      {
+		printf ("%s, side %d, arena %d, stream %d: differs\n",
+			frame_names[f], side, use_arena, use_stream);
+		failures++;
+	      }
+	    else if (hand[side].skewStatus || hand[side].edgeStatus)
+	      {
+		printf ("%s, side %d: media not found\n",
+			frame_names[f], side);
+		failures++;
+	      }
+	  }
+
+	for (side = 0; side < 2; side++)
+	  {
+	    sanei_magic_streamFree (stream[side]);
+	    free (hb[side]);
+	    free (pb[side]);
+	  }
+      }
+
+  sanei_magic_arenaFree (arena);
+
+  if (failures)
+    printf ("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,396 @@
+/* test_magic_rotate.c -- check sanei_magic_rotate against the old loop
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+ */
+
+#include "../include/sane/config.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+#include "test_magic_common.h"
+
+/* Noise pages in gray, color and lineart are rotated by several slopes,
+   around centers inside and outside the page, on one and four threads.
+   Nearest sampling must give the same pixels as the loop used before
+   the fixed point code, except where the loop's source position is
+   within EDGE of a pixel edge, and so could round either way.  Slopes
+   from 0 to about 3 degrees copy runs of pixels, steeper ones go pixel
+   by pixel.  Bilinear sampling of a steep linear gradient must give
+   the value of the gradient at the source position, which nearest
+   sampling cannot.  Rotations reusing an arena, after larger and
+   smaller pages, must give the same bytes as a fresh buffer.  */
+
+#define EDGE 1e-5
+
+static const double slopes[] = {
+  0, 1e-4, -1e-4, 0.01, -0.01, 0.035, -0.052, 0.2, -0.5
+};
+
+#define NUM_SLOPES (sizeof (slopes) / sizeof (slopes[0]))
+
+/* a page of noise, so that any pixel taken from the wrong place shows */
+static SANE_Byte *
+noise_page (SANE_Parameters * params, int frame, int depth, int width,
+	    int height)
+{
+  SANE_Byte *buf = new_page (params, width, height, frame, depth);
+  size_t i;
+
+  if (!buf)
+    return NULL;
+
+  for (i = 0; i < (size_t) params->bytes_per_line * height; i++)
+    buf[i] = noise ();
+
+  return buf;
+}
+
+/* sanei_magic_rotate as it was before the fixed point code. ambiguous
+   is set for output pixels whose source is within EDGE of an edge */
+static void
+original_rotate (SANE_Parameters * params, SANE_Byte * buffer,
+		 SANE_Byte * outbuf, char *ambiguous, int centerX,
+		 int centerY, double slope, int bg_color)
+{
+  double slopeRad = -atan (slope);
+  double slopeSin = sin (slopeRad);
+  double slopeCos = cos (slopeRad);
+  int pwidth = params->pixels_per_line;
+  int bwidth = params->bytes_per_line;
+  int height = params->lines;
+  int depth = 0;
+  int i, j, k;
+
+  if (params->format == SANE_FRAME_RGB)
+    depth = 3;
+  else if (params->depth == 8)
+    depth = 1;
+  else if (bg_color)
+    bg_color = 0xff;
+
+  memset (outbuf, bg_color, bwidth * height);
+
+  for (i = 0; i < height; i++)
+    {
+      int shiftY = centerY - i;
+
+      for (j = 0; j < pwidth; j++)
+	{
+	  int shiftX = centerX - j;
+	  double x = shiftX * slopeCos + shiftY * slopeSin;
+	  double y = -shiftY * slopeCos + shiftX * slopeSin;
+	  int sourceX = centerX - (int) x;
+	  int sourceY = centerY + (int) y;
+
+	  ambiguous[i * pwidth + j] = fabs (x - floor (x + 0.5)) < EDGE
+	    || fabs (y - floor (y + 0.5)) < EDGE;
+
+	  if (sourceX < 0 || sourceX >= pwidth
+	      || sourceY < 0 || sourceY >= height)
+	    continue;
+
+	  if (depth)
+	    {
+	      for (k = 0; k < depth; k++)
+		outbuf[i * bwidth + j * depth + k]
+		  = buffer[sourceY * bwidth + sourceX * depth + k];
+	      continue;
+	    }
+
+	  outbuf[i * bwidth + j / 8] &= ~(1 << (7 - (j % 8)));
+	  outbuf[i * bwidth + j / 8] |=
+	    ((buffer[sourceY * bwidth + sourceX / 8]
+	      >> (7 - (sourceX % 8))) & 1) << (7 - (j % 8));
+	}
+    }
+}
+
+/* does pixel x, y differ between two pages */
+static int
+pixel_differs (SANE_Parameters * params, SANE_Byte * a, SANE_Byte * b,
+	       int x, int y)
+{
+  size_t row = (size_t) y * params->bytes_per_line;
+  int k;
+
+  if (params->format == SANE_FRAME_RGB)
+    {
+      for (k = 0; k < 3; k++)
+	if (a[row + x * 3 + k] != b[row + x * 3 + k])
+	  return 1;
+      return 0;
+    }
+
+  if (params->depth == 8)
+    return a[row + x] != b[row + x];
+
+  return ((a[row + x / 8] ^ b[row + x / 8]) >> (7 - x % 8)) & 1;
+}
+
+static void
+check_nearest (void)
+{
+  static const int frames[][2] = {
+    {SANE_FRAME_GRAY, 8}, {SANE_FRAME_RGB, 8}, {SANE_FRAME_GRAY, 1}
+  };
+  static const char *frame_names[] = { "gray", "color", "lineart" };
+  static const int threads[] = { 1, 4 };
+  SANE_Parameters params;
+  SANE_Byte *page, *ref, *out;
+  char *ambiguous;
+  size_t f, s, t;
+  int c, x, y;
+
+  for (f = 0; f < sizeof (frames) / sizeof (frames[0]); f++)
+    {
+      int width = 421, height = 333;
+      int centers[][2] = {
+	{210, 166}, {-30, -40}, {441, 12}
+      };
+      size_t size;
+      long edges = 0;
+
+      seed = 7;
+      page = noise_page (&params, frames[f][0], frames[f][1], width,
+			 height);
+      size = (size_t) params.bytes_per_line * height;
+      ref = malloc (size);
+      out = malloc (size);
+      ambiguous = malloc (width * height);
+      if (!page || !ref || !out || !ambiguous)
+	{
+	  printf ("out of memory\n");
+	  exit (1);
+	}
+
+      for (s = 0; s < NUM_SLOPES; s++)
+	for (c = 0; c < 3; c++)
+	  {
+	    original_rotate (&params, page, ref, ambiguous, centers[c][0],
+			     centers[c][1], slopes[s], 0xff);
+
+	    for (t = 0; t < sizeof (threads) / sizeof (threads[0]); t++)
+	      {
+		int far = 0;
+
+		memcpy (out, page, size);
+		sanei_magic_setThreads (threads[t]);
+		if (sanei_magic_rotate (&params, out, centers[c][0],
+					centers[c][1], slopes[s], 0xff))
+		  {
+		    printf ("%s: slope %g failed\n", frame_names[f],
+			    slopes[s]);
+		    failures++;
+		    continue;
+		  }
+
+		for (y = 0; y < height; y++)
+		  for (x = 0; x < width; x++)
+		    if (pixel_differs (&params, ref, out, x, y))
+		      {
+			if (ambiguous[y * width + x])
+			  edges++;
+			else
+			  far++;
+		      }
+
+		if (far)
+		  {
+		    printf ("%s: slope %g, center %d,%d, %d threads: %d "
+			    "pixels differ from the original\n",
+			    frame_names[f], slopes[s], centers[c][0],
+			    centers[c][1], (int) threads[t], far);
+		    failures++;
+		  }
+	      }
+	  }
+
+      printf ("%s: %ld pixels on a source edge came out different\n",
+	      frame_names[f], edges);
+
+      free (ambiguous);
+      free (out);
+      free (ref);
+      free (page);
+    }
+
+  sanei_magic_setThreads (1);
+}
+
+/* the test gradient, channel k at x, y, largest value 253 */
+static double
+gradient (int k, double x, double y)
+{
+  if (k == 1)
+    return 253 - (2 * x + y);
+  if (k == 2)
+    return x + 2 * y;
+  return 2 * x + y;
+}
+
+static void
+check_bilinear (void)
+{
+  static const double bi_slopes[] = { 0.01, -0.05, 0.2 };
+  static const int bi_centers[][2] = { {50, 27}, {-10, 70} };
+  SANE_Parameters params;
+  SANE_Byte *page, *out;
+  int rgb, s, c, x, y, k;
+
+  sanei_magic_selectRotate ("bilinear");
+
+  for (rgb = 0; rgb < 2; rgb++)
+    {
+      int depth = rgb ? 3 : 1;
+      int width = 100, height = 55;
+
+      page = new_page (&params, width, height,
+		       rgb ? SANE_FRAME_RGB : SANE_FRAME_GRAY, 8);
+      out = malloc ((size_t) params.bytes_per_line * height);
+      if (!page || !out)
+	{
+	  printf ("out of memory\n");
+	  exit (1);
+	}
+
+      for (y = 0; y < height; y++)
+	for (x = 0; x < width; x++)
+	  for (k = 0; k < depth; k++)
+	    page[y * params.bytes_per_line + x * depth + k]
+	      = gradient (k, x, y);
+
+      for (s = 0; s < 3; s++)
+	for (c = 0; c < 2; c++)
+	  {
+	    double slopeRad = -atan (bi_slopes[s]);
+	    int cx = bi_centers[c][0], cy = bi_centers[c][1];
+	    int bad = 0, checked = 0;
+
+	    memcpy (out, page, (size_t) params.bytes_per_line * height);
+	    sanei_magic_rotate (&params, out, cx, cy, bi_slopes[s], 0);
+
+	    for (y = 0; y < height; y++)
+	      for (x = 0; x < width; x++)
+		{
+		  int shiftX = cx - x, shiftY = cy - y;
+		  double sx = cx - (shiftX * cos (slopeRad)
+				    + shiftY * sin (slopeRad));
+		  double sy = cy + (-shiftY * cos (slopeRad)
+				    + shiftX * sin (slopeRad));
+
+		  /* all four source pixels inside the page */
+		  if (sx < EDGE || sx > width - 1 - EDGE
+		      || sy < EDGE || sy > height - 1 - EDGE)
+		    continue;
+
+		  checked++;
+		  for (k = 0; k < depth; k++)
+		    if (fabs (out[y * params.bytes_per_line + x * depth + k]
+			      - gradient (k, sx, sy)) > 0.6)
+		      bad++;
+		}
+
+	    if (bad || checked < width * height / 2)
+	      {
+		printf ("bilinear %s: slope %g, center %d,%d: %d of %d "
+			"samples off the gradient\n", rgb ? "color" : "gray",
+			bi_slopes[s], cx, cy, bad, checked * depth);
+		failures++;
+	      }
+	  }
+
+      free (out);
+      free (page);
+    }
+
+  sanei_magic_selectRotate (NULL);
+}
+
+static void
+check_arena (void)
+{
+  static const int frames[][4] = {
+    {SANE_FRAME_GRAY, 8, 421, 333}, {SANE_FRAME_RGB, 8, 600, 400},
+    {SANE_FRAME_GRAY, 8, 421, 333}, {SANE_FRAME_GRAY, 1, 517, 611},
+    {SANE_FRAME_RGB, 8, 97, 50}
+  };
+  SANEI_Magic_Arena *arena;
+  SANE_Parameters params;
+  SANE_Byte *fresh, *reused;
+  size_t f;
+
+  if (sanei_magic_arenaNew (&arena))
+    {
+      printf ("no arena\n");
+      exit (1);
+    }
+
+  for (f = 0; f < sizeof (frames) / sizeof (frames[0]); f++)
+    {
+      size_t size;
+
+      seed = 11 + f;
+      fresh = noise_page (&params, frames[f][0], frames[f][1],
+			  frames[f][2], frames[f][3]);
+      size = (size_t) params.bytes_per_line * params.lines;
+      reused = malloc (size);
+      if (!fresh || !reused)
+	{
+	  printf ("out of memory\n");
+	  exit (1);
+	}
+      memcpy (reused, fresh, size);
+
+      sanei_magic_rotate (&params, fresh, frames[f][2] / 3,
+			  frames[f][3] / 2, 0.03, 0xff);
+      sanei_magic_rotateArena (&params, reused, frames[f][2] / 3,
+			       frames[f][3] / 2, 0.03, 0xff, arena);
+
+      if (memcmp (fresh, reused, size))
+	{
+	  printf ("arena: page %d differs from a fresh buffer\n", (int) f);
+	  failures++;
+	}
+
+      free (reused);
+      free (fresh);
+    }
+
+  sanei_magic_arenaFree (arena);
+}
+
+int
+main (int argc, char **argv)
+{
+  (void) argc;
+  (void) argv;
+
+  sanei_magic_init ();
+
+  check_nearest ();
+  check_bilinear ();
+  check_arena ();
+
+  if (failures)
+    printf ("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
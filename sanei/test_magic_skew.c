@@ -0,0 +1,126 @@
+/* test_magic_skew.c -- check skew detection of sanei_magic
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+ */
+
+#include "../include/sane/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+#include "test_magic_common.h"
+
+/* Skew detection against a corpus of synthetic pages: a letter sized
+   sheet on a dark background, rotated by a known angle, with noisy
+   paper, a ragged edge and some print.  Every page must be found by
+   the default method to within MAX_ERROR degrees.  Also reports the
+   accuracy and time of each method, so they can be compared.  */
+
+static const char *method_names[] = { "hough", "bins", 0 };
+
+static const double angles[] = {
+  -9.7, -6.1, -4.0, -2.35, -1.2, -0.6, -0.27, 0.31, 0.8, 1.45, 2.9, 5.2, 8.3
+};
+
+static const int resolutions[] = { 150, 300 };
+
+#define NUM_ANGLES (sizeof (angles) / sizeof (angles[0]))
+#define NUM_RES (sizeof (resolutions) / sizeof (resolutions[0]))
+#define MAX_ERROR 0.1
+
+int
+main (int argc, char **argv)
+{
+  SANE_Parameters params;
+  SANE_Byte *page;
+  double worst[2] = { 0, 0 }, total[2] = { 0, 0 }, secs[2] = { 0, 0 };
+  int missed[2] = { 0, 0 };
+  struct timeval start;
+  size_t a, r;
+  int m;
+
+  (void) argc;
+  (void) argv;
+
+  sanei_magic_init ();
+
+  for (r = 0; r < NUM_RES; r++)
+    for (a = 0; a < NUM_ANGLES; a++)
+      {
+	int dpi = resolutions[r];
+	int frame = (a % 2) ? SANE_FRAME_RGB : SANE_FRAME_GRAY;
+
+	page = make_sheet (&params, frame, 8, dpi * 9, dpi * 12, dpi,
+			   angles[a], dpi / 3, 0);
+	if (!page)
+	  {
+	    printf ("out of memory\n");
+	    return 1;
+	  }
+
+	for (m = 0; method_names[m]; m++)
+	  {
+	    int centerX, centerY;
+	    double slope = 0, err;
+	    SANE_Status status;
+
+	    sanei_magic_selectSkew (method_names[m]);
+
+	    gettimeofday (&start, NULL);
+	    status = sanei_magic_findSkew (&params, page, dpi, dpi,
+					   &centerX, &centerY, &slope);
+	    secs[m] += elapsed (&start);
+
+	    err = fabs (atan (slope) * 180 / M_PI - angles[a]);
+	    if (status != SANE_STATUS_GOOD)
+	      {
+		missed[m]++;
+		err = fabs (angles[a]);
+	      }
+
+	    total[m] += err;
+	    if (err > worst[m])
+	      worst[m] = err;
+
+	    if (m == 0 && (status != SANE_STATUS_GOOD || err > MAX_ERROR))
+	      {
+		printf ("%s: %d dpi, %+.2f degrees: status %d, found %+.3f\n",
+			method_names[m], dpi, angles[a], status,
+			atan (slope) * 180 / M_PI);
+		failures++;
+	      }
+	  }
+
+	free (page);
+      }
+
+  for (m = 0; method_names[m]; m++)
+    printf ("%-6s missed %d, mean error %.3f, worst %.3f degrees, "
+	    "%.1f ms per page\n", method_names[m], missed[m],
+	    total[m] / (NUM_RES * NUM_ANGLES), worst[m],
+	    secs[m] * 1000 / (NUM_RES * NUM_ANGLES));
+
+  sanei_magic_selectSkew (NULL);
+
+  if (failures)
+    printf ("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
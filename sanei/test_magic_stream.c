@@ -0,0 +1,158 @@
+/* test_magic_stream.c -- check the sanei_magic stream against whole pages
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+ */
+
+#include "../include/sane/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+#include "test_magic_common.h"
+
+/* Pages are fed to a stream in uneven chunks of rows.  After each chunk,
+   the blank, edge and skew results of the stream must be the same as
+   the whole-page calls on a buffer of the rows seen so far, for gray,
+   color and lineart, at several angles and widths.  */
+
+static const double angles[] = { 0, -3.1, 0.7, 4.2 };
+
+/* odd widths leave padding at the end of lineart rows */
+static const int widths[] = { 500, 496 };
+
+static const int chunks[] = { 1, 7, 50, 13, 200, 3 };
+
+#define NUM_ANGLES (sizeof (angles) / sizeof (angles[0]))
+#define NUM_WIDTHS (sizeof (widths) / sizeof (widths[0]))
+#define NUM_CHUNKS (sizeof (chunks) / sizeof (chunks[0]))
+
+static void
+compare (const char *name, double angle, int width, int lines,
+	 SANE_Parameters * params, SANE_Byte * page,
+	 SANEI_Magic_Stream * stream)
+{
+  SANE_Parameters part = *params;
+  SANE_Status ws, ss;
+  int wt, wb, wl, wr, st, sb, sl, sr;
+  int wx = 0, wy = 0, sx = 0, sy = 0;
+  double wslope = 0, sslope = 0;
+
+  part.lines = lines;
+
+  ws = sanei_magic_isBlank (&part, page, 1.0);
+  ss = sanei_magic_streamIsBlank (stream, 1.0);
+  if (ws != ss)
+    {
+      printf ("%s %g %d %d rows: blank %d, stream %d\n", name, angle,
+	      width, lines, ws, ss);
+      failures++;
+    }
+
+  wt = wb = wl = wr = st = sb = sl = sr = 0;
+  ws = sanei_magic_findEdges (&part, page, 100, 100, &wt, &wb, &wl, &wr);
+  ss = sanei_magic_streamFindEdges (stream, &st, &sb, &sl, &sr);
+  if (ws != ss
+      || (ws == SANE_STATUS_GOOD
+	  && (wt != st || wb != sb || wl != sl || wr != sr)))
+    {
+      printf ("%s %g %d %d rows: edges %d %d/%d/%d/%d, stream %d "
+	      "%d/%d/%d/%d\n", name, angle, width, lines, ws, wt, wb, wl, wr,
+	      ss, st, sb, sl, sr);
+      failures++;
+    }
+
+  ws = sanei_magic_findSkew (&part, page, 100, 100, &wx, &wy, &wslope);
+  ss = sanei_magic_streamFindSkew (stream, &sx, &sy, &sslope);
+  if (ws != ss
+      || (ws == SANE_STATUS_GOOD
+	  && (wx != sx || wy != sy || wslope != sslope)))
+    {
+      printf ("%s %g %d %d rows: skew %d %d/%d/%f, stream %d %d/%d/%f\n",
+	      name, angle, width, lines, ws, wx, wy, wslope, ss, sx, sy,
+	      sslope);
+      failures++;
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int frames[][2] = {
+    {SANE_FRAME_GRAY, 8}, {SANE_FRAME_RGB, 8}, {SANE_FRAME_GRAY, 1}
+  };
+  static const char *frame_names[] = { "gray", "color", "lineart" };
+  SANE_Parameters params;
+  SANEI_Magic_Stream *stream;
+  SANE_Byte *page;
+  size_t a, f, w, c;
+  int lines, n;
+
+  (void) argc;
+  (void) argv;
+
+  sanei_magic_init ();
+
+  for (f = 0; f < sizeof (frames) / sizeof (frames[0]); f++)
+    for (w = 0; w < NUM_WIDTHS; w++)
+      for (a = 0; a < NUM_ANGLES; a++)
+	{
+	  seed = 1;
+	  page = make_sheet (&params, frames[f][0], frames[f][1],
+			     widths[w], 600, 100, angles[a], 50, 0);
+	  if (!page)
+	    {
+	      printf ("out of memory\n");
+	      return 1;
+	    }
+
+	  if (sanei_magic_streamStart (&params, 100, 100, &stream))
+	    {
+	      printf ("%s: cannot start stream\n", frame_names[f]);
+	      free (page);
+	      return 1;
+	    }
+
+	  for (lines = 0, c = 0; lines < params.lines; c++)
+	    {
+	      n = chunks[c % NUM_CHUNKS];
+	      if (n > params.lines - lines)
+		n = params.lines - lines;
+
+	      if (sanei_magic_streamRows (stream,
+					  page + lines * params.bytes_per_line,
+					  n))
+		{
+		  printf ("%s: cannot add rows\n", frame_names[f]);
+		  failures++;
+		  break;
+		}
+	      lines += n;
+
+	      compare (frame_names[f], angles[a], widths[w], lines, &params,
+		       page, stream);
+	    }
+
+	  sanei_magic_streamFree (stream);
+	  free (page);
+	}
+
+  if (failures)
+    printf ("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+#include "../include/sane/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_reorder.h"
+
+/* Differential test: every sanei_reorder implementation available on
+   this machine must give the same output as the plain C one, for all
+   sample sizes, for lengths that do and don't fill whole vector
+   registers, and for unaligned buffers.  Also reports the throughput
+   of each implementation on lines of a 2400 dpi colour scan.  */
+
+static const char *impl_names[] = { "scalar", "ssse3", 0 };
+
+#define MAX_PIXELS 300
+#define LINE_PIXELS 20400	/* 8.5 inch at 2400 dpi */
+#define BENCH_LINES 24
+#define BENCH_ROUNDS 8
+
+static int failures;
+
+static SANE_Byte src[3 * 2 * MAX_PIXELS * 12 + 64];
+static SANE_Byte out[3 * 2 * MAX_PIXELS + 64];
+static SANE_Byte ref[3 * 2 * MAX_PIXELS + 64];
+
+static void
+fail (const char *impl, const char *what, size_t count, int bps, int n)
+{
+  printf ("%s: %s differs (count %lu, %d bytes/sample, %d)\n",
+	  impl, what, (u_long) count, bps, n);
+  failures++;
+}
+
+/* run the test for one implementation against "scalar" */
+static void
+check_impl (const char *name)
+{
+  size_t offsets[12];
+  size_t count, plane;
+  int bps, n, c, align;
+
+  for (bps = 1; bps <= 2; bps++)
+    for (align = 0; align < 3; align++)
+      for (count = 0; count < MAX_PIXELS; count += 1 + count / 16)
+	{
+	  plane = count * bps + align;
+
+	  memset (ref, 0x55, sizeof (ref));
+	  sanei_reorder_select ("scalar");
+	  sanei_reorder_interleave3 (ref + align, src + align,
+				     src + align + plane,
+				     src + align + 2 * plane, count, bps);
+	  memset (out, 0x55, sizeof (out));
+	  sanei_reorder_select (name);
+	  sanei_reorder_interleave3 (out + align, src + align,
+				     src + align + plane,
+				     src + align + 2 * plane, count, bps);
+	  if (memcmp (out, ref, sizeof (out)) != 0)
+	    fail (name, "interleave3", count, bps, align);
+
+	  memset (ref, 0x55, sizeof (ref));
+	  sanei_reorder_select ("scalar");
+	  sanei_reorder_reverse3 (ref + align, src + align, count, bps);
+	  memset (out, 0x55, sizeof (out));
+	  sanei_reorder_select (name);
+	  sanei_reorder_reverse3 (out + align, src + align, count, bps);
+	  if (memcmp (out, ref, sizeof (out)) != 0)
+	    fail (name, "reverse3", count, bps, align);
+
+	  for (n = 1; n <= 12; n++)
+	    {
+	      for (c = 0; c < n; c++)
+		offsets[c] = rand () % (count * 10 + 1);
+
+	      memset (ref, 0x55, sizeof (ref));
+	      sanei_reorder_select ("scalar");
+	      sanei_reorder_stagger (ref + align, src + align, count * 3,
+				     offsets, n, bps);
+	      memset (out, 0x55, sizeof (out));
+	      sanei_reorder_select (name);
+	      sanei_reorder_stagger (out + align, src + align, count * 3,
+				     offsets, n, bps);
+	      if (memcmp (out, ref, sizeof (out)) != 0)
+		fail (name, "stagger", count * 3, bps, n);
+	    }
+	}
+}
+
+static double
+elapsed (struct timeval *start)
+{
+  struct timeval end;
+  double secs;
+
+  gettimeofday (&end, NULL);
+  secs = (end.tv_sec - start->tv_sec)
+    + (end.tv_usec - start->tv_usec) / 1e6;
+  return secs > 0 ? secs : 1e-6;
+}
+
+static void
+bench_impl (const char *name)
+{
+  SANE_Byte *in, *dst;
+  size_t line = LINE_PIXELS * 3 * 2;
+  size_t total = line * BENCH_LINES;
+  size_t offsets[6];
+  struct timeval start;
+  int i, r;
+
+  in = malloc (total + 16 * line);
+  dst = malloc (total);
+  if (!in || !dst)
+    {
+      printf ("out of memory\n");
+      failures++;
+      free (in);
+      free (dst);
+      return;
+    }
+  memset (in, 0x5a, total + 16 * line);
+  memset (dst, 0, total);
+
+  /* 16 bit colour, a CCD with 4 and 8 lines between the colours and
+     2 lines of stagger */
+  for (i = 0; i < 6; i++)
+    offsets[i] = ((i % 3) * 4 + (i >= 3 ? 2 : 0)) * LINE_PIXELS * 3;
+
+  gettimeofday (&start, NULL);
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    for (i = 0; i < BENCH_LINES; i++)
+      sanei_reorder_interleave3 (dst + i * line, in + i * line,
+				 in + i * line + line / 3,
+				 in + i * line + 2 * line / 3, LINE_PIXELS, 2);
+  printf ("%-8s interleave3 %6.2f GB/s", name,
+	  (double) total * BENCH_ROUNDS / elapsed (&start) / 1e9);
+
+  gettimeofday (&start, NULL);
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    sanei_reorder_reverse3 (dst, in, LINE_PIXELS * BENCH_LINES, 2);
+  printf ("  reverse3 %6.2f GB/s",
+	  (double) total * BENCH_ROUNDS / elapsed (&start) / 1e9);
+
+  gettimeofday (&start, NULL);
+  for (r = 0; r < BENCH_ROUNDS; r++)
+    sanei_reorder_stagger (dst, in, LINE_PIXELS * 3 * BENCH_LINES, offsets,
+			   6, 2);
+  printf ("  stagger %6.2f GB/s\n",
+	  (double) total * BENCH_ROUNDS / elapsed (&start) / 1e9);
+
+  free (in);
+  free (dst);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t i;
+  int bench = 1;
+
+  if (argc > 1 && !strcmp (argv[1], "--no-bench"))
+    bench = 0;
+
+  for (i = 0; i < sizeof (src); i++)
+    src[i] = rand ();
+
+  for (i = 0; impl_names[i]; i++)
+    {
+      if (sanei_reorder_select (impl_names[i]) != SANE_STATUS_GOOD)
+	{
+	  printf ("%-8s not available\n", impl_names[i]);
+	  continue;
+	}
+      check_impl (impl_names[i]);
+      if (bench)
+	{
+	  sanei_reorder_select (impl_names[i]);
+	  bench_impl (impl_names[i]);
+	}
+    }
+
+  sanei_reorder_select (NULL);
+  printf ("default: %s\n", sanei_reorder_impl ());
+
+  if (failures)
+    printf ("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}
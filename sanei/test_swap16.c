@@ -0,0 +1,174 @@
+#include "../include/sane/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_swap.h"
+
+/* Checks every sanei_swap16 implementation available on this machine
+   against a plain loop, exercises the stream functions with pieces of
+   random length and reports the throughput of each implementation.  */
+
+static const char *impl_names[] = { "scalar", "sse2", "avx2", "neon", 0 };
+
+#define BENCH_BYTES (16 * 1024 * 1024)
+#define BENCH_ROUNDS 16
+
+static int failures;
+
+static void
+reference (SANE_Byte * dst, const SANE_Byte * src, size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      dst[2 * i] = src[2 * i + 1];
+      dst[2 * i + 1] = src[2 * i];
+    }
+}
+
+static void
+check_impl (const char *name)
+{
+  SANE_Byte src[520], dst[520], ref[520];
+  size_t count, offset, i;
+
+  for (i = 0; i < sizeof (src); i++)
+    src[i] = rand ();
+
+  for (offset = 0; offset < 4; offset++)
+    for (count = 0; count < 256; count++)
+      {
+	memset (dst, 0xaa, sizeof (dst));
+	memset (ref, 0xaa, sizeof (ref));
+	sanei_swap16 (dst + offset, src + offset, count);
+	reference (ref + offset, src + offset, count);
+	if (memcmp (dst, ref, sizeof (dst)) != 0)
+	  {
+	    printf ("%s: wrong result for %lu samples at offset %lu\n",
+		    name, (u_long) count, (u_long) offset);
+	    failures++;
+	    return;
+	  }
+
+	/* in place */
+	memcpy (dst, src, sizeof (dst));
+	sanei_swap16 (dst + offset, dst + offset, count);
+	memcpy (ref, src, sizeof (ref));
+	reference (ref + offset, src + offset, count);
+	if (memcmp (dst, ref, sizeof (dst)) != 0)
+	  {
+	    printf ("%s: wrong in-place result for %lu samples at offset "
+		    "%lu\n", name, (u_long) count, (u_long) offset);
+	    failures++;
+	    return;
+	  }
+      }
+}
+
+static void
+check_stream (void)
+{
+  SANEI_Swap16_Stream st;
+  SANE_Byte in[4096], expect[4096], out[4096 + 16], buf[16];
+  size_t in_pos, out_pos, max, start, n, ready;
+
+  for (n = 0; n < sizeof (in); n++)
+    in[n] = rand ();
+  reference (expect, in, sizeof (in) / 2);
+
+  sanei_swap16_stream_init (&st);
+  in_pos = out_pos = 0;
+  while (out_pos < sizeof (in))
+    {
+      max = 1 + rand () % sizeof (buf);
+      start = sanei_swap16_stream_begin (&st, buf, max);
+
+      /* like read (): anything from nothing to all that fits */
+      n = rand () % (max - start + 1);
+      if (n > sizeof (in) - in_pos)
+	n = sizeof (in) - in_pos;
+      memcpy (buf + start, in + in_pos, n);
+      in_pos += n;
+
+      ready = sanei_swap16_stream_end (&st, buf, start + n);
+      if (ready > max || out_pos + ready > sizeof (in))
+	{
+	  printf ("stream: returned %lu bytes for a %lu byte buffer\n",
+		  (u_long) ready, (u_long) max);
+	  failures++;
+	  return;
+	}
+      memcpy (out + out_pos, buf, ready);
+      out_pos += ready;
+    }
+
+  if (memcmp (out, expect, sizeof (in)) != 0 || st.carry >= 0)
+    {
+      printf ("stream: wrong result\n");
+      failures++;
+    }
+}
+
+static void
+bench_impl (const char *name, SANE_Byte * buf)
+{
+  struct timeval start, end;
+  double secs;
+  int i;
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < BENCH_ROUNDS; i++)
+    sanei_swap16 (buf, buf, BENCH_BYTES / 2);
+  gettimeofday (&end, NULL);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  if (secs <= 0)
+    secs = 1e-6;
+  printf ("%-8s %6.2f GB/s\n", name,
+	  (double) BENCH_BYTES * BENCH_ROUNDS / secs / 1e9);
+}
+
+int
+main (int argc, char **argv)
+{
+  SANE_Byte *buf;
+  int i, bench = 1;
+
+  if (argc > 1 && !strcmp (argv[1], "--no-bench"))
+    bench = 0;
+
+  buf = malloc (BENCH_BYTES);
+  if (!buf)
+    {
+      printf ("out of memory\n");
+      return 1;
+    }
+  memset (buf, 0x5a, BENCH_BYTES);
+
+  for (i = 0; impl_names[i]; i++)
+    {
+      if (sanei_swap16_select (impl_names[i]) != SANE_STATUS_GOOD)
+	{
+	  printf ("%-8s not available\n", impl_names[i]);
+	  continue;
+	}
+      check_impl (impl_names[i]);
+      if (bench)
+	bench_impl (impl_names[i], buf);
+    }
+
+  sanei_swap16_select (NULL);
+  printf ("default: %s\n", sanei_swap16_impl ());
+  for (i = 0; i < 100; i++)
+    check_stream ();
+
+  free (buf);
+  if (failures)
+    printf ("%d failure(s)\n", failures);
+  return failures ? 1 : 0;
+}